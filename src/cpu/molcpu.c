@@ -593,7 +593,8 @@ rvec_unexpected_mmu_cond( int rvec, int param1, int param2 )
 int
 _rvec_io_read( int dummy_rvec, ulong mphys_ioaddr, void *usr_data )
 {
-	ulong ea, cont, inst=mregs->inst_opcode;
+	ulong ea, cont, inst=mregs->inst_opcode, nip=mregs->nip;
+	ullong t0 = ioprof_active ? get_mticks_() : 0;
 	int op, op_ext, rD, rA, rB, d;
 	int flag=0, ret=1;
 
@@ -713,6 +714,8 @@ _rvec_io_read( int dummy_rvec, ulong mphys_ioaddr, void *usr_data )
 			ret = 1;
 			mregs->gpr[rA] = ea;
 		}
+		if( t0 )
+			ioprof_trap( usr_data, mphys_ioaddr, 1, nip, get_mticks_() - t0 );
 	}
 
 	if( flag )
@@ -729,7 +732,8 @@ int
 _rvec_io_write( int dummy_rvec, ulong mphys_ioaddr, void *usr_data )
 {
 	int op, op_ext, rS, rA, rB, d, flag=0, ret=0;
-	ulong ea, cont, len, inst=mregs->inst_opcode;
+	ulong ea, cont, len, inst=mregs->inst_opcode, nip=mregs->nip;
+	ullong t0 = ioprof_active ? get_mticks_() : 0;
 
 	enum {	byte=1, half=2, word=4, len_mask=7, indexed=8, update=16, 
 		reverse=32, nop=64, fpinst=128 };
@@ -830,6 +834,8 @@ _rvec_io_write( int dummy_rvec, ulong mphys_ioaddr, void *usr_data )
 			mregs->gpr[rA] = ea;
 			ret = 1;
 		}
+		if( t0 )
+			ioprof_trap( usr_data, mphys_ioaddr, 0, nip, get_mticks_() - t0 );
 	}
 
 	if( flag )
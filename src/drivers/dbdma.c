@@ -19,6 +19,7 @@
 /* #define VERBOSE */
 
 #include <pthread.h>
+#include <sys/param.h>
 
 #include "extralib.h"
 #include "debugger.h"
@@ -1127,6 +1128,149 @@ dma_read_ack( int irq, int len, struct dma_read_pb *pb )
 }
 
 
+/************************************************************************/
+/*	scatter-gather batches						*/
+/************************************************************************/
+
+/* Collect the buffers of the current and the following INPUT/OUTPUT commands.
+ * The walk stops after a *_LAST command, after a command which may wait,
+ * branch or interrupt and at any command the phase machine must handle by
+ * itself. Interrupts and status stamping are still done by finish_cmd as the
+ * batch is acknowledged; since a batch never extends past an interrupting
+ * command, the guest is notified no later than with unbatched transfers.
+ */
+static void
+walk_chain( struct dbdma_channel *ch, int input, struct dma_batch_pb *pb )
+{
+	struct dbdma_cmd *cp = ch->cur_cmd;
+	ulong cp_phys = ld_le32( &ch->reg[r_cmdptr] );
+	int cmd, in_rom = ch->cur_cmd_in_rom;
+	punfix_t phy_addr;
+	char *p, *buf;
+
+	pb->iov[0].iov_base = ch->iostate.buf + ch->iostate.res_count;
+	pb->iov[0].iov_len = ch->iostate.req_count - ch->iostate.res_count;
+	pb->total = pb->iov[0].iov_len;
+	pb->nvec = 1;
+	pb->key = ch->iostate.key;
+	pb->is_last = ch->iostate.is_last;
+
+	while( !pb->is_last && pb->nvec < DMA_MAX_IOV ) {
+		/* wait, branch and interrupt conditions are left to finish_cmd */
+		if( in_rom || (ld_le16(&cp->command) & 0x3f) )
+			break;
+		cp_phys += sizeof(struct dbdma_cmd);
+		if( (in_rom=mphys_to_lvptr(cp_phys, &p)) )
+			break;
+		cp = (struct dbdma_cmd*)p;
+		cmd = ld_le16( &cp->command );
+
+		if( (cmd & 0x700) != pb->key )
+			break;
+		cmd &= 0xf000;
+		if( input ? (cmd != INPUT_MORE && cmd != INPUT_LAST) : (cmd != OUTPUT_MORE && cmd != OUTPUT_LAST) )
+			break;
+		phy_addr.p_int = &cp->phy_addr;
+		buf = input ? transl_mphys( ld_le32(phy_addr.p_long) ) : transl_ro_mphys( ld_le32(phy_addr.p_long) );
+		if( !buf )
+			break;
+
+		pb->iov[pb->nvec].iov_base = buf;
+		pb->iov[pb->nvec].iov_len = ld_le16( &cp->req_count );
+		pb->total += pb->iov[pb->nvec++].iov_len;
+		pb->is_last = (cmd == INPUT_LAST || cmd == OUTPUT_LAST);
+	}
+}
+
+static int
+req_batch( int irq, int phase, struct dma_batch_pb *pb )
+{
+	struct dbdma_channel *ch = ch_table[irq];
+	
+	LOCK( ch );
+
+	if( ch->status & PAUSE ) {
+		UNLOCK( ch );
+		return 1;
+	}
+	if( ch->cmd_phase != phase ) {
+		process_cmds( ch, 0 /* don't block */ );
+		if( ch->cmd_phase != phase ) {
+			UNLOCK( ch );
+			return 1;
+		}
+	}
+	walk_chain( ch, phase == inputing, pb );
+	pb->identifier = ++ch->identifier;
+
+	UNLOCK( ch );
+	return 0;
+}
+
+/* The commands of the batch are completed one by one, exactly like a
+ * sequence of dma_read_ack/dma_write_ack calls would do, but under a
+ * single lock.
+ */
+static int
+ack_batch( int irq, int phase, int len, struct dma_batch_pb *pb )
+{
+	struct dbdma_channel *ch = ch_table[irq];
+	int i, n, ret=0;
+
+	LOCK( ch );
+	if( pb->identifier != ch->identifier )
+		ret = 1;
+
+	for( i=0; !ret && i<pb->nvec; i++ ) {
+		/* the channel program might have been modified */
+		if( ch->cmd_phase != phase || ch->iostate.buf + ch->iostate.res_count != (char*)pb->iov[i].iov_base ) {
+			ret = 1;
+			break;
+		}
+		n = MIN( len, ch->iostate.req_count - ch->iostate.res_count );
+		ch->iostate.res_count += n;
+		len -= n;
+
+		if( ch->iostate.res_count < ch->iostate.req_count )
+			break;
+		ch->cmd_phase = finishing;
+		process_cmds( ch, 0 );
+		if( !len )
+			break;
+	}
+#ifdef ERROR_CHECKING
+	if( !ret && len )
+		printm("DMA ack_batch owerflow\n");
+#endif
+	UNLOCK( ch );
+	return ret;
+}
+
+int
+dma_write_req_batch( int irq, struct dma_batch_pb *pb )
+{
+	return req_batch( irq, inputing, pb );
+}
+
+int
+dma_write_ack_batch( int irq, int len, struct dma_batch_pb *pb )
+{
+	return ack_batch( irq, inputing, len, pb );
+}
+
+int
+dma_read_req_batch( int irq, struct dma_batch_pb *pb )
+{
+	return req_batch( irq, outputing, pb );
+}
+
+int
+dma_read_ack_batch( int irq, int len, struct dma_batch_pb *pb )
+{
+	return ack_batch( irq, outputing, len, pb );
+}
+
+
 /* This function must be called whenever "hardware" controlled status
  * bits change. In particular, this is important for the 
  * "wait" mechanism to work properly.
@@ -38,10 +38,40 @@
 #include "ablk.h"
 
 
+#define MAX_IOVEC	32
+#define MAX_JOBS	32			/* requests in flight (power of 2) */
+
+/* A job is a request head and/or the sg-bufs following it. Jobs are queued
+ * per unit and retired in ring order, since the client only sees the
+ * request count.
+ */
+typedef struct ablk_job {
+	int		unit;
+	int		flags;			/* head flags, 0 for sg continuation */
+	unsigned int	param;
+	int		ndesc;			/* #descriptors retired by this job */
+	int		raise_irq;
+	int		error;
+	volatile int	done;
+
+	int		n, count;
+	struct iovec	vec[MAX_IOVEC];
+
+	struct ablk_job	*next;			/* unit queue */
+} ablk_job_t;
+
+typedef struct {
+	ablk_job_t	*q_head;
+	ablk_job_t	*q_tail;
+	pthread_cond_t	cond;
+	iofunc_t 	*iofunc;		/* function used for sg-bufs */
+} ablk_unit_t;
+
 typedef struct {
 	int		irq;
 	int		ndevs;
 	ablk_device_t	*devs;			/* array with ndevs elements */
+	ablk_unit_t	*units;			/* array with ndevs elements */
 
 	/* channel */
 	int		running;		/* ready for action */
@@ -55,14 +85,24 @@ typedef struct {
 	int		ring_mask;		/* ring index mask */
 	ablk_req_head_t	*ring;
 
+	/* job ring, protected by lock */
+	pthread_mutex_t	lock;
+	pthread_cond_t	retire_cond;		/* signaled when a job is done */
+	ablk_job_t	jobs[MAX_JOBS];
+	int		job_head;		/* oldest unretired job */
+	int		job_tail;		/* next free job */
+	int		error;
+
 	/* fields private to the i/o thread */
 	int		n_requests;		/* #descriptors processed (used for completion) */
 	int		cur_dev;		/* Current device */
-	iofunc_t 	*iofunc;
 } ablk_t;
 
 static ablk_t		ablk;
 
+#define LOCK		pthread_mutex_lock( &ablk.lock )
+#define UNLOCK		pthread_mutex_unlock( &ablk.lock )
+
 
 void
 ablk_post_event( ablk_device_t *d, int event )
@@ -76,8 +116,6 @@ ablk_post_event( ablk_device_t *d, int event )
 /*	Engine								*/
 /************************************************************************/
 
-#define MAX_IOVEC	32
-
 static int
 dummy_io( bdev_desc_t *bdev, const struct iovec *vec, int n )
 {
@@ -91,9 +129,8 @@ dummy_io( bdev_desc_t *bdev, const struct iovec *vec, int n )
 }
 
 static iofunc_t *
-control_request( bdev_desc_t *bdev, int cmd, int param ) 
+control_request( int unit, int cmd, int param ) 
 {
-	int unit = bdev->fd;
 	iofunc_t *ret = NULL;
 	cntrlfunc_t *func = ablk.devs[unit].cntrl_func;
 
@@ -109,53 +146,158 @@ control_request( bdev_desc_t *bdev, int cmd, int param )
 } 
 
 #define NEXT(ind)	(((ind)+1) & ablk.ring_mask)
+#define JOB(ind)	(&ablk.jobs[(ind) & (MAX_JOBS-1)])
 
+/* lock held. Account finished jobs in ring order */
 static void
-do_work( void )
+retire_jobs( void )
+{
+	ablk_job_t *job;
+	int raise = 0;
+
+	while( ablk.job_head != ablk.job_tail ) {
+		job = JOB( ablk.job_head );
+		if( !job->done || job->error )
+			break;
+		ablk.n_requests += job->ndesc;
+		raise |= job->raise_irq;
+		ablk.job_head++;
+	}
+	if( raise )
+		irq_line_hi( ablk.irq );
+}
+
+static int
+execute_job( ablk_job_t *job )
+{
+	ablk_unit_t *u = &ablk.units[job->unit];
+	bdev_desc_t *bdev = ablk.devs[job->unit].bdev;
+	struct iovec *vec = job->vec;
+	int ret, count = job->count;
+
+	/* Read / Write Request */
+	if( job->flags & (ABLK_READ_REQ | ABLK_WRITE_REQ) ) {
+		u->iofunc = (job->flags & ABLK_WRITE_REQ)? bdev->write : bdev->read;
+		/* param contains first sector */
+		if( bdev->seek(bdev, job->param, 0) < 0 ) {
+			printm("ablk: bad lseek");
+			return -1;
+		}
+	} else if( job->flags & ABLK_CNTRL_REQ_MASK ) {
+		u->iofunc = control_request( job->unit, job->flags & ABLK_CNTRL_REQ_MASK, job->param );
+	}
+	if( !job->n )
+		return 0;
+
+	while( (ret=(*u->iofunc)(bdev, vec, job->n)) != count ) {
+		int s, i;
+		for( i=0; ret > 0; i++, ret -= s, count -= s ) {
+			s = MIN( vec[i].iov_len, ret );
+			vec[i].iov_len -= s;
+			vec[i].iov_base += s;
+		}
+		if( ret < 0 && errno != EINTR ) {
+			perrorm("ablk iofunc");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+unit_thread( void *p )
+{
+	ablk_unit_t *u = p;
+	ablk_job_t *job;
+
+	LOCK;
+	for( ;; ) {
+		while( !u->q_head && !ablk.exiting )
+			pthread_cond_wait( &u->cond, &ablk.lock );
+		if( ablk.exiting )
+			break;
+		job = u->q_head;
+		UNLOCK;
+
+		job->error = execute_job( job );
+
+		LOCK;
+		if( !(u->q_head=job->next) )
+			u->q_tail = NULL;
+		job->done = 1;
+		if( job->error )
+			ablk.error = 1;
+		retire_jobs();
+		pthread_cond_signal( &ablk.retire_cond );
+	}
+	UNLOCK;
+}
+
+/* Allocate a job slot, waiting for a retirement if all slots are busy */
+static ablk_job_t *
+new_job( int unit, int flags, unsigned int param )
+{
+	ablk_job_t *job;
+
+	LOCK;
+	while( ablk.job_tail - ablk.job_head == MAX_JOBS && !ablk.error )
+		pthread_cond_wait( &ablk.retire_cond, &ablk.lock );
+	job = ablk.error ? NULL : JOB( ablk.job_tail++ );
+	UNLOCK;
+
+	if( job ) {
+		memset( job, 0, sizeof(*job) );
+		job->unit = unit;
+		job->flags = flags;
+		job->param = param;
+	}
+	return job;
+}
+
+static void
+submit_job( ablk_job_t *job )
 {
-	struct iovec vec[MAX_IOVEC];
-	int n, count;
+	ablk_unit_t *u = &ablk.units[job->unit];
+
+	LOCK;
+	if( u->q_tail )
+		u->q_tail->next = job;
+	else
+		u->q_head = job;
+	u->q_tail = job;
+	pthread_cond_signal( &u->cond );
+	UNLOCK;
+}
 
+/* Parse the ring and hand the requests to the unit threads.
+ * Returns when the engine stalls.
+ */
+static int
+dispatch( void )
+{
+	ablk_job_t *job = NULL;
 	union {
 		void ** v;
 		char ** c;
 	} iovec_pun;
 
-	n = count = 0;
-
 	for( ;; ) {
 		ablk_req_head_t *cur = &ablk.ring[ ablk.req_head ];
 		int proceed = cur->proceed;
 		int f, next = NEXT( ablk.req_head );
 		ablk_req_head_t *r = &ablk.ring[next];
 
-		/* execute request? */
-		if( n && (!proceed || n == MAX_IOVEC || !(r->flags & ABLK_SG_BUF)) ) {
-			int ret;
-
-			while( (ret=(*ablk.iofunc)(ablk.devs[ablk.cur_dev].bdev, vec, n)) != count ) {
-				int s, i;
-				for( i=0; ret > 0; i++, ret -= s, count -= s ) {
-					s = MIN( vec[i].iov_len, ret );
-					vec[i].iov_len -= s;
-					vec[i].iov_base += s;
-				}
-				if( ret < 0 && errno != EINTR ) {
-					perrorm("ablk iofunc");
-					goto error;
-				}
-			}
-			ablk.n_requests += n;
-
+		/* queue request? */
+		if( job && (!proceed || job->n == MAX_IOVEC || !(r->flags & ABLK_SG_BUF)) ) {
 			/* this takes into account the engine stall interrupt */
-			if( (cur->flags & ABLK_RAISE_IRQ) && proceed )
-				irq_line_hi( ablk.irq );
-			n = 0;
-			count = 0;
+			if( job->n && (cur->flags & ABLK_RAISE_IRQ) && proceed )
+				job->raise_irq = 1;
+			submit_job( job );
+			job = NULL;
 		}
 		/* engine stall? */
 		if( !proceed )
-			break;
+			return 0;
 
 		/* flag old head slot for reuse */
 		cur->flags = 0;
@@ -168,15 +310,21 @@ do_work( void )
 		/* process scatter & gather bufs */
 		if( (f & ABLK_SG_BUF) ) {
 			ablk_sg_t *p = (ablk_sg_t*)r;
-			iovec_pun.v = &(vec[n].iov_base);
+
+			/* continue the transfer of the current device */
+			if( !job && (ablk.cur_dev < 0 || !(job=new_job(ablk.cur_dev, 0, 0))) )
+				goto error;
+
+			iovec_pun.v = &(job->vec[job->n].iov_base);
 			if( mphys_to_lvptr( p->buf, (char**)iovec_pun.c ) ) {
 				printm("ablk: bogus sg-buf");
 				goto error;
 			}
-			vec[n++].iov_len = p->count;
-			count += p->count;
+			job->vec[job->n++].iov_len = p->count;
+			job->count += p->count;
 
-			/* req_count is increased when the request is finished */
+			/* the descriptor is retired when the job is finished */
+			job->ndesc++;
 			continue;
 		}
 
@@ -185,37 +333,64 @@ do_work( void )
 			printm("ablk: bad unit");
 			goto error;
 		}
-		ablk.cur_dev = r->unit;
-		/* Read / Write Request */
-		if( f & (ABLK_READ_REQ | ABLK_WRITE_REQ) ) {
-			/* Schedule the next iofunc */
-			ablk.iofunc = (f & ABLK_WRITE_REQ)? ablk.devs[r->unit].bdev->write : ablk.devs[r->unit].bdev->read;
-			/* r->param contains first sector */
-			if( ablk.devs[r->unit].bdev->seek( ablk.devs[r->unit].bdev, r->param, 0 ) < 0 ) {
-				printm("ablk: bad lseek");
-				goto error;
-			}
-		} else if( f & ABLK_CNTRL_REQ_MASK) {
-			ablk.iofunc = control_request( ablk.devs[r->unit].bdev, (f & ABLK_CNTRL_REQ_MASK), r->param );
-			if( f & ABLK_RAISE_IRQ )
-				irq_line_hi( ablk.irq );
-		} else {
+		if( !(f & (ABLK_READ_REQ | ABLK_WRITE_REQ | ABLK_CNTRL_REQ_MASK)) ) {
 			printm("bogus ablk command!\n");
 			goto error;
 		}
-		/* n and count have already been set to zero */
-		ablk.n_requests++;
+		ablk.cur_dev = r->unit;
+		if( !(job=new_job(r->unit, f & ~ABLK_RAISE_IRQ, r->param)) )
+			goto error;
+		if( (f & ABLK_CNTRL_REQ_MASK) && (f & ABLK_RAISE_IRQ) )
+			job->raise_irq = 1;
+		job->ndesc = 1;
 	}
 
-	/* engine stall */
-	ablk.active = 0;
-	irq_line_hi( ablk.irq );
-	return;
-
  error:
-	printm("ABlk engine error\n");
-	ablk.running = 0;
+	/* a half-built job is dropped; it is never retired */
+	if( job ) {
+		job->done = job->error = 1;
+		LOCK;
+		ablk.error = 1;
+		UNLOCK;
+	}
+	return -1;
+}
+
+static void
+do_work( void )
+{
+	int err;
+
+	/* keep parsing the ring until it is empty and all jobs are retired */
+	for( ;; ) {
+		err = dispatch();
+
+		LOCK;
+		err |= ablk.error;
+		if( ablk.job_head == ablk.job_tail || err ) {
+			/* on errors, wait for the outstanding jobs to finish */
+			while( err && !ablk.exiting ) {
+				int i, busy = 0;
+				for( i=ablk.job_head; i != ablk.job_tail; i++ )
+					busy |= !JOB(i)->done;
+				if( !busy )
+					break;
+				pthread_cond_wait( &ablk.retire_cond, &ablk.lock );
+			}
+			break;
+		}
+		pthread_cond_wait( &ablk.retire_cond, &ablk.lock );
+		UNLOCK;
+	}
+	if( err ) {
+		printm("ABlk engine error\n");
+		ablk.job_head = ablk.job_tail = 0;
+		ablk.error = 0;
+		ablk.running = 0;
+	}
+	/* engine stall */
 	ablk.active = 0;
+	UNLOCK;
 
 	irq_line_hi( ablk.irq );
 }
@@ -308,7 +483,7 @@ osip_ablk_ring_setup( int sel, int *params )
 static int
 osip_ablk_cntrl( int sel, int *params )
 {
-	int channel=params[0], ret=0;
+	int i, channel=params[0], ret=0;
 	uint unit;
 
 	if( channel )
@@ -320,7 +495,8 @@ osip_ablk_cntrl( int sel, int *params )
 			break;
 
 		ablk.cur_dev = -1;
-		ablk.iofunc = dummy_io;
+		for( i=0; i<ablk.ndevs; i++ )
+			ablk.units[i].iofunc = dummy_io;
 		if( ablk.ring ) {
 			/* el. 1 is the first element to be processed */
 			ablk.req_head = 0;
@@ -503,6 +679,7 @@ ablk_init( void )
 	static pci_dev_info_t pci_config = { 0x1000, 0x0003, 0x02, 0x0, 0x0100 };
 	mol_device_node_t *dn = prom_find_devices("mol-blk");
 	bdev_desc_t *bdev = NULL;
+	int i;
 	
 	memset( &ablk, 0, sizeof(ablk) );
 
@@ -519,7 +696,17 @@ ablk_init( void )
 	}
 	
 	pipe( ablk.ctrl_pipe );
-	
+	pthread_mutex_init( &ablk.lock, NULL );
+	pthread_cond_init( &ablk.retire_cond, NULL );
+
+	/* one i/o thread per unit; requests to different units run in parallel */
+	ablk.units = calloc( ablk.ndevs ? ablk.ndevs : 1, sizeof(ablk_unit_t) );
+	fail_nil( ablk.units );
+	for( i=0; i<ablk.ndevs; i++ ) {
+		pthread_cond_init( &ablk.units[i].cond, NULL );
+		ablk.units[i].iofunc = dummy_io;
+		create_thread( unit_thread, &ablk.units[i], "blk-unit" );
+	}
 	create_thread( io_thread, NULL, "blk-io" );
 	register_osi_iface( osi_iface, sizeof(osi_iface) );
 
@@ -532,7 +719,12 @@ ablk_cleanup( void )
 	char dummy_ch=0;
 	int i;
 
+	LOCK;
 	ablk.exiting = 1;
+	for( i=0; i<ablk.ndevs; i++ )
+		pthread_cond_signal( &ablk.units[i].cond );
+	pthread_cond_broadcast( &ablk.retire_cond );
+	UNLOCK;
 	write( ablk.ctrl_pipe[1], &dummy_ch, 1 );
 	
 	close( ablk.ctrl_pipe[0] );
@@ -545,6 +737,7 @@ ablk_cleanup( void )
 	}
 
 	free( ablk.devs );
+	free( ablk.units );
 	ablk.ndevs = 0;
 }
 
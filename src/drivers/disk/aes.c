@@ -28,6 +28,8 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "aes.h"
+#include "byteorder.h"
+#include <sys/param.h>
 
 #define NDEBUG
 #include <assert.h>
@@ -1310,3 +1312,130 @@ void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		}			
 	}
 }
+
+/*
+ * Sector crypto for disk images: each 512 byte sector is encrypted in
+ * CBC mode with the IV { le64(sector_num), 0 }. On x86 hosts with
+ * AES-NI the sectors are processed with the AES instructions, several
+ * sectors at a time; otherwise the table code above is used.
+ */
+
+#if (defined(__i386__) || defined(__x86_64__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define AES_NI
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#define AESNI_LANES	4
+#define SECTOR_BLOCKS	(512 / AES_BLOCK_SIZE)
+
+static int
+aesni_available( void )
+{
+	unsigned int a, b, c, d;
+
+	if( !__get_cpuid(1, &a, &b, &c, &d) )
+		return 0;
+	return (c & bit_AES) && (d & bit_SSE2);
+}
+
+/* The round keys are kept as big-endian words; AES-NI wants bytes */
+__attribute__((target("aes,sse2")))
+static void
+aesni_load_key( const AES_KEY *key, __m128i *rk )
+{
+	u8 b[AES_BLOCK_SIZE];
+	int i, j;
+
+	for( i=0; i<=key->rounds; i++ ) {
+		for( j=0; j<4; j++ )
+			PUTU32(b + 4*j, key->rd_key[4*i + j]);
+		rk[i] = _mm_loadu_si128((__m128i *)b);
+	}
+}
+
+__attribute__((target("aes,sse2")))
+static void
+aesni_cbc_sectors( const u8 *in, u8 *out, int nb_sectors, u64 sector_num,
+		   const AES_KEY *key, int enc )
+{
+	__m128i rk[AES_MAXNR + 1], x[AESNI_LANES], iv[AESNI_LANES], c[AESNI_LANES];
+	int nr = key->rounds;
+	int i, k, r, n, blk;
+
+	aesni_load_key(key, rk);
+
+	if( enc ) {
+		/* CBC encryption is serial within a sector; interleave
+		   sectors to keep the AES unit busy */
+		for( i=0; i<nb_sectors; i+=n ) {
+			n = MIN(nb_sectors - i, AESNI_LANES);
+			for( k=0; k<n; k++ )
+				iv[k] = _mm_set_epi32(0, 0, (u32)((sector_num + i + k) >> 32),
+						      (u32)(sector_num + i + k));
+			for( blk=0; blk<SECTOR_BLOCKS; blk++ ) {
+				for( k=0; k<n; k++ ) {
+					x[k] = _mm_loadu_si128((__m128i *)(in + (i+k)*512 + blk*16));
+					x[k] = _mm_xor_si128(_mm_xor_si128(x[k], iv[k]), rk[0]);
+				}
+				for( r=1; r<nr; r++ )
+					for( k=0; k<n; k++ )
+						x[k] = _mm_aesenc_si128(x[k], rk[r]);
+				for( k=0; k<n; k++ ) {
+					iv[k] = _mm_aesenclast_si128(x[k], rk[nr]);
+					_mm_storeu_si128((__m128i *)(out + (i+k)*512 + blk*16), iv[k]);
+				}
+			}
+		}
+		return;
+	}
+
+	/* CBC decryption is parallel within a sector */
+	for( i=0; i<nb_sectors; i++, in+=512, out+=512 ) {
+		iv[0] = _mm_set_epi32(0, 0, (u32)((sector_num + i) >> 32), (u32)(sector_num + i));
+		for( blk=0; blk<SECTOR_BLOCKS; blk+=AESNI_LANES ) {
+			for( k=0; k<AESNI_LANES; k++ ) {
+				c[k] = _mm_loadu_si128((__m128i *)(in + (blk+k)*16));
+				x[k] = _mm_xor_si128(c[k], rk[0]);
+			}
+			for( r=1; r<nr; r++ )
+				for( k=0; k<AESNI_LANES; k++ )
+					x[k] = _mm_aesdec_si128(x[k], rk[r]);
+			for( k=0; k<AESNI_LANES; k++ ) {
+				x[k] = _mm_aesdeclast_si128(x[k], rk[nr]);
+				x[k] = _mm_xor_si128(x[k], k ? c[k-1] : iv[0]);
+				_mm_storeu_si128((__m128i *)(out + (blk+k)*16), x[k]);
+			}
+			iv[0] = c[AESNI_LANES-1];
+		}
+	}
+}
+#endif /* AES_NI */
+
+void
+AES_cbc_sectors( const u8 *in, u8 *out, int nb_sectors, u64 sector_num,
+		 const AES_KEY *key, int enc )
+{
+	union {
+		u64 ll[2];
+		u8 b[AES_BLOCK_SIZE];
+	} ivec;
+#ifdef AES_NI
+	static int hw = -1;
+
+	if( hw < 0 )
+		hw = aesni_available();
+	if( hw ) {
+		aesni_cbc_sectors(in, out, nb_sectors, sector_num, key, enc);
+		return;
+	}
+#endif
+	for( ; nb_sectors > 0; nb_sectors-- ) {
+		ivec.ll[0] = cpu_to_le64(sector_num);
+		ivec.ll[1] = 0;
+		AES_cbc_encrypt(in, out, 512, key, ivec.b, enc);
+		sector_num++;
+		in += 512;
+		out += 512;
+	}
+}
@@ -27,6 +27,11 @@
  * THE SOFTWARE.
  */
 #include "blk_dmg.h"
+#include "res_manager.h"
+#include "thread.h"
+
+/* open images, for the debugger */
+static BDRVDMGState *dmg_images;
 
 /* Read 64 bit value */
 static off_t read_off(int fd)
@@ -46,9 +51,32 @@ static off_t read_uint32(int fd)
 	return be32_to_cpu(buffer);
 }
 
+static void readahead_thread(void *p);
+
+static int __dcmd
+cmd_dmgstat( int argc, char **argv )
+{
+    BDRVDMGState *s;
+    u64 n;
+
+    if (argc != 1)
+        return 1;
+    for (s = dmg_images; s; s = s->next) {
+        n = s->hits + s->misses;
+        printm("%s\n", s->bdev->dev_name ? s->bdev->dev_name : "<dmg>");
+        printm("    chunk cache: %ld / %ld KB, %d readahead threads\n",
+               (long)(s->cache_bytes >> 10), (long)(s->cache_limit >> 10), s->nthreads);
+        printm("    hits %lld  misses %lld  (%d%%)  readahead hits %lld  waits %lld\n",
+               s->hits, s->misses, n ? (int)(s->hits * 100 / n) : 0, s->ra_hits, s->waits);
+    }
+    return 0;
+}
+
 /* Open dmg image */
 int dmg_open(int fd, bdev_desc_t *bdev)
 {
+    static int cmd_added;
+    long n;
     u32 count;
     u32 max_compressed_size=1,max_sectors_per_chunk=1,i;
     bdev->priv = malloc(sizeof(BDRVDMGState));
@@ -61,13 +89,13 @@ int dmg_open(int fd, bdev_desc_t *bdev)
 
     /* Init the bdev struct */
     bdev->fd = fd;
-    bdev->read = &wrap_read;
-    bdev->real_read = &dmg_read;
+    bdev->read = &dmg_read;
     bdev->write = NULL;
     bdev->seek = &dmg_seek;
     bdev->close = &dmg_close;
 
     s->fd = fd;
+    s->bdev = bdev;
     /* RO */
     bdev->flags &= ~BF_ENABLE_WRITE;
     s->n_chunks = 0;
@@ -114,7 +142,8 @@ int dmg_open(int fd, bdev_desc_t *bdev)
 
 	    for(i=s->n_chunks;i<s->n_chunks+chunk_count;i++) {
 		s->types[i] = read_uint32(s->fd);
-		if(s->types[i]!=0x80000005 && s->types[i]!=1 && s->types[i]!=2) {
+		if(s->types[i]!=DMG_CHUNK_ZLIB && s->types[i]!=DMG_CHUNK_COPY &&
+		   s->types[i]!=DMG_CHUNK_ZERO) {
 		    if(s->types[i]==0xffffffff) {
 			last_in_offset = s->offsets[i-1]+s->lengths[i-1];
 			last_out_offset = s->sectors[i-1]+s->sectorcounts[i-1];
@@ -141,15 +170,38 @@ int dmg_open(int fd, bdev_desc_t *bdev)
     bdev->size = s->n_chunks * 512;
 
     /* initialize zlib engine */
+    s->max_compressed_size = max_compressed_size;
     if(!(s->compressed_chunk=(char*)malloc(max_compressed_size+1)))
 	goto fail;
-    if(!(s->uncompressed_chunk=(char*)malloc(512*max_sectors_per_chunk)))
-	goto fail;
     if(inflateInit(&s->zstream) != Z_OK)
 	goto fail;
 
-    s->current_chunk = s->n_chunks;
-    
+    /* chunk cache */
+    if(!(s->cache = calloc(s->n_chunks ? s->n_chunks : 1, sizeof(DMGCacheEntry *))))
+	goto fail;
+    if((n = get_numeric_res("dmg.cache_mb")) < 0)
+	n = DMG_CACHE_MB;
+    s->cache_limit = (size_t)n << 20;
+    if((s->readahead = get_numeric_res("dmg.readahead")) < 0)
+	s->readahead = DMG_READAHEAD;
+    s->readahead = MIN(s->readahead, DMG_RA_QUEUE - 1);
+    s->next_sector = -1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    if((n = get_numeric_res("dmg.threads")) < 0)
+	n = DMG_THREADS;
+    if(!s->readahead)
+	n = 0;
+    for(i=0; i<n; i++) {
+	s->nthreads++;
+	create_thread(readahead_thread, s, "dmg-inflate");
+    }
+
+    s->next = dmg_images;
+    dmg_images = s;
+    if(!cmd_added++)
+	add_cmd("dmgstat", "dmgstat \nshow dmg chunk cache statistics\n", -1, cmd_dmgstat);
     return 0;
 
 fail:
@@ -157,17 +209,7 @@ fail:
     
 }
 
-static inline int is_sector_in_chunk(BDRVDMGState* s,
-		u32 chunk_num,int sector_num)
-{
-    if(chunk_num>=s->n_chunks || s->sectors[chunk_num]>sector_num ||
-	    s->sectors[chunk_num]+s->sectorcounts[chunk_num]<=sector_num)
-	return 0;
-    else
-	return -1;
-}
-
-static inline u32 search_chunk(BDRVDMGState* s,int sector_num)
+static inline u32 search_chunk(BDRVDMGState* s,long sector_num)
 {
     /* binary search */
     u32 chunk1=0,chunk2=s->n_chunks,chunk3;
@@ -178,81 +220,284 @@ static inline u32 search_chunk(BDRVDMGState* s,int sector_num)
 	else if(s->sectors[chunk3]+s->sectorcounts[chunk3]>sector_num)
 	    return chunk3;
 	else
-	    chunk1 = chunk3;
+	    chunk1 = chunk3+1;
     }
     return s->n_chunks; /* error */
 }
 
-static inline int dmg_read_chunk(BDRVDMGState *s, int sector_num)
+/* Decompress a zlib chunk into 'out'. Called without the lock held; the
+ * stream and buffer belong to the caller. */
+static int inflate_chunk(BDRVDMGState *s, z_stream *zs, char *cbuf,
+			 u32 chunk, char *out)
 {
-    if(!is_sector_in_chunk(s, s->current_chunk, sector_num)) {
-	int ret;
-	u32 chunk = search_chunk(s,sector_num);
+    size_t i = 0;
+    ssize_t ret;
 
-	if(chunk>=s->n_chunks)
+    /* we need to buffer, because only the chunk as whole can be
+     * inflated. */
+    while(i < s->lengths[chunk]) {
+	ret = pread(s->fd, cbuf+i, s->lengths[chunk]-i, s->offsets[chunk]+i);
+	if(ret < 0 && errno == EINTR)
+	    continue;
+	if(ret <= 0)
 	    return -1;
+	i += ret;
+    }
 
-	s->current_chunk = s->n_chunks;
-	switch(s->types[chunk]) {
-	case 0x80000005: { /* zlib compressed */
-	    int i;
-
-	    ret = lseek(s->fd, s->offsets[chunk], SEEK_SET);
-	    if(ret<0)
-		return -1;
-
-	    /* we need to buffer, because only the chunk as whole can be
-	     * inflated. */
-	    i=0;
-	    do {
-		ret = read(s->fd, s->compressed_chunk+i, s->lengths[chunk]-i);
-		if(ret<0 && errno==EINTR)
-		    ret=0;
-		i+=ret;
-	    } while(ret>=0 && ret+i<s->lengths[chunk]);
-
-	    if (ret != s->lengths[chunk])
-		return -1;
-	
-	    s->zstream.next_in = (unsigned char *) (s->compressed_chunk);
-	    s->zstream.avail_in = s->lengths[chunk];
-	    s->zstream.next_out = (unsigned char *) (s->uncompressed_chunk);
-	    s->zstream.avail_out = 512*s->sectorcounts[chunk];
-	    ret = inflateReset(&s->zstream);
-	    if(ret != Z_OK)
-		return -1;
-	    ret = inflate(&s->zstream, Z_FINISH);
-	    if(ret != Z_STREAM_END || s->zstream.total_out != 512*s->sectorcounts[chunk])
-		return -1;
-	    break; }
-	case 1: /* copy */
-	    ret = read(s->fd, s->uncompressed_chunk, s->lengths[chunk]);
-	    if (ret != s->lengths[chunk])
-		return -1;
-	    break;
-	case 2: /* zero */
-	    memset(s->uncompressed_chunk, 0, 512*s->sectorcounts[chunk]);
+    zs->next_in = (unsigned char *)cbuf;
+    zs->avail_in = s->lengths[chunk];
+    zs->next_out = (unsigned char *)out;
+    zs->avail_out = 512*s->sectorcounts[chunk];
+    if(inflateReset(zs) != Z_OK)
+	return -1;
+    ret = inflate(zs, Z_FINISH);
+    if(ret != Z_STREAM_END || zs->total_out != 512*s->sectorcounts[chunk])
+	return -1;
+    return 0;
+}
+
+static void cache_free(BDRVDMGState *s, DMGCacheEntry *e)
+{
+    DMGCacheEntry **pp;
+
+    for(pp = &s->entries; *pp; pp = &(*pp)->next) {
+	if(*pp == e) {
+	    *pp = e->next;
 	    break;
 	}
-	s->current_chunk = chunk;
+    }
+    s->cache[e->chunk] = NULL;
+    s->cache_bytes -= e->size;
+    if(e->prefetched)
+	s->ra_bytes -= e->size;
+    free(e->data);
+    free(e);
+}
+
+/* Evict least recently used chunks until 'size' more bytes fit in the
+ * budget. Chunks which are being loaded or copied stay. */
+static int cache_make_room(BDRVDMGState *s, size_t size)
+{
+    DMGCacheEntry *e, *victim;
+
+    while(s->cache_bytes + size > s->cache_limit) {
+	victim = NULL;
+	for(e = s->entries; e; e = e->next) {
+	    if(e->refs || e->state == DMG_CACHE_QUEUED || e->state == DMG_CACHE_LOADING)
+		continue;
+	    if(!victim || e->lru < victim->lru)
+		victim = e;
+	}
+	if(!victim)
+	    return -1;
+	cache_free(s, victim);
     }
     return 0;
 }
 
-int dmg_read(bdev_desc_t *bdev, u8 *buf, int nb_bytes)
+/* Create a cache entry for a chunk. The caller holds the lock. */
+static DMGCacheEntry *cache_insert(BDRVDMGState *s, u32 chunk, int state)
+{
+    DMGCacheEntry *e;
+    u32 size = 512*s->sectorcounts[chunk];
+
+    /* a chunk the guest waits for may exceed the budget */
+    if(cache_make_room(s, size) < 0 && state == DMG_CACHE_QUEUED)
+	return NULL;
+    if(!(e = calloc(1, sizeof(*e))))
+	return NULL;
+    if(!(e->data = malloc(size))) {
+	free(e);
+	return NULL;
+    }
+    e->chunk = chunk;
+    e->state = state;
+    e->size = size;
+    e->lru = ++s->lru_tick;
+    e->next = s->entries;
+    s->entries = e;
+    s->cache[chunk] = e;
+    s->cache_bytes += size;
+    return e;
+}
+
+/* Returns the decompressed chunk with a reference held. Called with the
+ * lock held, which is dropped while inflating. */
+static DMGCacheEntry *get_chunk(BDRVDMGState *s, u32 chunk)
+{
+    DMGCacheEntry *e;
+    int ret;
+
+    for(;;) {
+	if(!(e = s->cache[chunk])) {
+	    s->misses++;
+	    if(!(e = cache_insert(s, chunk, DMG_CACHE_LOADING)))
+		return NULL;
+	    break;
+	}
+	if(e->state == DMG_CACHE_QUEUED) {
+	    /* not picked up by a readahead thread yet, do it ourselves */
+	    e->state = DMG_CACHE_LOADING;
+	    e->prefetched = 0;
+	    s->ra_bytes -= e->size;
+	    s->misses++;
+	    break;
+	}
+	if(e->state == DMG_CACHE_LOADING) {
+	    s->waits++;
+	    pthread_cond_wait(&s->cond, &s->lock);
+	    continue;
+	}
+	if(e->state == DMG_CACHE_FAILED) {
+	    cache_free(s, e);
+	    return NULL;
+	}
+	s->hits++;
+	if(e->prefetched) {
+	    e->prefetched = 0;
+	    s->ra_bytes -= e->size;
+	    s->ra_hits++;
+	}
+	e->lru = ++s->lru_tick;
+	e->refs++;
+	return e;
+    }
+
+    e->refs++;
+    pthread_mutex_unlock(&s->lock);
+    ret = inflate_chunk(s, &s->zstream, s->compressed_chunk, chunk, e->data);
+    pthread_mutex_lock(&s->lock);
+    e->state = ret ? DMG_CACHE_FAILED : DMG_CACHE_READY;
+    pthread_cond_broadcast(&s->cond);
+    if(ret) {
+	e->refs--;
+	cache_free(s, e);
+	return NULL;
+    }
+    return e;
+}
+
+/* Queue the zlib chunks following 'chunk' for the readahead threads */
+static void queue_readahead(BDRVDMGState *s, u32 chunk)
+{
+    DMGCacheEntry *e;
+    u32 i;
+
+    if(!s->nthreads)
+	return;
+    for(i = chunk+1; i < s->n_chunks && i <= chunk+s->readahead; i++) {
+	if(s->types[i] != DMG_CHUNK_ZLIB || s->cache[i])
+	    continue;
+	/* don't let readahead push out more than half of the cache */
+	if(s->ra_bytes * 2 > s->cache_limit ||
+	   (s->ra_tail+1) % DMG_RA_QUEUE == s->ra_head)
+	    break;
+	if(!(e = cache_insert(s, i, DMG_CACHE_QUEUED)))
+	    break;
+	e->prefetched = 1;
+	s->ra_bytes += e->size;
+	s->ra_queue[s->ra_tail] = i;
+	s->ra_tail = (s->ra_tail+1) % DMG_RA_QUEUE;
+	pthread_cond_broadcast(&s->cond);
+    }
+}
+
+static void readahead_thread(void *p)
+{
+    BDRVDMGState *s = p;
+    DMGCacheEntry *e;
+    char *cbuf;
+    z_stream zs;
+    u32 chunk;
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    cbuf = malloc(s->max_compressed_size+1);
+    if(!cbuf || inflateInit(&zs) != Z_OK) {
+	free(cbuf);
+	cbuf = NULL;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    while(cbuf && !s->exiting) {
+	if(s->ra_head == s->ra_tail) {
+	    pthread_cond_wait(&s->cond, &s->lock);
+	    continue;
+	}
+	chunk = s->ra_queue[s->ra_head];
+	s->ra_head = (s->ra_head+1) % DMG_RA_QUEUE;
+	/* a reader may have taken it over */
+	if(!(e = s->cache[chunk]) || e->state != DMG_CACHE_QUEUED)
+	    continue;
+	e->state = DMG_CACHE_LOADING;
+	pthread_mutex_unlock(&s->lock);
+
+	ret = inflate_chunk(s, &zs, cbuf, chunk, e->data);
+
+	pthread_mutex_lock(&s->lock);
+	e->state = ret ? DMG_CACHE_FAILED : DMG_CACHE_READY;
+	pthread_cond_broadcast(&s->cond);
+    }
+    if(cbuf) {
+	inflateEnd(&zs);
+	free(cbuf);
+    }
+    s->nthreads--;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+int dmg_read(bdev_desc_t *bdev, struct iovec *vec, int count)
 {
     BDRVDMGState *s = DMG_PRIV(bdev);
-    int i;
-    int nb_sectors = ceil(nb_bytes / 512);
+    long sector = s->seek_sector;
+    int nb_sectors = iov_cursor_total(vec, count) / 512;
+    DMGCacheEntry *e;
+    iov_cursor_t c;
+    u32 chunk = s->n_chunks;
+    int n, offs;
 
-    for(i=0;i<nb_sectors;i++) {
-	u32 sector_offset_in_chunk;
-	if(dmg_read_chunk(s, s->seek_sector+i) != 0)
-	    return -1;
-	sector_offset_in_chunk = s->seek_sector+i-s->sectors[s->current_chunk];
-	memcpy(buf+i*512, s->uncompressed_chunk+sector_offset_in_chunk*512, 512);
+    iov_cursor_init(&c, vec, count);
+    pthread_mutex_lock(&s->lock);
+    while(nb_sectors > 0) {
+	if(chunk >= s->n_chunks || sector >= s->sectors[chunk]+s->sectorcounts[chunk])
+	    chunk = search_chunk(s, sector);
+	if(chunk >= s->n_chunks)
+	    goto err;
+	offs = sector - s->sectors[chunk];
+	n = MIN(nb_sectors, s->sectorcounts[chunk] - offs);
+
+	switch(s->types[chunk]) {
+	case DMG_CHUNK_ZLIB:
+	    if(!(e = get_chunk(s, chunk)))
+		goto err;
+	    pthread_mutex_unlock(&s->lock);
+	    iov_cursor_from_buf(&c, e->data + offs*512, n*512);
+	    pthread_mutex_lock(&s->lock);
+	    e->refs--;
+	    break;
+	case DMG_CHUNK_COPY:
+	    if(iov_cursor_rw(s->fd, &c, n*512, s->offsets[chunk] + offs*512, 0) < 0)
+		goto err;
+	    break;
+	case DMG_CHUNK_ZERO:
+	    iov_cursor_zero(&c, n*512);
+	    break;
+	}
+	sector += n;
+	nb_sectors -= n;
     }
-    return nb_bytes;
+
+    /* read ahead when the guest reads sequentially */
+    if(s->seek_sector == s->next_sector && chunk < s->n_chunks)
+	queue_readahead(s, chunk);
+    s->next_sector = sector;
+    pthread_mutex_unlock(&s->lock);
+    return (sector - s->seek_sector) * 512;
+
+err:
+    pthread_mutex_unlock(&s->lock);
+    return -1;
 }
 
 int dmg_seek(bdev_desc_t *bdev, long seek_block, long offset){
@@ -263,6 +508,27 @@ int dmg_seek(bdev_desc_t *bdev, long seek_block, long offset){
 void dmg_close(bdev_desc_t *bdev)
 {
     BDRVDMGState *s = DMG_PRIV(bdev);
+    BDRVDMGState **pp;
+
+    for(pp = &dmg_images; *pp; pp = &(*pp)->next) {
+	if(*pp == s) {
+	    *pp = s->next;
+	    break;
+	}
+    }
+
+    /* wait for the readahead threads */
+    pthread_mutex_lock(&s->lock);
+    s->exiting = 1;
+    pthread_cond_broadcast(&s->cond);
+    while(s->nthreads)
+	pthread_cond_wait(&s->cond, &s->lock);
+    while(s->entries)
+	cache_free(s, s->entries);
+    pthread_mutex_unlock(&s->lock);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+
     if(s->n_chunks>0) {
 	free(s->types);
 	free(s->offsets);
@@ -270,8 +536,8 @@ void dmg_close(bdev_desc_t *bdev)
 	free(s->sectors);
 	free(s->sectorcounts);
     }
+    free(s->cache);
     free(s->compressed_chunk);
-    free(s->uncompressed_chunk);
     inflateEnd(&s->zstream);
     free(s);
 }
@@ -29,11 +29,62 @@
  */
 
 #include "blk_qcow.h"
+#include "res_manager.h"
+#include "thread.h"
 
-static int decompress_cluster(BDRVQCowState *s, u64 cluster_offset);
+static u8 *decompress_cluster(BDRVQCowState *s, u64 cluster_offset);
+
+/* open images, for the debugger */
+static BDRVQCowState *qcow_images;
+
+static int __dcmd
+cmd_qcowstat( int argc, char **argv )
+{
+    BDRVQCowState *s;
+    u64 n;
+
+    if (argc != 1)
+        return 1;
+    for (s = qcow_images; s; s = s->next) {
+        n = s->l2c.hits + s->l2c.misses;
+        printm("%s\n", s->bdev->dev_name ? s->bdev->dev_name : "<qcow>");
+        printm("    L2 cache: %d tables (%d sets x %d ways)\n",
+               l2_cache_size(&s->l2c), s->l2c.sets, QCOW_L2_CACHE_WAYS);
+        printm("    hits %lld  misses %lld  (%d%%)  evictions %lld  metadata writes %lld\n",
+               s->l2c.hits, s->l2c.misses, n ? (int)(s->l2c.hits * 100 / n) : 0,
+               s->l2c.evictions, s->meta_writes);
+        n = s->cc_hits + s->cc_misses;
+        if (n)
+            printm("    compressed: %d clusters cached  hits %lld  misses %lld  (%d%%)  "
+                   "parallel %lld\n", s->ccache_size, s->cc_hits, s->cc_misses,
+                   (int)(s->cc_hits * 100 / n), s->cc_parallel);
+    }
+    return 0;
+}
+
+/* The key is the password padded with zeros to 16 bytes (as in qemu) */
+static int qcow_set_key(BDRVQCowState *s, const char *key)
+{
+    u8 keybuf[16];
+    int len;
+
+    if (!key)
+        return -1;
+    memset(keybuf, 0, 16);
+    len = strlen(key);
+    if (len > 16)
+        len = 16;
+    memcpy(keybuf, key, len);
+    if (AES_set_encrypt_key(keybuf, 128, &s->aes_encrypt_key) != 0 ||
+        AES_set_decrypt_key(keybuf, 128, &s->aes_decrypt_key) != 0)
+        return -1;
+    s->crypt_method = s->crypt_method_header;
+    return 0;
+}
 
 int qcow_open(int fd, bdev_desc_t *bdev) 
 {
+    static int cmd_added;
     int len, i, shift;
     QCowHeader header;
     BDRVQCowState *s = NULL;
@@ -41,15 +92,13 @@ int qcow_open(int fd, bdev_desc_t *bdev)
     
     bdev->priv = malloc( sizeof (BDRVQCowState) );
     if(bdev->priv == NULL)
-	    goto fail;
+	    return -1;
     s = QCOW_PRIV(bdev);
     CLEAR( *s );
 
     /* Init the bdev struct */
-    bdev->read = &wrap_read;
-    bdev->write = &wrap_write;
-    bdev->real_read = &qcow_read;
-    bdev->real_write = &qcow_write;
+    bdev->read = &qcow_read;
+    bdev->write = &qcow_write;
     bdev->seek = &qcow_seek;
     bdev->close = &qcow_close;
     bdev->fd = fd;
@@ -77,8 +126,14 @@ int qcow_open(int fd, bdev_desc_t *bdev)
     if (header.crypt_method > QCOW_CRYPT_AES)
         goto fail;
     s->crypt_method_header = header.crypt_method;
-    if (s->crypt_method_header)
-        bdev->flags &= BF_ENCRYPTED;
+    if (s->crypt_method_header) {
+        bdev->flags |= BF_ENCRYPTED;
+        /* without the key reads return ciphertext and writes corrupt the image */
+        if (qcow_set_key(s, get_str_res("qcow.key")) < 0) {
+            printm("qcow: encrypted image but no (valid) qcow.key given\n");
+            goto fail;
+        }
+    }
     s->cluster_bits = header.cluster_bits;
     s->cluster_size = 1 << s->cluster_bits;
     s->cluster_sectors = 1 << (s->cluster_bits - 9);
@@ -103,15 +158,38 @@ int qcow_open(int fd, bdev_desc_t *bdev)
     }
 
     /* alloc L2 cache */
-    s->l2_cache = malloc(s->l2_size * QCOW_L2_CACHE_SIZE * sizeof(u64));
-    if (!s->l2_cache)
-        goto fail;
-    s->cluster_cache = malloc(s->cluster_size);
-    if (!s->cluster_cache)
+    if ((i = get_numeric_res("qcow.l2_cache")) <= 0)
+        i = QCOW_L2_CACHE_SIZE;
+    if (l2_cache_init(&s->l2c, i, s->l2_size * sizeof(u64), s->cluster_bits) < 0)
         goto fail;
     s->cluster_data = malloc(s->cluster_size);
     if (!s->cluster_data)
-    s->cluster_cache_offset = -1;
+        goto fail;
+
+    /* decompressed cluster cache */
+    if ((s->ccache_size = get_numeric_res("qcow.compressed_cache")) <= 0)
+        s->ccache_size = QCOW_CCACHE_SIZE;
+    s->ccache = calloc(s->ccache_size, sizeof(QCowCCEntry));
+    s->jobs = calloc(s->ccache_size, sizeof(QCowInflateJob));
+    if (!s->ccache || !s->jobs)
+        goto fail;
+    for (i = 0; i < s->ccache_size; i++) {
+        s->ccache[i].offset = -1;
+        if (!(s->ccache[i].data = malloc(s->cluster_size)))
+            goto fail;
+    }
+    if (inflateInit2(&s->zstream, -12) != Z_OK)
+        goto fail;
+    s->zstream_ok = 1;
+    /* helper threads are started by the first multi-cluster read */
+    if ((s->inflate_threads = get_numeric_res("qcow.inflate_threads")) < 0)
+        s->inflate_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (s->inflate_threads > QCOW_MAX_INFLATE_THREADS)
+        s->inflate_threads = QCOW_MAX_INFLATE_THREADS;
+    pthread_mutex_init(&s->inflate_lock, NULL);
+    pthread_cond_init(&s->inflate_cond, NULL);
+    pthread_cond_init(&s->inflate_done, NULL);
+
     if (header.backing_file_offset != 0) {
         int not_used;
         
@@ -134,17 +212,31 @@ int qcow_open(int fd, bdev_desc_t *bdev)
     	  goto fail;
         }
     }
+
+    s->bdev = bdev;
+    s->next = qcow_images;
+    qcow_images = s;
+    if (!cmd_added++)
+        add_cmd("qcowstat", "qcowstat \nshow qcow L2 cache statistics\n", -1, cmd_qcowstat);
     return 0;
 
  fail:
     if(s->l1_table)
     	free(s->l1_table);
-    if(s->l2_cache)
-	free(s->l2_cache);
-    if(s->cluster_cache)
-	free(s->cluster_cache);
+    l2_cache_free(&s->l2c);
     if(s->cluster_data) 
 	free(s->cluster_data);
+    if(s->ccache) {
+	for (i = 0; i < s->ccache_size; i++)
+	    free(s->ccache[i].data);
+	free(s->ccache);
+    }
+    free(s->jobs);
+    if(s->zstream_ok)
+	inflateEnd(&s->zstream);
+    free(s);
+    bdev->priv = NULL;
+    bdev->close = NULL;
 #if 0
     // close is done by caller
     close(s->fd);
@@ -160,21 +252,105 @@ static void encrypt_sectors(BDRVQCowState *s, u64 sector_num,
                             int nb_sectors, int enc,
                             const AES_KEY *key)
 {
-    union {
-        u64 ll[2];
-        u8 b[16];
-    } ivec;
-    int i;
+    AES_cbc_sectors(in_buf, out_buf, nb_sectors, sector_num, key, enc);
+}
 
-    for(i = 0; i < nb_sectors; i++) {
-        ivec.ll[0] = cpu_to_le64(sector_num);
-        ivec.ll[1] = 0;
-        AES_cbc_encrypt(in_buf, out_buf, 512, key, 
-                        ivec.b, enc);
-        sector_num++;
-        in_buf += 512;
-        out_buf += 512;
+/* Write back the dirty part of an L2 table */
+static int l2_writeback(BDRVQCowState *s, QCowL2Entry *e)
+{
+    int len = (e->dirty_end - e->dirty_start) * sizeof(u64);
+
+    if (!len)
+        return 0;
+    s->meta_writes++;
+    if (pwrite(s->fd, e->table + e->dirty_start, len,
+               e->offset + e->dirty_start * sizeof(u64)) != len)
+        return -1;
+    e->dirty_start = e->dirty_end = 0;
+    return 0;
+}
+
+/* Write back all dirty metadata. Called once the data of a request has
+   been written; the data is synced first so that tables never reference
+   clusters before their data is on disk. New L2 tables go out before the
+   L1 entries pointing at them. */
+static int qcow_flush_meta(BDRVQCowState *s)
+{
+    u64 *buf = (u64 *)s->cluster_data;
+    int i, n, chunk = s->cluster_size / sizeof(u64);
+    int ret = 0;
+
+    for (i = 0; i < l2_cache_size(&s->l2c); i++)
+        if (l2_entry_dirty(&s->l2c.entries[i]))
+            break;
+    if (i == l2_cache_size(&s->l2c) && s->l1_dirty_start == s->l1_dirty_end)
+        return 0;
+    if (fdatasync(s->fd) < 0)
+        return -1;
+
+    for (i = 0; i < l2_cache_size(&s->l2c); i++)
+        ret |= l2_writeback(s, &s->l2c.entries[i]);
+
+    while (s->l1_dirty_start < s->l1_dirty_end) {
+        n = s->l1_dirty_end - s->l1_dirty_start;
+        if (n > chunk)
+            n = chunk;
+        for (i = 0; i < n; i++)
+            buf[i] = cpu_to_be64(s->l1_table[s->l1_dirty_start + i]);
+        s->meta_writes++;
+        if (pwrite(s->fd, buf, n * sizeof(u64),
+                   s->l1_table_offset + s->l1_dirty_start * sizeof(u64)) !=
+            n * sizeof(u64))
+            return -1;
+        s->l1_dirty_start += n;
+    }
+    s->l1_dirty_start = s->l1_dirty_end = 0;
+    return ret;
+}
+
+static inline void mark_dirty(int *start, int *end, int index)
+{
+    if (*start == *end) {
+        *start = index;
+        *end = index + 1;
+    } else if (index < *start) {
+        *start = index;
+    } else if (index >= *end) {
+        *end = index + 1;
+    }
+}
+
+/* Look up the L2 table at l2_offset, loading it on a miss. A dirty way
+   is only replaced (through qcow_flush_meta, after the data it
+   references) when no data write is pending; otherwise the lookup fails
+   with l2_pinned set and the caller ends its batch. */
+static QCowL2Entry *l2_cache_lookup(BDRVQCowState *s, u64 l2_offset,
+                                    int new_l2_table)
+{
+    QCowL2Entry *e;
+
+    if ((e = l2_cache_find(&s->l2c, l2_offset)))
+        return e;
+    e = l2_cache_victim(&s->l2c, l2_offset);
+    if (l2_entry_dirty(e)) {
+        if (s->data_pending) {
+            s->l2_pinned = 1;
+            return NULL;
+        }
+        if (qcow_flush_meta(s) < 0)
+            return NULL;
+    }
+    l2_cache_drop(&s->l2c, e);
+    if (new_l2_table) {
+        /* the table has been reserved with ftruncate and reads as zero */
+        memset(e->table, 0, s->l2_size * sizeof(u64));
+    } else {
+        if (pread(s->fd, e->table, s->l2_size * sizeof(u64), l2_offset) !=
+            s->l2_size * sizeof(u64))
+            return NULL;
     }
+    l2_cache_install(&s->l2c, e, l2_offset);
+    return e;
 }
 
 /* 
@@ -192,15 +368,18 @@ static void encrypt_sectors(BDRVQCowState *s, u64 sector_num,
  * cluster_size 
  *
  * return 0 if not allocated.
+ *
+ * Updated L1/L2 entries are only marked dirty; qcow_flush_meta
+ * writes them back.
  */
 static u64 get_cluster_offset(BDRVQCowState *s, 
                                    u64 offset, int allocate,
                                    int compressed_size,
                                    int n_start, int n_end)
 {
-    int min_index, i, j, l1_index, l2_index;
-    u64 l2_offset, *l2_table, cluster_offset, tmp;
-    u32 min_count;
+    int i, l1_index, l2_index;
+    u64 l2_offset, *l2_table, cluster_offset;
+    QCowL2Entry *e;
     int new_l2_table;
 
     /* Find the L1 Table Offset */
@@ -214,50 +393,16 @@ static u64 get_cluster_offset(BDRVQCowState *s,
         l2_offset = lseek(s->fd, 0, SEEK_END);
         /* round to cluster size */
         l2_offset = (l2_offset + s->cluster_size - 1) & ~(s->cluster_size - 1);
+        if (ftruncate(s->fd, l2_offset + s->l2_size * sizeof(u64)))
+            return 0;
         /* update the L1 entry */
         s->l1_table[l1_index] = l2_offset;
-        tmp = cpu_to_be64(l2_offset);
-        lseek(s->fd, s->l1_table_offset + l1_index * sizeof(tmp), SEEK_SET);
-        if (write(s->fd, &tmp, sizeof(tmp)) != sizeof(tmp)) 
-            return 0;
+        mark_dirty(&s->l1_dirty_start, &s->l1_dirty_end, l1_index);
         new_l2_table = 1;
     }
-    for(i = 0; i < QCOW_L2_CACHE_SIZE; i++) {
-        if (l2_offset == s->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++s->l2_cache_counts[i] == 0xffffffff) {
-                for(j = 0; j < QCOW_L2_CACHE_SIZE; j++) {
-                    s->l2_cache_counts[j] >>= 1;
-                }
-            }
-            l2_table = s->l2_cache + (i << s->l2_bits);
-            goto found;
-        }
-    }
-    /* not found: load a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for(i = 0; i < QCOW_L2_CACHE_SIZE; i++) {
-        if (s->l2_cache_counts[i] < min_count) {
-            min_count = s->l2_cache_counts[i];
-            min_index = i;
-        }
-    }
-    l2_table = s->l2_cache + (min_index << s->l2_bits);
-    lseek(s->fd, l2_offset, SEEK_SET);
-    if (new_l2_table) {
-        memset(l2_table, 0, s->l2_size * sizeof(u64));
-        if (write(s->fd, l2_table, s->l2_size * sizeof(u64)) !=
-            s->l2_size * sizeof(u64)) 
-            return 0;
-    } else {
-        if (read(s->fd, l2_table, s->l2_size * sizeof(u64)) !=
-            s->l2_size * sizeof(u64)) 
-            return 0;
-    }
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
- found:
+    if (!(e = l2_cache_lookup(s, l2_offset, new_l2_table)))
+        return 0;
+    l2_table = e->table;
     l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
     cluster_offset = be64_to_cpu(l2_table[l2_index]);
     if (!cluster_offset ||
@@ -270,16 +415,17 @@ static u64 get_cluster_offset(BDRVQCowState *s,
             /* if the cluster is already compressed, we must
                decompress it in the case it is not completely
                overwritten */
-            if (decompress_cluster(s, cluster_offset) < 0)
+            u8 *data = decompress_cluster(s, cluster_offset);
+
+            if (!data)
                 return 0;
             cluster_offset = lseek(s->fd, 0, SEEK_END);
             cluster_offset = (cluster_offset + s->cluster_size - 1) &
                 ~(s->cluster_size - 1);
             /* write the cluster content */
-            lseek(s->fd, cluster_offset, SEEK_SET);
-            if (write(s->fd, s->cluster_cache, s->cluster_size) !=
+            if (pwrite(s->fd, data, s->cluster_size, cluster_offset) !=
                 s->cluster_size) 
-                return -1;
+                return 0;
         } else {
             cluster_offset = lseek(s->fd, 0, SEEK_END);
             if (allocate == 1) {
@@ -294,19 +440,22 @@ static u64 get_cluster_offset(BDRVQCowState *s,
                 if (s->crypt_method &&
                     (n_end - n_start) < s->cluster_sectors) {
                     u64 start_sect;
+
                     start_sect = (offset & ~(s->cluster_size - 1)) >> 9;
-                    memset(s->cluster_data + 512, 0xaa, 512);
-                    for(i = 0; i < s->cluster_sectors; i++) {
-                        if (i < n_start || i >= n_end) {
-                            encrypt_sectors(s, start_sect + i,
-                                            s->cluster_data,
-                                            s->cluster_data + 512, 1, 1,
-                                            &s->aes_encrypt_key);
-                            lseek(s->fd, cluster_offset + i * 512, SEEK_SET);
-                            if (write(s->fd, s->cluster_data, 512) != 512)
-                                return -1;
-                        }
-                    }
+                    memset(s->cluster_data, 0, s->cluster_size);
+                    encrypt_sectors(s, start_sect, s->cluster_data,
+                                    s->cluster_data, n_start, 1,
+                                    &s->aes_encrypt_key);
+                    encrypt_sectors(s, start_sect + n_end,
+                                    s->cluster_data + n_end * 512,
+                                    s->cluster_data + n_end * 512,
+                                    s->cluster_sectors - n_end, 1,
+                                    &s->aes_encrypt_key);
+                    /* one write for head and tail; the sectors in
+                       between are written by the caller right after */
+                    if (pwrite(s->fd, s->cluster_data, s->cluster_size,
+                               cluster_offset) != s->cluster_size)
+                        return 0;
                 }
             } else {
                 cluster_offset |= QCOW_OFLAG_COMPRESSED |
@@ -314,74 +463,214 @@ static u64 get_cluster_offset(BDRVQCowState *s,
             }
         }
         /* update L2 table */
-        tmp = cpu_to_be64(cluster_offset);
-        l2_table[l2_index] = tmp;
-        lseek(s->fd, l2_offset + l2_index * sizeof(tmp), SEEK_SET);
-        if (write(s->fd, &tmp, sizeof(tmp)) != sizeof(tmp))
-            return 0;
+        l2_table[l2_index] = cpu_to_be64(cluster_offset);
+        mark_dirty(&e->dirty_start, &e->dirty_end, l2_index);
     }
     return cluster_offset;    
 }
 
-static int decompress_buffer(u8 *out_buf, int out_buf_size,
+/* inflate a raw deflate stream, reusing the z_stream of the caller */
+static int decompress_buffer(z_stream *strm, u8 *out_buf, int out_buf_size,
                              const u8 *buf, int buf_size)
 {
-    z_stream strm1, *strm = &strm1;
     int ret, out_len;
 
-    memset(strm, 0, sizeof(*strm));
-
+    if (inflateReset(strm) != Z_OK)
+        return -1;
     strm->next_in = (u8 *)buf;
     strm->avail_in = buf_size;
     strm->next_out = out_buf;
     strm->avail_out = out_buf_size;
 
-    ret = inflateInit2(strm, -12);
-    if (ret != Z_OK)
-        return -1;
     ret = inflate(strm, Z_FINISH);
     out_len = strm->next_out - out_buf;
     if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
-        inflateEnd(strm);
+        out_len != out_buf_size)
         return -1;
-    }
-    inflateEnd(strm);
     return 0;
 }
-                              
-static int decompress_cluster(BDRVQCowState *s, u64 cluster_offset)
+
+/* read and inflate the compressed cluster described by the L2 entry */
+static int inflate_cluster(BDRVQCowState *s, z_stream *strm, u8 *cbuf,
+                           u64 cluster_offset, u8 *out)
 {
-    int ret, csize;
-    u64 coffset;
-
-    coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        csize = cluster_offset >> (63 - s->cluster_bits);
-        csize &= (s->cluster_size - 1);
-        lseek(s->fd, coffset, SEEK_SET);
-        ret = read(s->fd, s->cluster_data, csize);
-        if (ret != csize) 
-            return -1;
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data, csize) < 0) {
-            return -1;
+    int csize;
+
+    csize = cluster_offset >> (63 - s->cluster_bits);
+    csize &= (s->cluster_size - 1);
+    if (pread(s->fd, cbuf, csize, cluster_offset & s->cluster_offset_mask) != csize)
+        return -1;
+    return decompress_buffer(strm, out, s->cluster_size, cbuf, csize);
+}
+
+static QCowCCEntry *cc_lookup(BDRVQCowState *s, u64 coffset)
+{
+    int i;
+
+    for (i = 0; i < s->ccache_size; i++) {
+        if (s->ccache[i].offset == coffset) {
+            s->ccache[i].lru = ++s->cc_tick;
+            return &s->ccache[i];
         }
-        s->cluster_cache_offset = coffset;
     }
-    return 0;
+    return NULL;
 }
 
-/* nb_bytes is the number of bytes to read in */
-int qcow_read(bdev_desc_t *bdev, u8 * buf, int nb_bytes)
+/* least recently used entry; it is invalidated and made most recent */
+static QCowCCEntry *cc_victim(BDRVQCowState *s)
+{
+    QCowCCEntry *e = &s->ccache[0];
+    int i;
+
+    for (i = 1; i < s->ccache_size; i++)
+        if (s->ccache[i].lru < e->lru)
+            e = &s->ccache[i];
+    e->offset = -1;
+    e->lru = ++s->cc_tick;
+    return e;
+}
+
+/* Returns the decompressed cluster, NULL on error */
+static u8 *decompress_cluster(BDRVQCowState *s, u64 cluster_offset)
+{
+    u64 coffset = cluster_offset & s->cluster_offset_mask;
+    QCowCCEntry *e;
+
+    if ((e = cc_lookup(s, coffset))) {
+        s->cc_hits++;
+        return e->data;
+    }
+    s->cc_misses++;
+    e = cc_victim(s);
+    if (inflate_cluster(s, &s->zstream, s->cluster_data, cluster_offset, e->data) < 0)
+        return NULL;
+    e->offset = coffset;
+    return e->data;
+}
+
+/************************************************************************/
+/*	parallel inflate						*/
+/************************************************************************/
+
+/* Run queued jobs until none are left; called with inflate_lock held */
+static void run_inflate_jobs(BDRVQCowState *s, z_stream *strm, u8 *cbuf)
+{
+    QCowInflateJob *j;
+
+    while (s->next_job < s->njobs) {
+        j = &s->jobs[s->next_job++];
+        pthread_mutex_unlock(&s->inflate_lock);
+        j->error = inflate_cluster(s, strm, cbuf, j->cluster_offset, j->e->data);
+        pthread_mutex_lock(&s->inflate_lock);
+        if (++s->jobs_done == s->njobs)
+            pthread_cond_broadcast(&s->inflate_done);
+    }
+}
+
+static void inflate_thread(void *p)
+{
+    BDRVQCowState *s = p;
+    z_stream strm;
+    u8 *cbuf;
+
+    memset(&strm, 0, sizeof(strm));
+    cbuf = malloc(s->cluster_size);
+    if (cbuf && inflateInit2(&strm, -12) != Z_OK) {
+        free(cbuf);
+        cbuf = NULL;
+    }
+
+    pthread_mutex_lock(&s->inflate_lock);
+    while (cbuf && !s->exiting) {
+        if (s->next_job >= s->njobs) {
+            pthread_cond_wait(&s->inflate_cond, &s->inflate_lock);
+            continue;
+        }
+        run_inflate_jobs(s, &strm, cbuf);
+    }
+    if (cbuf) {
+        inflateEnd(&strm);
+        free(cbuf);
+    }
+    s->threads_running--;
+    pthread_cond_broadcast(&s->inflate_done);
+    pthread_mutex_unlock(&s->inflate_lock);
+}
+
+static void stop_inflate_threads(BDRVQCowState *s)
+{
+    pthread_mutex_lock(&s->inflate_lock);
+    s->exiting = 1;
+    pthread_cond_broadcast(&s->inflate_cond);
+    while (s->threads_running)
+        pthread_cond_wait(&s->inflate_done, &s->inflate_lock);
+    pthread_mutex_unlock(&s->inflate_lock);
+}
+
+/* Inflate the uncached compressed clusters of a request in parallel;
+   the reads which follow find them in the cache. Half of the cache is
+   left to the clusters used before. */
+static void prefetch_compressed(BDRVQCowState *s, u64 sector_num, int nb_sectors)
+{
+    u64 offset, end, l2e;
+    int i, n = 0;
+
+    if (s->inflate_threads <= 0)
+        return;
+    end = (sector_num + nb_sectors) << 9;
+    offset = (sector_num << 9) & ~((u64)s->cluster_size - 1);
+    for (; offset < end && n < s->ccache_size / 2; offset += s->cluster_size) {
+        l2e = get_cluster_offset(s, offset, 0, 0, 0, 0);
+        if (!(l2e & QCOW_OFLAG_COMPRESSED))
+            continue;
+        for (i = 0; i < s->ccache_size; i++)
+            if (s->ccache[i].offset == (l2e & s->cluster_offset_mask))
+                break;
+        if (i < s->ccache_size)
+            continue;
+        s->jobs[n++].cluster_offset = l2e;
+    }
+    if (n < 2)
+        return;
+    for (i = 0; i < n; i++)
+        s->jobs[i].e = cc_victim(s);
+
+    pthread_mutex_lock(&s->inflate_lock);
+    while (s->threads_running < s->inflate_threads) {
+        s->threads_running++;
+        create_thread(inflate_thread, s, "qcow-inflate");
+    }
+    s->next_job = s->jobs_done = 0;
+    s->njobs = n;
+    pthread_cond_broadcast(&s->inflate_cond);
+    /* this thread takes its share */
+    run_inflate_jobs(s, &s->zstream, s->cluster_data);
+    while (s->jobs_done < s->njobs)
+        pthread_cond_wait(&s->inflate_done, &s->inflate_lock);
+    s->njobs = s->next_job = s->jobs_done = 0;
+    pthread_mutex_unlock(&s->inflate_lock);
+
+    for (i = 0; i < n; i++) {
+        if (s->jobs[i].error)
+            continue;
+        s->jobs[i].e->offset = s->jobs[i].cluster_offset & s->cluster_offset_mask;
+        s->cc_parallel++;
+    }
+}
+
+/* Read the guest vectors directly from the image. Clusters which
+   are contiguous in the image file are merged into a single preadv. */
+int qcow_read(bdev_desc_t *bdev, struct iovec *vec, int count)
 {
     BDRVQCowState *s = QCOW_PRIV(bdev);
     u64 sector_num = s->seek_sector;
-    int ret, index_in_cluster, n;
+    int index_in_cluster, n, m;
     u64 cluster_offset;
-    int nb_sectors = ceil(nb_bytes / 512ULL);
-    u8 * buf_start = buf;
-    
+    int nb_sectors = iov_cursor_total(vec, count) >> 9;
+    iov_cursor_t c;
+
+    iov_cursor_init(&c, vec, count);
+    prefetch_compressed(s, sector_num, nb_sectors);
     while (nb_sectors > 0) {
         cluster_offset = get_cluster_offset(s, sector_num << 9, 0, 0, 0, 0);
         index_in_cluster = sector_num & (s->cluster_sectors - 1);
@@ -389,45 +678,56 @@ int qcow_read(bdev_desc_t *bdev, u8 * buf, int nb_bytes)
         if (n > nb_sectors)
             n = nb_sectors;
         if (!cluster_offset) {
-            if (s->backing_hd) {
+            if (s->backing_hd >= 0) {
                 /* read from the base image */
-  	        if (pread(s->backing_hd, buf, n * 512, sector_num *512) < 0)
+                if (iov_cursor_rw(s->backing_hd, &c, n * 512, sector_num * 512, 0) < 0)
                     return -1;
             } else {
-                memset(buf, 0, 512 * n);
+                iov_cursor_zero(&c, n * 512);
             }
- 
         } else if (cluster_offset & QCOW_OFLAG_COMPRESSED) {
-            if (decompress_cluster(s, cluster_offset) < 0)
+            u8 *data = decompress_cluster(s, cluster_offset);
+
+            if (!data)
                 return -1;
-            memcpy(buf, s->cluster_cache + index_in_cluster * 512, 512 * n);
-        } else {
-            lseek(s->fd, cluster_offset + index_in_cluster * 512, SEEK_SET);
-            ret = read(s->fd, buf, n * 512);
-            if (ret != n * 512) 
+            iov_cursor_from_buf(&c, data + index_in_cluster * 512, 512 * n);
+        } else if (s->crypt_method) {
+            cluster_offset += index_in_cluster * 512;
+            if (pread(s->fd, s->cluster_data, n * 512, cluster_offset) != n * 512)
                 return -1;
-            if (s->crypt_method) {
-                encrypt_sectors(s, sector_num, buf, buf, n, 0,
-                                &s->aes_decrypt_key);
+            encrypt_sectors(s, sector_num, s->cluster_data, s->cluster_data, n, 0,
+                            &s->aes_decrypt_key);
+            iov_cursor_from_buf(&c, s->cluster_data, n * 512);
+        } else {
+            cluster_offset += index_in_cluster * 512;
+            while (n < nb_sectors) {
+                if (get_cluster_offset(s, (sector_num + n) << 9, 0, 0, 0, 0) !=
+                    cluster_offset + n * 512)
+                    break;
+                m = nb_sectors - n;
+                n += (m > s->cluster_sectors) ? s->cluster_sectors : m;
             }
+            if (iov_cursor_rw(s->fd, &c, n * 512, cluster_offset, 0) < 0)
+                return -1;
         }
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
     }
+    n = (sector_num - s->seek_sector) << 9;
     s->seek_sector = sector_num;
-    return buf - buf_start;
+    return n;
 }
 
-int qcow_write(bdev_desc_t *bdev, u8 * buf, int nb_bytes)
+int qcow_write(bdev_desc_t *bdev, struct iovec *vec, int count)
 {
     BDRVQCowState *s = QCOW_PRIV(bdev);
-    int ret, index_in_cluster, n;
-    u8 * buf_start = buf;
-    u64 cluster_offset;
+    int index_in_cluster, n, m;
+    u64 cluster_offset, next_offset;
     u64 sector_num = s->seek_sector;
-    int nb_sectors = ceil(nb_bytes / 512);
-    
+    int nb_sectors = iov_cursor_total(vec, count) >> 9;
+    iov_cursor_t c;
+
+    iov_cursor_init(&c, vec, count);
     while (nb_sectors > 0) {
         index_in_cluster = sector_num & (s->cluster_sectors - 1);
         n = s->cluster_sectors - index_in_cluster;
@@ -438,23 +738,46 @@ int qcow_write(bdev_desc_t *bdev, u8 * buf, int nb_bytes)
                                             index_in_cluster + n);
         if (!cluster_offset)
             return -1;
-        lseek(s->fd, cluster_offset + index_in_cluster * 512, SEEK_SET);
+        cluster_offset += index_in_cluster * 512;
         if (s->crypt_method) {
-            encrypt_sectors(s, sector_num, s->cluster_data, buf, n, 1,
+            iov_cursor_to_buf(&c, s->cluster_data, n * 512);
+            encrypt_sectors(s, sector_num, s->cluster_data, s->cluster_data, n, 1,
                             &s->aes_encrypt_key);
-            ret = write(s->fd, s->cluster_data, n * 512);
+            if (pwrite(s->fd, s->cluster_data, n * 512, cluster_offset) != n * 512)
+                return -1;
         } else {
-            ret = write(s->fd, buf, n * 512);
+            /* the following clusters are allocated up front so that
+               adjacent allocations go out in a single pwritev. Their
+               tables must stay in the cache until the data is written;
+               the batch ends when a set has no clean way left. */
+            s->data_pending = 1;
+            while (n < nb_sectors) {
+                m = nb_sectors - n;
+                if (m > s->cluster_sectors)
+                    m = s->cluster_sectors;
+                next_offset = get_cluster_offset(s, (sector_num + n) << 9, 1, 0, 0, m);
+                if (!next_offset && s->l2_pinned)
+                    break;
+                if (!next_offset) {
+                    s->data_pending = 0;
+                    return -1;
+                }
+                if (next_offset != cluster_offset + n * 512)
+                    break;
+                n += m;
+            }
+            s->data_pending = s->l2_pinned = 0;
+            if (iov_cursor_rw(s->fd, &c, n * 512, cluster_offset, 1) < 0)
+                return -1;
         }
-        if (ret != n * 512)
-            return -1;
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
     }
+    if (qcow_flush_meta(s) < 0)
+        return -1;
+    n = (sector_num - s->seek_sector) << 9;
     s->seek_sector = sector_num;
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-    return buf - buf_start;
+    return n;
 }
 
 int qcow_seek(bdev_desc_t *bdev, long block, long offset){
@@ -465,10 +788,28 @@ int qcow_seek(bdev_desc_t *bdev, long block, long offset){
 void qcow_close(bdev_desc_t *bdev)
 {
     BDRVQCowState *s = QCOW_PRIV(bdev);
+    BDRVQCowState **pp;
+    int i;
+
+    for (pp = &qcow_images; *pp; pp = &(*pp)->next) {
+        if (*pp == s) {
+            *pp = s->next;
+            break;
+        }
+    }
+    qcow_flush_meta(s);
     fsync(s->fd);
+    stop_inflate_threads(s);
+    pthread_mutex_destroy(&s->inflate_lock);
+    pthread_cond_destroy(&s->inflate_cond);
+    pthread_cond_destroy(&s->inflate_done);
+    for (i = 0; i < s->ccache_size; i++)
+        free(s->ccache[i].data);
+    free(s->ccache);
+    free(s->jobs);
+    inflateEnd(&s->zstream);
     free(s->l1_table);
-    free(s->l2_cache);
-    free(s->cluster_cache);
+    l2_cache_free(&s->l2c);
     free(s->cluster_data);
     if (s->backing_hd != -1)
         close(s->backing_hd);
@@ -0,0 +1,1471 @@
+/*
+ * <blk-qcow2.c>
+ *
+ * qemu QCOW2 block device read/write functions
+ *
+ * Based on the QEMU Block driver for the QCOW2 format
+ *
+ * Copyright (c) 2004-2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Differences to qcow version 1:
+ *
+ * - every host cluster has a 16 bit reference count. Clusters with a
+ *   zero count are reused by the allocator, so the image no longer
+ *   grows on every allocation.
+ * - internal snapshots: a snapshot is a copy of the L1 table; the
+ *   clusters it shares with the active image have a count > 1 and are
+ *   copied on write. QCOW2_OFLAG_COPIED marks entries with a count of
+ *   exactly one, which can be written in place.
+ * - lazy refcounts (version 3): refcount updates are only written at
+ *   close. The header carries the dirty bit in the meantime and the
+ *   counts are rebuilt from the tables if the image was not closed.
+ *
+ * Encrypted images are not supported.
+ */
+
+#include "blk_qcow2.h"
+#include "res_manager.h"
+#include <stddef.h>
+#include <time.h>
+
+#define HDR_OFFSET(field)	offsetof(QCow2Header, field)
+
+/* open images, for the debugger */
+static BDRVQCow2State *qcow2_images;
+
+static int qcow2_flush(BDRVQCow2State *s);
+static int decompress_cluster(BDRVQCow2State *s, u64 l2e);
+
+
+/************************************************************************/
+/*	refcounts							*/
+/************************************************************************/
+
+/* make sure the refcount array covers 'n' clusters */
+static int grow_refcounts(BDRVQCow2State *s, u64 n)
+{
+    u64 nb, nblocks, old_blocks;
+    u16 *p;
+    u8 *d;
+
+    if (n <= s->nb_clusters)
+        return 0;
+    nblocks = (n + (1 << s->refcount_block_bits) - 1) >> s->refcount_block_bits;
+    nb = nblocks << s->refcount_block_bits;
+    old_blocks = s->nb_clusters >> s->refcount_block_bits;
+
+    if (!(p = realloc(s->refcounts, nb * sizeof(u16))))
+        return -1;
+    s->refcounts = p;
+    memset(p + s->nb_clusters, 0, (nb - s->nb_clusters) * sizeof(u16));
+    if (!(d = realloc(s->refblock_dirty, nblocks)))
+        return -1;
+    s->refblock_dirty = d;
+    memset(d + old_blocks, 0, nblocks - old_blocks);
+    s->nb_clusters = nb;
+    return 0;
+}
+
+static inline int get_refcount(BDRVQCow2State *s, u64 cluster)
+{
+    return (cluster < s->nb_clusters) ? s->refcounts[cluster] : 0;
+}
+
+/* add 'addend' to the count of every cluster touched by [offset, offset+length) */
+static int update_refcount(BDRVQCow2State *s, u64 offset, u64 length, int addend)
+{
+    u64 start, last, i;
+    int rc;
+
+    if (!length)
+        return 0;
+    start = offset >> s->cluster_bits;
+    last = (offset + length - 1) >> s->cluster_bits;
+    if (grow_refcounts(s, last + 1) < 0)
+        return -1;
+    for (i = start; i <= last; i++) {
+        rc = s->refcounts[i] + addend;
+        if (rc < 0 || rc > 0xffff) {
+            printm("qcow2: refcount overflow for cluster %lld\n", i);
+            return -1;
+        }
+        s->refcounts[i] = rc;
+        s->refblock_dirty[i >> s->refcount_block_bits] = 1;
+        if (!rc && i < s->free_cluster_index)
+            s->free_cluster_index = i;
+    }
+    s->refcounts_dirty = 1;
+    return 0;
+}
+
+/* Allocate 'n' contiguous clusters, reusing freed ones first */
+static u64 alloc_clusters(BDRVQCow2State *s, int n)
+{
+    u64 i, j;
+
+    for (i = s->free_cluster_index; ; i = j + 1) {
+        if (grow_refcounts(s, i + n) < 0)
+            return 0;
+        for (j = i; j < i + n && !s->refcounts[j]; j++)
+            ;
+        if (j == i + n)
+            break;
+    }
+    s->free_cluster_index = i + n;
+    if (update_refcount(s, i << s->cluster_bits, (u64)n << s->cluster_bits, 1) < 0)
+        return 0;
+    return i << s->cluster_bits;
+}
+
+/* Clusters dropped from the active tree keep their count until the
+   tables which no longer reference them are on disk (qcow2_flush);
+   until then the allocator can't hand them out again */
+static int defer_free(BDRVQCow2State *s, u64 offset, u64 length)
+{
+    QCow2Extent *p;
+    int n;
+
+    if (s->n_pending_free == s->max_pending_free) {
+        n = s->max_pending_free ? s->max_pending_free * 2 : 16;
+        if (!(p = realloc(s->pending_free, n * sizeof(QCow2Extent))))
+            return -1;
+        s->pending_free = p;
+        s->max_pending_free = n;
+    }
+    p = &s->pending_free[s->n_pending_free++];
+    p->offset = offset;
+    p->length = length;
+    return 0;
+}
+
+static int release_pending_free(BDRVQCow2State *s)
+{
+    int i;
+
+    for (i = 0; i < s->n_pending_free; i++)
+        if (update_refcount(s, s->pending_free[i].offset, s->pending_free[i].length, -1) < 0)
+            return -1;
+    s->n_pending_free = 0;
+    return 0;
+}
+
+static int load_refcounts(BDRVQCow2State *s, u64 nb_file_clusters)
+{
+    u16 *block = (u16 *)s->cluster_data;
+    u64 last = 0;
+    int i, j, n = 1 << s->refcount_block_bits;
+
+    for (i = 0; i < s->refcount_table_size; i++)
+        if (s->refcount_table[i])
+            last = i + 1;
+    if (grow_refcounts(s, MAX(last << s->refcount_block_bits, nb_file_clusters)) < 0)
+        return -1;
+
+    for (i = 0; i < last; i++) {
+        if (!s->refcount_table[i])
+            continue;
+        if (pread(s->fd, block, s->cluster_size, s->refcount_table[i]) != s->cluster_size)
+            return -1;
+        for (j = 0; j < n; j++)
+            s->refcounts[((u64)i << s->refcount_block_bits) + j] = be16_to_cpu(block[j]);
+    }
+    s->free_cluster_index = 0;
+    return 0;
+}
+
+/* Write back the dirty refcount blocks. Blocks which don't exist yet are
+   allocated, growing the refcount table if necessary. */
+static int flush_refcounts(BDRVQCow2State *s)
+{
+    u16 *block = (u16 *)s->cluster_data;
+    u64 *table, off, old_offset = 0, nblocks;
+    int i, j, n, changed, table_dirty = 0, old_clusters = 0;
+    int bsize = 1 << s->refcount_block_bits;
+
+    if (!s->refcounts_dirty)
+        return 0;
+
+    do {
+        changed = 0;
+        nblocks = s->nb_clusters >> s->refcount_block_bits;
+        if (nblocks > s->refcount_table_size) {
+            /* move the table to a bigger area; leave some slack */
+            n = ((nblocks + 8) * sizeof(u64) + s->cluster_size - 1) >> s->cluster_bits;
+            if (!(table = calloc((u64)n << s->cluster_bits, 1)))
+                return -1;
+            memcpy(table, s->refcount_table, s->refcount_table_size * sizeof(u64));
+            if (!table_dirty || !old_offset) {
+                /* the area of the table we started out with is freed */
+                old_offset = s->refcount_table_offset;
+                old_clusters = (s->refcount_table_size * sizeof(u64)) >> s->cluster_bits;
+            } else if (update_refcount(s, s->refcount_table_offset,
+                                       (u64)s->refcount_table_size * sizeof(u64), -1) < 0) {
+                free(table);
+                return -1;
+            }
+            free(s->refcount_table);
+            s->refcount_table = table;
+            s->refcount_table_size = ((u64)n << s->cluster_bits) / sizeof(u64);
+            if (!(s->refcount_table_offset = alloc_clusters(s, n)))
+                return -1;
+            table_dirty = changed = 1;
+            continue;
+        }
+        for (i = 0; i < nblocks; i++) {
+            if (!s->refblock_dirty[i] || s->refcount_table[i])
+                continue;
+            for (j = 0; j < bsize && !s->refcounts[((u64)i << s->refcount_block_bits) + j]; j++)
+                ;
+            if (j == bsize)
+                continue;
+            if (!(off = alloc_clusters(s, 1)))
+                return -1;
+            s->refcount_table[i] = off;
+            table_dirty = changed = 1;
+        }
+    } while (changed);
+
+    /* refcount blocks before the table pointing at them */
+    nblocks = s->nb_clusters >> s->refcount_block_bits;
+    for (i = 0; i < nblocks; i++) {
+        if (!s->refblock_dirty[i] || !s->refcount_table[i])
+            continue;
+        for (j = 0; j < bsize; j++)
+            block[j] = cpu_to_be16(s->refcounts[((u64)i << s->refcount_block_bits) + j]);
+        if (pwrite(s->fd, block, s->cluster_size, s->refcount_table[i]) != s->cluster_size)
+            return -1;
+        s->refblock_dirty[i] = 0;
+    }
+    s->refcounts_dirty = 0;
+
+    if (table_dirty) {
+        struct {
+            u64 offset;
+            u32 clusters;
+        } __attribute__((packed)) hdr;
+        int size = s->refcount_table_size * sizeof(u64);
+
+        if (!(table = malloc(size)))
+            return -1;
+        for (i = 0; i < s->refcount_table_size; i++)
+            table[i] = cpu_to_be64(s->refcount_table[i]);
+        n = pwrite(s->fd, table, size, s->refcount_table_offset);
+        free(table);
+        if (n != size)
+            return -1;
+        if (old_offset) {
+            hdr.offset = cpu_to_be64(s->refcount_table_offset);
+            hdr.clusters = cpu_to_be32(size >> s->cluster_bits);
+            if (pwrite(s->fd, &hdr, sizeof(hdr), HDR_OFFSET(refcount_table_offset)) != sizeof(hdr))
+                return -1;
+            /* the old table is unreferenced now */
+            if (update_refcount(s, old_offset, (u64)old_clusters << s->cluster_bits, -1) < 0)
+                return -1;
+            return flush_refcounts(s);
+        }
+    }
+    return 0;
+}
+
+/* Set or clear the dirty bit, which tells that the on-disk refcounts
+   may be stale (lazy refcounts) */
+static int set_dirty_bit(BDRVQCow2State *s, int dirty)
+{
+    u64 features = s->incompatible_features;
+    u64 tmp;
+
+    if (dirty)
+        features |= QCOW2_INCOMPAT_DIRTY;
+    else
+        features &= ~QCOW2_INCOMPAT_DIRTY;
+    if (features == s->incompatible_features)
+        return 0;
+    if (!dirty && fsync(s->fd))
+        return -1;
+    tmp = cpu_to_be64(features);
+    if (pwrite(s->fd, &tmp, sizeof(tmp), HDR_OFFSET(incompatible_features)) != sizeof(tmp))
+        return -1;
+    if (dirty && fsync(s->fd))
+        return -1;
+    s->incompatible_features = features;
+    return 0;
+}
+
+
+/************************************************************************/
+/*	L1 / L2 tables							*/
+/************************************************************************/
+
+static int l2_writeback(BDRVQCow2State *s, QCowL2Entry *e)
+{
+    int len = (e->dirty_end - e->dirty_start) * sizeof(u64);
+
+    if (!len)
+        return 0;
+    if (pwrite(s->fd, e->table + e->dirty_start, len,
+               e->offset + e->dirty_start * sizeof(u64)) != len)
+        return -1;
+    e->dirty_start = e->dirty_end = 0;
+    return 0;
+}
+
+static int l1_writeback(BDRVQCow2State *s)
+{
+    u64 *buf = (u64 *)s->cluster_data;
+    int i, n, chunk = s->cluster_size / sizeof(u64);
+
+    while (s->l1_dirty_start < s->l1_dirty_end) {
+        n = MIN(s->l1_dirty_end - s->l1_dirty_start, chunk);
+        for (i = 0; i < n; i++)
+            buf[i] = cpu_to_be64(s->l1_table[s->l1_dirty_start + i]);
+        if (pwrite(s->fd, buf, n * sizeof(u64),
+                   s->l1_table_offset + s->l1_dirty_start * sizeof(u64)) != n * sizeof(u64))
+            return -1;
+        s->l1_dirty_start += n;
+    }
+    s->l1_dirty_start = s->l1_dirty_end = 0;
+    return 0;
+}
+
+static inline void mark_dirty(int *start, int *end, int index)
+{
+    if (*start == *end) {
+        *start = index;
+        *end = index + 1;
+    } else if (index < *start) {
+        *start = index;
+    } else if (index >= *end) {
+        *end = index + 1;
+    }
+}
+
+/* Drop the L2 cache; used after the tables have been modified on disk */
+static int l2_cache_invalidate(BDRVQCow2State *s)
+{
+    int i;
+
+    if (qcow2_flush(s) < 0)
+        return -1;
+    for (i = 0; i < l2_cache_size(&s->l2c); i++) {
+        l2_cache_drop(&s->l2c, &s->l2c.entries[i]);
+        s->l2c.entries[i].lru = 0;
+    }
+    return 0;
+}
+
+/* Returns the cache entry of the L2 table at l2_offset. A dirty way is
+   only replaced (through qcow2_flush, after the data it references) when
+   no data write is pending; otherwise the lookup fails with l2_pinned
+   set and the caller ends its batch. */
+static QCowL2Entry *l2_load(BDRVQCow2State *s, u64 l2_offset, int new_l2_table)
+{
+    QCowL2Entry *e;
+
+    if ((e = l2_cache_find(&s->l2c, l2_offset)))
+        return e;
+    e = l2_cache_victim(&s->l2c, l2_offset);
+    if (l2_entry_dirty(e)) {
+        if (s->data_pending) {
+            s->l2_pinned = 1;
+            return NULL;
+        }
+        if (qcow2_flush(s) < 0)
+            return NULL;
+    }
+    l2_cache_drop(&s->l2c, e);
+    if (!new_l2_table && pread(s->fd, e->table, s->cluster_size, l2_offset) != s->cluster_size)
+        return NULL;
+    l2_cache_install(&s->l2c, e, l2_offset);
+    if (new_l2_table) {
+        /* the cluster may have been used before */
+        memset(e->table, 0, s->cluster_size);
+        e->dirty_start = 0;
+        e->dirty_end = s->l2_size;
+    }
+    return e;
+}
+
+/* Returns the L2 entry (cpu order) for the guest offset, 0 if unallocated */
+static u64 get_l2_entry(BDRVQCow2State *s, u64 offset)
+{
+    int l1_index;
+    u64 l2_offset;
+    QCowL2Entry *e;
+
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size)
+        return 0;
+    l2_offset = s->l1_table[l1_index] & QCOW2_L1E_OFFSET_MASK;
+    if (!l2_offset || !(e = l2_load(s, l2_offset, 0)))
+        return 0;
+    return be64_to_cpu(e->table[(offset >> s->cluster_bits) & (s->l2_size - 1)]);
+}
+
+/* host clusters covered by a compressed cluster */
+static void compressed_extent(BDRVQCow2State *s, u64 l2e, u64 *offset, u64 *length)
+{
+    int nb_csectors = ((l2e >> s->csize_shift) & s->csize_mask) + 1;
+
+    *offset = l2e & s->cluster_offset_mask;
+    *length = nb_csectors * 512 - (*offset & 511);
+}
+
+/* Fill the new cluster 'new_offset' with the old content of the guest
+   cluster, except for the sectors n_start to n_end which are about to
+   be written */
+static int cow_cluster(BDRVQCow2State *s, u64 offset, u64 l2e, u64 new_offset,
+                       int n_start, int n_end)
+{
+    u8 *buf = s->cluster_data;
+    u64 old = l2e & QCOW2_L2E_OFFSET_MASK;
+    int len;
+
+    if (n_start == 0 && n_end == s->cluster_sectors)
+        return 0;
+
+    if (l2e & QCOW2_OFLAG_COMPRESSED) {
+        if (decompress_cluster(s, l2e) < 0)
+            return -1;
+        buf = s->cluster_cache;
+    } else if (old && !(s->version >= 3 && (l2e & QCOW2_OFLAG_ZERO))) {
+        if (pread(s->fd, buf, s->cluster_size, old) != s->cluster_size)
+            return -1;
+    } else if (!old && !(l2e & QCOW2_OFLAG_ZERO) && s->backing_hd >= 0) {
+        memset(buf, 0, s->cluster_size);
+        if (pread(s->backing_hd, buf, s->cluster_size, offset) < 0)
+            return -1;
+    } else {
+        memset(buf, 0, s->cluster_size);
+    }
+    if (n_start) {
+        len = n_start * 512;
+        if (pwrite(s->fd, buf, len, new_offset) != len)
+            return -1;
+    }
+    if (n_end < s->cluster_sectors) {
+        len = (s->cluster_sectors - n_end) * 512;
+        if (pwrite(s->fd, buf + n_end * 512, len, new_offset + n_end * 512) != len)
+            return -1;
+    }
+    return 0;
+}
+
+/* Returns a host cluster which may be written in place for the guest
+   cluster at 'offset'. Shared, compressed and unallocated clusters are
+   replaced by a new cluster; the old one is released by qcow2_flush. */
+static u64 get_writable_cluster(BDRVQCow2State *s, u64 offset, int n_start, int n_end)
+{
+    int l1_index, l2_index;
+    u64 l1e, l2_offset, l2e, new_offset, ext_offset, ext_len;
+    QCowL2Entry *e, *old;
+
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size)
+        return 0;
+    l1e = s->l1_table[l1_index];
+    l2_offset = l1e & QCOW2_L1E_OFFSET_MASK;
+
+    if (l2_offset && (l1e & QCOW2_OFLAG_COPIED)) {
+        if (!(e = l2_load(s, l2_offset, 0)))
+            return 0;
+    } else {
+        /* allocate a new table, a shared one is copied */
+        if (!(new_offset = alloc_clusters(s, 1)))
+            return 0;
+        if (!(e = l2_load(s, new_offset, 1))) {
+            /* never referenced, may be reused right away */
+            update_refcount(s, new_offset, s->cluster_size, -1);
+            return 0;
+        }
+        if (l2_offset) {
+            /* shared tables are never dirty, the file copy is current */
+            if ((old = l2_cache_find(&s->l2c, l2_offset)))
+                memcpy(e->table, old->table, s->cluster_size);
+            else if (pread(s->fd, e->table, s->cluster_size, l2_offset) != s->cluster_size)
+                return 0;
+            if (defer_free(s, l2_offset, s->cluster_size) < 0)
+                return 0;
+        }
+        s->l1_table[l1_index] = new_offset | QCOW2_OFLAG_COPIED;
+        mark_dirty(&s->l1_dirty_start, &s->l1_dirty_end, l1_index);
+    }
+    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2e = be64_to_cpu(e->table[l2_index]);
+
+    if ((l2e & QCOW2_OFLAG_COPIED) && !(l2e & QCOW2_OFLAG_COMPRESSED) &&
+        (l2e & QCOW2_L2E_OFFSET_MASK) && !(s->version >= 3 && (l2e & QCOW2_OFLAG_ZERO)))
+        return l2e & QCOW2_L2E_OFFSET_MASK;
+
+    /* allocate a new cluster */
+    if (!(new_offset = alloc_clusters(s, 1)))
+        return 0;
+    if (cow_cluster(s, offset & ~((u64)s->cluster_size - 1), l2e, new_offset, n_start, n_end) < 0)
+        return 0;
+    if (l2e & QCOW2_OFLAG_COMPRESSED) {
+        compressed_extent(s, l2e, &ext_offset, &ext_len);
+        if (defer_free(s, ext_offset, ext_len) < 0)
+            return 0;
+        s->cluster_cache_offset = -1;
+    } else if (l2e & QCOW2_L2E_OFFSET_MASK) {
+        if (defer_free(s, l2e & QCOW2_L2E_OFFSET_MASK, s->cluster_size) < 0)
+            return 0;
+    }
+    e->table[l2_index] = cpu_to_be64(new_offset | QCOW2_OFLAG_COPIED);
+    mark_dirty(&e->dirty_start, &e->dirty_end, l2_index);
+    return new_offset;
+}
+
+/* The host cluster get_writable_cluster would return for the guest
+   cluster at 'offset', without allocating anything. 0 if a new L2
+   table would be needed or the table can't be loaded right now. */
+static u64 peek_writable_cluster(BDRVQCow2State *s, u64 offset)
+{
+    int l1_index;
+    u64 l1e, l2_offset, l2e, i;
+    QCowL2Entry *e;
+
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size)
+        return 0;
+    l1e = s->l1_table[l1_index];
+    l2_offset = l1e & QCOW2_L1E_OFFSET_MASK;
+    if (!l2_offset || !(l1e & QCOW2_OFLAG_COPIED) || !(e = l2_load(s, l2_offset, 0)))
+        return 0;
+    l2e = be64_to_cpu(e->table[(offset >> s->cluster_bits) & (s->l2_size - 1)]);
+
+    if ((l2e & QCOW2_OFLAG_COPIED) && !(l2e & QCOW2_OFLAG_COMPRESSED) &&
+        (l2e & QCOW2_L2E_OFFSET_MASK) && !(s->version >= 3 && (l2e & QCOW2_OFLAG_ZERO)))
+        return l2e & QCOW2_L2E_OFFSET_MASK;
+
+    /* alloc_clusters hands out the first free cluster */
+    for (i = s->free_cluster_index; get_refcount(s, i); i++)
+        ;
+    return i << s->cluster_bits;
+}
+
+/* Write back all dirty metadata in the order data, refcount increments,
+   L2 tables, L1 table, refcount decrements, with a sync between the
+   steps. Clusters freed by a write are only reused after that. */
+static int qcow2_flush(BDRVQCow2State *s)
+{
+    int i, l2_dirty = 0;
+
+    for (i = 0; i < l2_cache_size(&s->l2c); i++)
+        l2_dirty |= l2_entry_dirty(&s->l2c.entries[i]);
+    if (!l2_dirty && s->l1_dirty_start == s->l1_dirty_end && !s->n_pending_free)
+        return s->lazy_refcounts ? 0 : flush_refcounts(s);
+
+    if (!s->lazy_refcounts && flush_refcounts(s) < 0)
+        return -1;
+    if (fdatasync(s->fd) < 0)
+        return -1;
+    for (i = 0; i < l2_cache_size(&s->l2c); i++)
+        if (l2_writeback(s, &s->l2c.entries[i]) < 0)
+            return -1;
+    if (s->l1_dirty_start != s->l1_dirty_end) {
+        /* new tables before the L1 entries pointing at them */
+        if ((l2_dirty && fdatasync(s->fd) < 0) || l1_writeback(s) < 0)
+            return -1;
+    }
+    if (!s->n_pending_free)
+        return 0;
+    if (fdatasync(s->fd) < 0 || release_pending_free(s) < 0)
+        return -1;
+    return s->lazy_refcounts ? 0 : flush_refcounts(s);
+}
+
+
+/************************************************************************/
+/*	snapshot support						*/
+/************************************************************************/
+
+/* Add 'addend' to the counts of the L2 tables and data clusters of a tree */
+static int update_tree_refcount(BDRVQCow2State *s, const u64 *l1_table, int l1_size,
+                                int addend)
+{
+    u64 *l2_table, l2_offset, l2e, ext_offset, ext_len;
+    int i, j, ret = -1;
+
+    if (!(l2_table = malloc(s->cluster_size)))
+        return -1;
+    for (i = 0; i < l1_size; i++) {
+        if (!(l2_offset = l1_table[i] & QCOW2_L1E_OFFSET_MASK))
+            continue;
+        if (pread(s->fd, l2_table, s->cluster_size, l2_offset) != s->cluster_size)
+            goto out;
+        for (j = 0; j < s->l2_size; j++) {
+            l2e = be64_to_cpu(l2_table[j]);
+            if (l2e & QCOW2_OFLAG_COMPRESSED) {
+                compressed_extent(s, l2e, &ext_offset, &ext_len);
+                if (update_refcount(s, ext_offset, ext_len, addend) < 0)
+                    goto out;
+            } else if (l2e & QCOW2_L2E_OFFSET_MASK) {
+                if (update_refcount(s, l2e & QCOW2_L2E_OFFSET_MASK, s->cluster_size, addend) < 0)
+                    goto out;
+            }
+        }
+        if (update_refcount(s, l2_offset, s->cluster_size, addend) < 0)
+            goto out;
+    }
+    ret = 0;
+ out:
+    free(l2_table);
+    return ret;
+}
+
+/* Recompute the COPIED flags of the active tree and write it back */
+static int update_copied_flags(BDRVQCow2State *s)
+{
+    u64 *l2_table, l2_offset, l2e, flag;
+    int i, j, changed, ret = -1;
+
+    if (l2_cache_invalidate(s) < 0 || !(l2_table = malloc(s->cluster_size)))
+        return -1;
+    for (i = 0; i < s->l1_size; i++) {
+        if (!(l2_offset = s->l1_table[i] & QCOW2_L1E_OFFSET_MASK))
+            continue;
+        if (get_refcount(s, l2_offset >> s->cluster_bits) == 1)
+            s->l1_table[i] = l2_offset | QCOW2_OFLAG_COPIED;
+        else
+            s->l1_table[i] = l2_offset;
+
+        /* a shared table is copied before it is written, but the copy
+           takes over its flags */
+        if (pread(s->fd, l2_table, s->cluster_size, l2_offset) != s->cluster_size)
+            goto out;
+        for (changed = 0, j = 0; j < s->l2_size; j++) {
+            l2e = be64_to_cpu(l2_table[j]);
+            if ((l2e & QCOW2_OFLAG_COMPRESSED) || !(l2e & QCOW2_L2E_OFFSET_MASK))
+                continue;
+            flag = (get_refcount(s, (l2e & QCOW2_L2E_OFFSET_MASK) >> s->cluster_bits) == 1) ?
+                QCOW2_OFLAG_COPIED : 0;
+            if ((l2e & QCOW2_OFLAG_COPIED) != flag) {
+                l2_table[j] = cpu_to_be64((l2e & ~QCOW2_OFLAG_COPIED) | flag);
+                changed = 1;
+            }
+        }
+        if (changed && pwrite(s->fd, l2_table, s->cluster_size, l2_offset) != s->cluster_size)
+            goto out;
+    }
+    s->l1_dirty_start = 0;
+    s->l1_dirty_end = s->l1_size;
+    ret = l1_writeback(s);
+ out:
+    free(l2_table);
+    return ret;
+}
+
+static int read_l1_table(BDRVQCow2State *s, u64 offset, int size, u64 *table)
+{
+    int i;
+
+    if (pread(s->fd, table, size * sizeof(u64), offset) != size * sizeof(u64))
+        return -1;
+    for (i = 0; i < size; i++)
+        table[i] = be64_to_cpu(table[i]);
+    return 0;
+}
+
+static void free_snapshots(BDRVQCow2State *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_snapshots; i++) {
+        free(s->snapshots[i].id_str);
+        free(s->snapshots[i].name);
+    }
+    free(s->snapshots);
+    s->snapshots = NULL;
+    s->nb_snapshots = 0;
+}
+
+static int read_snapshots(BDRVQCow2State *s, int nb_snapshots)
+{
+    QCow2SnapshotHeader h;
+    QCow2Snapshot *sn;
+    u64 offset = s->snapshots_offset;
+    int i;
+
+    if (!nb_snapshots)
+        return 0;
+    if (!(s->snapshots = calloc(nb_snapshots, sizeof(QCow2Snapshot))))
+        return -1;
+    for (i = 0; i < nb_snapshots; i++) {
+        offset = (offset + 7) & ~7ULL;
+        if (pread(s->fd, &h, sizeof(h), offset) != sizeof(h))
+            return -1;
+        offset += sizeof(h) + be32_to_cpu(h.extra_data_size);
+
+        sn = &s->snapshots[s->nb_snapshots++];
+        sn->l1_table_offset = be64_to_cpu(h.l1_table_offset);
+        sn->l1_size = be32_to_cpu(h.l1_size);
+        sn->date_sec = be32_to_cpu(h.date_sec);
+        sn->date_nsec = be32_to_cpu(h.date_nsec);
+        sn->vm_clock_nsec = be64_to_cpu(h.vm_clock_nsec);
+        sn->vm_state_size = be32_to_cpu(h.vm_state_size);
+        sn->id_str = calloc(be16_to_cpu(h.id_str_size) + 1, 1);
+        sn->name = calloc(be16_to_cpu(h.name_size) + 1, 1);
+        if (!sn->id_str || !sn->name)
+            return -1;
+        if (pread(s->fd, sn->id_str, be16_to_cpu(h.id_str_size), offset) !=
+            be16_to_cpu(h.id_str_size))
+            return -1;
+        offset += be16_to_cpu(h.id_str_size);
+        if (pread(s->fd, sn->name, be16_to_cpu(h.name_size), offset) !=
+            be16_to_cpu(h.name_size))
+            return -1;
+        offset += be16_to_cpu(h.name_size);
+    }
+    s->snapshots_size = offset - s->snapshots_offset;
+    return 0;
+}
+
+/* Write the snapshot table to a new area and free the old one */
+static int write_snapshots(BDRVQCow2State *s)
+{
+    struct {
+        u32 nb_snapshots;
+        u64 snapshots_offset;
+    } __attribute__((packed)) hdr;
+    struct {
+        u64 vm_state_size_large;
+        u64 disk_size;
+    } extra;
+    QCow2SnapshotHeader h;
+    QCow2Snapshot *sn;
+    u64 offset = 0, old_offset = s->snapshots_offset;
+    int i, size, old_size = s->snapshots_size, id_len, name_len;
+    u8 *buf;
+
+    for (size = 0, i = 0; i < s->nb_snapshots; i++) {
+        size = (size + 7) & ~7;
+        size += sizeof(h) + sizeof(extra) + strlen(s->snapshots[i].id_str) +
+            strlen(s->snapshots[i].name);
+    }
+    if (size) {
+        if (!(buf = calloc(size, 1)))
+            return -1;
+        for (offset = 0, i = 0; i < s->nb_snapshots; i++) {
+            sn = &s->snapshots[i];
+            id_len = strlen(sn->id_str);
+            name_len = strlen(sn->name);
+            offset = (offset + 7) & ~7ULL;
+            h.l1_table_offset = cpu_to_be64(sn->l1_table_offset);
+            h.l1_size = cpu_to_be32(sn->l1_size);
+            h.id_str_size = cpu_to_be16(id_len);
+            h.name_size = cpu_to_be16(name_len);
+            h.date_sec = cpu_to_be32(sn->date_sec);
+            h.date_nsec = cpu_to_be32(sn->date_nsec);
+            h.vm_clock_nsec = cpu_to_be64(sn->vm_clock_nsec);
+            h.vm_state_size = cpu_to_be32(sn->vm_state_size);
+            h.extra_data_size = cpu_to_be32(sizeof(extra));
+            extra.vm_state_size_large = cpu_to_be64(sn->vm_state_size);
+            extra.disk_size = cpu_to_be64(s->size);
+            memcpy(buf + offset, &h, sizeof(h));
+            offset += sizeof(h);
+            memcpy(buf + offset, &extra, sizeof(extra));
+            offset += sizeof(extra);
+            memcpy(buf + offset, sn->id_str, id_len);
+            offset += id_len;
+            memcpy(buf + offset, sn->name, name_len);
+            offset += name_len;
+        }
+        offset = alloc_clusters(s, (size + s->cluster_size - 1) >> s->cluster_bits);
+        if (!offset || pwrite(s->fd, buf, size, offset) != size) {
+            free(buf);
+            return -1;
+        }
+        free(buf);
+    }
+    /* the table must be on disk before the header points at it */
+    if (flush_refcounts(s) < 0 || fsync(s->fd))
+        return -1;
+    hdr.nb_snapshots = cpu_to_be32(s->nb_snapshots);
+    hdr.snapshots_offset = cpu_to_be64(offset);
+    if (pwrite(s->fd, &hdr, sizeof(hdr), HDR_OFFSET(nb_snapshots)) != sizeof(hdr))
+        return -1;
+    s->snapshots_offset = offset;
+    s->snapshots_size = size;
+    if (old_size && update_refcount(s, old_offset, old_size, -1) < 0)
+        return -1;
+    return flush_refcounts(s);
+}
+
+static QCow2Snapshot *find_snapshot(BDRVQCow2State *s, const char *name)
+{
+    int i;
+
+    for (i = 0; i < s->nb_snapshots; i++)
+        if (!strcmp(s->snapshots[i].name, name) || !strcmp(s->snapshots[i].id_str, name))
+            return &s->snapshots[i];
+    return NULL;
+}
+
+static int snapshot_create(BDRVQCow2State *s, const char *name)
+{
+    QCow2Snapshot *sn;
+    u64 *l1, offset;
+    int i, id, size = s->l1_size * sizeof(u64);
+    char buf[16];
+
+    if (find_snapshot(s, name)) {
+        printm("qcow2: snapshot '%s' exists\n", name);
+        return -1;
+    }
+    if (qcow2_flush(s) < 0 || l2_cache_invalidate(s) < 0)
+        return -1;
+
+    /* copy of the active L1 table */
+    if (!(l1 = malloc(size)))
+        return -1;
+    for (i = 0; i < s->l1_size; i++)
+        l1[i] = cpu_to_be64(s->l1_table[i] & QCOW2_L1E_OFFSET_MASK);
+    offset = alloc_clusters(s, (size + s->cluster_size - 1) >> s->cluster_bits);
+    if (!offset || pwrite(s->fd, l1, size, offset) != size) {
+        free(l1);
+        return -1;
+    }
+    free(l1);
+
+    /* the tree is shared now */
+    if (update_tree_refcount(s, s->l1_table, s->l1_size, 1) < 0 ||
+        update_copied_flags(s) < 0 || flush_refcounts(s) < 0)
+        return -1;
+
+    for (id = 0, i = 0; i < s->nb_snapshots; i++)
+        id = MAX(id, strtol(s->snapshots[i].id_str, NULL, 10));
+    sprintf(buf, "%d", id + 1);
+
+    if (!(sn = realloc(s->snapshots, (s->nb_snapshots + 1) * sizeof(QCow2Snapshot))))
+        return -1;
+    s->snapshots = sn;
+    sn = &s->snapshots[s->nb_snapshots++];
+    memset(sn, 0, sizeof(*sn));
+    sn->l1_table_offset = offset;
+    sn->l1_size = s->l1_size;
+    sn->id_str = strdup(buf);
+    sn->name = strdup(name);
+    sn->date_sec = time(NULL);
+    return write_snapshots(s);
+}
+
+static int snapshot_goto(BDRVQCow2State *s, QCow2Snapshot *sn)
+{
+    u64 *l1;
+
+    if (sn->l1_size > s->l1_size) {
+        printm("qcow2: snapshot has a larger L1 table than the image\n");
+        return -1;
+    }
+    if (qcow2_flush(s) < 0 || l2_cache_invalidate(s) < 0)
+        return -1;
+    if (!(l1 = calloc(s->l1_size, sizeof(u64))))
+        return -1;
+    if (read_l1_table(s, sn->l1_table_offset, sn->l1_size, l1) < 0 ||
+        update_tree_refcount(s, l1, sn->l1_size, 1) < 0 ||
+        update_tree_refcount(s, s->l1_table, s->l1_size, -1) < 0) {
+        free(l1);
+        return -1;
+    }
+    memcpy(s->l1_table, l1, s->l1_size * sizeof(u64));
+    free(l1);
+    s->cluster_cache_offset = -1;
+    if (update_copied_flags(s) < 0)
+        return -1;
+    return flush_refcounts(s);
+}
+
+static int snapshot_delete(BDRVQCow2State *s, QCow2Snapshot *sn)
+{
+    u64 *l1;
+    int ret;
+
+    if (qcow2_flush(s) < 0 || l2_cache_invalidate(s) < 0)
+        return -1;
+    if (!(l1 = calloc(sn->l1_size, sizeof(u64))))
+        return -1;
+    ret = read_l1_table(s, sn->l1_table_offset, sn->l1_size, l1);
+    if (!ret)
+        ret = update_tree_refcount(s, l1, sn->l1_size, -1);
+    free(l1);
+    if (ret < 0 || update_refcount(s, sn->l1_table_offset, sn->l1_size * sizeof(u64), -1) < 0)
+        return -1;
+
+    free(sn->id_str);
+    free(sn->name);
+    memmove(sn, sn + 1, (s->snapshots + s->nb_snapshots - sn - 1) * sizeof(*sn));
+    s->nb_snapshots--;
+    if (write_snapshots(s) < 0)
+        return -1;
+    /* clusters only shared with the deleted snapshot are writable again */
+    if (update_copied_flags(s) < 0)
+        return -1;
+    return flush_refcounts(s);
+}
+
+/* Rebuild the refcounts from the tables (after an unclean close of an
+   image with lazy refcounts) */
+static int rebuild_refcounts(BDRVQCow2State *s)
+{
+    u64 *l1;
+    int i, ret;
+
+    printm("qcow2: image was not closed properly, rebuilding refcounts\n");
+    memset(s->refcounts, 0, s->nb_clusters * sizeof(u16));
+    memset(s->refblock_dirty, 1, s->nb_clusters >> s->refcount_block_bits);
+
+    if (update_refcount(s, 0, s->cluster_size, 1) < 0 ||
+        update_refcount(s, s->l1_table_offset, s->l1_size * sizeof(u64), 1) < 0 ||
+        update_refcount(s, s->refcount_table_offset,
+                        (u64)s->refcount_table_size * sizeof(u64), 1) < 0 ||
+        update_refcount(s, s->snapshots_offset, s->snapshots_size, 1) < 0)
+        return -1;
+    for (i = 0; i < s->refcount_table_size; i++)
+        if (s->refcount_table[i] && update_refcount(s, s->refcount_table[i], s->cluster_size, 1) < 0)
+            return -1;
+    if (update_tree_refcount(s, s->l1_table, s->l1_size, 1) < 0)
+        return -1;
+    for (i = 0; i < s->nb_snapshots; i++) {
+        QCow2Snapshot *sn = &s->snapshots[i];
+
+        if (update_refcount(s, sn->l1_table_offset, sn->l1_size * sizeof(u64), 1) < 0 ||
+            !(l1 = calloc(sn->l1_size, sizeof(u64))))
+            return -1;
+        ret = read_l1_table(s, sn->l1_table_offset, sn->l1_size, l1);
+        if (!ret)
+            ret = update_tree_refcount(s, l1, sn->l1_size, 1);
+        free(l1);
+        if (ret < 0)
+            return -1;
+    }
+    s->free_cluster_index = 0;
+    return 0;
+}
+
+/* Allocate all missing L2 tables back to back, so that they don't end
+   up interleaved with the data clusters */
+static int preallocate_metadata(BDRVQCow2State *s)
+{
+    u64 offset;
+    int i, n;
+
+    for (n = 0, i = 0; i < s->l1_size; i++)
+        n += !(s->l1_table[i] & QCOW2_L1E_OFFSET_MASK);
+    if (!n)
+        return 0;
+    if (!(offset = alloc_clusters(s, n)))
+        return -1;
+    memset(s->cluster_data, 0, s->cluster_size);
+    for (i = 0; i < s->l1_size; i++) {
+        if (s->l1_table[i] & QCOW2_L1E_OFFSET_MASK)
+            continue;
+        if (pwrite(s->fd, s->cluster_data, s->cluster_size, offset) != s->cluster_size)
+            return -1;
+        s->l1_table[i] = offset | QCOW2_OFLAG_COPIED;
+        mark_dirty(&s->l1_dirty_start, &s->l1_dirty_end, i);
+        offset += s->cluster_size;
+    }
+    if (s->lazy_refcounts && set_dirty_bit(s, 1) < 0)
+        return -1;
+    return qcow2_flush(s);
+}
+
+
+/************************************************************************/
+/*	debugger							*/
+/************************************************************************/
+
+static BDRVQCow2State *
+find_image( const char *str )
+{
+    BDRVQCow2State *s;
+    int i, n = strtol(str, NULL, 10);
+
+    for (i = 0, s = qcow2_images; s && i < n; s = s->next, i++)
+        ;
+    if (!s)
+        printm("No such qcow2 image\n");
+    return s;
+}
+
+static int __dcmd
+cmd_qsnapls( int argc, char **argv )
+{
+    BDRVQCow2State *s;
+    time_t date;
+    int i, n;
+
+    if (argc != 1)
+        return 1;
+    for (n = 0, s = qcow2_images; s; s = s->next, n++) {
+        printm("[%d] %s\n", n, s->bdev->dev_name ? s->bdev->dev_name : "<qcow2>");
+        for (i = 0; i < s->nb_snapshots; i++) {
+            date = s->snapshots[i].date_sec;
+            printm("    %-4s %-24s %s", s->snapshots[i].id_str, s->snapshots[i].name,
+                   ctime(&date));
+        }
+    }
+    return 0;
+}
+
+static int __dcmd
+cmd_qsnap( int argc, char **argv )
+{
+    BDRVQCow2State *s;
+    QCow2Snapshot *sn;
+    int ret = -1;
+
+    if (argc != 3 || !(s = find_image(argv[1])))
+        return 1;
+    pthread_mutex_lock(&s->lock);
+    if (!strcmp(argv[0], "qsnap")) {
+        ret = snapshot_create(s, argv[2]);
+    } else if (!(sn = find_snapshot(s, argv[2]))) {
+        printm("No such snapshot\n");
+    } else if (!strcmp(argv[0], "qsnapgo")) {
+        ret = snapshot_goto(s, sn);
+    } else {
+        ret = snapshot_delete(s, sn);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (ret < 0)
+        printm("qcow2: %s failed\n", argv[0]);
+    return 0;
+}
+
+static dbg_cmd_t dbg_cmds[] = {
+#ifdef CONFIG_DEBUGGER
+    { "qsnapls", cmd_qsnapls, "qsnapls \nlist qcow2 images and snapshots\n" },
+    { "qsnap",   cmd_qsnap,   "qsnap image name \ncreate qcow2 snapshot\n" },
+    { "qsnapgo", cmd_qsnap,   "qsnapgo image name \nrevert qcow2 image to snapshot\n" },
+    { "qsnaprm", cmd_qsnap,   "qsnaprm image name \ndelete qcow2 snapshot\n" },
+#endif
+};
+
+
+/************************************************************************/
+/*	open / close							*/
+/************************************************************************/
+
+int qcow2_open(int fd, bdev_desc_t *bdev)
+{
+    static int cmds_added;
+    QCow2Header header;
+    BDRVQCow2State *s;
+    struct stat st;
+    u64 l1_bytes;
+    int i, len;
+
+    if (!(s = calloc(1, sizeof(BDRVQCow2State))))
+        return -1;
+
+    s->fd = fd;
+    s->bdev = bdev;
+    s->backing_hd = -1;
+    s->cluster_cache_offset = -1;
+    pthread_mutex_init(&s->lock, NULL);
+
+    memset(&header, 0, sizeof(header));
+    if (pread(fd, &header, sizeof(header), 0) < QCOW2_V2_HEADER_LENGTH)
+        goto fail;
+
+    header.magic = be32_to_cpu(header.magic);
+    header.version = be32_to_cpu(header.version);
+    header.backing_file_offset = be64_to_cpu(header.backing_file_offset);
+    header.backing_file_size = be32_to_cpu(header.backing_file_size);
+    header.cluster_bits = be32_to_cpu(header.cluster_bits);
+    header.size = be64_to_cpu(header.size);
+    header.crypt_method = be32_to_cpu(header.crypt_method);
+    header.l1_size = be32_to_cpu(header.l1_size);
+    header.l1_table_offset = be64_to_cpu(header.l1_table_offset);
+    header.refcount_table_offset = be64_to_cpu(header.refcount_table_offset);
+    header.refcount_table_clusters = be32_to_cpu(header.refcount_table_clusters);
+    header.nb_snapshots = be32_to_cpu(header.nb_snapshots);
+    header.snapshots_offset = be64_to_cpu(header.snapshots_offset);
+    if (header.version == 2) {
+        header.incompatible_features = 0;
+        header.compatible_features = 0;
+        header.autoclear_features = 0;
+        header.refcount_order = 4;
+        header.header_length = QCOW2_V2_HEADER_LENGTH;
+    } else {
+        header.incompatible_features = be64_to_cpu(header.incompatible_features);
+        header.compatible_features = be64_to_cpu(header.compatible_features);
+        header.autoclear_features = be64_to_cpu(header.autoclear_features);
+        header.refcount_order = be32_to_cpu(header.refcount_order);
+        header.header_length = be32_to_cpu(header.header_length);
+    }
+
+    if (header.magic != QCOW2_MAGIC || (header.version != 2 && header.version != 3))
+        goto fail;
+    if (header.cluster_bits < 9 || header.cluster_bits > 21 || header.size <= 1)
+        goto fail;
+    if (header.crypt_method != QCOW2_CRYPT_NONE) {
+        printm("qcow2: encrypted images are not supported\n");
+        goto fail;
+    }
+    if (header.incompatible_features & ~QCOW2_INCOMPAT_MASK) {
+        printm("qcow2: unsupported features %llx\n",
+               header.incompatible_features & ~QCOW2_INCOMPAT_MASK);
+        goto fail;
+    }
+    if (header.refcount_order != 4) {
+        printm("qcow2: only 16 bit refcounts are supported\n");
+        goto fail;
+    }
+
+    s->version = header.version;
+    s->cluster_bits = header.cluster_bits;
+    s->cluster_size = 1 << s->cluster_bits;
+    s->cluster_sectors = 1 << (s->cluster_bits - 9);
+    s->l2_bits = s->cluster_bits - 3;
+    s->l2_size = 1 << s->l2_bits;
+    s->csize_shift = 62 - (s->cluster_bits - 8);
+    s->csize_mask = (1 << (s->cluster_bits - 8)) - 1;
+    s->cluster_offset_mask = (1LL << s->csize_shift) - 1;
+    s->refcount_block_bits = s->cluster_bits - 1;
+    s->size = bdev->size = header.size;
+    s->header_length = header.header_length;
+    s->incompatible_features = header.incompatible_features;
+    s->compatible_features = header.compatible_features;
+    s->autoclear_features = header.autoclear_features;
+
+    /* read the level 1 table */
+    s->l1_size = header.l1_size;
+    if (s->l1_size < ((header.size + ((u64)s->cluster_size << s->l2_bits) - 1) >>
+                      (s->cluster_bits + s->l2_bits)))
+        goto fail;
+    s->l1_table_offset = header.l1_table_offset;
+    l1_bytes = (u64)s->l1_size * sizeof(u64);
+    if (!(s->l1_table = malloc(l1_bytes ? l1_bytes : 1)) ||
+        read_l1_table(s, s->l1_table_offset, s->l1_size, s->l1_table) < 0)
+        goto fail;
+
+    if ((i = get_numeric_res("qcow2.l2_cache")) <= 0)
+        i = QCOW2_L2_CACHE_SIZE;
+    if (l2_cache_init(&s->l2c, i, s->cluster_size, s->cluster_bits) < 0 ||
+        !(s->cluster_cache = malloc(s->cluster_size)) ||
+        !(s->cluster_data = malloc(s->cluster_size)))
+        goto fail;
+
+    /* refcounts */
+    s->refcount_table_offset = header.refcount_table_offset;
+    s->refcount_table_size = ((u64)header.refcount_table_clusters << s->cluster_bits) / sizeof(u64);
+    if (!(s->refcount_table = malloc(s->refcount_table_size * sizeof(u64))))
+        goto fail;
+    if (pread(fd, s->refcount_table, s->refcount_table_size * sizeof(u64),
+              s->refcount_table_offset) != s->refcount_table_size * sizeof(u64))
+        goto fail;
+    for (i = 0; i < s->refcount_table_size; i++)
+        s->refcount_table[i] = be64_to_cpu(s->refcount_table[i]) & QCOW2_REFT_OFFSET_MASK;
+    if (fstat(fd, &st) < 0 ||
+        load_refcounts(s, (st.st_size + s->cluster_size - 1) >> s->cluster_bits) < 0)
+        goto fail;
+
+    s->snapshots_offset = header.snapshots_offset;
+    if (read_snapshots(s, header.nb_snapshots) < 0)
+        goto fail;
+
+    if (header.backing_file_offset != 0) {
+        int not_used;
+
+        len = header.backing_file_size;
+        if (len > 1023) {
+            printm("backing filename too long!\n");
+            goto fail;
+        }
+        if (pread(fd, s->backing_file, len, header.backing_file_offset) != len)
+            goto fail;
+        s->backing_file[len] = '\0';
+        if (s->backing_file[0] != '/') {
+            printm("Sorry only absolute filename for backing file!\n");
+            goto fail;
+        }
+        if ((s->backing_hd = disk_open(s->backing_file, 0, &not_used, 0)) < 0) {
+            printm("Can't open backing file!\n");
+            goto fail;
+        }
+    }
+
+    s->lazy_refcounts = s->version >= 3 &&
+        ((s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS) ||
+         get_bool_res("qcow2.lazy_refcounts") == 1);
+    if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
+        /* written back with the first flush */
+        if (rebuild_refcounts(s) < 0)
+            goto fail;
+        s->lazy_refcounts = 1;
+    }
+    if ((fcntl(fd, F_GETFL) & O_ACCMODE) != O_RDONLY) {
+        if (s->autoclear_features) {
+            u64 tmp = 0;
+            /* we don't maintain any of the autoclear extensions */
+            if (pwrite(fd, &tmp, sizeof(tmp), HDR_OFFSET(autoclear_features)) != sizeof(tmp))
+                goto fail;
+            s->autoclear_features = 0;
+        }
+        if (get_bool_res("qcow2.prealloc_metadata") == 1 && preallocate_metadata(s) < 0)
+            goto fail;
+    }
+
+    bdev->priv = s;
+    bdev->read = &qcow2_read;
+    bdev->write = &qcow2_write;
+    bdev->seek = &qcow2_seek;
+    bdev->close = &qcow2_close;
+    bdev->fd = fd;
+
+    s->next = qcow2_images;
+    qcow2_images = s;
+    if (!cmds_added++)
+        add_dbg_cmds(dbg_cmds, sizeof(dbg_cmds));
+    return 0;
+
+ fail:
+    printm("qcow2: failed to open image\n");
+    if (s->backing_hd >= 0)
+        close(s->backing_hd);
+    free_snapshots(s);
+    free(s->l1_table);
+    l2_cache_free(&s->l2c);
+    free(s->pending_free);
+    free(s->cluster_cache);
+    free(s->cluster_data);
+    free(s->refcount_table);
+    free(s->refcounts);
+    free(s->refblock_dirty);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+    return -1;
+}
+
+void qcow2_close(bdev_desc_t *bdev)
+{
+    BDRVQCow2State *s = QCOW2_PRIV(bdev);
+    BDRVQCow2State **pp;
+
+    for (pp = &qcow2_images; *pp; pp = &(*pp)->next) {
+        if (*pp == s) {
+            *pp = s->next;
+            break;
+        }
+    }
+    if (qcow2_flush(s) < 0 || flush_refcounts(s) < 0 || set_dirty_bit(s, 0) < 0)
+        printm("qcow2: failed to write back metadata\n");
+    fsync(s->fd);
+
+    if (s->backing_hd >= 0)
+        close(s->backing_hd);
+    free_snapshots(s);
+    free(s->l1_table);
+    l2_cache_free(&s->l2c);
+    free(s->pending_free);
+    free(s->cluster_cache);
+    free(s->cluster_data);
+    free(s->refcount_table);
+    free(s->refcounts);
+    free(s->refblock_dirty);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+
+/************************************************************************/
+/*	read / write							*/
+/************************************************************************/
+
+static int decompress_buffer(u8 *out_buf, int out_buf_size,
+                             const u8 *buf, int buf_size)
+{
+    z_stream strm1, *strm = &strm1;
+    int ret, out_len;
+
+    memset(strm, 0, sizeof(*strm));
+
+    strm->next_in = (u8 *)buf;
+    strm->avail_in = buf_size;
+    strm->next_out = out_buf;
+    strm->avail_out = out_buf_size;
+
+    ret = inflateInit2(strm, -12);
+    if (ret != Z_OK)
+        return -1;
+    ret = inflate(strm, Z_FINISH);
+    out_len = strm->next_out - out_buf;
+    inflateEnd(strm);
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || out_len != out_buf_size)
+        return -1;
+    return 0;
+}
+
+static int decompress_cluster(BDRVQCow2State *s, u64 l2e)
+{
+    u64 coffset, csize;
+    u8 *buf;
+    int ret;
+
+    compressed_extent(s, l2e, &coffset, &csize);
+    if (s->cluster_cache_offset == coffset)
+        return 0;
+    /* a compressed cluster may be larger than cluster_data */
+    if (!(buf = malloc(csize)))
+        return -1;
+    ret = pread(s->fd, buf, csize, coffset);
+    if (ret > 0)
+        ret = decompress_buffer(s->cluster_cache, s->cluster_size, buf, ret);
+    else
+        ret = -1;
+    free(buf);
+    if (ret < 0)
+        return -1;
+    s->cluster_cache_offset = coffset;
+    return 0;
+}
+
+static inline int is_data_entry(BDRVQCow2State *s, u64 l2e)
+{
+    return (l2e & QCOW2_L2E_OFFSET_MASK) && !(l2e & QCOW2_OFLAG_COMPRESSED) &&
+        !(s->version >= 3 && (l2e & QCOW2_OFLAG_ZERO));
+}
+
+static int do_read(BDRVQCow2State *s, iov_cursor_t *c, int nb_sectors)
+{
+    u64 sector_num = s->seek_sector;
+    int index_in_cluster, n, m;
+    u64 l2e, cluster_offset;
+
+    while (nb_sectors > 0) {
+        l2e = get_l2_entry(s, sector_num << 9);
+        index_in_cluster = sector_num & (s->cluster_sectors - 1);
+        n = MIN(s->cluster_sectors - index_in_cluster, nb_sectors);
+
+        if (l2e & QCOW2_OFLAG_COMPRESSED) {
+            if (decompress_cluster(s, l2e) < 0)
+                return -1;
+            iov_cursor_from_buf(c, s->cluster_cache + index_in_cluster * 512, 512 * n);
+        } else if (is_data_entry(s, l2e)) {
+            /* merge clusters which are contiguous in the file */
+            cluster_offset = (l2e & QCOW2_L2E_OFFSET_MASK) + index_in_cluster * 512;
+            while (n < nb_sectors) {
+                l2e = get_l2_entry(s, (sector_num + n) << 9);
+                if (!is_data_entry(s, l2e) ||
+                    (l2e & QCOW2_L2E_OFFSET_MASK) != cluster_offset + n * 512)
+                    break;
+                m = nb_sectors - n;
+                n += MIN(m, s->cluster_sectors);
+            }
+            if (iov_cursor_rw(s->fd, c, n * 512, cluster_offset, 0) < 0)
+                return -1;
+        } else if (!(l2e & QCOW2_OFLAG_ZERO) && s->backing_hd >= 0) {
+            if (iov_cursor_rw(s->backing_hd, c, n * 512, sector_num * 512, 0) < 0)
+                return -1;
+        } else {
+            iov_cursor_zero(c, n * 512);
+        }
+        nb_sectors -= n;
+        sector_num += n;
+    }
+    n = (sector_num - s->seek_sector) << 9;
+    s->seek_sector = sector_num;
+    return n;
+}
+
+static int do_write(BDRVQCow2State *s, iov_cursor_t *c, int nb_sectors)
+{
+    u64 sector_num = s->seek_sector;
+    int index_in_cluster, n, m;
+    u64 cluster_offset, next_offset;
+
+    if (s->lazy_refcounts && set_dirty_bit(s, 1) < 0)
+        return -1;
+
+    while (nb_sectors > 0) {
+        index_in_cluster = sector_num & (s->cluster_sectors - 1);
+        n = MIN(s->cluster_sectors - index_in_cluster, nb_sectors);
+        cluster_offset = get_writable_cluster(s, sector_num << 9, index_in_cluster,
+                                              index_in_cluster + n);
+        if (!cluster_offset)
+            return -1;
+        cluster_offset += index_in_cluster * 512;
+
+        /* look up the following clusters so that adjacent ones go out
+           in a single pwritev. A cluster is only claimed once it is known
+           to extend the run. Their tables must stay in the cache until
+           the data is written; the batch ends when a set has no clean
+           way left. */
+        s->data_pending = 1;
+        while (n < nb_sectors) {
+            m = MIN(nb_sectors - n, s->cluster_sectors);
+            next_offset = peek_writable_cluster(s, (sector_num + n) << 9);
+            if (next_offset != cluster_offset + n * 512)
+                break;
+            if (get_writable_cluster(s, (sector_num + n) << 9, 0, m) != next_offset) {
+                s->data_pending = 0;
+                return -1;
+            }
+            n += m;
+        }
+        s->data_pending = s->l2_pinned = 0;
+        if (iov_cursor_rw(s->fd, c, n * 512, cluster_offset, 1) < 0)
+            return -1;
+        nb_sectors -= n;
+        sector_num += n;
+    }
+    if (qcow2_flush(s) < 0)
+        return -1;
+    n = (sector_num - s->seek_sector) << 9;
+    s->seek_sector = sector_num;
+    return n;
+}
+
+int qcow2_read(bdev_desc_t *bdev, struct iovec *vec, int count)
+{
+    BDRVQCow2State *s = QCOW2_PRIV(bdev);
+    iov_cursor_t c;
+    int ret;
+
+    iov_cursor_init(&c, vec, count);
+    pthread_mutex_lock(&s->lock);
+    ret = do_read(s, &c, iov_cursor_total(vec, count) >> 9);
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+int qcow2_write(bdev_desc_t *bdev, struct iovec *vec, int count)
+{
+    BDRVQCow2State *s = QCOW2_PRIV(bdev);
+    iov_cursor_t c;
+    int ret;
+
+    iov_cursor_init(&c, vec, count);
+    pthread_mutex_lock(&s->lock);
+    ret = do_write(s, &c, iov_cursor_total(vec, count) >> 9);
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+int qcow2_seek(bdev_desc_t *bdev, long block, long offset)
+{
+    QCOW2_PRIV(bdev)->seek_sector = (u64)(block + offset);
+    return 0;
+}
@@ -34,6 +34,7 @@
 /* Disk Type Includes */
 #include "blk_raw.h"
 #include "blk_qcow.h"
+#include "blk_qcow2.h"
 #include "blk_dmg.h"
 
 #define BLKFLSBUF  _IO(0x12,97)		/* from <linux/fs.h> */
@@ -72,6 +73,8 @@ enum { kMacVolumes, kLinuxDisks };
 #define kDiskTypeRaw		(1<<6)
 #define kDiskTypeQCow		(1<<7)
 #define kDiskTypeDMG		(1<<8)
+#define kDiskTypeQCow2		(1<<9)
+#define kDiskTypeBadImage	(1<<10)		/* image header we failed to open */
 
 
 static bdev_desc_t 		*s_all_disks;
@@ -99,7 +102,17 @@ find_disk_type(int fd, char *name, bdev_desc_t *bdev)
 	
 	/* Check for QCow Disks */
 	if ( QCOW_MAGIC == be32_to_cpu(((QCowHeader *)buf)->magic) ) {
-		qcow_open(fd, bdev);
+		if( be32_to_cpu(((QCowHeader *)buf)->version) >= 2 ) {
+			if( qcow2_open(fd, bdev) < 0 ) {
+				raw_open(fd, bdev);
+				return kDiskTypeBadImage;
+			}
+			return kDiskTypeQCow2;
+		}
+		if( qcow_open(fd, bdev) < 0 ) {
+			raw_open(fd, bdev);
+			return kDiskTypeBadImage;
+		}
 		return kDiskTypeQCow;
 	}
 
@@ -128,7 +141,7 @@ inspect_disk( bdev_desc_t *bdev, char **typestr, char **volname, int type)
 	*typestr = "Disk";
 	*volname = NULL;	
 
-	if (type == kDiskTypeUnknown) {
+	if (type == kDiskTypeUnknown || type == kDiskTypeBadImage) {
 		*volname = strdup("- Unknown -");
 		return kDiskTypeUnknown;
 	}
@@ -260,7 +273,12 @@ open_mac_disk( char *name, int flags, int constructed )
 	if( ro_fallback )
 		flags &= ~BF_ENABLE_WRITE;
 
-	if( type & (kDiskTypeHFSPlus | kDiskTypeHFSX | kDiskTypeHFS | kDiskTypeUFS) ) {
+	if( type & kDiskTypeBadImage ) {
+		/* never export the image container itself, not even with -force */
+		printm("----> %s: unsupported or corrupt disk image\n", name );
+		ret = -1;
+	}
+	else if( type & (kDiskTypeHFSPlus | kDiskTypeHFSX | kDiskTypeHFS | kDiskTypeUFS) ) {
 		/* Standard Mac Volumes, nothing to do  */
 	} 
 	else if( type & kDiskTypePartitioned ) {
@@ -291,6 +309,8 @@ open_mac_disk( char *name, int flags, int constructed )
 	}
 	else {
 		/* Close the block device */
+		if( bdev->close != NULL )
+			bdev->close( bdev );
 		close( bdev->fd );
 		/* Free the block dev struct */
 		free(bdev);
@@ -27,4 +27,9 @@ void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		     const unsigned long length, const AES_KEY *key,
 		     unsigned char *ivec, const int enc);
 
+/* CBC over 512 byte sectors with the IV { le64(sector_num), 0 },
+   in == out is supported */
+void AES_cbc_sectors(const u8 *in, u8 *out, int nb_sectors, u64 sector_num,
+		     const AES_KEY *key, int enc);
+
 #endif
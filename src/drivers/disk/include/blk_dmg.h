@@ -35,6 +35,7 @@
 #endif /* _LARGEFILE64_SOURCE */
 
 #include <zlib.h>
+#include <pthread.h>
 #include "platform.h"
 #include "byteorder.h"
 #include "ablk_sh.h"
@@ -47,8 +48,37 @@
 #include <math.h>
 #include "vec_wrap.h"
 
+/* chunk types */
+#define DMG_CHUNK_ZLIB		0x80000005
+#define DMG_CHUNK_COPY		1
+#define DMG_CHUNK_ZERO		2
+
+/* cached chunk states */
+#define DMG_CACHE_QUEUED	0	/* waiting for a readahead thread */
+#define DMG_CACHE_LOADING	1
+#define DMG_CACHE_READY		2
+#define DMG_CACHE_FAILED	3
+
+#define DMG_CACHE_MB		16	/* default memory budget */
+#define DMG_READAHEAD		4	/* default #chunks read ahead */
+#define DMG_THREADS		2	/* default #inflate threads */
+#define DMG_RA_QUEUE		32
+
+/* A decompressed zlib chunk */
+typedef struct DMGCacheEntry {
+    u32 chunk;
+    int state;
+    int refs;			/* readers copying from data */
+    int prefetched;		/* loaded by readahead, not used yet */
+    u32 lru;
+    u32 size;
+    char *data;
+    struct DMGCacheEntry *next;
+} DMGCacheEntry;
+
 typedef struct BDRVDMGState {
     int fd;
+    bdev_desc_t *bdev;
     
     /* each chunk contains a certain number of sectors,
      * offsets[i] is the offset in the .dmg file,
@@ -64,10 +94,31 @@ typedef struct BDRVDMGState {
     u64* lengths;
     u64* sectors;
     u64* sectorcounts;
-    u32 current_chunk;
+    u32 max_compressed_size;
     char* compressed_chunk;
-    char* uncompressed_chunk;
     z_stream zstream;
+
+    /* decompressed chunks; cache[i] is chunk i or NULL */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;	/* chunk loaded, readahead queued or exit */
+    DMGCacheEntry **cache;
+    DMGCacheEntry *entries;	/* all cached chunks */
+    size_t cache_bytes;
+    size_t cache_limit;
+    u32 lru_tick;
+
+    /* readahead */
+    int readahead;		/* #chunks */
+    u32 ra_queue[DMG_RA_QUEUE];
+    int ra_head, ra_tail;
+    int nthreads;		/* running inflate threads */
+    int exiting;
+    long next_sector;		/* where a sequential read continues */
+
+    size_t ra_bytes;		/* prefetched chunks not used yet */
+
+    u64 hits, misses, ra_hits, waits;
+    struct BDRVDMGState *next;
     
     /* Current sector we've seeked to */
     long seek_sector;
@@ -78,7 +129,7 @@ typedef struct BDRVDMGState {
 
 /* Function declarations */
 int dmg_open(int fd, bdev_desc_t *bdev);
-int dmg_read(bdev_desc_t *bdev, u8 *buf, int nb_bytes);
+int dmg_read(bdev_desc_t *bdev, struct iovec *vec, int count);
 void dmg_close(bdev_desc_t *bdev);
 int dmg_seek(bdev_desc_t *bdev, long block, long offset);
 
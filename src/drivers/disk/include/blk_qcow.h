@@ -37,6 +37,7 @@
 
 #include "mol_config.h"
 #include <zlib.h>
+#include <pthread.h>
 #include "platform.h"
 #include "byteorder.h"
 #include "blk_shared.h"
@@ -51,6 +52,7 @@
 #include <math.h>
 #include "disk.h"
 #include "vec_wrap.h"
+#include "qcow_l2cache.h"
 
 
 /**************************************************************/
@@ -79,7 +81,28 @@ typedef struct QCowHeader {
     u64 l1_table_offset;
 } QCowHeader;
 
-#define QCOW_L2_CACHE_SIZE 16
+/* L2 table cache, 'qcow.l2_cache' tables (see qcow_l2cache.h) */
+#define QCOW_L2_CACHE_SIZE 64
+
+/* Decompressed clusters, 'qcow.compressed_cache' entries with LRU
+   replacement. Compressed data is never rewritten in place (new
+   clusters are always appended) so entries stay valid across writes. */
+#define QCOW_CCACHE_SIZE 32
+
+typedef struct QCowCCEntry {
+    u64 offset;             /* compressed offset in file, -1 if unused */
+    u8 *data;
+    u32 lru;
+} QCowCCEntry;
+
+/* compressed clusters of one request inflated by the helper threads */
+#define QCOW_MAX_INFLATE_THREADS 8
+
+typedef struct QCowInflateJob {
+    u64 cluster_offset;     /* L2 entry */
+    QCowCCEntry *e;
+    int error;
+} QCowInflateJob;
 
 typedef struct BDRVQcowState {
     int fd;
@@ -92,12 +115,32 @@ typedef struct BDRVQcowState {
     u64 cluster_offset_mask;
     u64 l1_table_offset;
     u64 *l1_table;
-    u64 *l2_cache;
-    u64 l2_cache_offsets[QCOW_L2_CACHE_SIZE];
-    u32 l2_cache_counts[QCOW_L2_CACHE_SIZE];
-    u8 *cluster_cache;
+    QCowL2Cache l2c;
+    int l1_dirty_start;     /* dirty L1 range, empty if start == end */
+    int l1_dirty_end;
+    int data_pending;       /* clusters allocated, data not yet written */
+    int l2_pinned;          /* lookup failed, all ways of the set dirty */
+    u64 meta_writes;
     u8 *cluster_data;
-    u64 cluster_cache_offset;
+    QCowCCEntry *ccache;
+    int ccache_size;
+    u32 cc_tick;
+    z_stream zstream;
+    int zstream_ok;
+    u64 cc_hits;
+    u64 cc_misses;
+    u64 cc_parallel;        /* clusters inflated by a batch */
+    /* inflate threads */
+    pthread_mutex_t inflate_lock;
+    pthread_cond_t inflate_cond;    /* jobs queued or exit */
+    pthread_cond_t inflate_done;    /* job finished or thread exited */
+    QCowInflateJob *jobs;
+    int njobs;
+    int next_job;
+    int jobs_done;
+    int inflate_threads;    /* wanted */
+    int threads_running;
+    int exiting;
     u32 crypt_method; /* current crypt method, 0 if no key yet */
     u32 crypt_method_header;
     AES_KEY aes_encrypt_key;
@@ -105,6 +148,8 @@ typedef struct BDRVQcowState {
     u64 seek_sector;    /* Current sector */
     char backing_file[1024];
     int  backing_hd;
+    bdev_desc_t *bdev;
+    struct BDRVQcowState *next;
 } BDRVQCowState;
 
 /* Private QCOW Struct, bdev is the argument */
@@ -112,8 +157,8 @@ typedef struct BDRVQcowState {
 
 /* Function declarations */
 int qcow_open(int fd, bdev_desc_t *bdev);
-int qcow_read(bdev_desc_t *bdev, u8 *buf, int count);
-int qcow_write(bdev_desc_t *bdev, u8 *buf, int count);
+int qcow_read(bdev_desc_t *bdev, struct iovec *vec, int count);
+int qcow_write(bdev_desc_t *bdev, struct iovec *vec, int count);
 void qcow_close(bdev_desc_t *bdev);
 int qcow_seek(bdev_desc_t *bdev, long block, long offset);
 
@@ -0,0 +1,203 @@
+/*
+ * <blk-qcow2.h>
+ *
+ * qemu QCOW2 block device read/write functions
+ *
+ * Based on the QEMU Block driver for the QCOW2 format
+ *
+ * Copyright (c) 2004-2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _H_BLK_QCOW2
+#define _H_BLK_QCOW2
+
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE
+#endif /* _LARGEFILE64_SOURCE */
+
+#include "mol_config.h"
+#include <zlib.h>
+#include <pthread.h>
+#include "platform.h"
+#include "byteorder.h"
+#include "ablk_sh.h"
+#include "ablk.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "disk.h"
+#include "vec_wrap.h"
+#include "qcow_l2cache.h"
+
+
+/**************************************************************/
+/* QEMU COW block driver, version 2 and 3 images */
+
+#define QCOW2_MAGIC (('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
+
+#define QCOW2_CRYPT_NONE 0
+
+#define QCOW2_OFLAG_COPIED     (1ULL << 63)	/* refcount is exactly one */
+#define QCOW2_OFLAG_COMPRESSED (1ULL << 62)
+#define QCOW2_OFLAG_ZERO       (1ULL << 0)	/* version 3 only */
+
+#define QCOW2_L1E_OFFSET_MASK  0x00fffffffffffe00ULL
+#define QCOW2_L2E_OFFSET_MASK  0x00fffffffffffe00ULL
+#define QCOW2_REFT_OFFSET_MASK 0xfffffffffffffe00ULL
+
+/* incompatible features */
+#define QCOW2_INCOMPAT_DIRTY   (1ULL << 0)	/* refcounts may be stale */
+#define QCOW2_INCOMPAT_CORRUPT (1ULL << 1)
+#define QCOW2_INCOMPAT_MASK    QCOW2_INCOMPAT_DIRTY
+
+/* compatible features */
+#define QCOW2_COMPAT_LAZY_REFCOUNTS (1ULL << 0)
+
+typedef struct QCow2Header {
+    u32 magic;
+    u32 version;
+    u64 backing_file_offset;
+    u32 backing_file_size;
+    u32 cluster_bits;
+    u64 size; /* in bytes */
+    u32 crypt_method;
+    u32 l1_size;
+    u64 l1_table_offset;
+    u64 refcount_table_offset;
+    u32 refcount_table_clusters;
+    u32 nb_snapshots;
+    u64 snapshots_offset;
+
+    /* version 3 */
+    u64 incompatible_features;
+    u64 compatible_features;
+    u64 autoclear_features;
+    u32 refcount_order;
+    u32 header_length;
+} __attribute__((packed)) QCow2Header;
+
+#define QCOW2_V2_HEADER_LENGTH 72
+
+typedef struct QCow2SnapshotHeader {
+    u64 l1_table_offset;
+    u32 l1_size;
+    u16 id_str_size;
+    u16 name_size;
+    u32 date_sec;
+    u32 date_nsec;
+    u64 vm_clock_nsec;
+    u32 vm_state_size;
+    u32 extra_data_size; /* extra data follows, then id and name */
+} __attribute__((packed)) QCow2SnapshotHeader;
+
+typedef struct QCow2Snapshot {
+    u64 l1_table_offset;
+    u32 l1_size;
+    char *id_str;
+    char *name;
+    u32 date_sec;
+    u32 date_nsec;
+    u64 vm_clock_nsec;
+    u32 vm_state_size;
+} QCow2Snapshot;
+
+/* L2 table cache, 'qcow2.l2_cache' tables (see qcow_l2cache.h) */
+#define QCOW2_L2_CACHE_SIZE 16
+
+/* host clusters released once the tables no longer reference them */
+typedef struct QCow2Extent {
+    u64 offset;
+    u64 length;
+} QCow2Extent;
+
+typedef struct BDRVQcow2State {
+    int fd;
+    bdev_desc_t *bdev;
+    pthread_mutex_t lock;
+
+    int version;
+    int cluster_bits;
+    int cluster_size;
+    int cluster_sectors;
+    int l2_bits;
+    int l2_size;
+    int csize_shift;            /* compressed cluster descriptor */
+    u64 csize_mask;
+    u64 cluster_offset_mask;
+    u64 size;
+    int header_length;
+    u64 incompatible_features;
+    u64 compatible_features;
+    u64 autoclear_features;
+
+    int l1_size;
+    u64 l1_table_offset;
+    u64 *l1_table;              /* cpu order, flags included */
+    int l1_dirty_start;         /* dirty L1 range, empty if start == end */
+    int l1_dirty_end;
+
+    QCowL2Cache l2c;
+    int data_pending;           /* clusters allocated, data not yet written */
+    int l2_pinned;              /* lookup failed, all ways of the set dirty */
+
+    /* refcounts are kept in memory, one u16 per host cluster */
+    u64 refcount_table_offset;
+    int refcount_table_size;    /* #entries */
+    u64 *refcount_table;
+    int refcount_block_bits;    /* log2 of #entries per block */
+    u16 *refcounts;
+    u64 nb_clusters;            /* #clusters covered by refcounts */
+    u8 *refblock_dirty;         /* one flag per refcount table entry */
+    int refcounts_dirty;
+    u64 free_cluster_index;     /* allocation hint */
+    QCow2Extent *pending_free;  /* refcount decrements, applied by qcow2_flush */
+    int n_pending_free;
+    int max_pending_free;
+    int lazy_refcounts;
+
+    int nb_snapshots;
+    u64 snapshots_offset;
+    int snapshots_size;         /* bytes */
+    QCow2Snapshot *snapshots;
+
+    u8 *cluster_cache;
+    u8 *cluster_data;
+    u64 cluster_cache_offset;
+    u64 seek_sector;    /* Current sector */
+    char backing_file[1024];
+    int  backing_hd;
+
+    struct BDRVQcow2State *next;
+} BDRVQCow2State;
+
+/* Private QCOW2 Struct, bdev is the argument */
+#define QCOW2_PRIV(x) ( (BDRVQCow2State *)(x->priv) )
+
+/* Function declarations */
+int qcow2_open(int fd, bdev_desc_t *bdev);
+int qcow2_read(bdev_desc_t *bdev, struct iovec *vec, int count);
+int qcow2_write(bdev_desc_t *bdev, struct iovec *vec, int count);
+void qcow2_close(bdev_desc_t *bdev);
+int qcow2_seek(bdev_desc_t *bdev, long block, long offset);
+
+#endif
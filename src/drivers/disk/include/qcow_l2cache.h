@@ -0,0 +1,62 @@
+/*
+ *   Creation Date: <2026/10/18 01:03:35 agent>
+ *   Time-stamp: <2026/10/18 01:40:12 agent>
+ *
+ *	<qcow_l2cache.h>
+ *
+ *	L2 table cache shared by the qcow and qcow2 drivers
+ *
+ *   Copyright (C) 2026 agent (agent@local)
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   version 2
+ */
+
+#ifndef _H_QCOW_L2CACHE
+#define _H_QCOW_L2CACHE
+
+#include "mol_config.h"
+#include "platform.h"
+
+/* Tables are organized in sets of QCOW_L2_CACHE_WAYS tables, indexed by
+   the table offset, with LRU replacement within a set. The drivers decide
+   when a dirty table may be written back. */
+#define QCOW_L2_CACHE_WAYS 4
+
+typedef struct QCowL2Entry {
+    u64 offset;             /* table offset in file, 0 if unused */
+    u64 *table;             /* big-endian, as on disk */
+    u32 lru;                /* tick of the last access */
+    int dirty_start;        /* dirty index range, empty if start == end */
+    int dirty_end;
+} QCowL2Entry;
+
+typedef struct QCowL2Cache {
+    QCowL2Entry *entries;
+    u64 *tables;
+    int sets;               /* power of 2 */
+    int shift;              /* log2 of the table alignment */
+    u32 tick;
+    /* statistics */
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+} QCowL2Cache;
+
+#define l2_cache_size(c)    ((c)->sets * QCOW_L2_CACHE_WAYS)
+#define l2_entry_dirty(e)   ((e)->dirty_start != (e)->dirty_end)
+
+int  l2_cache_init(QCowL2Cache *c, int ntables, int table_bytes, int shift);
+void l2_cache_free(QCowL2Cache *c);
+
+/* cached table at 'offset', NULL on a miss */
+QCowL2Entry *l2_cache_find(QCowL2Cache *c, u64 offset);
+/* the way which a miss at 'offset' replaces, clean ways first */
+QCowL2Entry *l2_cache_victim(QCowL2Cache *c, u64 offset);
+/* forget the table of a (clean) way before it is reloaded */
+void l2_cache_drop(QCowL2Cache *c, QCowL2Entry *e);
+/* the way now holds the (clean) table at 'offset' */
+void l2_cache_install(QCowL2Cache *c, QCowL2Entry *e, u64 offset);
+
+#endif
@@ -1,9 +1,35 @@
 /* Read / Write Vector Wrappers */
 
+#ifndef _H_VEC_WRAP
+#define _H_VEC_WRAP
+
 #include "mol_config.h"
 #include <limits.h>
 #include <sys/uio.h>
+#include <sys/param.h>
 #include "disk.h"
 
 int wrap_read(bdev_desc_t *bdev, struct iovec *vec, int count);
 int wrap_write(bdev_desc_t *bdev, struct iovec *vec, int count);
+
+/* Walks an iovec list for drivers that handle the vectors natively */
+typedef struct iov_cursor {
+	const struct iovec	*vec;
+	int			count;
+	int			ind;		/* current element */
+	size_t			offs;		/* offset into current element */
+} iov_cursor_t;
+
+void	iov_cursor_init(iov_cursor_t *c, const struct iovec *vec, int count);
+size_t	iov_cursor_total(const struct iovec *vec, int count);
+size_t	iov_cursor_slice(iov_cursor_t *c, size_t len, struct iovec *dst, int max, int *n);
+size_t	iov_cursor_from_buf(iov_cursor_t *c, const void *buf, size_t len);
+size_t	iov_cursor_to_buf(iov_cursor_t *c, void *buf, size_t len);
+size_t	iov_cursor_zero(iov_cursor_t *c, size_t len);
+
+/* max iovecs handed to a single preadv/pwritev by iov_cursor_rw */
+#define IOV_CURSOR_MAX_IOVEC	64
+
+int	iov_cursor_rw(int fd, iov_cursor_t *c, size_t len, u64 offset, int write);
+
+#endif
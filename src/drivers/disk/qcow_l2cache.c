@@ -0,0 +1,98 @@
+/*
+ *   Creation Date: <2026/10/18 01:03:35 agent>
+ *   Time-stamp: <2026/10/18 01:40:12 agent>
+ *
+ *	<qcow_l2cache.c>
+ *
+ *	L2 table cache shared by the qcow and qcow2 drivers
+ *
+ *   Copyright (C) 2026 agent (agent@local)
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   version 2
+ */
+
+#include "qcow_l2cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* 'ntables' is rounded down to a power of two number of sets */
+int l2_cache_init(QCowL2Cache *c, int ntables, int table_bytes, int shift)
+{
+    int i, n;
+
+    memset(c, 0, sizeof(*c));
+    for (c->sets = 1; c->sets * 2 * QCOW_L2_CACHE_WAYS <= ntables; c->sets *= 2)
+        ;
+    c->shift = shift;
+    n = l2_cache_size(c);
+    c->tables = malloc((size_t)n * table_bytes);
+    c->entries = calloc(n, sizeof(QCowL2Entry));
+    if (!c->tables || !c->entries) {
+        l2_cache_free(c);
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+        c->entries[i].table = (u64 *)((u8 *)c->tables + (size_t)i * table_bytes);
+    return 0;
+}
+
+void l2_cache_free(QCowL2Cache *c)
+{
+    free(c->tables);
+    free(c->entries);
+    c->tables = NULL;
+    c->entries = NULL;
+}
+
+static inline QCowL2Entry *cache_set(QCowL2Cache *c, u64 offset)
+{
+    return c->entries + ((offset >> c->shift) & (c->sets - 1)) * QCOW_L2_CACHE_WAYS;
+}
+
+QCowL2Entry *l2_cache_find(QCowL2Cache *c, u64 offset)
+{
+    QCowL2Entry *e = cache_set(c, offset);
+    int i;
+
+    for (i = 0; i < QCOW_L2_CACHE_WAYS; i++, e++) {
+        if (e->offset == offset) {
+            c->hits++;
+            e->lru = ++c->tick;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+QCowL2Entry *l2_cache_victim(QCowL2Cache *c, u64 offset)
+{
+    QCowL2Entry *set = cache_set(c, offset), *e, *victim = set, *clean = NULL;
+    int i;
+
+    for (i = 0; i < QCOW_L2_CACHE_WAYS; i++) {
+        e = &set[i];
+        if (e->lru < victim->lru)
+            victim = e;
+        if (!l2_entry_dirty(e) && (!clean || e->lru < clean->lru))
+            clean = e;
+    }
+    return clean ? clean : victim;
+}
+
+void l2_cache_drop(QCowL2Cache *c, QCowL2Entry *e)
+{
+    if (e->offset)
+        c->evictions++;
+    e->offset = 0;
+    e->dirty_start = e->dirty_end = 0;
+}
+
+void l2_cache_install(QCowL2Cache *c, QCowL2Entry *e, u64 offset)
+{
+    c->misses++;
+    e->offset = offset;
+    e->lru = ++c->tick;
+    e->dirty_start = e->dirty_end = 0;
+}
@@ -76,3 +76,121 @@ int wrap_write(bdev_desc_t *bdev, struct iovec *vec, int count)
 	return total_bytes;
 
 }
+
+/************************************************************************/
+/*	iovec cursor							*/
+/************************************************************************/
+
+void iov_cursor_init(iov_cursor_t *c, const struct iovec *vec, int count)
+{
+	c->vec = vec;
+	c->count = count;
+	c->ind = 0;
+	c->offs = 0;
+}
+
+/* Returns the byte count of the list, or 0 if it overflows */
+size_t iov_cursor_total(const struct iovec *vec, int count)
+{
+	size_t total = 0;
+	int i;
+
+	for(i=0; i<count; i++) {
+		if(total + vec[i].iov_len >= SSIZE_MAX)
+			return 0;
+		total += vec[i].iov_len;
+	}
+	return total;
+}
+
+/* Describe the next 'len' bytes of the list in at most 'max' elements of
+ * 'dst' and advance past them. Returns the number of bytes described,
+ * which is less than 'len' if the list or 'dst' runs out.
+ */
+size_t iov_cursor_slice(iov_cursor_t *c, size_t len, struct iovec *dst, int max, int *n)
+{
+	size_t s, done = 0;
+
+	for(*n=0; done < len && *n < max && c->ind < c->count; ) {
+		s = MIN(c->vec[c->ind].iov_len - c->offs, len - done);
+		if(s) {
+			dst[*n].iov_base = (u8 *)c->vec[c->ind].iov_base + c->offs;
+			dst[*n].iov_len = s;
+			(*n)++;
+			done += s;
+			c->offs += s;
+		}
+		if(c->offs == c->vec[c->ind].iov_len) {
+			c->ind++;
+			c->offs = 0;
+		}
+	}
+	return done;
+}
+
+/* Copy 'len' bytes from a linear buffer into the list */
+size_t iov_cursor_from_buf(iov_cursor_t *c, const void *buf, size_t len)
+{
+	struct iovec v;
+	size_t s, done = 0;
+	int n;
+
+	while(done < len && (s=iov_cursor_slice(c, len - done, &v, 1, &n))) {
+		memcpy(v.iov_base, (const u8 *)buf + done, s);
+		done += s;
+	}
+	return done;
+}
+
+/* Copy 'len' bytes from the list into a linear buffer */
+size_t iov_cursor_to_buf(iov_cursor_t *c, void *buf, size_t len)
+{
+	struct iovec v;
+	size_t s, done = 0;
+	int n;
+
+	while(done < len && (s=iov_cursor_slice(c, len - done, &v, 1, &n))) {
+		memcpy((u8 *)buf + done, v.iov_base, s);
+		done += s;
+	}
+	return done;
+}
+
+size_t iov_cursor_zero(iov_cursor_t *c, size_t len)
+{
+	struct iovec v;
+	size_t s, done = 0;
+	int n;
+
+	while(done < len && (s=iov_cursor_slice(c, len - done, &v, 1, &n))) {
+		memset(v.iov_base, 0, s);
+		done += s;
+	}
+	return done;
+}
+
+/* Transfer 'len' bytes between the list and the file at 'offset'. Lists
+ * longer than IOV_CURSOR_MAX_IOVEC are split over several syscalls.
+ */
+int iov_cursor_rw(int fd, iov_cursor_t *c, size_t len, u64 offset, int write)
+{
+	struct iovec vec[IOV_CURSOR_MAX_IOVEC];
+	ssize_t ret;
+	size_t s;
+	int n;
+
+	while(len > 0) {
+		s = iov_cursor_slice(c, len, vec, IOV_CURSOR_MAX_IOVEC, &n);
+		if(!s)
+			return -1;
+		if(write)
+			ret = TEMP_FAILURE_RETRY(pwritev(fd, vec, n, offset));
+		else
+			ret = TEMP_FAILURE_RETRY(preadv(fd, vec, n, offset));
+		if(ret != s)
+			return -1;
+		len -= s;
+		offset += s;
+	}
+	return 0;
+}
@@ -17,6 +17,8 @@
 #ifndef _H_DBDMA
 #define _H_DBDMA
 
+#include <sys/uio.h>
+
 /* all variables should be considered read only */
 struct dma_read_pb {
 	int	res_count;
@@ -42,6 +44,25 @@ struct dma_write_pb {
 	ulong	identifier;
 };
 
+/* Scatter-gather batch: the buffers of the current and the following
+ * INPUT (or OUTPUT) commands of the channel program, up to the first
+ * command which waits, branches or interrupts. A batch is good for a
+ * single acknowledge.
+ */
+#define DMA_MAX_IOV		16
+
+struct dma_batch_pb {
+	int		nvec;
+	struct iovec	iov[DMA_MAX_IOV];	/* the part of each buffer not yet transfered */
+	int		total;			/* sum of the iov lengths */
+
+	int		key;
+	int		is_last;		/* the batch ends with a *_LAST command */
+
+	/* private variable */
+	ulong		identifier;
+};
+
 typedef char	(*dma_sbits_func)( int irq, int write_mask, char write_data );
 
 extern void	allocate_dbdma( int gc_offs, char *name, int irq, 
@@ -74,5 +95,15 @@ extern int	dma_write_ack( int irq, char *buf, int len, struct dma_write_pb *pb )
 extern int	dma_read_req( int irq, struct dma_read_pb *pb );
 extern int	dma_read_ack( int irq, int len, struct dma_read_pb *pb );
 
+/* Batched versions. INPUT data is stored directly in the iov buffers
+ * before dma_write_ack_batch is called. The iov array must be passed
+ * back unmodified. The ack returns nonzero if the channel program changed
+ * since the request; the rest of the batch is then dropped.
+ */
+extern int	dma_write_req_batch( int irq, struct dma_batch_pb *pb );
+extern int	dma_write_ack_batch( int irq, int len, struct dma_batch_pb *pb );
+extern int	dma_read_req_batch( int irq, struct dma_batch_pb *pb );
+extern int	dma_read_ack_batch( int irq, int len, struct dma_batch_pb *pb );
+
 #endif   /* _H_DBDMA */
 
@@ -23,10 +23,35 @@
 #include "hacks.h"
 #include "drivers.h"
 #include "driver_mgr.h"
+#include "timer.h"
+#include "res_manager.h"
 
 /* #define PERFORMANCE_INFO */
 /* #define IOPORTS_VERBOSE  */
 
+/* MMIO trap profile (the 'ioprof' debugger command) */
+#define PROF_REGS	64		/* register offsets tracked per range (2^n) */
+#define PROF_NIPS	8		/* guest PCs tracked per range */
+
+typedef struct {
+	ulong		offs;
+	ulong		reads, writes;	/* both zero if the slot is free */
+	ullong		ticks, max_ticks;
+} prof_reg_t;
+
+typedef struct {
+	ulong		nip;
+	ulong		count;
+} prof_nip_t;
+
+typedef struct {
+	ulong		reads, writes;
+	ullong		ticks;
+	ulong		lost;		/* accesses to offsets not fitting in reg[] */
+	prof_reg_t	reg[PROF_REGS];
+	prof_nip_t	nip[PROF_NIPS];
+} io_prof_t;
+
 typedef struct io_range {
 	struct io_range	*next;		/* list, addition order */
 	struct io_range *snext;		/* ordered list */
@@ -43,32 +68,129 @@ typedef struct io_range {
 	void		*usr;		/* user information */
 	io_ops_t	ops;
 
+	io_prof_t	*prof;		/* allocated on the first profiled trap */
+
 #ifdef PERFORMANCE_INFO
 	ulong		num_reads;	/* performance counter */
 	ulong		num_writes;	/* performance counter */
 #endif
 } io_range_t;
 
+/* The ranges flattened into sorted, non-overlapping segments. Where ranges
+ * overlap, the most recently added one owns the address (the same answer
+ * a walk of the root list gives).
+ */
+typedef struct {
+	ulong		start;
+	ulong		last;		/* inclusive */
+	io_range_t	*ior;
+} io_seg_t;
+
 static io_range_t	*root=0;
 static io_range_t	*sroot=0;	/* only intended for verbose output */
 static int		next_id=1;
 
+static io_seg_t		*segs;
+static int		nsegs;
+
+/* last hit, one per caller */
+static io_seg_t		*last_rd, *last_wr, *last_misc;
+
 
 /************************************************************************/
-/*	unmapped read/write						*/
+/*	range lookup							*/
 /************************************************************************/
 
+static int
+bound_cmp( const void *p1, const void *p2 )
+{
+	ullong a = *(ullong*)p1, b = *(ullong*)p2;
+	return (a < b) ? -1 : (a > b);
+}
+
+static void
+rebuild_segs( void )
+{
+	io_range_t *cur, *ior;
+	io_seg_t *s = NULL;
+	ullong *b;
+	int i, n, nb = 0;
+
+	for( n=0, cur=root; cur; cur=cur->next )
+		n++;
+	last_rd = last_wr = last_misc = NULL;
+	free( segs );
+	segs = NULL;
+	nsegs = 0;
+	if( !n )
+		return;
+
+	/* every range start and end is a segment boundary */
+	if( !(b=malloc(2 * n * sizeof(ullong))) || !(s=malloc(2 * n * sizeof(io_seg_t))) ) {
+		printm("Out of memory");
+		exit(1);
+	}
+	for( cur=root; cur; cur=cur->next ) {
+		b[nb++] = cur->mphys;
+		b[nb++] = (ullong)cur->mphys + cur->size;
+	}
+	qsort( b, nb, sizeof(ullong), bound_cmp );
+
+	for( n=0, i=0; i < nb-1; i++ ) {
+		if( b[i] == b[i+1] )
+			continue;
+		for( ior=root; ior; ior=ior->next )
+			if( b[i] >= ior->mphys && b[i] < (ullong)ior->mphys + ior->size )
+				break;
+		if( !ior )
+			continue;
+		if( n && s[n-1].ior == ior && (ullong)s[n-1].last + 1 == b[i] ) {
+			s[n-1].last = b[i+1] - 1;
+			continue;
+		}
+		s[n].start = b[i];
+		s[n].last = b[i+1] - 1;
+		s[n++].ior = ior;
+	}
+	free( b );
+	segs = s;
+	nsegs = n;
+}
+
+static inline io_seg_t *
+lookup_seg( ulong addr, io_seg_t **cache )
+{
+	io_seg_t *s = *cache;
+	int lo, hi, mid;
+
+	if( s && addr >= s->start && addr <= s->last )
+		return s;
+
+	/* find the last segment starting at or below addr */
+	for( lo=0, hi=nsegs-1; lo <= hi ; ) {
+		mid = (lo + hi) / 2;
+		if( segs[mid].start <= addr )
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	if( hi < 0 || addr > segs[hi].last )
+		return NULL;
+	return (*cache = &segs[hi]);
+}
+
 static io_range_t *
 get_range( ulong addr ) 
 {
-	io_range_t 	*cur;
-	
-	for( cur=root; cur; cur=cur->next )
-		if( addr >= cur->mphys && addr <= cur->mphys+cur->size-1 )
-			return cur;
-	return 0;
+	io_seg_t *s = lookup_seg( addr, &last_misc );
+	return s ? s->ior : NULL;
 }
 
+
+/************************************************************************/
+/*	unmapped read/write						*/
+/************************************************************************/
+
 static void 
 print_io_access( int isread, ulong addr, ulong value, int len, void *usr )
 {
@@ -177,6 +299,7 @@ add_io_range( ulong mbase, size_t size, char *name, int flags, io_ops_t *ops, vo
 		
 	ior->flags = flags;
 	ior->usr = usr;
+	rebuild_segs();
 	
 	/* We do the size check to avoid VRAM/ROM etc, 
 	 * which should be handled differently.
@@ -207,8 +330,10 @@ remove_io_range( int iorange_id )
 
 			/* And cleanup */
 			next = (**pn).next;
+			free( (**pn).prof );
 			free( *pn );
 			*pn = next;
+			rebuild_segs();
 			return 0;
 		}
 	return 1;
@@ -222,14 +347,13 @@ remove_io_range( int iorange_id )
 static void 
 mem_io_read( ulong mphys, int len, ulong *retvalue ) 
 {
-	io_range_t 	*cur;
+	io_seg_t	*s;
 
-	cur = get_range( mphys );
-	if( !cur ) {
+	if( !(s=lookup_seg(mphys, &last_rd)) ) {
 		*retvalue = unmapped_read( mphys, len, NULL );
 		return;
 	}
-	do_io_read( cur, mphys, len, retvalue );
+	do_io_read( s->ior, mphys, len, retvalue );
 }
 
 void 
@@ -262,15 +386,14 @@ do_io_read( void *_ior, ulong ptr, int len, ulong *retvalue )
 static void 
 mem_io_write( ulong mphys, ulong data, int len ) 
 {
-	io_range_t *cur;
+	io_seg_t *s;
 
-	cur = get_range( mphys );
-	if( !cur ) {
+	if( !(s=lookup_seg(mphys, &last_wr)) ) {
 		unmapped_write( mphys, data, len, NULL );
 		return;
 	}
 
-	do_io_write( cur, mphys, data, len );
+	do_io_write( s->ior, mphys, data, len );
 	return;
 }
 
@@ -296,6 +419,226 @@ do_io_write( void *_ior, ulong mphys, ulong data, int len )
 }
 
 
+/************************************************************************/
+/*	MMIO trap profiler						*/
+/************************************************************************/
+
+int			ioprof_active;
+
+/* called by the CPU emulation once a load/store trap has been handled */
+void
+ioprof_trap( void *_ior, ulong mphys, int isread, ulong nip, ullong ticks )
+{
+	io_range_t *ior = _ior;
+	io_prof_t *p;
+	prof_reg_t *r;
+	prof_nip_t *n, *min;
+	ulong offs;
+	int i;
+
+	if( !ior && !(ior=get_range(mphys)) )
+		return;
+	if( !(p=ior->prof) && !(p=ior->prof=calloc(1, sizeof(io_prof_t))) )
+		return;
+
+	if( isread )
+		p->reads++;
+	else
+		p->writes++;
+	p->ticks += ticks;
+
+	/* register offset, open addressing */
+	offs = mphys - ior->mphys;
+	for( i=0; i<PROF_REGS; i++ ) {
+		r = &p->reg[ (offs + i) & (PROF_REGS - 1) ];
+		if( r->offs == offs || (!r->reads && !r->writes) )
+			break;
+	}
+	if( i < PROF_REGS ) {
+		r->offs = offs;
+		if( isread )
+			r->reads++;
+		else
+			r->writes++;
+		r->ticks += ticks;
+		if( ticks > r->max_ticks )
+			r->max_ticks = ticks;
+	} else {
+		p->lost++;
+	}
+
+	/* most frequent guest PCs (space-saving; counts may be overestimated) */
+	for( min=n=p->nip, i=0; i<PROF_NIPS; i++, n++ ) {
+		if( n->nip == nip && n->count )
+			break;
+		if( n->count < min->count )
+			min = n;
+	}
+	if( i < PROF_NIPS ) {
+		n->count++;
+	} else {
+		min->nip = nip;
+		min->count++;
+	}
+}
+
+static void
+ioprof_clear( void )
+{
+	io_range_t *cur;
+
+	for( cur=root; cur; cur=cur->next ) {
+		free( cur->prof );
+		cur->prof = NULL;
+	}
+}
+
+static double
+ticks_to_us( ullong ticks )
+{
+	static double scale;
+
+	if( !scale )
+		scale = mticks_to_usecs( 1 << 24 ) / (double)(1 << 24);
+	return ticks * scale;
+}
+
+static int
+prof_reg_cmp( const void *p1, const void *p2 )
+{
+	const prof_reg_t *a = p1, *b = p2;
+	return (a->ticks < b->ticks) - (a->ticks > b->ticks);
+}
+
+static int
+prof_nip_cmp( const void *p1, const void *p2 )
+{
+	const prof_nip_t *a = p1, *b = p2;
+	return (a->count < b->count) - (a->count > b->count);
+}
+
+static int
+prof_range_cmp( const void *p1, const void *p2 )
+{
+	const io_range_t *a = *(io_range_t**)p1, *b = *(io_range_t**)p2;
+	return (a->prof->ticks < b->prof->ticks) - (a->prof->ticks > b->prof->ticks);
+}
+
+/* profiled ranges, most expensive first (the PCs are sorted too) */
+static io_range_t **
+ioprof_sorted( int *num )
+{
+	io_range_t *cur, **v;
+	int n;
+
+	for( n=0, cur=root; cur; cur=cur->next )
+		n += !!cur->prof;
+	if( !(v=malloc((n + 1) * sizeof(io_range_t*))) )
+		return NULL;
+	for( n=0, cur=root; cur; cur=cur->next ) {
+		if( !cur->prof )
+			continue;
+		qsort( cur->prof->nip, PROF_NIPS, sizeof(prof_nip_t), prof_nip_cmp );
+		v[n++] = cur;
+	}
+	qsort( v, n, sizeof(io_range_t*), prof_range_cmp );
+	*num = n;
+	return v;
+}
+
+/* reg[] is a hash table, sort a copy */
+static prof_reg_t *
+sorted_regs( io_prof_t *p, prof_reg_t *buf )
+{
+	memcpy( buf, p->reg, sizeof(p->reg) );
+	qsort( buf, PROF_REGS, sizeof(prof_reg_t), prof_reg_cmp );
+	return buf;
+}
+
+static void
+ioprof_print( void )
+{
+	prof_reg_t buf[PROF_REGS], *r;
+	io_range_t **v;
+	io_prof_t *p;
+	int i, j, n;
+
+	if( !(v=ioprof_sorted(&n)) )
+		return;
+	for( i=0; i<n; i++ ) {
+		p = v[i]->prof;
+		printm("%-20s %08lX  R/W %lu/%lu  total %.0f us, %.2f us/trap\n", v[i]->name, v[i]->mphys,
+		       p->reads, p->writes, ticks_to_us(p->ticks), ticks_to_us(p->ticks) / (p->reads + p->writes) );
+		r = sorted_regs( p, buf );
+		for( j=0; j<4 && (r[j].reads || r[j].writes); j++ )
+			printm("    +%04lX  R/W %lu/%lu  %.2f us/trap (max %.2f)\n", r[j].offs,
+			       r[j].reads, r[j].writes, ticks_to_us(r[j].ticks) / (r[j].reads + r[j].writes),
+			       ticks_to_us(r[j].max_ticks) );
+		printm("    NIP");
+		for( j=0; j<4 && p->nip[j].count; j++ )
+			printm("  %08lX (%lu)", p->nip[j].nip, p->nip[j].count );
+		printm("\n");
+	}
+	free( v );
+}
+
+static int
+ioprof_export( const char *name, int json )
+{
+	prof_reg_t buf[PROF_REGS], *r;
+	io_range_t **v;
+	io_prof_t *p;
+	int i, j, k, n;
+	FILE *f;
+
+	if( !(v=ioprof_sorted(&n)) )
+		return 1;
+	if( !(f=fopen(name, "w")) ) {
+		perrorm("%s", name );
+		free( v );
+		return 1;
+	}
+	if( json )
+		fprintf( f, "[\n" );
+	else
+		fprintf( f, "range,base,offset,reads,writes,total_us,max_us\n" );
+
+	for( i=0; i<n; i++ ) {
+		p = v[i]->prof;
+		if( json ) {
+			fprintf( f, "  { \"range\": \"%s\", \"base\": %lu, \"reads\": %lu, \"writes\": %lu, "
+				 "\"total_us\": %.2f, \"lost\": %lu,\n    \"regs\": [", v[i]->name,
+				 v[i]->mphys, p->reads, p->writes, ticks_to_us(p->ticks), p->lost );
+		}
+		sorted_regs( p, buf );
+		for( k=0, j=0; j<PROF_REGS; j++ ) {
+			r = &buf[j];
+			if( !r->reads && !r->writes )
+				continue;
+			if( json )
+				fprintf( f, "%s\n      { \"offset\": %lu, \"reads\": %lu, \"writes\": %lu, "
+					 "\"total_us\": %.2f, \"max_us\": %.2f }", k++ ? "," : "", r->offs,
+					 r->reads, r->writes, ticks_to_us(r->ticks), ticks_to_us(r->max_ticks) );
+			else
+				fprintf( f, "%s,0x%08lx,0x%04lx,%lu,%lu,%.2f,%.2f\n", v[i]->name, v[i]->mphys,
+					 r->offs, r->reads, r->writes, ticks_to_us(r->ticks), ticks_to_us(r->max_ticks) );
+		}
+		if( json ) {
+			fprintf( f, " ],\n    \"nips\": [" );
+			for( j=0; j<PROF_NIPS && p->nip[j].count; j++ )
+				fprintf( f, "%s{ \"nip\": %lu, \"count\": %lu }", j ? ", " : " ",
+					 p->nip[j].nip, p->nip[j].count );
+			fprintf( f, " ] }%s\n", (i < n-1) ? "," : "" );
+		}
+	}
+	if( json )
+		fprintf( f, "]\n" );
+	fclose( f );
+	free( v );
+	return 0;
+}
+
+
 /************************************************************************/
 /*	convenience functions						*/
 /************************************************************************/
@@ -468,6 +811,29 @@ cmd_iosb( int argv, char **args ) {
 }
 
 
+/* MMIO trap profiler */
+static int __dcmd
+cmd_ioprof( int argc, char **argv )
+{
+	if( argc == 1 ) {
+		printm("Profiling is %s\n", ioprof_active ? "on" : "off" );
+		ioprof_print();
+	} else if( argc == 2 && !strcmp(argv[1], "on") ) {
+		ioprof_active = 1;
+	} else if( argc == 2 && !strcmp(argv[1], "off") ) {
+		ioprof_active = 0;
+	} else if( argc == 2 && !strcmp(argv[1], "clear") ) {
+		ioprof_clear();
+	} else if( argc == 3 && (!strcmp(argv[1], "csv") || !strcmp(argv[1], "json")) ) {
+		if( !ioprof_export(argv[2], argv[1][0] == 'j') )
+			printm("Profile written to %s\n", argv[2] );
+	} else {
+		return 1;
+	}
+	return 0;
+}
+
+
 /************************************************************************/
 /*	init / cleanup							*/
 /************************************************************************/
@@ -481,6 +847,7 @@ static dbg_cmd_t dbg_cmds[] = {
 	{ "iocb", cmd_iocb, "iocb \nclear all IO-range break flags\n" },
 	{ "iosv", cmd_iosv, "iosv \nset all IO-range verbose flags\n" },
 	{ "iosb", cmd_iosb, "iosb \nset all IO-range break flags\n" },
+	{ "ioprof", cmd_ioprof, "ioprof [on | off | clear | csv file | json file] \nMMIO trap profile\n" },
 #endif
 };
 
@@ -493,6 +860,8 @@ ioports_init( void )
 	add_io_range( 0x80000000, 0x80000000, "IO_unmapped", 0, NULL, NULL );
 	add_dbg_cmds( dbg_cmds, sizeof(dbg_cmds) );
 
+	ioprof_active = (get_bool_res("ioprof") == 1);
+
 	return 1;
 }
 
@@ -507,8 +876,11 @@ ioports_cleanup( void )
 #endif
 	for( cur=root; cur; cur=next ) {
 		next = cur->next;
+		free( cur->prof );
 		free( cur );
 	}
+	root = sroot = NULL;
+	rebuild_segs();
 }
 
 driver_interface_t ioports_driver = {
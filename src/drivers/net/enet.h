@@ -24,11 +24,14 @@ typedef struct enet_iface enet_iface_t;
 #define TUN_PACKET_DRIVER_ID		1
 #define TAP_PACKET_DRIVER_ID		2
 #define SHEEP_PACKET_DRIVER_ID		4
+#define AFPACKET_PACKET_DRIVER_ID	8
+#define USER_PACKET_DRIVER_ID		16
 
 /* enet iface flags */
 #define NO_DHCP				1
 #define HAS_CUSTOM_MACADDR		2
 #define IP_PAYLOAD			4	/* no link layer */
+#define BATCH_IO			8	/* fd is a socket (recvmmsg/sendmmsg) */
 
 struct enet_iface {
 	packet_driver_t	*pd;
@@ -73,6 +76,8 @@ extern packet_driver_t	*g_packet_driver_list;
 /* initialization */
 extern void		init_tun( void );
 extern void		init_sheep( void );
+extern void		init_afpacket( void );
+extern void		init_usernet( void );
 
 #define DECLARE_PACKET_DRIVER( initname, pd ) \
 void			initname( void ) { pd._next = g_packet_driver_list; g_packet_driver_list = &pd; }
@@ -86,6 +91,22 @@ extern int		check_netdev( const char *ifname );
 extern int		send_packet( enet_iface_t *iface, struct iovec *vec, size_t nvec );
 extern int		receive_packet( enet_iface_t *iface, struct iovec *vec, size_t nvec );
 
+/* batched I/O (a single syscall for BATCH_IO interfaces) */
+typedef struct {
+	struct iovec	*iov;
+	int		nvec;
+	int		len;			/* bytes received */
+} packet_vec_t;
+
+#define MAX_PACKET_BATCH	32
+
+/* send_packets returns the number of packets consumed (sent, handled locally or
+ * counted in *errs). The rest should be retried when the fd becomes writable.
+ */
+extern int		send_packets( enet_iface_t *iface, packet_vec_t *pv, int n, int *errs );
+extern int		receive_packets( enet_iface_t *iface, packet_vec_t *pv, int n );	/* returns #packets */
+extern int		drop_packets( enet_iface_t *iface );
+
 /* world interface */
 extern int		find_packet_driver( int index, enet_iface_t *is );
 extern void		netif_print_blurb( enet_iface_t *is, int port );
@@ -28,15 +28,25 @@
 #include "enet.h"
 #include "enet2_sh.h"
 #include "osi_driver.h"
+#include "timer.h"
+#include "debugger.h"
 
 typedef struct {
 	enet_iface_t	iface;
-	int		rx_async;	/* rx async handler id */
+	int		rx_async;	/* async handler id (rx, and tx when blocked) */
 	int		running;
+	int		tx_blocked;	/* waiting for POLLOUT to send the rest of the ring */
 
 	int		irq;
 	int		irq_enable;
 
+	/* interrupt coalescing */
+	int		irq_packets;	/* raise the irq when this many packets are pending */
+	int		irq_usecs;	/* ...or this long after the first (0 = no coalescing) */
+	int		irq_pending;
+	int		irq_armed;	/* coalescing timer is running */
+	int		irq_timer;
+
 	enet2_ring_t	*tx_ring;	/* 2^n entries */
 	enet2_ring_t	*tx_of_ring;	/* used when a buffer crosses a page boundary */
 	int		tx_head;
@@ -46,6 +56,12 @@ typedef struct {
 	enet2_ring_t	*rx_of_ring;	/* used when a buffer crosses a page boundary */
 	int		rx_tail;
 	int		rx_mask;
+
+	struct {
+		ullong	rx_packets, rx_bytes, rx_dropped, rx_batches;
+		ullong	tx_packets, tx_bytes, tx_errors, tx_batches, tx_stalls;
+		ullong	irqs;
+	} stats;
 } mol_enet2_t;
 
 static mol_enet2_t *me;
@@ -75,6 +91,52 @@ dbg_dump_packet( const char *str, struct iovec *vec, int nvec )
 }
 
 
+/************************************************************************/
+/*	interrupt coalescing						*/
+/************************************************************************/
+
+static void
+raise_irq( void )
+{
+	me->irq_pending = 0;
+	if( me->irq_enable ) {
+		me->stats.irqs++;
+		irq_line_hi( me->irq );
+	}
+}
+
+static void
+irq_timeout( int id, void *usr, int info )
+{
+	/* cleared before irq_pending is examined (see rx_irq) */
+	me->irq_armed = 0;
+	__sync_synchronize();
+	if( me->irq_pending )
+		raise_irq();
+}
+
+/* called after n packets have been put in the RX ring */
+static void
+rx_irq( int n )
+{
+	if( !n )
+		return;
+	if( __sync_add_and_fetch(&me->irq_pending, n) >= me->irq_packets || !me->irq_usecs )
+		raise_irq();
+	else if( __sync_bool_compare_and_swap(&me->irq_armed, 0, 1) )
+		me->irq_timer = usec_timer( me->irq_usecs, irq_timeout, NULL );
+}
+
+static void
+cancel_irq_timer( void )
+{
+	if( me->irq_armed )
+		cancel_timer( me->irq_timer );
+	me->irq_armed = 0;
+	me->irq_pending = 0;
+}
+
+
 /************************************************************************/
 /*	OSI Interface							*/
 /************************************************************************/
@@ -176,6 +238,7 @@ osip_enet2_cntrl( int sel, int *params )
 		/* fall through */
 	case kEnet2Stop:
 		//printm("kEnet2Stop\n");
+		cancel_irq_timer();
 		irq_line_low( me->irq );
 		me->running = 0;
 		me->irq_enable = 0;
@@ -187,44 +250,84 @@ osip_enet2_cntrl( int sel, int *params )
 	return 0;
 }
 
+/* send the TX ring; returns 1 on a bad descriptor */
 static int
-osip_enet2_kick( int sel, int *params )
+tx_ring_flush( void )
 {
-	struct iovec vec[2];
-
-	if( !me->running )
-		return 1;
-
-	for( ;; ) {
-		enet2_ring_t *r = me->tx_ring + me->tx_head;
-		int nvec = 1;
-		
-		if( !r->psize )
+	struct iovec vec[MAX_PACKET_BATCH][2];
+	packet_vec_t pv[MAX_PACKET_BATCH];
+	int i, n, sent, errs, fault = 0;
+
+	while( !fault ) {
+		/* collect a batch of descriptors */
+		for( n=0; n < MAX_PACKET_BATCH && n <= me->tx_mask; n++ ) {
+			int ind = (me->tx_head + n) & me->tx_mask;
+			enet2_ring_t *r = me->tx_ring + ind;
+
+			if( !r->psize )
+				break;
+
+			pv[n].iov = vec[n];
+			pv[n].nvec = 1;
+			vec[n][0].iov_len = r->psize;
+			if( !(vec[n][0].iov_base=transl_mphys(r->buf)) ) {
+				fault = 1;
+				break;
+			}
+			if( (r->flags & kEnet2SplitBufferFlag) ) {
+				enet2_ring_t *r2 = me->tx_of_ring + ind;
+
+				vec[n][1].iov_len = r2->psize;
+				if( !(vec[n][1].iov_base=transl_mphys(r2->buf)) ) {
+					fault = 1;
+					break;
+				}
+				pv[n].nvec = 2;
+			}
+			dbg_dump_packet(C_RED "OUTGOING PACKET", vec[n], pv[n].nvec );
+		}
+		if( !n )
 			break;
 
-		vec[0].iov_len = r->psize;
-		if( !(vec[0].iov_base=transl_mphys(r->buf)) )
-			goto fault;
-
-		if( (r->flags & kEnet2SplitBufferFlag) ) {
-			enet2_ring_t *r2 = me->tx_of_ring + me->tx_head;
+		errs = 0;
+		sent = send_packets( &me->iface, pv, n, &errs );
+		me->stats.tx_errors += errs;
+		me->stats.tx_packets += sent;
+		me->stats.tx_batches++;
 
-			vec[1].iov_len = r2->psize;
-			if( !(vec[1].iov_base=transl_mphys(r2->buf)) )
-				goto fault;
-			nvec = 2;
+		for( i=0; i<sent; i++ ) {
+			enet2_ring_t *r = me->tx_ring + ((me->tx_head + i) & me->tx_mask);
+			me->stats.tx_bytes += r->psize;
+			r->psize = 0;
 		}
-		dbg_dump_packet(C_RED "OUTGOING PACKET", vec, nvec );
-		send_packet( &me->iface, vec, nvec );
-
-		me->tx_head = (me->tx_head + 1) & me->tx_mask;
-		r->psize = 0;
+		me->tx_head = (me->tx_head + sent) & me->tx_mask;
+
+		/* the device is full; the rest is left in the ring until it
+		 * becomes writable
+		 */
+		if( sent < n ) {
+			me->stats.tx_stalls++;
+			me->tx_blocked = 1;
+			set_async_handler_events( me->rx_async, POLLIN | POLLPRI | POLLOUT );
+			return 0;
+		}
+	}
+	if( fault ) {
+		printm("enet2_kick: Bad Access\n");
+		me->running = 0;
+		return 1;
 	}
 	return 0;
- fault:
-	printm("enet2_kick: Bad Access\n");
-	me->running = 0;
-	return 1;
+}
+
+static int
+osip_enet2_kick( int sel, int *params )
+{
+	if( !me->running )
+		return 1;
+	if( me->tx_blocked )
+		return 0;
+	return tx_ring_flush();
 }
 
 static const osi_iface_t osi_iface[] = { 
@@ -243,24 +346,25 @@ static const osi_iface_t osi_iface[] = {
 /************************************************************************/
 
 static int
-prepare_iovec( enet2_ring_t *r, struct iovec (*vec)[2], int pad )
+prepare_iovec( int ind, struct iovec *vec, int pad )
 {
+	enet2_ring_t *r = me->rx_ring + ind;
 	int nvec = 1;
 	char *buf;
 
 	if( !r->bsize || !(buf=transl_mphys(r->buf)) )
 		goto fault;
-	(*vec)[0].iov_len = r->bsize + pad;
-	(*vec)[0].iov_base = buf - pad;
+	vec[0].iov_len = r->bsize + pad;
+	vec[0].iov_base = buf - pad;
 	
 	if( (r->flags & kEnet2SplitBufferFlag) ) {
-		enet2_ring_t *r2 = me->rx_of_ring + me->rx_tail;
+		enet2_ring_t *r2 = me->rx_of_ring + ind;
 		
 		if( !(buf=transl_mphys(r2->buf)) )
 			goto fault;
 		
-		(*vec)[1].iov_len = r2->bsize;
-		(*vec)[1].iov_base = buf;
+		vec[1].iov_len = r2->bsize;
+		vec[1].iov_base = buf;
 		nvec = 2;
 	}
 	return nvec;
@@ -273,38 +377,58 @@ prepare_iovec( enet2_ring_t *r, struct iovec (*vec)[2], int pad )
 static void
 rx_packet_handler( int fd, int events )
 {
-	char dummy;
-	int n = 0;
-
+	struct iovec vec[MAX_PACKET_BATCH][2];
+	packet_vec_t pv[MAX_PACKET_BATCH];
+	int i, n, cnt;
+
+	if( (events & POLLOUT) && me->tx_blocked ) {
+		me->tx_blocked = 0;
+		set_async_handler_events( me->rx_async, POLLIN | POLLPRI );
+		if( me->running )
+			tx_ring_flush();
+		if( !(events & ~POLLOUT) )
+			return;
+	}
 	if( !me->running ) {
-		while( read(fd, &dummy, sizeof(dummy)) >= 0 )
-			;
+		drop_packets( &IFACE );
 		return;
 	}
 	for( ;; ) {
-		enet2_ring_t *r = me->rx_ring + me->rx_tail;
-		struct iovec vec[2];
-		int s, nvec;
-
-		if( r->psize ) {
+		/* map a batch of free RX descriptors */
+		for( n=0; n < MAX_PACKET_BATCH && n <= me->rx_mask; n++ ) {
+			int ind = (me->rx_tail + n) & me->rx_mask;
+
+			if( me->rx_ring[ind].psize )
+				break;
+			pv[n].iov = vec[n];
+			if( (pv[n].nvec=prepare_iovec(ind, vec[n], IFACE.packet_pad)) <= 0 )
+				return;
+		}
+		if( !n ) {
 			/* ring full, dropping packets */
-			printm("rx ring full\n");
-			while( read(fd, &dummy, sizeof(dummy)) >=0 )
-				n++;
+			me->stats.rx_dropped += drop_packets( &IFACE );
 			break;
 		}
-		if( (nvec=prepare_iovec(r, &vec, IFACE.packet_pad)) <= 0 )
-			break;
-		if( (s=receive_packet(&IFACE, vec, nvec)) <= 0 )
-			break;
-		dbg_dump_packet(C_GREEN "INCOMING_PACKET", vec, nvec );
+		cnt = receive_packets( &IFACE, pv, n );
+
+		for( i=0; i<cnt; i++ ) {
+			enet2_ring_t *r = me->rx_ring + ((me->rx_tail + i) & me->rx_mask);
+
+			dbg_dump_packet(C_GREEN "INCOMING_PACKET", pv[i].iov, pv[i].nvec );
+			r->psize = pv[i].len - IFACE.packet_pad;
+			me->stats.rx_bytes += r->psize;
+		}
+		me->rx_tail = (me->rx_tail + cnt) & me->rx_mask;
+		if( cnt ) {
+			me->stats.rx_packets += cnt;
+			me->stats.rx_batches++;
+		}
+		rx_irq( cnt );
 
-		r->psize = s - IFACE.packet_pad;
-		me->rx_tail = (me->rx_tail+1) & me->rx_mask;
-		n++;
+		/* the queue is empty */
+		if( cnt < n )
+			break;
 	}
-	if( n && me->irq_enable )
-		irq_line_hi( me->irq );
 }
 
 static void
@@ -314,16 +438,51 @@ inject_packet( enet_iface_t *iface, const char *packet, int len )
 	struct iovec vec[2];
 	int nvec;
 	
-	if( !me->running || r->psize || (nvec=prepare_iovec(r,&vec,0)) <= 0 )
+	if( !me->running || r->psize || (nvec=prepare_iovec(me->rx_tail, vec, 0)) <= 0 )
 		return;
 	
 	r->psize = memcpy_tovec( vec, nvec, packet, len );
 	dbg_dump_packet(C_YELLOW "INJECTED_PACKET", vec, nvec );
 
 	me->rx_tail = (me->rx_tail+1) & me->rx_mask;
-	irq_line_hi( me->irq );
+	me->stats.rx_packets++;
+	me->stats.rx_bytes += r->psize;
+	raise_irq();
+}
+
+
+/************************************************************************/
+/*	debugger							*/
+/************************************************************************/
+
+static int __dcmd
+cmd_enet2( int argc, char **argv )
+{
+	if( !me )
+		return 0;
+	if( argc == 2 && !strcmp(argv[1], "clear") ) {
+		memset( &me->stats, 0, sizeof(me->stats) );
+		return 0;
+	}
+	if( argc != 1 )
+		return 1;
+
+	printm("rx: %lld packets, %lld bytes, %lld dropped (ring full), %lld batches\n",
+	       me->stats.rx_packets, me->stats.rx_bytes, me->stats.rx_dropped, me->stats.rx_batches );
+	printm("tx: %lld packets, %lld bytes, %lld errors, %lld batches, %lld stalls (device full)\n",
+	       me->stats.tx_packets, me->stats.tx_bytes, me->stats.tx_errors, me->stats.tx_batches,
+	       me->stats.tx_stalls );
+	printm("irqs: %lld (coalescing %d packets / %d us)\n",
+	       me->stats.irqs, me->irq_packets, me->irq_usecs );
+	return 0;
 }
 
+static dbg_cmd_t dbg_cmds[] = {
+#ifdef CONFIG_DEBUGGER
+	{ "enet2",	cmd_enet2,	"enet2 [clear] \nshow enet2 packet statistics\n" },
+#endif
+};
+
 
 /************************************************************************/
 /*	init / cleanup							*/
@@ -342,6 +501,11 @@ add_netdev( int index, int irq )
 	me->irq = irq;
 	me->iface.inject_packet = inject_packet;
 
+	if( (me->irq_usecs=get_numeric_res("enet2_irq_usecs")) < 0 )
+		me->irq_usecs = 0;
+	if( (me->irq_packets=get_numeric_res("enet2_irq_packets")) <= 0 )
+		me->irq_packets = me->irq_usecs ? 0x7fffffff : 1;
+
 	if( PD.open(&IFACE) ) {
 		printm("Failed to initialize the %s-<%s> device\n", PD.name, IFACE.iface_name );
 		goto bail;
@@ -374,6 +538,7 @@ enet2_init( void )
 		return 0;
 	}
 	register_osi_iface( osi_iface, sizeof(osi_iface) );
+	add_dbg_cmds( dbg_cmds, sizeof(dbg_cmds) );
 	return 1;
 }
 
@@ -382,6 +547,7 @@ enet2_cleanup( void )
 {
 	if( me ) {
 		delete_async_handler( me->rx_async );
+		cancel_irq_timer();
 		
 		PD.close( &IFACE );
 		free( me );
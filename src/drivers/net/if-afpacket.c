@@ -0,0 +1,139 @@
+/*
+ *   Creation Date: <2026/10/18 00:07:42 agent>
+ *   Time-stamp: <2026/10/18 01:06:06 agent>
+ *
+ *	<if-afpacket.c>
+ *
+ *	AF_PACKET packet driver
+ *
+ *   Copyright (C) 2026 agent (agent@local)
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation
+ *
+ */
+
+#include "mol_config.h"
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include "res_manager.h"
+#include "enet.h"
+
+/* The guest shares a host ethernet card (in promiscuous mode) through a raw
+ * socket. Unlike the tun and sheep devices, a socket allows a whole batch
+ * of packets to be read or written with a single syscall.
+ */
+
+static const char		def_hw_addr[6] = { 0, 0, 0x0D, 0xEA, 0xDC, 0xEE };
+
+static void
+afpacket_preconfigure( enet_iface_t *is )
+{
+	/* no DHCP, the guest is on the host network */
+	is->client_ip = is->broadcast_ip = is->my_ip = 0;
+	is->netmask = is->nameserver = is->gateway = 0;
+	is->flags |= NO_DHCP;
+
+	memcpy( is->c_macaddr, def_hw_addr, 6 );
+	is->c_macaddr[5] += g_session_id;
+}
+
+/* The card is in promiscuous mode; only frames for the guest MAC,
+ * broadcasts and multicasts are passed on. Everything sent from this
+ * host (including our own packets looped back to the socket) is dropped.
+ */
+static int
+attach_filter( enet_iface_t *is, int fd )
+{
+	unsigned char *m = is->c_macaddr;
+	struct sock_filter code[] = {
+		BPF_STMT( BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE ),
+		BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 6, 0 ),
+		/* group bit of the destination address */
+		BPF_STMT( BPF_LD | BPF_B | BPF_ABS, 0 ),
+		BPF_JUMP( BPF_JMP | BPF_JSET | BPF_K, 1, 5, 0 ),
+		BPF_STMT( BPF_LD | BPF_W | BPF_ABS, 0 ),
+		BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, ((u32)m[0] << 24) | (m[1] << 16) | (m[2] << 8) | m[3], 0, 2 ),
+		BPF_STMT( BPF_LD | BPF_H | BPF_ABS, 4 ),
+		BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, (m[4] << 8) | m[5], 1, 0 ),
+		BPF_STMT( BPF_RET | BPF_K, 0 ),
+		BPF_STMT( BPF_RET | BPF_K, 0xffff ),
+	};
+	struct sock_fprog prog = { sizeof(code)/sizeof(code[0]), code };
+
+	return setsockopt( fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog) );
+}
+
+static int
+afpacket_open( enet_iface_t *is )
+{
+	struct sockaddr_ll sll;
+	struct packet_mreq mr;
+	int fd, ifindex;
+
+	if( check_netdev(is->iface_name) )
+		return 1;
+	if( !(ifindex=if_nametoindex(is->iface_name)) ) {
+		perrorm("if_nametoindex");
+		return 1;
+	}
+	if( (fd=socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0 ) {
+		perrorm("AF_PACKET socket");
+		return 1;
+	}
+	fcntl( fd, F_SETFD, FD_CLOEXEC );
+	fcntl( fd, F_SETFL, O_NONBLOCK );
+
+	if( attach_filter(is, fd) < 0 ) {
+		perrorm("SO_ATTACH_FILTER");
+		goto err;
+	}
+	memset( &sll, 0, sizeof(sll) );
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons( ETH_P_ALL );
+	sll.sll_ifindex = ifindex;
+	if( bind(fd, (struct sockaddr*)&sll, sizeof(sll)) < 0 ) {
+		perrorm("AF_PACKET bind");
+		goto err;
+	}
+
+	/* receive the packets addressed to the guest MAC */
+	memset( &mr, 0, sizeof(mr) );
+	mr.mr_ifindex = ifindex;
+	mr.mr_type = PACKET_MR_PROMISC;
+	if( setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) < 0 ) {
+		perrorm("PACKET_MR_PROMISC");
+		goto err;
+	}
+	is->packet_pad = 0;
+	is->flags |= BATCH_IO;
+
+	netif_open_common( is, fd );
+	return 0;
+ err:
+	close( fd );
+	return 1;
+}
+
+static void
+afpacket_close( enet_iface_t *is )
+{
+	netif_close_common( is );
+}
+
+static packet_driver_t afpacket_pd = {
+	.name		= "afpacket",
+	.flagstr	= "-afpacket",
+	.id		= AFPACKET_PACKET_DRIVER_ID,
+	.preconfigure	= afpacket_preconfigure,
+	.open 		= afpacket_open,
+	.close		= afpacket_close,
+};
+
+DECLARE_PACKET_DRIVER( init_afpacket, afpacket_pd );
@@ -81,6 +81,8 @@ initialize_drivers( void )
 #ifdef __linux__
 	init_tun();
 	init_sheep();
+	init_afpacket();
+	init_usernet();
 #endif
 #ifdef __darwin__
 	init_tun();
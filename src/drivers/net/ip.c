@@ -1,81 +1,112 @@
-/* 
- *   Creation Date: <2000/12/01 01:25:23 samuel>
- *   Time-stamp: <2001/01/21 17:13:24 samuel>
- *   
+/*
+ *   Creation Date: <2026/10/18 00:29:58 agent>
+ *   Time-stamp: <2026/10/18 01:38:01 agent>
+ *
  *	<ip.c>
- *	
- *	Handles the TCP and UDP protocol
- *   
- *   Copyright (C) 2000 Samuel Rydh (samuel@ibrium.se)
- *   
+ *
+ *	User-mode TCP/UDP networking (no TAP device needed)
+ *
+ *   Copyright (C) 2026 agent (agent@local)
+ *
  *   This program is free software; you can redistribute it and/or
  *   modify it under the terms of the GNU General Public License
  *   as published by the Free Software Foundation
- *   
+ *
  */
 
-#if 0	/******** THIS FILE IS CURRENTLY DISABLED SINCE IT CONTAINS UNFINISHED CODE ***********/
-
 #include "mol_config.h"
-
 #include <sys/socket.h>
-#include <sys/poll_compat.h>
 #include <sys/param.h>
 #include <sys/uio.h>
 #include <netinet/in.h>
-#include <linux/tcp.h>
-#include <linux/udp.h>
-#include <linux/ip.h>
-#include <linux/if_ether.h>
-#include <linux/if_arp.h>
-
+#include <netinet/tcp.h>
+#include <time.h>
+#include "poll_compat.h"
+#include "async.h"
+#include "timer.h"
 #include "debugger.h"
+#include "res_manager.h"
+#include "enet.h"
 #include "ip.h"
-#include "async.h"
-
-/* Two buffers of size HALF_TCP_WINDOW is used for receive buffering and retransmitting */ 
-#define HALF_TCP_WINDOW		0x1000
-
 
-#define FAKE_ETH_ADDR		0xDEADF00D
-static inline void copy_fake_eth_addr( char *s ) { *(short*)s = 0; *(ulong*)&s[2] = FAKE_ETH_ADDR; }
-
-struct tcp_port;
-typedef int tcp_handler_t( struct tcp_port *tp, struct iphdr *iph, struct tcphdr *h, int size );
-
-/* TCP state of the MOL endpoint:
+/* The guest talks IP over one end of a datagram socketpair (ARP and DHCP
+ * are answered by packet.c). The other end is served by a small TCP/IP
+ * stack which terminates the guest connections and proxies the payload
+ * onto ordinary host sockets:
+ *
+ * 	[MacOS] <----TCP----> [MOL endpoint <=> socket interface]
  *
- * 	[socket interface <=> MOL] <----TCP----> [MacOS]
+ * The gateway address (my_ip) is the host itself; DNS requests sent to it
+ * are forwarded to the host resolver.
  */
+
+#define IP_PACKET_SIZE		(MAX_PACKET_SIZE - 14)
+#define CTL_QUEUE_SIZE		8		/* reserved for RST segments */
+#define MAX_UDP_DATA		(IP_PACKET_SIZE - IP_HLEN - UDP_HLEN)
+#define MAX_UDP_PORTS		64
+
+#define TCP_MAX_MSS		(IP_PACKET_SIZE - IP_HLEN - TCP_HLEN)
+#define TCP_DEF_MSS		536
+#define SNDBUF_SIZE		0x40000		/* MOL -> MacOS, unacked + unsent (2^n) */
+#define RCVBUF_SIZE		0x10000		/* MacOS -> MOL, not yet taken by the socket (2^n) */
+
+#define TCP_HASH_SIZE		256		/* 2^n */
+#define UDP_HASH_SIZE		64
+#define MAX_OOO			8		/* out-of-order ranges kept per connection */
+#define FD_HASH_SIZE		64
+
+/* timers (ms) */
+#define TCP_TICK_USECS		10000
+#define TCP_DELACK		40
+#define TCP_RTO_MIN		200
+#define TCP_RTO_INIT		1000
+#define TCP_RTO_MAX		60000
+#define TCP_MAXRXTSHIFT		12
+#define TCP_TIMEWAIT		10000		/* 2MSL; the guest link never holds old duplicates */
+
+#define SEQ_LT(a,b)		((int)((a)-(b)) < 0)
+#define SEQ_LEQ(a,b)		((int)((a)-(b)) <= 0)
+#define SEQ_GT(a,b)		((int)((a)-(b)) > 0)
+#define TIME_GEQ(a,b)		((int)((a)-(b)) >= 0)
+
+/* TCP state of the MOL endpoint */
 enum {
 	kCLOSED = 0,
-	kSYN_RCVD,			// connecting, ACK,SYN sent if n_sent == 1
-	kSYN_SENT,
+	kCONNECTING,			// SYN received, host connect in progress
+	kSYN_RCVD,			// SYN,ACK sent
 	kESTABLISHED,
 	kCLOSE_WAIT,			// MacOS sent FIN
+	kFIN_WAIT_1,			// EOF received from socket, FIN queued
+	kCLOSING,
 	kLAST_ACK,
-
-	kFIN_WAIT_1,			// EOF received from socket
 	kFIN_WAIT_2,
-	// kCLOSING,
-	// kTIME_WAIT,
+	kTIME_WAIT,
 
 	NUM_TCP_STATES			// MUST BE LAST!
 };
 
-#define assert( cond, error ) ({ if( !(cond) ) printm("Assertion failed: %s", error); })
-
-static tcp_handler_t 	tcph_closed, tcph_syn_rcvd, tcph_established, tcph_close_wait;
-static tcp_handler_t 	tcph_fin_wait_1, tcph_fin_wait_2, tcph_last_ack;
-static tcp_handler_t	*tcp_handlers[ NUM_TCP_STATES ];
+static const char *state_names[ NUM_TCP_STATES ] = {
+	"CLOSED", "CONNECTING", "SYN_RCVD", "ESTABLISHED", "CLOSE_WAIT",
+	"FIN_WAIT_1", "CLOSING", "LAST_ACK", "FIN_WAIT_2", "TIME_WAIT"
+};
 
+/* tcp_port flags */
+#define TF_ACKNOW		1	/* send an ACK immediately */
+#define TF_DELACK		2	/* an ACK is owed */
+#define TF_WSCALE		4	/* MacOS scales its window */
+#define TF_EOF			8	/* EOF read from the socket */
+#define TF_SNDFIN		0x10	/* a FIN follows the buffered data */
+#define TF_RCVDFIN		0x20	/* FIN received from MacOS */
+#define TF_SHUTWR		0x40	/* socket write side is shut down */
+#define TF_FORCE		0x80	/* window probe */
 
 #define COMMON_PORT_FIELDS(k) 					\
 	int		mac_port;	/* mac port# */		\
-	int		port;		/* linux port# */	\
+	u32		mac_ip;					\
 	int		sfd;					\
 	int		async_hid;				\
-	struct k##_port	*next;
+	struct k##_port	*next;		/* port hash chain */	\
+	struct gen_port	*fd_next;	/* fd hash chain */
 
 typedef struct gen_port {
 	COMMON_PORT_FIELDS(gen);
@@ -83,246 +114,301 @@ typedef struct gen_port {
 
 typedef struct udp_port {
 	COMMON_PORT_FIELDS(udp);
-} udp_port_t;
 
+	u32		nat_ip;		// host address behind my_ip
+	uint		last_use;
+} udp_port_t;
 
 typedef struct tcp_port {
 	COMMON_PORT_FIELDS(tcp);
 
 	int		state;		// kCLOSED, kLAST_ACK etc.
-
-	ulong		remote_ip;
-	ulong		remote_port;
-	
-	ulong		mac_isn;	// initial sequence number for MacOS
-	ulong		mol_isn;	// ISN for MOL
-
-	ulong		n_mac_acked;	// #bytes acked by MacOS
-	ulong		n_sent;		// #bytes we have sent to MacOS
-	ulong		n_rcvd;		// #bytes we have received from MacOS
-
-#if 0
-	ulong		mac_win;     	// Announced mac-window (starts at n_mac_acked) 
-	// retransmit buf
-#endif
+	int		flags;		// TF_xxx
+	int		events;		// async events currently requested
+
+	u32		remote_ip;	// as seen by MacOS
+	int		remote_port;
+
+	/* MOL -> MacOS */
+	u32		iss;
+	u32		snd_una;	// oldest unacked seq (start of sbuf)
+	u32		snd_nxt;
+	u32		snd_max;	// highest seq sent
+	u32		snd_wnd;	// MacOS receive window
+	u32		snd_wl1;	// seq and ack of the last window update
+	u32		snd_wl2;
+	int		snd_wscale;
+	int		mss;
+	int		dupacks;
+	char		*sbuf;
+	int		sb_start, sb_len;
+
+	/* MacOS -> MOL */
+	u32		rcv_nxt;
+	u32		rcv_adv;	// right edge of the advertised window
+	char		*rbuf;
+	int		rb_start, rb_len;
+	struct { u32 seq, end; } ooo[MAX_OOO];	// out-of-order data already in rbuf
+	int		n_ooo;
+
+	/* timers (ms, 0 if inactive) */
+	uint		rexmt_time;
+	uint		delack_time;
+	uint		tw_time;
+	int		rxtshift;
+	int		srtt;		// scaled by 8
+	int		rttvar;		// scaled by 4
+	int		rto;
+	uint		rtt_time;	// timed segment
+	u32		rtt_seq;
 } tcp_port_t;
 
 typedef struct ip_state {
-	udp_port_t	*udp_root;	// udp ports in use
-	tcp_port_t	*tcp_root;	// tcp ports in use
-
-	void		*enetif;
-	ulong		mac_ip;
-
-	unsigned short	next_packet_id;
-	ulong		next_tcp_isn;
+	enet_iface_t	*is;
+	int		fd;		// our end of the socketpair
+	int		async_hid;
+	int		tick_id;
+	int		tick_armed;
+
+	tcp_port_t	*tcp_hash[ TCP_HASH_SIZE ];
+	udp_port_t	*udp_hash[ UDP_HASH_SIZE ];
+	gen_port_t	*fd_hash[ FD_HASH_SIZE ];
+	int		n_tcp, n_udp;
+
+	u32		dns_ip;		// host resolver
+	u16		next_packet_id;
+	u32		next_tcp_isn;
+
+	/* packets to MacOS, sent as a batch */
+	struct {
+		char	buf[ MAX_PACKET_BATCH ][ IP_PACKET_SIZE ];
+		int	len[ MAX_PACKET_BATCH ];
+		int	head, cnt;
+		int	blocked;	// socketpair full, waiting for POLLOUT
+
+		/* RSTs queued while buf is full; sent after it */
+		char	ctl_buf[ CTL_QUEUE_SIZE ][ IP_HLEN + TCP_HLEN ];
+		int	ctl_len[ CTL_QUEUE_SIZE ];
+		int	ctl_cnt;
+	} tx;
+	char		rx_buf[ MAX_PACKET_BATCH ][ IP_PACKET_SIZE ];
+
+	struct {
+		ullong	tcp_in, tcp_out, tcp_rexmt, tcp_timeouts, tcp_ooo;
+		ullong	udp_in, udp_out, udp_dropped;
+		ullong	dropped;
+	} stats;
 } ip_state_t;
 
 static ip_state_t 	ip[1];
 static int 		use_count = 0;
 
-static void 		handle_tcp_packet( struct iphdr *iph, struct tcphdr *tcph, int tcp_size );
-static void		handle_udp_packet( struct iphdr *iph, struct udphdr *h, int udp_size );
-static void		handle_arp_packet( const struct ethhdr *eh, int total_size, void *enetif );
 static void 		rx_udp( int fd, int events );
 static void 		rx_tcp( int fd, int events );
+static void		tcp_output( tcp_port_t *tp );
+static void		send_synack( tcp_port_t *tp );
+static void		tcp_drop( tcp_port_t *tp, int notify_mac );
 static void 		destroy_tcp_port( tcp_port_t *tp );
-static void 		destroy_udp_port( udp_port_t *tp );
+static void 		destroy_udp_port( udp_port_t *up );
 
 
 /************************************************************************/
-/*	Init / Cleanup							*/
+/*	Helpers								*/
 /************************************************************************/
 
-void
-ip_init( void )
-{	
-	if( use_count++ > 0 )
-		return;
-
-	memset( &ip[0], 0, sizeof(ip));
-
-	// Initial IDs. Should perhaps be randomized
-	ip->next_packet_id = 0;
-	ip->next_tcp_isn = 0x1000;
+static inline uint
+get_ms( void )
+{
+	struct timespec ts;
 
-	// TCP Handlers
-	memset( tcp_handlers, 0, sizeof(tcp_handlers));
-	tcp_handlers[ kCLOSED ] = tcph_closed;
-	tcp_handlers[ kSYN_RCVD ] = tcph_syn_rcvd;
-	tcp_handlers[ kESTABLISHED ] = tcph_established;
-	tcp_handlers[ kCLOSE_WAIT ] = tcph_close_wait;
-	tcp_handlers[ kLAST_ACK ] = tcph_last_ack;
-	tcp_handlers[ kFIN_WAIT_2 ] = tcph_fin_wait_2;
-	tcp_handlers[ kFIN_WAIT_1 ] = tcph_fin_wait_1;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void
-ip_cleanup( void )
+/* zero means 'inactive' */
+static inline uint
+deadline( int ms )
 {
-	if( --use_count != 0)
-		return;
-	
-	while( ip->tcp_root )
-		destroy_tcp_port( ip->tcp_root );
-	while( ip->udp_root )
-		destroy_udp_port( ip->udp_root );
+	uint t = get_ms() + ms;
+	return t ? t : 1;
 }
 
+/* one's complement sum of big endian 16-bit words */
+static u32
+csum_add( u32 sum, const u8 *p, int len )
+{
+	ullong s = sum;
+	u32 w;
 
-/************************************************************************/
-/*	Verbose							       	*/
-/************************************************************************/
+	for( ; len >= 4; len -= 4, p += 4 ) {
+		memcpy( &w, p, 4 );
+		s += ntohl( w );
+	}
+	if( len >= 2 ) {
+		s += (p[0] << 8) | p[1];
+		len -= 2;
+		p += 2;
+	}
+	if( len )
+		s += p[0] << 8;
 
-#define C_RED           "\33[1;31m"
-#define C_GREEN         "\33[1;32m"
-#define C_YELLOW        "\33[1;33m"
-#define C_NORMAL        "\33[0;39m"
+	s = (s & 0xffffffff) + (s >> 32);
+	s = (s & 0xffffffff) + (s >> 32);
+	return s;
+}
 
-static void 
-print_ipaddr( long addr )
+/* TCP/UDP checksum (pseudo header included) */
+static u16
+l4_csum( u32 saddr, u32 daddr, int protocol, const u8 *p, int len )
 {
-	printm("%ld.%ld.%ld.%ld", (addr>>24) & 0xff, (addr>>16) & 0xff,
-	       (addr>>8)& 0xff, addr & 0xff );
+	u32 sum = (saddr >> 16) + (saddr & 0xffff) + (daddr >> 16) + (daddr & 0xffff) + protocol + len;
+
+	sum = csum_add( sum, p, len );
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
 }
 
 static void
-print_tcp_packet( int to_mac, tcp_port_t *tp, struct iphdr *ip )
+build_ip_header( char *p, int protocol, u32 saddr, u32 daddr, int datalen )
 {
-	int seq, ack_seq;
-	struct tcphdr *h = (struct tcphdr*)((char*)ip + ip->ihl*4);
-
-#if 1
-	return;
-#endif
-	printm( to_mac ? C_RED : C_GREEN );
-	printm("%s: ", to_mac? "=> MAC" : "<= MAC" );
-	print_ipaddr( ip->saddr );
-	printm(" %d -> ", h->source );
-	print_ipaddr( ip->daddr );
-	printm(" %d: ", h->dest);
-
-	seq = h->seq;
-	ack_seq = h->ack_seq;
-	if( tp ){
-		if( to_mac ) {
-			seq -= tp->mol_isn;
-			ack_seq -= tp->mac_isn;
-		} else {
-			seq -= tp->mac_isn;
-			ack_seq -= tp->mol_isn;
-		}
-	}
-	printm(" %4d (%4d)", seq, ip->tot_len - (ip->ihl*4) - (h->doff)*4 );
-	if( h->ack )
-		printm(" %d", ack_seq );
-	printm("%s%s%s%s%s%s",
-	       h->ack? " ACK" : "",
-	       h->rst? " RST" : "",
-	       h->urg? " URG" : "",
-	       h->psh? " PSH" : "",
-	       h->fin? " FIN" : "",
-	       h->syn? " SYN" : "");
-	printm( C_NORMAL );
-	printm("\n");
+	ip_header_t *ipp = (ip_header_t*)p;
+
+	ipp->version = 4;
+	ipp->hlen = IP_HLEN / 4;
+	ipp->tos = 0;
+	ipp->totlen = htons( IP_HLEN + datalen );
+	ipp->id = htons( ip->next_packet_id++ );
+	ipp->frag_offs = htons( 0x4000 );		/* DF */
+	ipp->ttl = 64;
+	ipp->protocol = protocol;
+	ipp->saddr = htonl( saddr );
+	ipp->daddr = htonl( daddr );
+	ipp->checksum = 0;
+	ipp->checksum = ip_fast_csum( (u8*)ipp, ipp->hlen );
 }
 
-/************************************************************************/
-/*	Transmit side						       	*/
-/************************************************************************/
-
-int 
-tx_packet_hook( char *p, int size, void *enetif )
+/* no broadcasts, multicasts or loopback addresses */
+static int
+valid_dest( u32 addr )
 {
-	struct ethhdr *eh = (struct ethhdr*)p;
-	struct iphdr *iph;
-	int offs;
+	return addr && addr != 0xffffffff && addr != ip->is->broadcast_ip
+		&& (addr >> 28) != 0xe && (addr >> 24) != 127;
+}
 
-	// We handle ARP & IP
-	if( eh->h_proto == ETH_P_ARP ){
-		handle_arp_packet( eh, size, enetif );
-		return 1;
-	}
+/* host address of a MacOS destination */
+static u32
+map_addr( u32 addr, int port, int is_udp )
+{
+	if( addr != ip->is->my_ip )
+		return addr;
+	if( is_udp && port == 53 )
+		return ip->dns_ip;
+	return INADDR_LOOPBACK;
+}
 
-	if( eh->h_proto != ETH_P_IP )
-		return 0;
-	iph = (struct iphdr*)(p + sizeof(struct ethhdr));
-
-	if( iph->frag_off & 0x1fff)
-		printm("Fragmented package %X!\n", iph->frag_off);
-
-	// offset to TCP / UDP header
-	offs = sizeof(struct ethhdr) + 4*iph->ihl;
-	
-	// XXX: detect mac-interface changes
-
-	// We assume only one interface uses IP
-	ip->enetif = enetif;
-	ip->mac_ip = iph->saddr;
-
-	if( iph->protocol == IPPROTO_TCP ) {
-		handle_tcp_packet( iph, (struct tcphdr*)(p+offs), size-offs );
-	} else if( iph->protocol == IPPROTO_UDP ) {
-		printm("IP from "); print_ipaddr( iph->saddr );
-		printm(" to "); print_ipaddr( iph->daddr ); printm("  ");
-		handle_udp_packet( iph, (struct udphdr*)(p+offs), size-offs );
-		printm("\n");
-	} else {
-		printm("Unknown IP packet type received\n");
+static u32
+lookup_resolver( void )
+{
+	unsigned int a, b, c, d;
+	u32 addr = INADDR_LOOPBACK;
+	char buf[256];
+	FILE *f;
+
+	if( (f=fopen("/etc/resolv.conf", "r")) ) {
+		while( fgets(buf, sizeof(buf), f) )
+			if( sscanf(buf, " nameserver %u.%u.%u.%u", &a, &b, &c, &d) == 4 ) {
+				addr = (a << 24) | (b << 16) | (c << 8) | d;
+				break;
+			}
+		fclose( f );
 	}
-	return 1;
+	return addr;
 }
 
+
 /************************************************************************/
-/*	ARP protocol							*/
+/*	Packets to MacOS						*/
 /************************************************************************/
 
-static void
-handle_arp_packet( const struct ethhdr *eh, int size, void *enetif )
+/* returns non-zero if MacOS is not draining the socketpair */
+static int
+flush_tx( void )
 {
-	struct eth_arphdr *h = (struct eth_arphdr*)((char*)eh + sizeof(struct ethhdr));
-	char reply[ sizeof(struct ethhdr) + sizeof(struct eth_arphdr) ];
-	struct eth_arphdr *rh = (void*)&reply[sizeof(struct ethhdr)];
-	struct ethhdr *reh = (void*)&reply;
+	struct mmsghdr msgs[ MAX_PACKET_BATCH + CTL_QUEUE_SIZE ];
+	struct iovec iov[ MAX_PACKET_BATCH + CTL_QUEUE_SIZE ];
+	int i, j, n, total = ip->tx.cnt + ip->tx.ctl_cnt;
 
-	if( size != sizeof(struct eth_arphdr) + sizeof(struct ethhdr) ) {
-		printm("Bad arp packet (size = %d)!\n", size);
-		return;
+	if( !total )
+		return 0;
+
+	memset( msgs, 0, sizeof(msgs[0]) * total );
+	for( i=0; i<ip->tx.cnt; i++ ) {
+		j = (ip->tx.head + i) % MAX_PACKET_BATCH;
+		iov[i].iov_base = ip->tx.buf[j];
+		iov[i].iov_len = ip->tx.len[j];
 	}
-	if( h->ar_hrd != ARPHRD_ETHER || h->ar_pro != 0x800 || h->ar_pln != 4 || h->ar_hln != 6 ){
-		printm("Bad arp packet\n");
-		return;
+	for( j=0; j<ip->tx.ctl_cnt; i++, j++ ) {
+		iov[i].iov_base = ip->tx.ctl_buf[j];
+		iov[i].iov_len = ip->tx.ctl_len[j];
 	}
-	if( h->ar_op != ARPOP_REQUEST ) {
-		printm("Unimplemented ARP operation %d\n", h->ar_op );
-		return;
+	for( i=0; i<total; i++ ) {
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
 	}
-	if( *(ulong*)h->ar_sip == 0 ) {
-		// printm("ARP: MacOS tries to find its IP\n");
-		// MacOS is trying to see if its own IP is free (it is)
-		return;
+	if( (n=sendmmsg(ip->fd, msgs, total, MSG_DONTWAIT)) < 0 ) {
+		n = 0;
+		if( errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS ) {
+			perrorm("usernet");
+			n = total;
+		}
 	}
-	if( *(ulong*)h->ar_tip == *(ulong*)h->ar_sip ) {
-		// printm("Gratious ARP\n");
-		return;
+	i = MIN( n, ip->tx.cnt );
+	ip->tx.head = (ip->tx.head + i) % MAX_PACKET_BATCH;
+	ip->tx.cnt -= i;
+	if( (n -= i) ) {
+		ip->tx.ctl_cnt -= n;
+		memmove( ip->tx.ctl_buf[0], ip->tx.ctl_buf[n], ip->tx.ctl_cnt * sizeof(ip->tx.ctl_buf[0]) );
+		memmove( &ip->tx.ctl_len[0], &ip->tx.ctl_len[n], ip->tx.ctl_cnt * sizeof(int) );
 	}
 
-	// Don't modify eh
-	*rh = *h;
-	*(ulong*)rh->ar_sip = *(ulong*)h->ar_tip;
-	*(ulong*)rh->ar_tip = *(ulong*)h->ar_sip;
-	*(short*)&rh->ar_tha[4] = *(short*)&h->ar_sha[4];
-	*(ulong*)rh->ar_tha = *(ulong*)h->ar_sha;
+	if( !ip->tx.cnt && !ip->tx.ctl_cnt )
+		return 0;
+	if( !ip->tx.blocked ) {
+		ip->tx.blocked = 1;
+		set_async_handler_events( ip->async_hid, POLLIN | POLLOUT );
+	}
+	return 1;
+}
 
-	copy_fake_eth_addr( reh->h_source );
-	copy_fake_eth_addr( rh->ar_sha );
-	
-	reh->h_proto = ETH_P_ARP;
-	rh->ar_op = ARPOP_REPLY;
+static char *
+get_txbuf( void )
+{
+	if( ip->tx.cnt == MAX_PACKET_BATCH && flush_tx() )
+		return NULL;
+	return ip->tx.buf[ (ip->tx.head + ip->tx.cnt) % MAX_PACKET_BATCH ];
+}
 
-	if( synthesize_eth_packet( reply, sizeof(reply), enetif )){
-		printm("synthesize_eth_packet error\n");
-	}
+static inline void
+queue_tx( int len )
+{
+	ip->tx.len[ (ip->tx.head + ip->tx.cnt) % MAX_PACKET_BATCH ] = len;
+	ip->tx.cnt++;
+}
+
+/* The RST of a dropped connection (or to a segment without one) is never
+ * retransmitted; when the socketpair is full it goes to a small reserved queue.
+ */
+static char *
+get_ctlbuf( void )
+{
+	return (ip->tx.ctl_cnt < CTL_QUEUE_SIZE) ? ip->tx.ctl_buf[ ip->tx.ctl_cnt ] : NULL;
+}
+
+static inline void
+queue_ctl( int len )
+{
+	ip->tx.ctl_len[ ip->tx.ctl_cnt++ ] = len;
 }
 
 
@@ -330,522 +416,919 @@ handle_arp_packet( const struct ethhdr *eh, int size, void *enetif )
 /*	Port allocation							*/
 /************************************************************************/
 
-#define bind_tcp_port(portnum)	((tcp_port_t*)bind_port(portnum,0))
-#define bind_udp_port(portnum)	((udp_port_t*)bind_port(portnum,1))
+static inline int
+tcp_hash( int mac_port, u32 remote_ip, int remote_port )
+{
+	return (mac_port ^ remote_port ^ remote_ip ^ (remote_ip >> 16)) & (TCP_HASH_SIZE - 1);
+}
+
+static tcp_port_t *
+lookup_tcp( int mac_port, u32 remote_ip, int remote_port )
+{
+	tcp_port_t *tp = ip->tcp_hash[ tcp_hash(mac_port, remote_ip, remote_port) ];
+
+	for( ; tp; tp=tp->next )
+		if( tp->mac_port == mac_port && tp->remote_port == remote_port && tp->remote_ip == remote_ip )
+			break;
+	return tp;
+}
+
+static udp_port_t *
+lookup_udp( int mac_port )
+{
+	udp_port_t *up = ip->udp_hash[ mac_port & (UDP_HASH_SIZE - 1) ];
+
+	for( ; up && up->mac_port != mac_port; up=up->next )
+		;
+	return up;
+}
 
 static gen_port_t *
-bind_port( int portnum, int is_udp )
+lookup_fd( int fd )
 {
-	struct sockaddr_in saddr;
-	gen_port_t *up;
-	int hid=-1;
-	int sfd;
+	gen_port_t *gp = ip->fd_hash[ fd & (FD_HASH_SIZE - 1) ];
 
-	// assertion: portnum not in the linked list
+	for( ; gp && gp->sfd != fd; gp=gp->fd_next )
+		;
+	return gp;
+}
 
-	if( portnum && portnum < 1024 ){
-#if 0
-		printm("Refusing to bind TCP/UDP port below 1024\n");
-		return NULL;
-#else
-		printm("Warning: binding TCP/UDP port below 1024\n");
-#endif
-	}
-	if( (sfd = socket(PF_INET, is_udp? SOCK_DGRAM : SOCK_STREAM, 0)) < 0 ) {
-		perrorm("opening UDP socket:\n");
-		return NULL;
-	}
-	saddr.sin_family = AF_INET;
-	saddr.sin_port = portnum;
-	saddr.sin_addr.s_addr = INADDR_ANY;
+static gen_port_t *
+bind_port( int portnum, int is_udp, size_t size )
+{
+	struct sockaddr_in saddr;
+	gen_port_t *gp, **pp;
+	int hid, sfd, one=1;
 
-	if( bind( sfd, &saddr, sizeof(saddr)) < 0 ){
-		perrorm("binding port %d:\n", portnum);
-		close(sfd);
+	if( (sfd=socket(PF_INET, is_udp ? SOCK_DGRAM : SOCK_STREAM, 0)) < 0 ) {
+		perrorm("usernet socket");
 		return NULL;
 	}
+	fcntl( sfd, F_SETFD, FD_CLOEXEC );
+	fcntl( sfd, F_SETFL, O_NONBLOCK );
+
+	if( is_udp ) {
+		/* keep the mac port# if possible, otherwise the kernel picks one */
+		memset( &saddr, 0, sizeof(saddr) );
+		saddr.sin_family = AF_INET;
+		saddr.sin_port = htons( portnum );
+		saddr.sin_addr.s_addr = INADDR_ANY;
+		if( portnum >= 1024 )
+			bind( sfd, (struct sockaddr*)&saddr, sizeof(saddr) );
+	} else {
+		/* MacOS does its own Nagle */
+		setsockopt( sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+	}
 
-	// Start the async handler
-	if( is_udp )
-		hid = add_async_handler( sfd, POLLIN, rx_udp, 1 /* sigio capable*/ );
-	else
-		hid = add_async_handler( sfd, 0 /* no events yet */, rx_tcp, 0 );
-
-	if( hid < 0 ){
-		printm("Could not register async UDP handler!\n");
-		close(sfd);
+	if( (hid=add_async_handler(sfd, is_udp ? POLLIN : 0, is_udp ? rx_udp : rx_tcp, 0)) < 0 ) {
+		printm("Could not register async handler!\n");
+		close( sfd );
 		return NULL;
 	}
-
-	// Insert in linked list and register 
-	up = calloc( 1, is_udp ? sizeof(udp_port_t) : sizeof(tcp_port_t) );
-	up->sfd = sfd;
-	up->port = portnum;
-	up->async_hid = hid;
-	
-	up->next = is_udp? (gen_port_t*)ip->udp_root : (gen_port_t*)ip->tcp_root;
-	*(is_udp? (gen_port_t**)&ip->udp_root : (gen_port_t**)&ip->tcp_root) = up;
-
-	// up->mac_port = portnum;	/* callee responsibility */
-	return up;
+	gp = calloc( 1, size );
+	gp->sfd = sfd;
+	gp->async_hid = hid;
+
+	pp = &ip->fd_hash[ sfd & (FD_HASH_SIZE - 1) ];
+	gp->fd_next = *pp;
+	*pp = gp;
+	return gp;
 }
 
-
 static void
-destroy_port( gen_port_t *tp, gen_port_t **rootp )
+close_socket( gen_port_t *gp )
 {
 	gen_port_t **pp;
-	int found=0;
-	
-	printm("Destroying port %d\n", tp->mac_port );
-	for( pp=rootp; *pp; pp=&(**pp).next )
-		if( *pp == tp ) {
-			found=1;
-			*pp = tp->next;
-			
-			delete_async_handler( tp->async_hid );
-			close(tp->sfd );
-			free( tp );
-			return;
+
+	if( gp->sfd < 0 )
+		return;
+	for( pp=&ip->fd_hash[ gp->sfd & (FD_HASH_SIZE - 1) ]; *pp; pp=&(**pp).fd_next )
+		if( *pp == gp ) {
+			*pp = gp->fd_next;
+			break;
 		}
-	printm("Internal error: destroy_tcp_port\n");
+	delete_async_handler( gp->async_hid );
+	close( gp->sfd );
+	gp->sfd = -1;
 }
 
 static void
 destroy_udp_port( udp_port_t *up )
 {
-	destroy_port( (gen_port_t*)up, (gen_port_t**)&ip->udp_root );
+	udp_port_t **pp;
+
+	for( pp=&ip->udp_hash[ up->mac_port & (UDP_HASH_SIZE - 1) ]; *pp; pp=&(**pp).next )
+		if( *pp == up ) {
+			*pp = up->next;
+			break;
+		}
+	close_socket( (gen_port_t*)up );
+	free( up );
+	ip->n_udp--;
 }
 
-static void 
+static void
 destroy_tcp_port( tcp_port_t *tp )
 {
-	destroy_port( (gen_port_t*)tp, (gen_port_t**)&ip->tcp_root );
+	tcp_port_t **pp;
+
+	for( pp=&ip->tcp_hash[ tcp_hash(tp->mac_port, tp->remote_ip, tp->remote_port) ]; *pp; pp=&(**pp).next )
+		if( *pp == tp ) {
+			*pp = tp->next;
+			break;
+		}
+	close_socket( (gen_port_t*)tp );
+	free( tp->sbuf );
+	free( tp );
+	ip->n_tcp--;
 }
 
 
 /************************************************************************/
-/*	IP header							*/
+/*	TCP timers							*/
 /************************************************************************/
 
-/* tlen is #bytes data (EXCLUDING the ip header!) */
-static inline void
-build_eth_ip_header(struct ethhdr *eh, int datalen, ulong saddr, int protocol )
+static void
+arm_tick( void )
+{
+	if( !ip->tick_armed ) {
+		ip->tick_armed = 1;
+		resume_ptimer( ip->tick_id );
+	}
+}
+
+static void
+tcp_rtt( tcp_port_t *tp, int rtt )
+{
+	int delta;
+
+	tp->rtt_time = 0;
+	if( !tp->srtt ) {
+		tp->srtt = (rtt << 3) + 1;
+		tp->rttvar = rtt << 1;
+	} else {
+		delta = rtt - (tp->srtt >> 3);
+		tp->srtt += delta;
+		if( delta < 0 )
+			delta = -delta;
+		tp->rttvar += delta - (tp->rttvar >> 2);
+	}
+	tp->rto = MAX( TCP_RTO_MIN, (tp->srtt >> 3) + tp->rttvar );
+}
+
+/* returns 1 if the port was destroyed */
+static int
+tcp_timers( tcp_port_t *tp, uint now )
 {
-	struct iphdr *iph = (struct iphdr*)((char*)eh + sizeof(struct ethhdr));
+	if( tp->tw_time && TIME_GEQ(now, tp->tw_time) && !tp->rb_len ) {
+		destroy_tcp_port( tp );
+		return 1;
+	}
+	if( tp->delack_time && TIME_GEQ(now, tp->delack_time) ) {
+		tp->delack_time = 0;
+		if( tp->flags & TF_DELACK )
+			tp->flags |= TF_ACKNOW;
+	}
+	if( tp->rexmt_time && TIME_GEQ(now, tp->rexmt_time) ) {
+		if( !tp->snd_wnd && tp->state != kSYN_RCVD ) {
+			/* closed window, probe it forever */
+			if( tp->rxtshift < TCP_MAXRXTSHIFT )
+				tp->rxtshift++;
+			tp->flags |= TF_FORCE;
+		} else if( ++tp->rxtshift > TCP_MAXRXTSHIFT ) {
+			tcp_drop( tp, 1 );
+			return 1;
+		}
+		ip->stats.tcp_timeouts++;
 
-	// Ethernet header
-	eh->h_proto = ETH_P_IP;
-	copy_fake_eth_addr( eh->h_source );
+		/* go back N; Karn: retransmissions are not timed */
+		tp->snd_nxt = tp->snd_una;
+		tp->rtt_time = 0;
+		tp->dupacks = 0;
+		tp->rexmt_time = deadline( MIN(tp->rto << tp->rxtshift, TCP_RTO_MAX) );
 
-	// IP header
-	memset(iph, 0, sizeof(struct iphdr));
-	iph->version = 4;
-	iph->ihl = sizeof(struct iphdr) / 4;
-	iph->tot_len = datalen + sizeof(struct iphdr);
-	iph->id = ip->next_packet_id++;
-	iph->ttl = 20;
-	iph->saddr = saddr;
-	iph->daddr = ip->mac_ip;
-	iph->protocol = protocol;
-	// iph->check = 0;
+		if( tp->state == kSYN_RCVD )
+			send_synack( tp );
+	}
+	tcp_output( tp );
+	return 0;
+}
 
-	// XXX: Tune these fields later 
-	// iph->tos = 0;
-	// iph->frag_off = 0;
+static void
+tcp_tick( int id, void *usr, int info )
+{
+	tcp_port_t *tp, *next;
+	uint now = get_ms();
+	int i, pending = 0;
+
+	ip->tick_armed = 0;
+	for( i=0; i<TCP_HASH_SIZE; i++ )
+		for( tp=ip->tcp_hash[i]; tp; tp=next ) {
+			next = tp->next;
+			if( !tcp_timers(tp, now) )
+				pending |= tp->rexmt_time | tp->delack_time | tp->tw_time;
+		}
+	flush_tx();
+
+	if( pending )
+		arm_tick();
 }
 
+
 /************************************************************************/
-/*	TCP protocol							*/
+/*	TCP output							*/
 /************************************************************************/
 
-#define	SIZEOF_HEADERS_TCP	(sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct tcphdr))
+static inline int
+rcv_window( tcp_port_t *tp )
+{
+	return MIN( RCVBUF_SIZE - tp->rb_len, 0xffff );
+}
 
-static int 
-send_tcp( tcp_port_t *tp, int flags, char *tcpdata, int datalen )
+/* seq is the sequence number of the data found at offset off in sbuf */
+static int
+send_tcp( tcp_port_t *tp, int flags, u32 seq, int off, int len )
 {
-	char buf[ ETH_FRAME_LEN + 2 ];
-	struct ethhdr *eh = (struct ethhdr*)&buf[2];
-	struct iphdr *iph = (struct iphdr*)((char*)eh + sizeof(struct ethhdr));
-	struct tcphdr *th = (struct tcphdr*)((char*)iph + sizeof(struct iphdr));
-	unsigned int checksum;
+	tcp_header_t *th;
+	int n, win, optlen = 0, ctl = 0;
+	char *p;
+	u8 *opt;
+
+	if( !(p=get_txbuf()) ) {
+		/* a RST has no options or data */
+		if( !(flags & TH_RST) || !(p=get_ctlbuf()) )
+			return 1;
+		ctl = 1;
+	}
+	th = (tcp_header_t*)(p + IP_HLEN);
+	opt = (u8*)th + TCP_HLEN;
+
+	if( flags & TH_SYN ) {
+		opt[0] = 2;			/* MSS */
+		opt[1] = 4;
+		opt[2] = TCP_MAX_MSS >> 8;
+		opt[3] = TCP_MAX_MSS & 0xff;
+		optlen = 4;
+		if( tp->flags & TF_WSCALE ) {
+			opt[4] = 1;		/* NOP */
+			opt[5] = 3;		/* window scale 0 (we never need more than 64K) */
+			opt[6] = 3;
+			opt[7] = 0;
+			optlen = 8;
+		}
+	}
+	if( len ) {
+		int start = (tp->sb_start + off) & (SNDBUF_SIZE - 1);
+		n = MIN( len, SNDBUF_SIZE - start );
+		memcpy( opt + optlen, tp->sbuf + start, n );
+		memcpy( opt + optlen + n, tp->sbuf, len - n );
+	}
+	win = rcv_window( tp );
+
+	th->sport = htons( tp->remote_port );
+	th->dport = htons( tp->mac_port );
+	th->seq = htonl( seq );
+	th->ack = (flags & TH_ACK) ? htonl( tp->rcv_nxt ) : 0;
+	th->doff = ((TCP_HLEN + optlen) / 4) << 4;
+	th->flags = flags;
+	th->window = htons( win );
+	th->urg_ptr = 0;
+	th->checksum = 0;
 
-	// NOTE: all fields in tp are not valid when called by send_tcp_nonconnected()
-	assert( datalen + SIZEOF_HEADERS_TCP <= ETH_FRAME_LEN, "send_tcp: datalen too big\n");
+	n = TCP_HLEN + optlen + len;
+	th->checksum = htons( l4_csum(tp->remote_ip, tp->mac_ip, PROT_TCP, (u8*)th, n) );
+	build_ip_header( p, PROT_TCP, tp->remote_ip, tp->mac_ip, n );
+	if( ctl )
+		queue_ctl( IP_HLEN + n );
+	else
+		queue_tx( IP_HLEN + n );
 
-	// Build IP header
-	build_eth_ip_header( eh, datalen + sizeof(struct tcphdr), tp->remote_ip, 6 );
-	iph->check = ip_fast_csum( (char*)iph, iph->ihl );
+	tp->rcv_adv = tp->rcv_nxt + win;
+	ip->stats.tcp_out++;
+	return 0;
+}
 
-	// Build TCP header
-	tcp_flag_word(th) = flags;	// Do first: overwrites other fields
-	th->source = tp->remote_port;
-	th->dest = tp->mac_port;
-	th->window = 4096;		// XXX: Tune later
-	th->urg_ptr = 0;
-	th->doff = sizeof(struct tcphdr) / 4;
+static void
+send_synack( tcp_port_t *tp )
+{
+	send_tcp( tp, TH_SYN | TH_ACK, tp->iss, 0, 0 );
 
-	th->seq = tp->mol_isn + tp->n_sent;
-	th->ack_seq = tp->mac_isn + tp->n_rcvd;
+	if( !tp->rxtshift ) {
+		tp->rtt_time = deadline( 0 );
+		tp->rtt_seq = tp->iss;
+	}
+	if( !tp->rexmt_time )
+		tp->rexmt_time = deadline( tp->rto );
+	arm_tick();
+}
 
-	// Copy TCP data
-	memcpy( (char*)th + sizeof(struct tcphdr), tcpdata, datalen );
+static void
+tcp_output( tcp_port_t *tp )
+{
+	int off, len, win, flags;
 
-	// Calculate TCP checksum
-	th->check = 0;
-	checksum = csum_partial( (char*)th, sizeof(struct tcphdr) + datalen, 0 );
-	th->check = csum_tcpudp_magic( ip->mac_ip, tp->remote_ip, sizeof(struct tcphdr) + datalen, 
-				       6 /* proto */, checksum );
+	if( tp->state == kCONNECTING || tp->state == kSYN_RCVD )
+		return;
 
-	// Done... send it!
-	print_tcp_packet( 1, tp, iph );
+	for( ;; ) {
+		win = tp->snd_wnd;
+		if( !win && (tp->flags & TF_FORCE) )
+			win = 1;
+		off = tp->snd_nxt - tp->snd_una;
+		len = MIN( tp->sb_len, win ) - off;
+		len = MAX( 0, MIN(len, tp->mss) );
+
+		/* avoid the silly window syndrome */
+		if( len < tp->mss && off + len < tp->sb_len && len < win / 2 )
+			len = 0;
+
+		flags = TH_ACK;
+		if( (tp->flags & TF_SNDFIN) && off + len == tp->sb_len )
+			flags |= TH_FIN;
+		if( !len && !(flags & TH_FIN) && !(tp->flags & TF_ACKNOW) )
+			break;
+		if( len && off + len == tp->sb_len )
+			flags |= TH_PSH;
 
-	if( synthesize_eth_packet( (char*)eh, datalen + SIZEOF_HEADERS_TCP, ip->enetif )){
-		printm("synthesize_eth_packet error\n");
-	} else {
-		tp->n_sent += datalen;
+		if( send_tcp(tp, flags, tp->snd_nxt, off, len) )
+			break;
+
+		if( len && tp->snd_nxt == tp->snd_max && !tp->rtt_time ) {
+			tp->rtt_time = deadline( 0 );
+			tp->rtt_seq = tp->snd_nxt;
+		}
+		if( SEQ_LT(tp->snd_nxt, tp->snd_max) )
+			ip->stats.tcp_rexmt++;
+
+		tp->snd_nxt += len + ((flags & TH_FIN) ? 1 : 0);
+		if( SEQ_GT(tp->snd_nxt, tp->snd_max) )
+			tp->snd_max = tp->snd_nxt;
+		tp->flags &= ~(TF_ACKNOW | TF_DELACK | TF_FORCE);
+		tp->delack_time = 0;
+
+		if( tp->snd_max != tp->snd_una && !tp->rexmt_time ) {
+			tp->rexmt_time = deadline( tp->rto );
+			arm_tick();
+		}
+	}
+
+	/* data is waiting for a closed window */
+	if( tp->sb_len && !tp->snd_wnd && !tp->rexmt_time ) {
+		tp->rexmt_time = deadline( tp->rto );
+		arm_tick();
 	}
-	return 0;
 }
 
-static int
-send_tcp_nonconnected( int remote_ip, int remote_port, int flags )
-{
-	tcp_port_t dummy_port;
 
-	memset( &dummy_port, 0, sizeof(dummy_port) );
-	dummy_port.remote_ip = remote_ip;
-	dummy_port.remote_port = remote_port;
-	return send_tcp( &dummy_port, flags, NULL, 0 );
-}
+/************************************************************************/
+/*	Host socket side						*/
+/************************************************************************/
 
+static void
+update_events( tcp_port_t *tp )
+{
+	int ev = 0;
 
-enum{ TCPH_NOERR=0, TCPH_RESET, TCPH_AGAIN, TCPH_IGNORE };
+	if( tp->sfd < 0 )
+		return;
+	if( tp->state == kCONNECTING ) {
+		ev = POLLOUT;
+	} else {
+		if( !(tp->flags & TF_EOF) && tp->sb_len < SNDBUF_SIZE )
+			ev |= POLLIN;
+		if( tp->rb_len )
+			ev |= POLLOUT;
+	}
+	if( ev != tp->events ) {
+		tp->events = ev;
+		set_async_handler_events( tp->async_hid, ev );
+	}
+}
 
 static void
-handle_tcp_packet( struct iphdr *iph, struct tcphdr *h, int size )
+tcp_drop( tcp_port_t *tp, int notify_mac )
 {
-	tcp_port_t *tp;
+	struct linger lin = { 1, 0 };
+
+	/* SO_LINGER makes close send a RST */
+	if( tp->sfd >= 0 )
+		setsockopt( tp->sfd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin) );
+	if( notify_mac ) {
+		if( tp->state == kCONNECTING )
+			send_tcp( tp, TH_RST | TH_ACK, 0, 0, 0 );
+		else
+			send_tcp( tp, TH_RST | TH_ACK, tp->snd_nxt, 0, 0 );
+	}
+	destroy_tcp_port( tp );
+}
 
-	// XXX: Check that size is large enough
+/* write pending MacOS data to the socket; returns 1 if the port was destroyed */
+static int
+flush_rbuf( tcp_port_t *tp )
+{
+	struct iovec iov[2];
+	struct msghdr mh;
+	int n;
 
-	// Find TCP connection
-	for( tp = ip->tcp_root; tp; tp=tp->next )
-		if( tp->mac_port == h->source )
-			break;
-	print_tcp_packet( 0, tp, iph );
-
-	// Handle RST packets
-	if( h->rst ){
-		if( tp ) {
-			struct linger lin = {1,0};
-			/* By using the SO_LINGER a RST is sent upon close */
-			if( setsockopt( tp->sfd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin) ) < 0 )
-				perrorm("setsockopt, SO_LINGER");
-			destroy_tcp_port(tp);
-			return;
+	if( tp->sfd < 0 )
+		return 0;
+
+	while( tp->rb_len ) {
+		iov[0].iov_base = tp->rbuf + tp->rb_start;
+		iov[0].iov_len = MIN( tp->rb_len, RCVBUF_SIZE - tp->rb_start );
+		iov[1].iov_base = tp->rbuf;
+		iov[1].iov_len = tp->rb_len - iov[0].iov_len;
+
+		memset( &mh, 0, sizeof(mh) );
+		mh.msg_iov = iov;
+		mh.msg_iovlen = 2;
+		if( (n=sendmsg(tp->sfd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 ) {
+			if( errno == EAGAIN || errno == EINTR )
+				break;
+			tcp_drop( tp, 1 );
+			return 1;
 		}
+		tp->rb_start = (tp->rb_start + n) & (RCVBUF_SIZE - 1);
+		tp->rb_len -= n;
 	}
 
-	if( !tp ){
-		if( !h->syn ){
-			printm("Not-SYN packet to nonexistent port\n");
-			send_tcp_nonconnected( iph->saddr, h->source, TCP_FLAG_RST );
-			return;
+	if( !tp->rb_len ) {
+		if( (tp->flags & TF_RCVDFIN) && !(tp->flags & TF_SHUTWR) ) {
+			shutdown( tp->sfd, SHUT_WR );
+			tp->flags |= TF_SHUTWR;
 		}
-		if( h->syn ){
-			if( !(tp=bind_tcp_port(h->source)) && !(tp=bind_tcp_port(0)) ) {
-				printm("Failed to allocate TCP port!\n");
-				send_tcp_nonconnected( iph->saddr, h->source, TCP_FLAG_RST );
-				return;
-			}
-			tp->state = kCLOSED;
+		/* both directions are done */
+		if( tp->state == kTIME_WAIT ) {
+			close_socket( (gen_port_t*)tp );
+			free( tp->sbuf );
+			tp->sbuf = tp->rbuf = NULL;
+			return 0;
 		}
 	}
+	/* window update once the window has opened by two segments */
+	if( (int)(tp->rcv_nxt + rcv_window(tp) - tp->rcv_adv) >= 2 * tp->mss )
+		tp->flags |= TF_ACKNOW;
+	return 0;
+}
 
-	for( ;; ) {
-		int ret;
-		if( !tcp_handlers[tp->state] ) {
-			printm("Tcp handler %d unimplemented\n", tp->state );
-			break;
+/* returns 1 if the port was destroyed */
+static int
+read_host( tcp_port_t *tp )
+{
+	struct iovec iov[2];
+	int n, tail, space;
+
+	while( !(tp->flags & TF_EOF) && (space=SNDBUF_SIZE - tp->sb_len) > 0 ) {
+		tail = (tp->sb_start + tp->sb_len) & (SNDBUF_SIZE - 1);
+		iov[0].iov_base = tp->sbuf + tail;
+		iov[0].iov_len = MIN( space, SNDBUF_SIZE - tail );
+		iov[1].iov_base = tp->sbuf;
+		iov[1].iov_len = space - iov[0].iov_len;
+
+		if( (n=readv(tp->sfd, iov, 2)) < 0 ) {
+			if( errno == EAGAIN || errno == EINTR )
+				break;
+			tcp_drop( tp, 1 );
+			return 1;
 		}
-		ret = (*tcp_handlers[tp->state])(tp, iph, h, size);
-		/* tp only valid after TCPH_RESET and TCPH_AGAIN */
-		if( ret == TCPH_NOERR )
-			break;
-		if( ret == TCPH_AGAIN )
-			continue;
-		if( ret == TCPH_IGNORE ){
-			printm("TCPH_IGNORE\n");
+		if( !n ) {
+			/* the FIN goes out after the buffered data */
+			tp->flags |= TF_EOF | TF_SNDFIN;
+			if( tp->state == kESTABLISHED )
+				tp->state = kFIN_WAIT_1;
+			else if( tp->state == kCLOSE_WAIT )
+				tp->state = kLAST_ACK;
 			break;
 		}
-		/* TCPH_RESET */
-		send_tcp( tp, TCP_FLAG_RST | TCP_FLAG_ACK, NULL, 0 );
-		destroy_tcp_port( tp );
-		break;
+		tp->sb_len += n;
+		if( n < space )
+			break;
 	}
+	return 0;
 }
 
-static int 
-tcph_closed( tcp_port_t *tp, struct iphdr *iph, struct tcphdr *h, int size )
+static void
+tcp_connected( tcp_port_t *tp )
 {
-	struct sockaddr_in to;
-
-	if( !h->syn )
-		return TCPH_RESET;
-
-	// Open connection
-	to.sin_family = AF_INET;
-	tp->remote_ip = to.sin_addr.s_addr = iph->daddr;
-	tp->remote_port = to.sin_port = h->dest;
-	tp->mac_port = h->source;
-
-	tp->mac_isn = h->seq;
-	tp->mol_isn = (ip->next_tcp_isn += 0x10000);
-	tp->n_rcvd = 1;
-	tp->n_sent = 0;
-	tp->n_mac_acked = 0;
-	
 	tp->state = kSYN_RCVD;
-	set_async_handler_events( tp->async_hid, POLLOUT );
-	if( connect( tp->sfd, &to, sizeof(to)) < 0 ){
-		if( errno == EINPROGRESS )
-			return TCPH_NOERR;
-		return TCPH_RESET;
-	}
-
-	// We almost certainly don't come here since connect will not complete synchronously.
-	send_tcp( tp, TCP_FLAG_SYN | TCP_FLAG_ACK, NULL, 0 );
-	tp->n_sent++;
-	return TCPH_NOERR;
+	send_synack( tp );
+	update_events( tp );
 }
 
-static int 
-tcph_syn_rcvd( tcp_port_t *tp, struct iphdr *iph, struct tcphdr *h, int size )
+static void
+rx_tcp( int fd, int events )
 {
-	if( h->syn ) {
-		// XXX: Handle new ISN?
-		return TCPH_NOERR;
+	tcp_port_t *tp = (tcp_port_t*)lookup_fd( fd );
+	socklen_t len;
+	int serr;
+
+	if( !tp ) {
+		printm("rx_tcp: internal error\n");
+		return;
 	}
-	if( !h->ack || h->ack_seq != tp->mol_isn +1 || tp->n_sent != 1)
-		return TCPH_RESET;
 
-	set_async_handler_events( tp->async_hid, POLLIN );
-	
-	tp->state = kESTABLISHED;
-	return TCPH_AGAIN;		// handle ACK and any data
+	// Handle asynchronous open of connection
+	if( tp->state == kCONNECTING ) {
+		len = sizeof(serr);
+		if( getsockopt(fd, SOL_SOCKET, SO_ERROR, &serr, &len) || serr )
+			tcp_drop( tp, 1 );
+		else
+			tcp_connected( tp );
+		goto out;
+	}
+	if( events & POLLERR ) {
+		tcp_drop( tp, 1 );
+		goto out;
+	}
+	if( (events & POLLOUT) && flush_rbuf(tp) )
+		goto out;
+	if( (events & (POLLIN | POLLHUP)) && read_host(tp) )
+		goto out;
+
+	tcp_output( tp );
+	update_events( tp );
+ out:
+	flush_tx();
 }
 
-static int 
-tcph_established( tcp_port_t *tp, struct iphdr *iph, struct tcphdr *h, int size )
+
+/************************************************************************/
+/*	TCP input							*/
+/************************************************************************/
+
+static void
+tcp_options( tcp_port_t *tp, const u8 *opt, int len )
 {
-	int data_len;
-	int data_offs;
-	
-	if( h->ack ) {
-		int new_count = MAX( h->ack_seq - tp->mol_isn, tp->n_mac_acked );
-		if( new_count > tp->n_sent ){
-			printm("Bad ACK\n");
-			return TCPH_IGNORE;
+	int kind, olen;
+
+	tp->mss = TCP_DEF_MSS;
+	while( len > 0 && (kind=opt[0]) ) {
+		if( kind == 1 ) {
+			opt++;
+			len--;
+			continue;
+		}
+		if( len < 2 || (olen=opt[1]) < 2 || olen > len )
+			break;
+		if( kind == 2 && olen == 4 )
+			tp->mss = (opt[2] << 8) | opt[3];
+		if( kind == 3 && olen == 3 ) {
+			tp->snd_wscale = MIN( opt[2], 14 );
+			tp->flags |= TF_WSCALE;
 		}
-		tp->n_mac_acked = new_count;
+		opt += olen;
+		len -= olen;
 	}
+	tp->mss = MAX( 64, MIN(tp->mss, TCP_MAX_MSS) );
+}
 
-	// Simply drop out of order packets for now.
-	if( h->seq != tp->mac_isn + tp->n_rcvd ){
-		printm("Out of order packet received\n");
-		send_tcp( tp, TCP_FLAG_ACK, NULL, 0 );
-		return TCPH_IGNORE;
-	}
+static tcp_port_t *
+tcp_open( u32 saddr, int sport, u32 daddr, int dport, u32 seq, const u8 *opt, int optlen )
+{
+	struct sockaddr_in to;
+	tcp_port_t *tp;
+
+	if( !valid_dest(daddr) )
+		return NULL;
+	if( !(tp=(tcp_port_t*)bind_port(0, 0, sizeof(tcp_port_t))) )
+		return NULL;
 
-	// Handle (in order) data packet
-	data_offs = sizeof(long) * (iph->ihl + h->doff);
-	data_len = iph->tot_len - data_offs;
+	tp->mac_ip = saddr;
+	tp->mac_port = sport;
+	tp->remote_ip = daddr;
+	tp->remote_port = dport;
 
-	if( data_len > 0 ) {
-		// printm("Got %d bytes of data\n", data_len );
-		if( write( tp->sfd, (char*)iph + data_offs, data_len ) != data_len )
-			perrorm("write");
-		tp->n_rcvd += data_len;
+	tp->next = ip->tcp_hash[ tcp_hash(sport, daddr, dport) ];
+	ip->tcp_hash[ tcp_hash(sport, daddr, dport) ] = tp;
+	ip->n_tcp++;
 
-		send_tcp( tp, TCP_FLAG_ACK, NULL, 0 );
+	if( !(tp->sbuf=malloc(SNDBUF_SIZE + RCVBUF_SIZE)) ) {
+		destroy_tcp_port( tp );
+		return NULL;
 	}
+	tp->rbuf = tp->sbuf + SNDBUF_SIZE;
+
+	tcp_options( tp, opt, optlen );
+	tp->rcv_nxt = tp->rcv_adv = seq + 1;
+	tp->iss = (ip->next_tcp_isn += 0x10000 + (get_ms() & 0xffff));
+	tp->snd_una = tp->iss;
+	tp->snd_nxt = tp->snd_max = tp->iss + 1;
+	tp->rto = TCP_RTO_INIT;
+	tp->state = kCONNECTING;
 
-	// FIN?
-	if( h->fin ){
-		tp->n_rcvd++;
-		send_tcp( tp, TCP_FLAG_ACK, NULL, 0 );
-		shutdown( tp->sfd, 1 );
-		tp->state = kCLOSE_WAIT;
+	memset( &to, 0, sizeof(to) );
+	to.sin_family = AF_INET;
+	to.sin_port = htons( dport );
+	to.sin_addr.s_addr = htonl( map_addr(daddr, dport, 0) );
+
+	if( !connect(tp->sfd, (struct sockaddr*)&to, sizeof(to)) ) {
+		tcp_connected( tp );
+	} else if( errno == EINPROGRESS ) {
+		update_events( tp );
+	} else {
+		destroy_tcp_port( tp );
+		return NULL;
 	}
-	return TCPH_NOERR;
+	return tp;
 }
 
-static int
-tcph_close_wait( tcp_port_t *tp, struct iphdr *iph, struct tcphdr *h, int size )
+/* copy data to offset off (relative the unread data) of the receive ring */
+static void
+rbuf_copy( tcp_port_t *tp, int off, char *data, int len )
 {
-	printm("tcph_close_wait....\n");
-	// send_tcp( tp, TCP_FLAG_ACK, NULL, 0 );
-	return TCPH_NOERR;
-}
+	int tail = (tp->rb_start + off) & (RCVBUF_SIZE - 1);
+	int n = MIN( len, RCVBUF_SIZE - tail );
 
-static int
-tcph_last_ack( tcp_port_t *tp, struct iphdr *iph, struct tcphdr *h, int size )
-{
-	if( h->ack ) {
-		if( h->seq != tp->mol_isn + tp->n_sent )
-			printm("tcph_last_ack error\n");
-		destroy_tcp_port( tp );
-	}
-	// send_tcp( tp, TCP_FLAG_ACK, NULL, 0 );
-	return TCPH_NOERR;
+	memcpy( tp->rbuf + tail, data, n );
+	memcpy( tp->rbuf, data + n, len - n );
 }
 
-static int
-tcph_fin_wait_1( tcp_port_t *tp, struct iphdr *iph, struct tcphdr *h, int size )
+/* out-of-order data is placed in the ring right away; only the ranges are recorded */
+static void
+store_ooo( tcp_port_t *tp, u32 seq, char *data, int len )
 {
-	if( h->ack ) {
-		if( h->ack_seq == tp->mol_isn + tp->n_sent )
-			tp->state = kFIN_WAIT_2;
-		else {
-			// data ACK
-			return TCPH_NOERR;
-		}
+	u32 end = seq + len;
+	int i, j;
+
+	if( tp->n_ooo == MAX_OOO ) {
+		/* forget the range furthest away */
+		for( j=0, i=1; i<MAX_OOO; i++ )
+			if( SEQ_GT(tp->ooo[i].seq, tp->ooo[j].seq) )
+				j = i;
+		if( SEQ_GT(seq, tp->ooo[j].seq) )
+			return;
+		tp->ooo[j] = tp->ooo[--tp->n_ooo];
 	}
-	if( h->fin && h->ack ){
-		tp->n_rcvd++;
-		send_tcp( tp, TCP_FLAG_ACK, NULL, 0 );
-		destroy_tcp_port( tp );
+	rbuf_copy( tp, tp->rb_len + (int)(seq - tp->rcv_nxt), data, len );
+
+	/* merge overlapping or adjacent ranges */
+	for( i=0; i<tp->n_ooo; i++ ) {
+		if( SEQ_GT(seq, tp->ooo[i].end) || SEQ_GT(tp->ooo[i].seq, end) )
+			continue;
+		if( SEQ_LT(tp->ooo[i].seq, seq) )
+			seq = tp->ooo[i].seq;
+		if( SEQ_GT(tp->ooo[i].end, end) )
+			end = tp->ooo[i].end;
+		tp->ooo[i--] = tp->ooo[--tp->n_ooo];
 	}
-	// XXX: Receive and ACK data
-	return TCPH_NOERR;
+	tp->ooo[tp->n_ooo].seq = seq;
+	tp->ooo[tp->n_ooo++].end = end;
 }
 
+/* advance rcv_nxt over stored ranges that have become contiguous; returns 1 if it moved */
 static int
-tcph_fin_wait_2( tcp_port_t *tp, struct iphdr *iph, struct tcphdr *h, int size )
+reass( tcp_port_t *tp )
 {
-	if( h->fin ){
-		tp->n_rcvd++;
-		send_tcp( tp, TCP_FLAG_ACK, NULL, 0 );
-		destroy_tcp_port( tp );
+	int i, n, ret = 0;
+
+	for( i=0; i<tp->n_ooo; i++ ) {
+		if( SEQ_GT(tp->ooo[i].seq, tp->rcv_nxt) )
+			continue;
+		if( (n=tp->ooo[i].end - tp->rcv_nxt) > 0 ) {
+			tp->rb_len += n;
+			tp->rcv_nxt += n;
+			ret = 1;
+		}
+		tp->ooo[i] = tp->ooo[--tp->n_ooo];
+		i = -1;
 	}
-	// send_tcp( tp, TCP_FLAG_ACK, NULL, 0 );
-	return TCPH_NOERR;
+	return ret;
 }
 
-
 static void
-remote_tcp_close( tcp_port_t *tp, int was_reset )
+enter_time_wait( tcp_port_t *tp )
 {
-	set_async_handler_events( tp->async_hid, 0 );
-
-	if( !was_reset ) {
-		switch( tp->state ){
-		case kCLOSE_WAIT:
-			tp->state = kLAST_ACK;
-			break;
-		case kESTABLISHED:
-			tp->state = kFIN_WAIT_1;
-			break;
-		default:
-			printm("Remote TCP close in state %d\n", tp->state );
-			was_reset = 1;
-			break;
-		}
-	}
-	if( !was_reset ) {
-		shutdown( tp->sfd, 0 );
-		send_tcp( tp, TCP_FLAG_FIN | TCP_FLAG_ACK, NULL, 0 );
-		tp->n_sent++;
-	} else {
-		send_tcp( tp, TCP_FLAG_RST, NULL, 0 );
-		destroy_tcp_port( tp );
-	}
+	tp->state = kTIME_WAIT;
+	tp->rexmt_time = 0;
+	tp->tw_time = deadline( TCP_TIMEWAIT );
+	arm_tick();
 }
 
 static void
-rx_tcp( int fd, int events )
+tcp_input( ip_header_t *ipp, char *p, int len )
 {
+	tcp_header_t *th = (tcp_header_t*)p;
+	int hlen, dlen, flags, todrop, acked, ourfinacked = 0;
+	u32 seq, ack, win, saddr, daddr;
+	int sport, dport;
 	tcp_port_t *tp;
-	char buf[ETH_FRAME_LEN - sizeof(struct iphdr) - sizeof(struct tcphdr) - sizeof(struct ethhdr)];
-	struct msghdr mh;
-	int s;
-	
-	for( tp=ip->tcp_root; tp; tp=tp->next )
-		if( tp->sfd == fd )
-			break;
-	if( !tp ){
-		printm("rx_tcp: internal error\n");
+	char *data;
+
+	if( len < TCP_HLEN || (hlen=(th->doff >> 4) * 4) < TCP_HLEN || hlen > len )
 		return;
+	ip->stats.tcp_in++;
+
+	data = p + hlen;
+	dlen = len - hlen;
+	flags = th->flags;
+	seq = ntohl( th->seq );
+	ack = ntohl( th->ack );
+	win = ntohs( th->window );
+	saddr = ntohl( ipp->saddr );
+	daddr = ntohl( ipp->daddr );
+	sport = ntohs( th->sport );
+	dport = ntohs( th->dport );
+
+	tp = lookup_tcp( sport, daddr, dport );
+
+	/* a new connection may reuse a port in TIME_WAIT */
+	if( tp && tp->state == kTIME_WAIT && (flags & (TH_SYN | TH_ACK)) == TH_SYN && SEQ_GT(seq, tp->rcv_nxt) ) {
+		destroy_tcp_port( tp );
+		tp = NULL;
 	}
+	if( !tp ) {
+		tcp_port_t dummy;
 
-	// Handle asynchronous open of connection
-	if( events & POLLOUT ){
-		int serr, optsize = sizeof(serr);
-		if( !getsockopt( tp->sfd, SOL_SOCKET, SO_ERROR, &serr, &optsize ) && !serr ) {
-			send_tcp( tp, TCP_FLAG_SYN | TCP_FLAG_ACK, NULL, 0 );
-			tp->n_sent++;
-			set_async_handler_events( tp->async_hid, 0 );
+		if( flags & TH_RST )
+			return;
+		if( (flags & (TH_SYN | TH_ACK)) == TH_SYN && tcp_open(saddr, sport, daddr, dport, seq,
+			(u8*)th + TCP_HLEN, hlen - TCP_HLEN) )
+		{
+			flush_tx();
+			return;
+		}
+		/* reply with a RST */
+		memset( &dummy, 0, sizeof(dummy) );
+		dummy.mac_ip = saddr;
+		dummy.mac_port = sport;
+		dummy.remote_ip = daddr;
+		dummy.remote_port = dport;
+		if( flags & TH_ACK ) {
+			send_tcp( &dummy, TH_RST, ack, 0, 0 );
 		} else {
-			// Could not open connection, respond with a RST
-			send_tcp( tp, TCP_FLAG_RST | TCP_FLAG_ACK, NULL, 0 );
-			destroy_tcp_port( tp );
+			dummy.rcv_nxt = seq + dlen + ((flags & TH_SYN) ? 1 : 0) + ((flags & TH_FIN) ? 1 : 0);
+			send_tcp( &dummy, TH_RST | TH_ACK, 0, 0, 0 );
 		}
 		return;
 	}
-	
-	if( events & ~POLLIN ) {
-		if( events & POLLHUP ) {
-			remote_tcp_close( tp, 1 );
+
+	if( flags & TH_RST ) {
+		if( tp->state <= kSYN_RCVD || (SEQ_LEQ(tp->rcv_nxt, seq) && SEQ_LT(seq, tp->rcv_adv + 1)) )
+			tcp_drop( tp, 0 );
+		return;
+	}
+
+	switch( tp->state ) {
+	case kCONNECTING:
+		/* retransmitted SYN, still waiting for the host */
+		return;
+
+	case kSYN_RCVD:
+		if( flags & TH_SYN ) {
+			/* our SYN,ACK was lost */
+			if( seq == tp->rcv_nxt - 1 )
+				send_synack( tp );
 			return;
 		}
-		if( events & POLLERR ){
-			printm("******** POLLERR *******\n");
+		if( !(flags & TH_ACK) )
+			return;
+		if( ack != tp->iss + 1 ) {
+			send_tcp( tp, TH_RST, ack, 0, 0 );
+			return;
 		}
-		if( events & POLLNVAL ){
-			printm("******** POLLNVAL ******\n");
+		if( tp->rtt_time )
+			tcp_rtt( tp, get_ms() - tp->rtt_time );
+		tp->snd_una = tp->snd_nxt = tp->snd_max = tp->iss + 1;
+		tp->snd_wl1 = seq - 1;
+		tp->rexmt_time = 0;
+		tp->rxtshift = 0;
+		tp->state = (tp->flags & TF_SNDFIN) ? kFIN_WAIT_1 : kESTABLISHED;
+		break;
+
+	default:
+		if( flags & TH_SYN ) {
+			tp->flags |= TF_ACKNOW;
+			goto out;
 		}
-		printm("RX_TCP from ");
-		print_ipaddr( tp->remote_ip );
-		printm(" %ld ", tp->remote_port );
-		printm("---> %d (state = %d)\n", tp->mac_port, tp->state );
-		set_async_handler_events( tp->async_hid, 0 );
-		return;
+		break;
 	}
 
-	if( !(events & POLLIN )) {
-		printm("--- POLLIN not set ---\n");
-		return;
+	/* trim data we already have */
+	if( (todrop=tp->rcv_nxt - seq) > 0 ) {
+		if( todrop >= dlen + ((flags & TH_FIN) ? 1 : 0) ) {
+			flags &= ~TH_FIN;
+			todrop = dlen;
+			tp->flags |= TF_ACKNOW;
+		}
+		data += todrop;
+		dlen -= todrop;
+		seq += todrop;
+	}
+	/* beyond the window */
+	if( (todrop=(int)(seq - tp->rcv_nxt) + dlen - (RCVBUF_SIZE - tp->rb_len)) > 0 ) {
+		dlen = MAX( dlen - todrop, 0 );
+		flags &= ~TH_FIN;
+		tp->flags |= TF_ACKNOW;
+	}
+	/* out of order; keep it and send a duplicate ACK */
+	if( SEQ_GT(seq, tp->rcv_nxt) ) {
+		ip->stats.tcp_ooo++;
+		if( dlen && tp->state >= kESTABLISHED && tp->state != kCLOSE_WAIT && tp->state <= kFIN_WAIT_2 )
+			store_ooo( tp, seq, data, dlen );
+		flags &= ~TH_FIN;
+		dlen = 0;
+		tp->flags |= TF_ACKNOW;
 	}
 
-	for( ;; ) {
-		struct iovec iov;
-		iov.iov_base = buf;
-		iov.iov_len = sizeof(buf);
-		
-		mh.msg_name = NULL;
-		mh.msg_namelen = 0 ;
-		mh.msg_iov = &iov;
-		mh.msg_iovlen = 1;
-		mh.msg_control = NULL;
-		mh.msg_controllen = 0;
-		mh.msg_flags = 0;
-
-		if( (s = recvmsg(fd, &mh, 0)) < 0 ){
-			if( errno == EAGAIN )
-				break;
-			perrorm("rx_tcp, rcvmsg");
-			return;
+	/* ACK processing */
+	if( !(flags & TH_ACK) )
+		goto out;
+	if( SEQ_GT(ack, tp->snd_max) ) {
+		tp->flags |= TF_ACKNOW;
+		goto out;
+	}
+	if( SEQ_LEQ(ack, tp->snd_una) ) {
+		if( ack == tp->snd_una && !dlen && (win << tp->snd_wscale) == tp->snd_wnd
+		    && tp->snd_max != tp->snd_una && !(flags & TH_FIN) ) {
+			/* fast retransmit */
+			if( ++tp->dupacks == 3 ) {
+				tp->snd_nxt = tp->snd_una;
+				tp->rtt_time = 0;
+			}
+		} else {
+			tp->dupacks = 0;
 		}
-		// Connection closed
-		if( !s ) {
-			remote_tcp_close( tp, 0 );
-			return;
+	} else {
+		acked = ack - tp->snd_una;
+		tp->dupacks = 0;
+		if( tp->rtt_time && SEQ_GT(ack, tp->rtt_seq) )
+			tcp_rtt( tp, get_ms() - tp->rtt_time );
+		if( (tp->flags & TF_SNDFIN) && acked > tp->sb_len ) {
+			ourfinacked = 1;
+			acked = tp->sb_len;
 		}
+		tp->sb_start = (tp->sb_start + acked) & (SNDBUF_SIZE - 1);
+		tp->sb_len -= acked;
+		tp->snd_una = ack;
+		if( SEQ_LT(tp->snd_nxt, tp->snd_una) )
+			tp->snd_nxt = tp->snd_una;
+		tp->rxtshift = 0;
+		tp->rexmt_time = (tp->snd_una == tp->snd_max) ? 0 : deadline( tp->rto );
+	}
+	if( SEQ_LT(tp->snd_wl1, seq) || (tp->snd_wl1 == seq && SEQ_LEQ(tp->snd_wl2, ack)) ) {
+		tp->snd_wnd = win << tp->snd_wscale;
+		tp->snd_wl1 = seq;
+		tp->snd_wl2 = ack;
+	}
+
+	if( ourfinacked ) {
+		tp->flags &= ~TF_SNDFIN;
+		switch( tp->state ) {
+		case kFIN_WAIT_1:
+			tp->state = kFIN_WAIT_2;
+			break;
+		case kCLOSING:
+			enter_time_wait( tp );
+			break;
+		case kLAST_ACK:
+			if( !tp->rb_len ) {
+				destroy_tcp_port( tp );
+				return;
+			}
+			/* the socket still has data to take */
+			enter_time_wait( tp );
+			break;
+		}
+	}
 
-		// XXX: Check TCP state
-		send_tcp( tp, TCP_FLAG_ACK, buf, s );
+	/* data to the host */
+	if( dlen && (tp->state == kESTABLISHED || tp->state == kFIN_WAIT_1 || tp->state == kFIN_WAIT_2) ) {
+		rbuf_copy( tp, tp->rb_len, data, dlen );
+		tp->rb_len += dlen;
+		tp->rcv_nxt += dlen;
+
+		/* delayed ACK, but ACK every other segment or a filled hole at once */
+		if( tp->n_ooo && reass(tp) ) {
+			tp->flags |= TF_ACKNOW;
+		} else if( tp->flags & TF_DELACK ) {
+			tp->flags |= TF_ACKNOW;
+		} else {
+			tp->flags |= TF_DELACK;
+			tp->delack_time = deadline( TCP_DELACK );
+			arm_tick();
+		}
 	}
+
+	if( (flags & TH_FIN) && !(tp->flags & TF_RCVDFIN) ) {
+		tp->rcv_nxt++;
+		tp->flags |= TF_ACKNOW | TF_RCVDFIN;
+		switch( tp->state ) {
+		case kESTABLISHED:
+			tp->state = kCLOSE_WAIT;
+			break;
+		case kFIN_WAIT_1:
+			tp->state = kCLOSING;
+			break;
+		case kFIN_WAIT_2:
+			enter_time_wait( tp );
+			break;
+		}
+	}
+	if( flush_rbuf(tp) )
+		return;
+ out:
+	tcp_output( tp );
+	update_events( tp );
 }
 
 
@@ -853,106 +1336,330 @@ rx_tcp( int fd, int events )
 /*	UDP protocol							*/
 /************************************************************************/
 
+static udp_port_t *
+udp_open( u32 saddr, int sport )
+{
+	udp_port_t *up, *lru = NULL;
+	int i;
+
+	/* recycle the least recently used port */
+	if( ip->n_udp >= MAX_UDP_PORTS ) {
+		for( i=0; i<UDP_HASH_SIZE; i++ )
+			for( up=ip->udp_hash[i]; up; up=up->next )
+				if( !lru || TIME_GEQ(lru->last_use, up->last_use) )
+					lru = up;
+		if( lru )
+			destroy_udp_port( lru );
+	}
+	if( !(up=(udp_port_t*)bind_port(sport, 1, sizeof(udp_port_t))) )
+		return NULL;
+	up->mac_ip = saddr;
+	up->mac_port = sport;
+	up->next = ip->udp_hash[ sport & (UDP_HASH_SIZE - 1) ];
+	ip->udp_hash[ sport & (UDP_HASH_SIZE - 1) ] = up;
+	ip->n_udp++;
+	return up;
+}
+
 static void
-handle_udp_packet( struct iphdr *iph, struct udphdr *h, int udp_size )
+udp_input( ip_header_t *ipp, char *p, int len )
 {
+	udp_header_t *uh = (udp_header_t*)p;
 	struct sockaddr_in to;
 	udp_port_t *up;
-	char *data = (char*)h + sizeof(struct udphdr);
-	int size;
-
-	printm("UDP, port: %d --> %d", h->source, h->dest);
+	int sport, dport, ulen;
+	u32 daddr;
 
-	// Safetychecks
-	if( udp_size < sizeof(struct udphdr) || (h->len < sizeof(struct udphdr)) || h->len > udp_size ) {
-		printm("Malformed UDP packet\n");
+	if( len < UDP_HLEN || (ulen=ntohs(uh->len)) < UDP_HLEN || ulen > len )
 		return;
-	}
-	size = h->len - sizeof(struct udphdr);
+	sport = ntohs( uh->sport );
+	dport = ntohs( uh->dport );
+	daddr = ntohl( ipp->daddr );
 
-	// Find/bind UDP port
-	for( up = ip->udp_root; up; up=up->next )
-		if( up->mac_port == h->source )
-			break;
-	if( !up && !(up = bind_udp_port(h->source)) && !(up=bind_udp_port(0)) ) {
-		printm("Failed to bind a UDP port!\n");
+	if( !valid_dest(daddr) )
 		return;
-	}
-	up->mac_port = h->source;
+	if( !(up=lookup_udp(sport)) && !(up=udp_open(ntohl(ipp->saddr), sport)) )
+		return;
+	up->last_use = get_ms();
 
-	// Send packet
+	memset( &to, 0, sizeof(to) );
 	to.sin_family = AF_INET;
-	to.sin_port = h->dest;
-	to.sin_addr.s_addr = iph->daddr;
-	if( sendto( up->sfd, data, size, 0, &to, sizeof(to) ) < 0 ){
-		perrorm("sendto");
-		return;
-	}
-	printm(" [SENT]");
-}
+	to.sin_port = htons( dport );
+	to.sin_addr.s_addr = htonl( map_addr(daddr, dport, 1) );
+	if( daddr == ip->is->my_ip )
+		up->nat_ip = map_addr( daddr, dport, 1 );
 
-#define MAX_UDP_DATA		(ETH_DATA_LEN - sizeof(struct iphdr) - sizeof(struct udphdr))
-#define SIZEOF_HEADERS_UDP 	(sizeof(struct iphdr) + sizeof(struct udphdr) + sizeof(struct ethhdr))
+	if( sendto(up->sfd, uh->data, ulen - UDP_HLEN, 0, (struct sockaddr*)&to, sizeof(to)) < 0 )
+		ip->stats.udp_dropped++;
+	else
+		ip->stats.udp_out++;
+}
 
 static void
 rx_udp( int fd, int events )
 {
 	struct sockaddr_in from;
-	int size, fromlen = sizeof(from);
+	socklen_t fromlen;
 	udp_port_t *up;
-	char buf[ ETH_FRAME_LEN + 2 ];
-	char *data = buf + 2 + sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr);
-	struct ethhdr *eh = (struct ethhdr*)&buf[2];
-	struct iphdr *iph = (struct iphdr*)((char*)eh + sizeof(struct ethhdr));
-	struct udphdr *uh = (struct udphdr*)((char*)iph + sizeof(struct iphdr));
-
-	for( up=ip->udp_root; up; up=up->next )
-		if( up->sfd == fd )
-			break;
-	if( !up ){
+	udp_header_t *uh;
+	u32 saddr;
+	char *p;
+	int n;
+
+	if( !(up=(udp_port_t*)lookup_fd(fd)) ) {
 		printm("rx_udp: internal error\n");
 		return;
 	}
-	if( (size=recvfrom( fd, data, MAX_UDP_DATA, 0, &from, &fromlen )) < 0 ){
-		perrorm("recvfrom");
-		return;
+	for( ;; ) {
+		/* MacOS is not keeping up, drop the datagram */
+		if( !(p=get_txbuf()) ) {
+			if( recv(fd, NULL, 0, MSG_DONTWAIT | MSG_TRUNC) < 0 )
+				break;
+			ip->stats.udp_dropped++;
+			continue;
+		}
+		fromlen = sizeof(from);
+		uh = (udp_header_t*)(p + IP_HLEN);
+		if( (n=recvfrom(fd, uh->data, MAX_UDP_DATA, MSG_TRUNC, (struct sockaddr*)&from, &fromlen)) < 0 )
+			break;
+		if( n > MAX_UDP_DATA ) {
+			ip->stats.udp_dropped++;
+			continue;
+		}
+		saddr = ntohl( from.sin_addr.s_addr );
+		if( saddr == up->nat_ip || saddr == INADDR_LOOPBACK )
+			saddr = ip->is->my_ip;
+
+		uh->sport = from.sin_port;
+		uh->dport = htons( up->mac_port );
+		uh->len = htons( UDP_HLEN + n );
+		uh->checksum = 0;
+		uh->checksum = htons( l4_csum(saddr, up->mac_ip, PROT_UDP, (u8*)uh, UDP_HLEN + n) ) ? : 0xffff;
+		build_ip_header( p, PROT_UDP, saddr, up->mac_ip, UDP_HLEN + n );
+		queue_tx( IP_HLEN + UDP_HLEN + n );
+		ip->stats.udp_in++;
 	}
-	printm("UDP packet size %d received, ", size);
-	print_ipaddr( from.sin_addr.s_addr );
-	printm(": %d ----> %d (mac: %d)\n", from.sin_port, up->port, up->mac_port);
+	up->last_use = get_ms();
+	flush_tx();
+}
 
-	// ************* Build ethernet packet *******************
-	build_eth_ip_header( eh, size + sizeof(struct udphdr), from.sin_addr.s_addr, 17 /* udp protocol */ );
-	iph->check = ip_fast_csum( (char*)iph, iph->ihl );
 
-	// UDP header
-	uh->source = from.sin_port;
-	uh->dest = up->mac_port;
-	uh->len = size + sizeof(struct udphdr);
-	/* XXX: The checksum is not required for UDP but we should perhaps use one anyway */
-	uh->check = 0;	
+/************************************************************************/
+/*	Packets from MacOS						*/
+/************************************************************************/
 
-	if( synthesize_eth_packet( buf+2, size + SIZEOF_HEADERS_UDP, ip->enetif )){
-		printm("synthesize_eth_packet error\n");
+static void
+handle_ip_packet( char *p, int len )
+{
+	ip_header_t *ipp = (ip_header_t*)p;
+	int hlen, totlen;
+
+	if( len < IP_HLEN || ipp->version != 4 )
+		return;
+	hlen = ipp->hlen * 4;
+	totlen = ntohs( ipp->totlen );
+	if( hlen < IP_HLEN || totlen < hlen || totlen > len )
+		return;
+
+	/* fragments are not reassembled (TCP uses the MSS) */
+	if( ntohs(ipp->frag_offs) & 0x3fff ) {
+		ip->stats.dropped++;
+		return;
 	}
+	switch( ipp->protocol ) {
+	case PROT_TCP:
+		tcp_input( ipp, p + hlen, totlen - hlen );
+		break;
+	case PROT_UDP:
+		udp_input( ipp, p + hlen, totlen - hlen );
+		break;
+	default:
+		ip->stats.dropped++;
+		break;
+	}
+}
+
+static void
+rx_guest( int fd, int events )
+{
+	struct mmsghdr msgs[ MAX_PACKET_BATCH ];
+	struct iovec iov[ MAX_PACKET_BATCH ];
+	tcp_port_t *tp;
+	int i, n;
+
+	/* the guest has drained the socketpair, restart stalled connections */
+	if( (events & POLLOUT) && !flush_tx() ) {
+		ip->tx.blocked = 0;
+		set_async_handler_events( ip->async_hid, POLLIN );
+		for( i=0; i<TCP_HASH_SIZE; i++ )
+			for( tp=ip->tcp_hash[i]; tp; tp=tp->next )
+				tcp_output( tp );
+	}
+
+	if( events & POLLIN ) {
+		do {
+			memset( msgs, 0, sizeof(msgs) );
+			for( i=0; i<MAX_PACKET_BATCH; i++ ) {
+				iov[i].iov_base = ip->rx_buf[i];
+				iov[i].iov_len = IP_PACKET_SIZE;
+				msgs[i].msg_hdr.msg_iov = &iov[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			if( (n=recvmmsg(fd, msgs, MAX_PACKET_BATCH, MSG_DONTWAIT, NULL)) <= 0 )
+				break;
+			for( i=0; i<n; i++ )
+				handle_ip_packet( ip->rx_buf[i], msgs[i].msg_len );
+		} while( n == MAX_PACKET_BATCH );
+	}
+	flush_tx();
 }
 
 
 /************************************************************************/
-/*	Packet reception (incoming packets from the network)		*/
+/*	Debugger							*/
 /************************************************************************/
 
-int 
-rx_packet_hook( char *p, int size, void *enetif )
+static int __dcmd
+cmd_usernet( int argc, char **argv )
 {
-	struct ethhdr *eh = (struct ethhdr*)p;
+	tcp_port_t *tp;
+	u32 a;
+	int i;
 
-	// We do IP and ARP
-	if( eh->h_proto != ETH_P_IP && eh->h_proto != ETH_P_ARP )
-		return 0;		/* XXX: FIXME */
+	if( argc == 2 && !strcmp(argv[1], "clear") ) {
+		memset( &ip->stats, 0, sizeof(ip->stats) );
+		return 0;
+	}
+	if( argc != 1 )
+		return 1;
 
-	printm("Got IP/ARP packet\n");
-	return 1;
+	for( i=0; i<TCP_HASH_SIZE; i++ )
+		for( tp=ip->tcp_hash[i]; tp; tp=tp->next ) {
+			a = tp->remote_ip;
+			printm("%5d -> %d.%d.%d.%d:%-5d %-11s  unacked %6d  queued %6d  wnd %6d  rx %6d  rto %d\n",
+			       tp->mac_port, a >> 24, (a >> 16) & 0xff, (a >> 8) & 0xff, a & 0xff,
+			       tp->remote_port, state_names[tp->state], tp->snd_max - tp->snd_una,
+			       tp->sb_len, tp->snd_wnd, tp->rb_len, tp->rto );
+		}
+	printm("tcp: %lld segments in, %lld out, %lld retransmitted, %lld timeouts, %lld out of order\n",
+	       ip->stats.tcp_in, ip->stats.tcp_out, ip->stats.tcp_rexmt, ip->stats.tcp_timeouts,
+	       ip->stats.tcp_ooo );
+	printm("udp: %lld datagrams in, %lld out, %lld dropped\n",
+	       ip->stats.udp_in, ip->stats.udp_out, ip->stats.udp_dropped );
+	printm("%d tcp ports, %d udp ports, %lld packets dropped\n", ip->n_tcp, ip->n_udp, ip->stats.dropped );
+	return 0;
 }
 
+static dbg_cmd_t dbg_cmds[] = {
+#ifdef CONFIG_DEBUGGER
+	{ "usernet",	cmd_usernet,	"usernet [clear] \nshow user-mode network connections\n" },
 #endif
+};
+
+
+/************************************************************************/
+/*	Init / Cleanup							*/
+/************************************************************************/
+
+static int
+ip_init( enet_iface_t *is, int fd )
+{
+	if( use_count ) {
+		printm("Only one user-mode network interface is supported\n");
+		return 1;
+	}
+	memset( ip, 0, sizeof(ip[0]) );
+	ip->is = is;
+	ip->fd = fd;
+	ip->dns_ip = lookup_resolver();
+	ip->next_tcp_isn = get_ms() << 12;
+
+	if( (ip->async_hid=add_async_handler(fd, POLLIN, rx_guest, 0)) < 0 )
+		return 1;
+	ip->tick_id = new_ptimer( tcp_tick, NULL, 0 );
+	set_ptimer( ip->tick_id, TCP_TICK_USECS );
+	ip->tick_armed = 1;
+
+	add_dbg_cmds( dbg_cmds, sizeof(dbg_cmds) );
+	use_count++;
+	return 0;
+}
+
+static void
+ip_cleanup( void )
+{
+	int i;
+
+	if( !use_count )
+		return;
+	for( i=0; i<TCP_HASH_SIZE; i++ )
+		while( ip->tcp_hash[i] )
+			destroy_tcp_port( ip->tcp_hash[i] );
+	for( i=0; i<UDP_HASH_SIZE; i++ )
+		while( ip->udp_hash[i] )
+			destroy_udp_port( ip->udp_hash[i] );
+
+	free_ptimer( ip->tick_id );
+	delete_async_handler( ip->async_hid );
+	close( ip->fd );
+	use_count = 0;
+}
+
+
+/************************************************************************/
+/*	Packet driver							*/
+/************************************************************************/
+
+static const char		def_hw_addr[6] = { 0, 0, 0x0D, 0xEA, 0xDD, 0xEE };
+
+static void
+user_preconfigure( enet_iface_t *is )
+{
+	memcpy( is->c_macaddr, def_hw_addr, 6 );
+	is->c_macaddr[5] += g_session_id;
+}
+
+static int
+user_open( enet_iface_t *is )
+{
+	int i, sv[2], size = 1 << 20;
+
+	if( socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0 ) {
+		perrorm("socketpair");
+		return 1;
+	}
+	for( i=0; i<2; i++ ) {
+		fcntl( sv[i], F_SETFD, FD_CLOEXEC );
+		fcntl( sv[i], F_SETFL, O_NONBLOCK );
+		setsockopt( sv[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+	}
+	if( ip_init(is, sv[1]) ) {
+		close( sv[0] );
+		close( sv[1] );
+		return 1;
+	}
+	/* the stack speaks IP; packet.c answers ARP and DHCP */
+	is->flags |= IP_PAYLOAD | BATCH_IO;
+	is->packet_pad = 0;
+
+	netif_open_common( is, sv[0] );
+	return 0;
+}
+
+static void
+user_close( enet_iface_t *is )
+{
+	ip_cleanup();
+	netif_close_common( is );
+}
+
+static packet_driver_t user_pd = {
+	.name		= "user",
+	.flagstr	= "-user",
+	.id		= USER_PACKET_DRIVER_ID,
+	.preconfigure	= user_preconfigure,
+	.open 		= user_open,
+	.close		= user_close,
+};
+
+DECLARE_PACKET_DRIVER( init_usernet, user_pd );
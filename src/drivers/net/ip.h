@@ -69,6 +69,7 @@ typedef struct {
 } ip_header_t;
 
 /* protocols */
+#define PROT_TCP	6
 #define PROT_UDP	17
 
 typedef struct {
@@ -79,6 +80,33 @@ typedef struct {
 	char		data[1];
 } udp_header_t;
 
+typedef struct {
+	u16		sport;
+	u16		dport;
+	u32		seq;
+	u32		ack;
+	u8		doff;			/* header length in words << 4 */
+	u8		flags;
+	u16		window;
+	u16		checksum;
+	u16		urg_ptr;
+	/* options if any */
+	u8		options[1];
+} tcp_header_t;
+
+/* tcp flags */
+#define TH_FIN		0x01
+#define TH_SYN		0x02
+#define TH_RST		0x04
+#define TH_PSH		0x08
+#define TH_ACK		0x10
+#define TH_URG		0x20
+
+/* header sizes (without options) */
+#define IP_HLEN		20
+#define UDP_HLEN	8
+#define TCP_HLEN	20
+
 /* assembly exports */
 extern u16 	ip_fast_csum( u8 *ipp, int len );
 
@@ -15,6 +15,7 @@
 
 #include "mol_config.h"
 #include <sys/uio.h>
+#include <sys/socket.h>
 #include "enet.h"
 #include "ip.h"
 #include "dhcp.h"
@@ -267,14 +268,16 @@ drop:
 /*	send/receive packet						*/
 /************************************************************************/
 
-static inline int
-intercept_packet( enet_iface_t *is, const struct iovec *vec, size_t nvec )
+enum { kPacketSend=0, kPacketDHCP, kPacketARP, kPacketDrop };
+
+static int
+packet_kind( enet_iface_t *is, const struct iovec *vec, size_t nvec )
 {
 	int type=0, len, dport=0, ip_prot=0, fragoffs=0;
 	int success=0;
 
 	if( (is->flags & NO_DHCP) && !(is->flags & IP_PAYLOAD) )
-		return 0;
+		return kPacketSend;
 
 	/* fast path */
 	if( vec[0].iov_len >= 40 ) {
@@ -303,28 +306,50 @@ intercept_packet( enet_iface_t *is, const struct iovec *vec, size_t nvec )
 			| iovec_getbyte(14+len+3,vec,nvec);
 	}
 	if( !(is->flags & NO_DHCP) && type == ETH_TYPE_IP && ip_prot == PROT_UDP && !fragoffs && dport == PORT_BOOTPS )
-		return handle_dhcp( is, vec, nvec );
+		return kPacketDHCP;
 
 	if( (is->flags & IP_PAYLOAD) ) {
 		if( type == ETH_TYPE_ARP )
-			return handle_arp( is, vec, nvec );
+			return kPacketARP;
 		if( type != ETH_TYPE_IP )
-			return 1;
+			return kPacketDrop;
+	}
+	return kPacketSend;
+}
+
+static inline int
+intercept_packet( enet_iface_t *is, const struct iovec *vec, size_t nvec )
+{
+	switch( packet_kind(is, vec, nvec) ) {
+	case kPacketDHCP:
+		return handle_dhcp( is, vec, nvec );
+	case kPacketARP:
+		return handle_arp( is, vec, nvec );
+	case kPacketDrop:
+		return 1;
 	}
 	return 0;
 }
 
+/* returns 1 if the packet should go out on the wire */
+static int
+prepare_send( enet_iface_t *is, struct iovec *vec, size_t nvec )
+{
+	if( intercept_packet(is, vec, nvec) )
+		return 0;
+	if( is->packet_pad ) {
+		vec[0].iov_len += is->packet_pad;
+		vec[0].iov_base -= is->packet_pad;
+	}
+	if( is->flags & IP_PAYLOAD )
+		iovec_skip( 14, vec, nvec );
+	return 1;
+}
+
 int
 send_packet( enet_iface_t *is, struct iovec *vec, size_t nvec )
 {
-	if( !intercept_packet(is, vec, nvec) ) {
-		if( is->packet_pad ) {
-			vec[0].iov_len += is->packet_pad;
-			vec[0].iov_base -= is->packet_pad;
-		}
-		if( is->flags & IP_PAYLOAD )
-			iovec_skip( 14, vec, nvec );
-
+	if( prepare_send(is, vec, nvec) ) {
 		if( writev(is->fd, vec, nvec) < 0 ) {
 			perrorm("send_packet");
 			return 1;
@@ -369,3 +394,114 @@ receive_packet( enet_iface_t *is, struct iovec *iov, size_t nvec )
 		return s;
 	return s + sadd;
 }
+
+/* Sends pv[from..to-1], the entries which are not set in 'sent' were
+ * handled locally. Returns the index of the first packet which could not
+ * be sent because the socket is full (to if all went out).
+ */
+static int
+send_run( enet_iface_t *is, packet_vec_t *pv, int from, int to, const char *sent, int *errs )
+{
+	int i;
+#ifdef __linux__
+	struct mmsghdr msgs[MAX_PACKET_BATCH];
+	int j, cnt, ret;
+
+	if( (is->flags & BATCH_IO) ) {
+		/* the locally handled packets are all at the start of the run */
+		for( ; from < to && !sent[from]; from++ )
+			;
+		memset( msgs, 0, sizeof(msgs[0]) * (to - from) );
+		for( cnt=0, i=from; i<to; i++, cnt++ ) {
+			msgs[cnt].msg_hdr.msg_iov = pv[i].iov;
+			msgs[cnt].msg_hdr.msg_iovlen = pv[i].nvec;
+		}
+		/* a failing packet is counted and skipped */
+		for( j=0; j<cnt; ) {
+			if( (ret=sendmmsg(is->fd, &msgs[j], cnt - j, MSG_DONTWAIT)) > 0 )
+				j += ret;
+			else if( errno == EAGAIN || errno == ENOBUFS )
+				break;
+			else if( errno != EINTR ) {
+				(*errs)++;
+				j++;
+			}
+		}
+		return from + j;
+	}
+#endif
+	for( i=from; i<to; i++ ) {
+		if( !sent[i] || writev(is->fd, pv[i].iov, pv[i].nvec) >= 0 )
+			continue;
+		if( errno == EAGAIN )
+			break;
+		(*errs)++;
+	}
+	return i;
+}
+
+int
+send_packets( enet_iface_t *is, packet_vec_t *pv, int n, int *errs )
+{
+	char sent[MAX_PACKET_BATCH];
+	int i, ret, first;
+
+	for( i=first=0; i<n; i++ ) {
+		/* the packets before one which is handled locally (DHCP, ARP)
+		 * go out first; if they have to be requeued, so does it
+		 */
+		if( i > first && packet_kind(is, pv[i].iov, pv[i].nvec) != kPacketSend ) {
+			if( (ret=send_run(is, pv, first, i, sent, errs)) < i )
+				return ret;
+			first = i;
+		}
+		sent[i] = prepare_send( is, pv[i].iov, pv[i].nvec );
+	}
+	return send_run( is, pv, first, n, sent, errs );
+}
+
+int
+receive_packets( enet_iface_t *is, packet_vec_t *pv, int n )
+{
+	int i, ret, sadd = 0;
+#ifdef __linux__
+	struct mmsghdr msgs[MAX_PACKET_BATCH];
+#endif
+	if( is->flags & IP_PAYLOAD ) {
+		for( i=0; i<n; i++ )
+			add_ip_header( is, pv[i].iov, pv[i].nvec );
+		sadd = 14;
+	}
+#ifdef __linux__
+	if( (is->flags & BATCH_IO) ) {
+		memset( msgs, 0, sizeof(msgs[0]) * n );
+		for( i=0; i<n; i++ ) {
+			msgs[i].msg_hdr.msg_iov = pv[i].iov;
+			msgs[i].msg_hdr.msg_iovlen = pv[i].nvec;
+		}
+		if( (ret=recvmmsg(is->fd, msgs, n, MSG_DONTWAIT, NULL)) <= 0 )
+			return 0;
+		for( i=0; i<ret; i++ )
+			pv[i].len = msgs[i].msg_len + sadd;
+		return ret;
+	}
+#endif
+	for( i=0; i<n; i++ ) {
+		if( (ret=readv(is->fd, pv[i].iov, pv[i].nvec)) <= 0 )
+			break;
+		pv[i].len = ret + sadd;
+	}
+	return i;
+}
+
+/* discard everything queued on the interface; returns the number of packets */
+int
+drop_packets( enet_iface_t *is )
+{
+	char buf[PACKET_BUF_SIZE];
+	int n = 0;
+
+	while( read(is->fd, buf, sizeof(buf)) >= 0 )
+		n++;
+	return n;
+}
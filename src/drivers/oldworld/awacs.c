@@ -134,21 +134,22 @@ awacs_cleanup( void )
 static void
 player_entry( void *dummy )
 {
-	struct dma_read_pb pb;
+	struct dma_batch_pb pb;
 	ulong speed = SND_SPEED;
 	ulong format = SND_FORMAT;
-	size_t len;
-	char *src;
+	struct iovec vec[DMA_MAX_IOV], *iov;
+	int i, ret, nvec, len;
 
 	static int is_working=0;
 
 	/* No output device? */
 	for( ;; ) {
-		while( dma_read_req( as->txdma_irq, &pb) )
+		/* the OUTPUT_MORE commands up to the next interrupt at once */
+		while( dma_read_req_batch( as->txdma_irq, &pb) )
 			dma_wait( as->txdma_irq, DMA_READ, NULL );
 
 		if( as->dsp_fd == -1 ) {
-			dma_read_ack( as->txdma_irq, pb.req_count, &pb );
+			dma_read_ack_batch( as->txdma_irq, pb.total, &pb );
 			continue;
 		}
 
@@ -157,27 +158,39 @@ player_entry( void *dummy )
 			ioctl( as->dsp_fd, SNDCTL_DSP_SETFMT, &format );
 		}
 
-		len = pb.req_count - pb.res_count;
-		src = pb.buf + pb.res_count;
-
-		while( len>0 ) {
-			int ret;
-			
-			ret = write( as->dsp_fd, src, len );
-#ifdef DUMP_ROM_BELL
-			if( as->rombell_fd != -1 && ret>0 )
-				write( as->rombell_fd, src, ret );
-#endif
-			if( ret< 0 && (errno == EAGAIN || errno == EINTR ))
+		/* pb.iov must be left intact for the acknowledge */
+		memcpy( vec, pb.iov, pb.nvec * sizeof(struct iovec) );
+		iov = vec;
+		nvec = pb.nvec;
+		for( len=pb.total; len > 0; len -= ret ) {
+			ret = writev( as->dsp_fd, iov, nvec );
+			if( ret< 0 && (errno == EAGAIN || errno == EINTR )) {
+				ret = 0;
 				continue;
+			}
 			if( ret< 0 ){
 				perrorm("AWACS: write");
 				return;
 			}
-			src += ret;
-			len -= ret;
+			/* skip what was written */
+			for( i=ret; nvec && i >= iov->iov_len; nvec-- )
+				i -= (iov++)->iov_len;
+			if( nvec ) {
+				iov->iov_base = (char*)iov->iov_base + i;
+				iov->iov_len -= i;
+			}
+		}
+#ifdef DUMP_ROM_BELL
+		if( as->rombell_fd != -1 )
+			writev( as->rombell_fd, pb.iov, pb.nvec );
+#endif
+		/* the channel program was modified (or the channel stopped)
+		 * while we were playing; the batch is void, start over.
+		 */
+		if( dma_read_ack_batch( as->txdma_irq, pb.total, &pb ) ) {
+			is_working = 0;
+			continue;
 		}
-		dma_read_ack( as->txdma_irq, pb.req_count, &pb );
 		is_working = !pb.is_last;
 	}
 
@@ -49,7 +49,7 @@ alsa_query( int format, int rate, int *fragsize )
 {
 	if( rate != 44100 && rate != 22050 && rate != 48000 )
 		return -1;
-	if( !(format & (kSoundFormat_S16_BE | kSoundFormat_U8)) )
+	if( !(format & (kSoundFormat_S16_BE | kSoundFormat_S16_LE | kSoundFormat_U8)) )
 		return -1;
 	*fragsize = alsa_fragsize();
 
@@ -112,6 +112,8 @@ alsa_open( int format, int rate, int *fragsize, int ringmode )
 	}
 
 	alsaformat = SND_PCM_FORMAT_S16_BE;
+	if( format & kSoundFormat_S16_LE )
+		alsaformat = SND_PCM_FORMAT_S16_LE;
 	if( format & kSoundFormat_U8 )
 		alsaformat = SND_PCM_FORMAT_U8;
 	
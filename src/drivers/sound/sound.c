@@ -28,6 +28,7 @@
 #include "pci.h"
 #include "timer.h"
 #include "mac_registers.h"
+#include "debugger.h"
 #include "sound-iface.h"
 
 static struct {
@@ -41,7 +42,7 @@ static struct {
 
 	/* volume */
 	int		mute;
-	int		vol_updated;
+	volatile int	vol_updated;
 	int		lvol, rvol;	/* PCM volume (0-255) */
 
 	/* current mode */
@@ -55,11 +56,29 @@ static struct {
 	/* output driver */
 	sound_ops_t	*ops;
 
-	/* double buffering */
+	/* host format */
+	int		hwformat;	/* format the device was opened with */
+	int		swap;		/* byteswap S16_BE samples for the device */
+
+	/* double buffering (classic) */
 	int		dbufsize;	/* double buffer size */
-	char		*dbuf_src;	/* next input buffer */
-	int		dbuf_srcsize;	/* size of input buffer */
 	volatile int	dbuf_go;	/* generate irqs */
+	volatile int	paused;
+
+	/* single-producer (OSI) / single-consumer (audio thread) fifo */
+	char		*fifo;
+	uint		fifo_size;	/* power of two */
+	volatile uint	fifo_head;	/* written by the producer only */
+	volatile uint	fifo_tail;	/* written by the consumer only */
+	volatile uint	wcount;		/* number of sound writes */
+
+	/* latency control (bytes queued when the client is asked for more) */
+	volatile uint	target;
+	uint		min_target, max_target;
+
+	/* statistics */
+	volatile uint	underruns;
+	volatile uint	overruns;
 
 	/* ring buffer */
 	char		*ringbuf;	/* ringbuf (if non-NULL) */
@@ -69,6 +88,8 @@ static struct {
 
 	/* misc */
 	char		*startboingbuf;	/* too be freed */
+	char		*boing_src;	/* startup sound (played before the fifo) */
+	int		boing_len;
 
 	/* debugging */
 	/* int		debug_tbl; */
@@ -155,6 +176,196 @@ static sound_ops_t nosound_driver_ops = {
 };
 
 
+/************************************************************************/
+/*	sample conversion						*/
+/************************************************************************/
+
+/* Sound devices on little endian hosts usually want S16_LE samples. We
+ * swap the bytes here rather than leaving it to the (scalar) conversion
+ * layer of the sound library.
+ */
+static void
+swab16_c( char *dst, const char *src, int bytes )
+{
+	const u16 *s = (const u16*)src;
+	u16 *d = (u16*)dst;
+	int i;
+
+	for( i=0; i<bytes/2; i++ )
+		d[i] = (s[i] << 8) | (s[i] >> 8);
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+
+#define SSE2		__attribute__((target("sse2")))
+#define AVX2		__attribute__((target("avx2")))
+
+static SSE2 void
+swab16_sse2( char *dst, const char *src, int bytes )
+{
+	for( ; bytes >= 16; bytes -= 16, src += 16, dst += 16 ) {
+		__m128i v = _mm_loadu_si128( (const __m128i*)src );
+		_mm_storeu_si128( (__m128i*)dst, _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)) );
+	}
+	swab16_c( dst, src, bytes );
+}
+
+static AVX2 void
+swab16_avx2( char *dst, const char *src, int bytes )
+{
+	const __m256i m = _mm256_setr_epi8( 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+					    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 );
+
+	for( ; bytes >= 32; bytes -= 32, src += 32, dst += 32 ) {
+		__m256i v = _mm256_loadu_si256( (const __m256i*)src );
+		_mm256_storeu_si256( (__m256i*)dst, _mm256_shuffle_epi8(v, m) );
+	}
+	swab16_c( dst, src, bytes );
+}
+#endif /* x86 */
+
+#ifdef __aarch64__
+#include <arm_neon.h>
+
+static void
+swab16_neon( char *dst, const char *src, int bytes )
+{
+	for( ; bytes >= 16; bytes -= 16, src += 16, dst += 16 )
+		vst1q_u8( (u8*)dst, vrev16q_u8(vld1q_u8((const u8*)src)) );
+	swab16_c( dst, src, bytes );
+}
+#endif /* __aarch64__ */
+
+static void	(*swab16)( char *dst, const char *src, int bytes ) = swab16_c;
+
+static void
+select_swab16( void )
+{
+#if defined(__i386__) || defined(__x86_64__)
+	if( __builtin_cpu_supports("avx2") )
+		swab16 = swab16_avx2;
+	else if( __builtin_cpu_supports("sse2") )
+		swab16 = swab16_sse2;
+#elif defined(__aarch64__)
+	swab16 = swab16_neon;
+#endif
+}
+
+static inline void
+copy_samples( char *dst, const char *src, int bytes )
+{
+	if( ss.swap )
+		(*swab16)( dst, src, bytes );
+	else
+		memcpy( dst, src, bytes );
+}
+
+/* the format the device is opened with */
+static int
+device_format( int format )
+{
+#if BYTE_ORDER == LITTLE_ENDIAN
+	int fmt, dummy_fragsize;
+
+	if( (format & kSoundFormatMask) == kSoundFormat_S16_BE ) {
+		fmt = (format & ~kSoundFormatMask) | kSoundFormat_S16_LE;
+		if( !(*ss.ops->query)(fmt, ss.rate, &dummy_fragsize) )
+			return fmt;
+	}
+#endif
+	return format;
+}
+
+
+/************************************************************************/
+/*	sample fifo							*/
+/************************************************************************/
+
+/* The classic driver passes buffers through osip_sound_write (the producer)
+ * and the audio thread (the consumer) feeds the device. Each side only
+ * writes its own index, so the fifo needs no lock.
+ */
+
+/* time without underruns before the latency target is lowered */
+#define CALM_SECS		10
+
+static inline uint
+fifo_fill( void )
+{
+	return ss.fifo_head - ss.fifo_tail;
+}
+
+/* must not be called while the audio thread is running */
+static int
+fifo_alloc( void )
+{
+	uint size;
+
+	/* room for the maximal target and two client buffers */
+	for( size=4096; size < ss.dbufsize * 6; size <<= 1 )
+		;
+	if( size != ss.fifo_size ) {
+		free( ss.fifo );
+		ss.fifo_size = 0;
+		if( !(ss.fifo=malloc(size)) )
+			return -1;
+		ss.fifo_size = size;
+	}
+	ss.fifo_head = ss.fifo_tail = 0;
+	return 0;
+}
+
+static void
+fifo_put( const char *buf, uint len )
+{
+	uint head = ss.fifo_head;
+	uint space = ss.fifo_size - (head - ss.fifo_tail);
+	uint off = head & (ss.fifo_size - 1);
+	uint n;
+
+	if( len > space ) {
+		ss.overruns++;
+		len = space;
+	}
+	n = MIN( len, ss.fifo_size - off );
+	memcpy( ss.fifo + off, buf, n );
+	memcpy( ss.fifo, buf + n, len - n );
+
+	/* the samples must be visible before the index */
+	__sync_synchronize();
+	ss.fifo_head = head + len;
+}
+
+static uint
+fifo_get( char *dst, uint len )
+{
+	uint tail = ss.fifo_tail;
+	uint off = tail & (ss.fifo_size - 1);
+	uint n;
+
+	len = MIN( len, ss.fifo_head - tail );
+	__sync_synchronize();
+
+	n = MIN( len, ss.fifo_size - off );
+	copy_samples( dst, ss.fifo + off, n );
+	copy_samples( dst + n, ss.fifo, len - n );
+
+	/* the samples must be read before the space is released */
+	__sync_synchronize();
+	ss.fifo_tail = tail + len;
+	return len;
+}
+
+static void
+reset_latency( void )
+{
+	ss.min_target = MIN( ss.fragsize, ss.dbufsize );
+	ss.max_target = ss.dbufsize * 4;
+	ss.target = ss.dbufsize;
+}
+
+
 /************************************************************************/
 /*	Sound Engine							*/
 /************************************************************************/
@@ -168,20 +379,41 @@ sound_calc_bpf( int format )
 	return bpf;
 }
 
+static void
+update_volume( void )
+{
+	int lvol, rvol;
+
+	if( !ss.vol_updated || !ss.ops->volume )
+		return;
+	LOCK;
+	ss.vol_updated = 0;
+	lvol = ss.lvol;
+	rvol = ss.rvol;
+	UNLOCK;
+	(*ss.ops->volume)( lvol, rvol );
+}
+
 static void
 ring_engine( void )
 {
-	char *p;
+	char *p, *frag = NULL;
+
+	if( ss.swap && !(frag=malloc(ss.fragsize)) ) {
+		printm("sound: out of memory\n");
+		return;
+	}
 	DEBUG_SND("Ring Engine: Started\n");
 	
 	while( ss.thread_running > 0 ) {
 		p = ss.ringbuf + ss.ringind * ss.fragsize;
 
-		if( ss.vol_updated && ss.ops->volume ) {
-			ss.vol_updated = 0;
-			(*ss.ops->volume)( ss.lvol, ss.rvol );
-		}
 		UNLOCK;
+		update_volume();
+		if( frag ) {
+			copy_samples( frag, p, ss.fragsize );
+			p = frag;
+		}
 		(*ss.ops->write)( p, ss.fragsize );
 		LOCK;
 
@@ -200,54 +432,74 @@ ring_engine( void )
 			abort_doze();
 		}
 	}
+	free( frag );
 	DEBUG_SND("Ring Engine: Stopped\n");
 }
 
-
 static void
-dbuf_engine( void )
+fifo_engine( void )
 {
-	char *dbuf = malloc( ss.dbufsize );
-	int dbuf_cnt = 0;
+	char *frag = malloc( ss.fragsize );
+	uint n, got, calm = 0, calm_limit = ss.rate * ss.bpf * CALM_SECS;
+	uint dry_mark = ss.wcount - (fifo_fill() ? 1 : 0);
+	int silence = (ss.format & kSoundFormat_U8) ? 0x80 : 0;
+
+	if( !frag ) {
+		printm("sound: out of memory\n");
+		return;
+	}
 
+	/* the lock is only taken for control events */
+	UNLOCK;
 	for( ;; ) {
-		/* double buffering */
-		if( dbuf_cnt ) {
-			if( ss.vol_updated && ss.ops->volume ) {
-				ss.vol_updated = 0;
-				(*ss.ops->volume)( ss.lvol, ss.rvol );
+		update_volume();
+
+		n = ss.fragsize;
+		if( ss.boing_len ) {
+			got = MIN( n, ss.boing_len );
+			copy_samples( frag, ss.boing_src, got );
+			ss.boing_src += got;
+			ss.boing_len -= got;
+		} else if( (got=fifo_get(frag, n)) < n ) {
+			if( !got && ss.thread_running < 0 ) {
+				LOCK;
+				if( ss.thread_running < 0 )
+					break;
+				UNLOCK;
 			}
-			UNLOCK;
-			(*ss.ops->write)( dbuf, dbuf_cnt );
-			dbuf_cnt = 0;
-			LOCK;
-		}
 
-		/* switch doublebuffer */
-		if( !ss.dbuf_srcsize ) {
-			if( ss.thread_running < 0 )
-				break;
-			/* buffer underrun, drop frame */
-			DEBUG_SND("Sound Double Buffer: Sound frame dropped\n");
-			memset( dbuf, 0, ss.dbufsize );
-			dbuf_cnt = ss.dbufsize;
-		} else {
-			int size = MIN(ss.dbuf_srcsize, ss.dbufsize);
-			memcpy( dbuf, ss.dbuf_src, size );
-			dbuf_cnt = size;
-			ss.dbuf_src += size;
-			ss.dbuf_srcsize -= size;
+			/* count a dry fifo once, unless the client paused or stopped */
+			if( ss.wcount != dry_mark && !ss.paused && ss.thread_running > 0 ) {
+				DEBUG_SND("Sound fifo underrun (target %d)\n", ss.target );
+				ss.underruns++;
+				ss.target = MIN( ss.target + ss.fragsize, ss.max_target );
+				calm = 0;
+			}
+			dry_mark = ss.wcount;
+		} else if( (calm += got) >= calm_limit ) {
+			/* no underruns for a while, try a lower latency */
+			if( ss.target > ss.min_target + ss.fragsize )
+				ss.target -= ss.fragsize;
+			else
+				ss.target = ss.min_target;
+			calm = 0;
 		}
-	
-		if( ss.dbuf_go ) {
-			ss.dbuf_go = 0;
-			irq_line_hi( ss.irq );
+
+		if( ss.dbuf_go && fifo_fill() <= ss.target ) {
+			LOCK;
+			if( ss.dbuf_go ) {
+				ss.dbuf_go = 0;
+				irq_line_hi( ss.irq );
+			}
+			UNLOCK;
 		}
+		if( got < n )
+			memset( frag + got, silence, n - got );
+		(*ss.ops->write)( frag, n );
 	}
-	free( dbuf );
+	free( frag );
 }
 
-
 static void
 audio_thread( void *dummy )
 {
@@ -255,7 +507,7 @@ audio_thread( void *dummy )
 	if( ss.ringbuf )
 		ring_engine();
 	else
-		dbuf_engine();
+		fifo_engine();
 
 	if( ss.ops->flush )
 		(*ss.ops->flush)();
@@ -266,6 +518,7 @@ audio_thread( void *dummy )
 	if( ss.startboingbuf ) {
 		free( ss.startboingbuf );
 		ss.startboingbuf = NULL;
+		ss.boing_len = 0;
 	}
 	UNLOCK;
 }
@@ -314,9 +567,6 @@ set_mode( int format, int rate )
 	if( (ret=(*ss.ops->query)(format, rate, &fragsize)) < 0 )
 		return ret;
 
-	lastformat = format;
-	lastrate = rate;
-
 	ss.rate = rate;
 	ss.bpf = sound_calc_bpf( format );
 	ss.fragsize = fragsize;
@@ -329,6 +579,13 @@ set_mode( int format, int rate )
 		;
 	ss.dbufsize = bufsize;
 
+	/* only cache the mode once it is fully set up */
+	lastformat = -2;
+	if( fifo_alloc() )
+		return -1;
+	lastformat = format;
+	lastrate = rate;
+
 	DEBUG_SND("SoundMode: %x, %d Hz, %d/%d\n", format, rate, fragsize, bufsize );
 	return 0;
 }
@@ -342,6 +599,7 @@ stop_sound( void )
 
 	LOCK;
 	ss.thread_running = -1;
+	ss.dbuf_go = 0;
 	irq_line_low( ss.irq );
 	UNLOCK;
 
@@ -364,10 +622,15 @@ start_sound( void )
 		ss.thread_running = 2;
 	} else {
 		int ringmode = ss.ringbuf ? 1:0;
-		if( (*ss.ops->open)(ss.format, ss.rate, &ss.fragsize, ringmode) ) {
+		ss.hwformat = device_format( ss.format );
+		ss.swap = (ss.hwformat != ss.format);
+		if( (*ss.ops->open)(ss.hwformat, ss.rate, &ss.fragsize, ringmode) ) {
 			printm("audiodevice unavailable\n");
 			nosound_open( ss.format, ss.rate, &ss.fragsize, ringmode );
+			ss.hwformat = ss.format;
+			ss.swap = 0;
 		}
+		reset_latency();
 		ss.thread_running = 1;
 		create_thread( (void*)audio_thread, NULL, "audio-thread" );
 	}
@@ -379,15 +642,19 @@ start_sound( void )
 static void
 resume_sound( void )
 {
-	if( ss.started )
+	if( ss.started ) {
+		ss.paused = 0;
 		ss.dbuf_go = 1;
+	}
 }
 
 static void
 pause_sound( void )
 {
-	if( ss.started )
+	if( ss.started ) {
+		ss.paused = 1;
 		ss.dbuf_go = 0;
+	}
 }
 
 
@@ -484,14 +751,13 @@ osip_sound_write( int sel, int *params )
 	char *buf = transl_mphys( params[0] );
 	int len = params[1];
 	
-	if( !params[0] || !buf )
+	if( !params[0] || !buf || !ss.fifo || len < 0 )
 		return -1;
 
-	if( ss.dbuf_srcsize )
-		printm("warning: ss.dbuf_srcsize != 0\n");
-
-	ss.dbuf_src = buf;
-	ss.dbuf_srcsize = len;
+	/* the buffer is copied, the client may reuse it immediately */
+	fifo_put( buf, len - len % ss.bpf );
+	ss.wcount++;
+	ss.paused = 0;
 	ss.dbuf_go = 1;
 
 	return 0;
@@ -548,13 +814,11 @@ startboing( void )
 			return;
 		}
 			
-		ss.dbuf_src = buf;
-		ss.dbuf_srcsize = len;
-		ss.dbuf_go = 1;
-		ss.startboingbuf = buf;
+		/* played by the audio thread ahead of the fifo */
+		ss.boing_src = ss.startboingbuf = buf;
+		ss.boing_len = len - len % 4;
 	}
 	close( fd );
-	free(buf);
 
 	set_mode( kSoundFormat_S16_BE | kSoundFormat_Stereo, 22050 );
 	start_sound();
@@ -562,6 +826,41 @@ startboing( void )
 }
 
 
+/************************************************************************/
+/*	debugger							*/
+/************************************************************************/
+
+/* sound statistics */
+static int __dcmd
+cmd_sndstat( int argc, char **argv )
+{
+	uint bpms = ss.rate * ss.bpf / 1000;
+
+	if( argc == 2 && !strcmp(argv[1], "clear") ) {
+		ss.underruns = ss.overruns = 0;
+		return 0;
+	}
+	if( argc != 1 )
+		return 1;
+	if( !bpms ) {
+		printm("No sound format set\n");
+		return 0;
+	}
+	printm("Format %x (device %x), %d Hz, fragsize %d, bufsize %d\n",
+	       ss.format, ss.hwformat, ss.rate, ss.fragsize, ss.dbufsize );
+	printm("Fifo: %d/%d bytes, target %d bytes (%d ms), range %d-%d\n",
+	       fifo_fill(), ss.fifo_size, ss.target, ss.target / bpms, ss.min_target, ss.max_target );
+	printm("Underruns: %d, overruns: %d\n", ss.underruns, ss.overruns );
+	return 0;
+}
+
+static dbg_cmd_t dbg_cmds[] = {
+#ifdef CONFIG_DEBUGGER
+	{ "sndstat", cmd_sndstat, "sndstat [clear] \nshow sound fifo statistics\n" },
+#endif
+};
+
+
 /************************************************************************/
 /*	init / cleanup							*/
 /************************************************************************/
@@ -587,6 +886,8 @@ osi_sound_init( void )
 		return 0;
 	}
 	pthread_mutex_init( &ss.lock, NULL );
+	select_swab16();
+	add_dbg_cmds( dbg_cmds, sizeof(dbg_cmds) );
 
 	/* handle user rate limits */
 	if( (limit=get_numeric_res("sound.maxrate")) > 0 )
@@ -629,6 +930,7 @@ osi_sound_cleanup( void )
 	wait_sound_stopped();
 	if( ss.ops->cleanup )
 		(*ss.ops->cleanup)();
+	free( ss.fifo );
 }
 
 driver_interface_t osi_sound_driver = {
@@ -37,6 +37,10 @@
 
 #define	NDP			8		/* #downstream ports */
 #define SOF_PERIOD_MS		37		/* frame period (37 ms) */ 
+#define SOF_POLL_MS		(SOF_PERIOD_MS * 8)	/* periodic list polling */
+#define FM_SYNC_MS		16384		/* frame counter keepalive (FNO interrupts) */
+#define RESCAN_MS		(SOF_POLL_MS * 2)	/* full walk of the interrupt lists */
+#define MAX_PERIODIC_EDS	64		/* distinct EDs remembered by a periodic scan */
 #define USB_DEBUG		0
 
 /* cu->submitted field */
@@ -93,12 +97,21 @@ struct usb_device {
 	struct usb_device *next;
 };
 
+/* interrupt ED found by the last walk of the periodic lists */
+typedef struct {
+	int		mphys;
+	int		list_type;		/* INTERRUPT_LIST | index */
+	int		headp, tailp;		/* when last examined */
+	int		idle;			/* no TDs queued */
+} periodic_ed_t;
+
 /* host controller state */
 typedef struct {
 	int		irq;			/* irq# */
 	int		bar;
 	int		range_id;
 	int		timer_id;		/* SOF periodic timer */
+	int		sof_period;		/* ms, 0 if the timer is paused */
 
 	int		r[ NUM_HC_REGS + NDP ];	/* big endian */
 	hcca_t		*hcca;
@@ -110,7 +123,14 @@ typedef struct {
 	usb_device_t	*devs;
 	priv_urb_t	*urbs;			/* submitted urbs */
 
-	int		next_periodic_ind;
+	/* the frame counter is derived from the clock */
+	int		fm_base;		/* frame number at fm_stamp */
+	ullong		fm_stamp;
+
+	periodic_ed_t	ped[ MAX_PERIODIC_EDS ];	/* interrupt EDs, in walk order */
+	int		n_ped;
+	int		rescan_ms;		/* since the last walk */
+	int		periodic_idle;		/* idle interrupt EDs (the guest may fill them silently) */
 	int		opti_workaround;	/* fix for OPTi hc driver */
 } ohci_t;
 
@@ -122,6 +142,7 @@ static ohci_t	hc;
 
 static void		process_endpoint( ohci_ed_t *ed, int ed_mphys, int list_type );
 static void		poll_lists( void );
+static void		schedule_sof( void );
 
 #if 0
 static char *regnames[ NUM_HC_REGS + NDP ] = {
@@ -228,8 +249,10 @@ hc_reset( int soft )
 	hc.r[ HC_RH_DESC_A ] = NDP | POTPGT_2MS * 10;
 	
 	hc.hcca = NULL;
+	hc.periodic_idle = 0;
 
 	update_port_status();
+	schedule_sof();
 }
 
 static void
@@ -893,24 +916,6 @@ poll_lists( void )
 /*	periodic list handling						*/
 /************************************************************************/
 
-static void
-rescan_periodic_list( void )
-{
-	int mphys, ind, ctrl = hc.r[ HC_CONTROL ];
-
-	if( !hc.hcca )
-		return;
-	
-	/* issue periodic list(s) */
-	if( ctrl & CTRL_PLE ) {
-		ind = hc.next_periodic_ind++ & INTERRUPT_IND_MASK;
-
-		mphys = hc.hcca->int_table[ind];
-		mphys = cpu_to_le32( mphys );
-		process_list( mphys, INTERRUPT_LIST | ind );
-	}
-}
-
 /* Interrupt urbs don't necessary complete in a timely fashion; in order
  * to prevent accumulation of stale (e.g. relinked) urbs, we check
  * the urb list now and then. (This is perhaps a bit overkill; in practice
@@ -959,6 +964,102 @@ clean_stale_interrupt_urbs( void )
 	}	
 }
 
+/* Issues the first TD of an interrupt ED unless it is already in flight.
+ * Returns 1 if the ED is idle (no TDs queued).
+ */
+static int
+issue_periodic_ed( periodic_ed_t *p, ohci_ed_t *ed )
+{
+	int td_mphys = ed->headp & ~0xf;
+	priv_urb_t *u;
+
+	p->headp = ed->headp;
+	p->tailp = ed->tailp;
+	if( ed->k || (ed->headp & HEADP_H) )
+		return 0;
+	if( ed->tailp == td_mphys )
+		return 1;
+	/* first TD already submitted? */
+	for( u=hc.urbs; u; u=u->next )
+		if( u->ed_mphys == p->mphys && u->td_mphys == td_mphys )
+			return 0;
+	process_endpoint( ed, p->mphys, p->list_type );
+	return 0;
+}
+
+/* Issue the interrupt lists. The 32 lists form a tree; a chain is only
+ * followed until it joins an ED visited before. This is done when the guest
+ * has had a chance to queue TDs (done queue processed, list enabled etc).
+ * The EDs are remembered for poll_idle_eds.
+ */
+static void
+scan_periodic_lists( void )
+{
+	periodic_ed_t *p, spare;
+	int i, j, hops, mphys, idle=0;
+	ohci_ed_t ed;
+
+	hc.periodic_idle = hc.n_ped = hc.rescan_ms = 0;
+	if( !hc.hcca || !IS_OPERATIONAL() || !(hc.r[HC_CONTROL] & CTRL_PLE) )
+		return;
+
+	for( i=0; i<32; i++ ) {
+		mphys = hc.hcca->int_table[i];
+		mphys = cpu_to_le32( mphys );
+
+		for( hops=0; mphys && hops < 256; mphys=ed.nexted, hops++ ) {
+			for( j=0; j<hc.n_ped && hc.ped[j].mphys != mphys; j++ )
+				;
+			if( j < hc.n_ped )
+				break;
+			p = (hc.n_ped < MAX_PERIODIC_EDS) ? &hc.ped[hc.n_ped++] : &spare;
+			p->mphys = mphys;
+			p->list_type = INTERRUPT_LIST | i;
+
+			get_ed( &ed, mphys );
+			/* isochronous ed terminates periodic list */
+			if( ed.f ) {
+				hc.n_ped -= (p != &spare);
+				break;
+			}
+			idle += (p->idle=issue_periodic_ed( p, &ed ));
+		}
+	}
+	hc.periodic_idle = idle;
+	clean_stale_interrupt_urbs();
+}
+
+/* The guest can append TDs to an idle ED without any register access. The
+ * timer rereads the idle EDs of the last walk in between the full walks;
+ * one is examined if its queue pointers changed.
+ */
+static void
+poll_idle_eds( void )
+{
+	periodic_ed_t *p;
+	ohci_ed_t ed;
+	int i, idle=0;
+
+	/* too many EDs to remember */
+	if( hc.n_ped == MAX_PERIODIC_EDS ) {
+		scan_periodic_lists();
+		return;
+	}
+	if( !hc.hcca || !IS_OPERATIONAL() || !(hc.r[HC_CONTROL] & CTRL_PLE) ) {
+		hc.periodic_idle = 0;
+		return;
+	}
+	for( i=0, p=hc.ped; i<hc.n_ped; i++, p++ ) {
+		if( !p->idle )
+			continue;
+		get_ed( &ed, p->mphys );
+		if( ed.headp != p->headp || ed.tailp != p->tailp )
+			p->idle = issue_periodic_ed( p, &ed );
+		idle += p->idle;
+	}
+	hc.periodic_idle = idle;
+}
+
 
 /************************************************************************/
 /*	user urb completeion 						*/
@@ -1030,21 +1131,27 @@ complete_urb( urb_t *uurb, int status )
 /*	start of frame							*/
 /************************************************************************/
 
-/* assertion: HCFS_OPERATIONAL */
+/* Advance the frame counter to the current time */
 static void
-sof_timer( int id, void *dummy, int lost ) 
+sync_frame( void )
 {
-	static int cnt;
-	int elapsed, old, new;
+	ullong mt, tbfreq = get_timebase_frequency();
+	ullong frames;
+	int old, new;
+
+	if( !IS_OPERATIONAL() )
+		return;
+
+	/* 64-bit (mticks_to_usecs wraps after 71 minutes) */
+	mt = get_mticks_() - hc.fm_stamp;
+	frames = (mt / tbfreq) * 1000 + (mt % tbfreq) * 1000 / tbfreq;
 
-	hc.irq_status |= INT_SF;
-	fix_irq();
 	old = hc.r[HC_FM_NUMBER];
+	new = (hc.fm_base + (int)(frames & 0xffff)) & 0xffff;
+	if( new == old )
+		return;
 
-	/* use realtime frame increments (avoids startup delay) */ 
-	elapsed = (lost + 1) * SOF_PERIOD_MS;
-	new = (old + elapsed) & 0xffff;
-	
+	hc.irq_status |= INT_SF;
 	/* frame number overflow? (bit15 flipped) */
 	if( (old^new) & 0x8000 )
 		hc.irq_status |= INT_FNO;
@@ -1052,16 +1159,58 @@ sof_timer( int id, void *dummy, int lost )
 	hc.r[HC_FM_NUMBER] = new;
 	if( hc.hcca )
 		hc.hcca->frame_num = cpu_to_le32( new );
+	fix_irq();
+}
 
-	/* save some cycles and rescan only now and then */
-	if( !(cnt++ & 0x7) )
-		rescan_periodic_list();
-	if( !(cnt & 0x3f) )
-		clean_stale_interrupt_urbs();
-	
-	/* should not be necessary... */
-	/* update_done_head(); */
-	/* poll_lists( void ); */
+/* The SOF timer only runs when the guest wants SOF interrupts or when the
+ * periodic list is enabled (EDs and TDs can be added to it without any
+ * register access). Otherwise, it only runs to raise FNO interrupts, if
+ * enabled; the frame counter is brought up to date whenever the guest
+ * reads it.
+ */
+static void
+schedule_sof( void )
+{
+	int period = 0;
+
+	if( IS_OPERATIONAL() ) {
+		if( hc.irq_enable & INT_SF )
+			period = SOF_PERIOD_MS;
+		else if( hc.r[HC_CONTROL] & CTRL_PLE )
+			period = SOF_POLL_MS;
+		else if( hc.irq_enable & INT_FNO )
+			period = FM_SYNC_MS;
+	}
+	if( period == hc.sof_period )
+		return;
+	hc.sof_period = period;
+
+	if( period )
+		set_ptimer( hc.timer_id, period * 1000 );
+	else
+		pause_ptimer( hc.timer_id );
+}
+
+/* the guest might have (re)queued periodic TDs */
+static void
+kick_periodic( void )
+{
+	scan_periodic_lists();
+	schedule_sof();
+}
+
+/* assertion: HCFS_OPERATIONAL */
+static void
+sof_timer( int id, void *dummy, int lost ) 
+{
+	sync_frame();
+
+	/* new EDs (or EDs no longer skipped) are only found by a full walk */
+	if( (hc.rescan_ms += hc.sof_period) >= RESCAN_MS )
+		scan_periodic_lists();
+	else if( hc.periodic_idle )
+		poll_idle_eds();
+	schedule_sof();
 }
 
 
@@ -1079,6 +1228,8 @@ reg_io_read( ulong addr, int len, void *usr )
 		printm("strange USB read\n");
 		return 0;
 	}
+	if( r == HC_FM_NUMBER || r == HC_INT_STATUS )
+		sync_frame();
 	ret = hc.r[r];
 
 	switch( r ) {
@@ -1194,9 +1345,6 @@ reg_io_write( ulong addr, ulong data, int len, void *usr )
 		hc.r[r] = val;
 		/* enable bits for the various lists, functional state */
 		if( (val & HCFS_MASK) != (old & HCFS_MASK) ) {
-			if( (old & HCFS_MASK) == HCFS_OPERATIONAL )
-				pause_ptimer( hc.timer_id );
-			
 			switch( val & HCFS_MASK ) {
 			case HCFS_RESET:
 				/* printm("USB HC RESET\n"); */
@@ -1207,6 +1355,8 @@ reg_io_write( ulong addr, ulong data, int len, void *usr )
 				break;
 			case HCFS_OPERATIONAL:
 				/* printm("FS_OPERATIONAL\n"); */
+				hc.fm_base = hc.r[HC_FM_NUMBER];
+				hc.fm_stamp = get_mticks_();
 				update_done_head();
 				poll_lists();
 				break;
@@ -1215,9 +1365,9 @@ reg_io_write( ulong addr, ulong data, int len, void *usr )
 				/* printm("FS_SUSPEND\n"); */
 				break;
 			}
-			if( IS_OPERATIONAL() )
-				set_ptimer( hc.timer_id, SOF_PERIOD_MS * 1000 );
 		}
+		if( (val ^ old) & (HCFS_MASK | CTRL_PLE) )
+			kick_periodic();
 		val = hc.r[r];
 		break;
 	case HC_CMD_STATUS:
@@ -1249,18 +1399,24 @@ reg_io_write( ulong addr, ulong data, int len, void *usr )
 	case HC_INT_STATUS:
 		hc.irq_status &= ~val;
 		/* update done head from here rather from the sof-timer */
-		if( (val & INT_WDH) )
+		if( (val & INT_WDH) ) {
 			update_done_head();
+			/* the done queue has been processed, TDs are probably requeued */
+			kick_periodic();
+		}
 		break;
 	case HC_INT_ENABLE:
 		hc.irq_enable |= val;
+		schedule_sof();
 		break;
 	case HC_INT_DISABLE:
 		hc.irq_enable &= ~val;
+		schedule_sof();
 		break;
 	case HC_HCCA:
 		val &= ~0xff;
 		hc.hcca = val ? transl_mphys(val) : 0;
+		kick_periodic();
 		break;
 	case HC_CNTRL_HEAD_ED:
 	case HC_BULK_HEAD_ED:
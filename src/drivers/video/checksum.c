@@ -26,7 +26,9 @@
 typedef void vcksum_func( u32 *ctab, int ctab_add, int height, int fbadd, 
 			  char *fbdata, u32 *dirtytable, u32 dirtybit, int block_width );
 
+#ifdef __ppc__
 extern vcksum_func 	vchecksum_4, vchecksum_2, vchecksum_1;
+#endif
 
 struct video_cksum {
 	video_desc_t 	*vmode;		/* video mode */
@@ -38,67 +40,231 @@ struct video_cksum {
 	int		bpp_shift;	/* bytes per pixel shift */
 	
 	u32 		*t;		/* table of size lines*n_blks */
-	u32		*dirty;		/* indexed by lines */
+	u32		*dirty;		/* n_planes tables indexed by lines */
+	int		n_planes;	/* one bit per block, 32 blocks per plane */
 
 	vcksum_func	*func;		/* lowlevel checksum func */
 };
 
 #ifndef __ppc__
-void
-vchecksum_1( u32 *ctab, int ctab_add, int height, int fbadd, 
-	     char *fbdata, u32 *dirtytable, u32 dirtybit, int block_width )
+/* The non-PPC kernels hash each block line as eight independent 32-bit lanes
+ * (two 16 byte halves of every 32 byte chunk). There is no serial dependency
+ * between the lanes, which lets SSE2/AVX2/NEON handle a whole chunk per step;
+ * all implementations compute the same value. A block line is at least 16 bytes
+ * (see alloc_vcksum); a partial chunk at the end is loaded so that it ends at
+ * the last byte of the block, i.e. nothing outside the block is read.
+ */
+#define CSUM_SEED	13
+#define ROTL( x, n )	(((x) << (n)) | ((x) >> (32-(n))))
+
+static inline u32
+fold_lanes( const u32 *a, const u32 *b )
 {
-	u32 *p = (u32*)fbdata;
-	int i, j;
-	
-	for( i=0; i<height; i++, p=(u32*)((char*)p + fbadd) ) {
-		u32 csum = 13;
-		for( j=0 ; j < block_width/4; j+=4 )
-			csum = (p[j] + p[j+1] + p[j+1] + ~(csum-p[j+2]) + (csum <<1)) ^ p[j+3];
-		if (csum != *ctab) {
-			dirtytable[i] |= dirtybit;
-			*ctab = csum;
-		}
-		ctab = (u32*)((char*)ctab + ctab_add);
+	u32 c0 = a[0] ^ ROTL(b[0],16), c1 = a[1] ^ ROTL(b[1],16);
+	u32 c2 = a[2] ^ ROTL(b[2],16), c3 = a[3] ^ ROTL(b[3],16);
+
+	return c0 + ROTL(c1,8) + ROTL(c2,16) + ROTL(c3,24);
+}
+
+#define VCHECKSUM_FUNCS( isa, attr )							\
+static attr void									\
+vchecksum_##isa( u32 *ctab, int ctab_add, int height, int fbadd,			\
+		 char *fbdata, u32 *dirtytable, u32 dirtybit, int bytes )		\
+{											\
+	int i;										\
+	for( i=0; i<height; i++, fbdata += fbadd ) {					\
+		u32 csum = vhash_##isa( fbdata, bytes );				\
+		if( csum != *ctab ) {							\
+			dirtytable[i] |= dirtybit;					\
+			*ctab = csum;							\
+		}									\
+		ctab = (u32*)((char*)ctab + ctab_add);					\
+	}										\
+}											\
+static void										\
+vchecksum_##isa##_1( u32 *ctab, int ctab_add, int height, int fbadd,			\
+		     char *fbdata, u32 *dirtytable, u32 dirtybit, int block_width )	\
+{											\
+	vchecksum_##isa( ctab, ctab_add, height, fbadd, fbdata, dirtytable, dirtybit, block_width ); \
+}											\
+static void										\
+vchecksum_##isa##_2( u32 *ctab, int ctab_add, int height, int fbadd,			\
+		     char *fbdata, u32 *dirtytable, u32 dirtybit, int block_width )	\
+{											\
+	vchecksum_##isa( ctab, ctab_add, height, fbadd, fbdata, dirtytable, dirtybit, block_width << 1 ); \
+}											\
+static void										\
+vchecksum_##isa##_4( u32 *ctab, int ctab_add, int height, int fbadd,			\
+		     char *fbdata, u32 *dirtytable, u32 dirtybit, int block_width )	\
+{											\
+	vchecksum_##isa( ctab, ctab_add, height, fbadd, fbdata, dirtytable, dirtybit, block_width << 2 ); \
+}
+
+/* portable C version */
+static inline void
+step_c( u32 *h, const char *p )
+{
+	u32 v[4];
+	int i;
+
+	memcpy( v, p, 16 );
+	for( i=0; i<4; i++ )
+		h[i] = (h[i] + v[i]) ^ ROTL( h[i], 7 );
+}
+
+static inline u32
+vhash_c( const char *p, int bytes )
+{
+	u32 a[4] = { CSUM_SEED, CSUM_SEED, CSUM_SEED, CSUM_SEED };
+	u32 b[4] = { CSUM_SEED, CSUM_SEED, CSUM_SEED, CSUM_SEED };
+	const char *end = p + bytes;
+
+	for( ; end - p >= 32; p += 32 ) {
+		step_c( a, p );
+		step_c( b, p + 16 );
 	}
+	if( end - p >= 16 ) {
+		step_c( a, p );
+		p += 16;
+	}
+	if( end - p > 0 )
+		step_c( b, end - 16 );
+	return fold_lanes( a, b );
 }
+VCHECKSUM_FUNCS( c, )
 
-void
-vchecksum_2( u32 *ctab, int ctab_add, int height, int fbadd, 
-	     char *fbdata, u32 *dirtytable, u32 dirtybit, int block_width )
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+
+#define SSE2		__attribute__((target("sse2")))
+#define AVX2		__attribute__((target("avx2")))
+
+static inline SSE2 __m128i
+step_sse2( __m128i h, const char *p )
 {
-	u32 *p = (u32*)fbdata;
-	int i, j;
-	
-	for( i=0; i<height; i++, p=(u32*)((char*)p + fbadd) ) {
-		u32 csum = 13;
-		for( j=0 ; j < block_width/2; j+=4 )
-			csum = (p[j] + p[j+1] + p[j+1] + ~(csum-p[j+2]) + (csum <<1)) ^ p[j+3];
-		if (csum != *ctab) {
-			dirtytable[i] |= dirtybit;
-			*ctab = csum;
-		}
-		ctab = (u32*)((char*)ctab + ctab_add);
+	__m128i v = _mm_loadu_si128( (const __m128i*)p );
+	__m128i r = _mm_or_si128( _mm_slli_epi32(h, 7), _mm_srli_epi32(h, 25) );
+
+	return _mm_xor_si128( _mm_add_epi32(h, v), r );
+}
+
+static inline SSE2 u32
+fold_sse2( __m128i a, __m128i b )
+{
+	u32 la[4], lb[4];
+
+	_mm_storeu_si128( (__m128i*)la, a );
+	_mm_storeu_si128( (__m128i*)lb, b );
+	return fold_lanes( la, lb );
+}
+
+static inline SSE2 u32
+vhash_sse2( const char *p, int bytes )
+{
+	__m128i a = _mm_set1_epi32( CSUM_SEED ), b = a;
+	const char *end = p + bytes;
+
+	for( ; end - p >= 32; p += 32 ) {
+		a = step_sse2( a, p );
+		b = step_sse2( b, p + 16 );
+	}
+	if( end - p >= 16 ) {
+		a = step_sse2( a, p );
+		p += 16;
 	}
+	if( end - p > 0 )
+		b = step_sse2( b, end - 16 );
+	return fold_sse2( a, b );
 }
+VCHECKSUM_FUNCS( sse2, SSE2 )
 
-void
-vchecksum_4( u32 *ctab, int ctab_add, int height, int fbadd, 
-	     char *fbdata, u32 *dirtytable, u32 dirtybit, int block_width )
+static inline AVX2 u32
+vhash_avx2( const char *p, int bytes )
 {
-	u32 *p = (u32*)fbdata;
-	int i, j;
-	
-	for( i=0; i<height; i++, p=(u32*)((char*)p + fbadd) ) {
-		u32 csum = 13;
-		for( j=0 ; j < block_width; j+=4 )
-			csum = (p[j] + p[j+1] + p[j+1] + ~(csum-p[j+2]) + (csum <<1)) ^ p[j+3];
-		if (csum != *ctab) {
-			dirtytable[i] |= dirtybit;
-			*ctab = csum;
-		}
-		ctab = (u32*)((char*)ctab + ctab_add);
+	__m256i h = _mm256_set1_epi32( CSUM_SEED );
+	const char *end = p + bytes;
+	__m128i a, b;
+
+	for( ; end - p >= 32; p += 32 ) {
+		__m256i v = _mm256_loadu_si256( (const __m256i*)p );
+		__m256i r = _mm256_or_si256( _mm256_slli_epi32(h, 7), _mm256_srli_epi32(h, 25) );
+		h = _mm256_xor_si256( _mm256_add_epi32(h, v), r );
 	}
+	a = _mm256_castsi256_si128( h );
+	b = _mm256_extracti128_si256( h, 1 );
+	if( end - p >= 16 ) {
+		a = step_sse2( a, p );
+		p += 16;
+	}
+	if( end - p > 0 )
+		b = step_sse2( b, end - 16 );
+	return fold_sse2( a, b );
+}
+VCHECKSUM_FUNCS( avx2, AVX2 )
+#endif /* x86 */
+
+#ifdef __aarch64__
+#include <arm_neon.h>
+
+static inline uint32x4_t
+step_neon( uint32x4_t h, const char *p )
+{
+	uint32x4_t v = vld1q_u32( (const uint32_t*)p );
+
+	return veorq_u32( vaddq_u32(h, v), vsriq_n_u32(vshlq_n_u32(h, 7), h, 25) );
+}
+
+static inline u32
+vhash_neon( const char *p, int bytes )
+{
+	uint32x4_t a = vdupq_n_u32( CSUM_SEED ), b = a;
+	const char *end = p + bytes;
+	u32 la[4], lb[4];
+
+	for( ; end - p >= 32; p += 32 ) {
+		a = step_neon( a, p );
+		b = step_neon( b, p + 16 );
+	}
+	if( end - p >= 16 ) {
+		a = step_neon( a, p );
+		p += 16;
+	}
+	if( end - p > 0 )
+		b = step_neon( b, end - 16 );
+	vst1q_u32( la, a );
+	vst1q_u32( lb, b );
+	return fold_lanes( la, lb );
+}
+VCHECKSUM_FUNCS( neon, )
+#endif /* __aarch64__ */
+
+/* select the best kernel the host CPU supports */
+static void
+select_kernels( vcksum_func **f1, vcksum_func **f2, vcksum_func **f4 )
+{
+#if defined(__i386__) || defined(__x86_64__)
+	if( __builtin_cpu_supports("avx2") ) {
+		*f1 = vchecksum_avx2_1; *f2 = vchecksum_avx2_2; *f4 = vchecksum_avx2_4;
+		return;
+	}
+	if( __builtin_cpu_supports("sse2") ) {
+		*f1 = vchecksum_sse2_1; *f2 = vchecksum_sse2_2; *f4 = vchecksum_sse2_4;
+		return;
+	}
+#endif
+#ifdef __aarch64__
+	*f1 = vchecksum_neon_1; *f2 = vchecksum_neon_2; *f4 = vchecksum_neon_4;
+	return;
+#endif
+	*f1 = vchecksum_c_1; *f2 = vchecksum_c_2; *f4 = vchecksum_c_4;
+}
+
+#else /* __ppc__ */
+
+static void
+select_kernels( vcksum_func **f1, vcksum_func **f2, vcksum_func **f4 )
+{
+	*f1 = vchecksum_1; *f2 = vchecksum_2; *f4 = vchecksum_4;
 }
 #endif
 
@@ -107,38 +273,44 @@ video_cksum_t *
 alloc_vcksum( video_desc_t *vmode )
 {
 	video_cksum_t *csum = calloc( 1, sizeof(video_cksum_t) );
+	vcksum_func *f1, *f2, *f4;
+
+	select_kernels( &f1, &f2, &f4 );
 
 	switch( vmode->depth ) {
 	case 32:
 	case 24:
-		csum->func = &vchecksum_4;
+		csum->func = f4;
 		csum->bpp_shift=2;
 		break;
 	case 15:
 	case 16:
-		csum->func = &vchecksum_2;
+		csum->func = f2;
 		csum->bpp_shift=1;
 		break;
 	case 8:
-		csum->func = &vchecksum_1;
+		csum->func = f1;
 		csum->bpp_shift=0;
 		break;
 	}
 	csum->n_blks = vmode->w / X_BLOCK_SIZE;
 	csum->pixel_residue = vmode->w % X_BLOCK_SIZE;
 
-	/* The assembly implementation requires pixel_residue * bpp to be at least 16 */
+	/* All implementations require pixel_residue * bpp to be at least 16 */
 	if( (csum->pixel_residue << csum->bpp_shift) < 16 )
 		csum->pixel_residue = 0;
 
 	csum->n_residue = csum->pixel_residue? 1:0;
 	csum->n_blks += csum->n_residue;
 
+	/* the dirty bits of blocks 32n..32n+31 are in plane n; the
+	 * checksum functions step through a plane one line at a time
+	 */
+	csum->n_planes = (csum->n_blks + 31) / 32;
+
 	csum->t = malloc( csum->n_blks * vmode->h * sizeof(ulong) );
-	csum->dirty = malloc( vmode->h * sizeof(ulong) );
+	csum->dirty = calloc( csum->n_planes * vmode->h, sizeof(u32) );
 	csum->vmode = vmode;
-
-	memset( csum->dirty, 0, vmode->h * sizeof(ulong) );
 	return csum;
 }
 
@@ -152,10 +324,10 @@ free_vcksum( video_cksum_t *csum )
 	free( csum );
 }
 
-void
-vcksum_redraw( video_cksum_t *csum, int y, int height, cksum_redraw_func *redraw_func ) 
+static void
+redraw_plane( video_cksum_t *csum, int plane, int y, int height, cksum_redraw_func *redraw_func )
 {
-	u32 *d = &csum->dirty[y];
+	u32 *d = &csum->dirty[plane * csum->vmode->h + y];
 	ulong mask, b;
 	uint x, j, yy, w;
 
@@ -183,16 +355,26 @@ vcksum_redraw( video_cksum_t *csum, int y, int height, cksum_redraw_func *redraw
 			d[j] &= ~mask;
 
 		w *= X_BLOCK_SIZE;
-		x *= X_BLOCK_SIZE;
+		x = (x + plane * 32) * X_BLOCK_SIZE;
 
 		/* Last block is not necessary of X_BLOCK_SIZE... */
 		if( x+w > csum->vmode->w )
 			w = csum->vmode->w - x;
 
-		(*redraw_func)( x, yy+y, w, j-yy );
+		if( redraw_func )
+			(*redraw_func)( x, yy+y, w, j-yy );
 	}
 }
 
+void
+vcksum_redraw( video_cksum_t *csum, int y, int height, cksum_redraw_func *redraw_func ) 
+{
+	int i;
+
+	for( i=0; i<csum->n_planes; i++ )
+		redraw_plane( csum, i, y, height, redraw_func );
+}
+
 void
 vcksum_calc( video_cksum_t *csum, int y, int height )
 {
@@ -201,20 +383,20 @@ vcksum_calc( video_cksum_t *csum, int y, int height )
 	uint n_blks = csum->n_blks;
 	u32 *t = &csum->t[y*n_blks];
 	uint limit = n_blks - csum->n_residue;
-	uint b, x;
+	uint x;
 	
 	if( !height )
 		return;
 
 	/* checksum for complete X_BLOCK_SIZE blocks */
-	for( b=1, x=0; x<limit; x++, b=b<<1 ) {
+	for( x=0; x<limit; x++ ) {
 		csum->func( t, (n_blks<<2), height, vmode->rowbytes, s,
-			    &csum->dirty[y], b, X_BLOCK_SIZE );
+			    &csum->dirty[(x >> 5) * vmode->h + y], 1U << (x & 31), X_BLOCK_SIZE );
 		s += (X_BLOCK_SIZE<<csum->bpp_shift);
 		t++;
 	}
 	if( csum->n_residue ) {
 		csum->func( t, (n_blks<<2), height, vmode->rowbytes, s,
-			    &csum->dirty[y], b, csum->pixel_residue );
+			    &csum->dirty[(x >> 5) * vmode->h + y], 1U << (x & 31), csum->pixel_residue );
 	}
 }
@@ -0,0 +1,42 @@
+/*
+ *   Creation Date: <2026/10/18 00:04:56 agent>
+ *   Time-stamp: <2026/10/18 01:12:15 agent>
+ *
+ *	<pixconv.h>
+ *
+ *	Mac framebuffer to host/client pixel conversion
+ *
+ *   Copyright (C) 2026 agent (agent@local)
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation
+ *
+ */
+
+#ifndef _H_PIXCONV
+#define _H_PIXCONV
+
+/* true colour destination format */
+typedef struct {
+	int		bpp;			/* bytes per pixel (1, 2 or 4) */
+	int		big_endian;
+
+	int		red_max, green_max, blue_max;
+	int		red_shift, green_shift, blue_shift;
+} pixfmt_t;
+
+typedef struct pixconv pixconv_t;
+
+/* src_depth is the depth of the (big endian) Mac framebuffer: 8, 15/16 or 24/32 */
+extern pixconv_t	*alloc_pixconv( int src_depth, const pixfmt_t *fmt );
+extern void		free_pixconv( pixconv_t *pc );
+
+/* 256 R,G,B triplets; used for 8-bit sources */
+extern void		pixconv_set_palette( pixconv_t *pc, const char *pal );
+
+extern void		pixconv_line( pixconv_t *pc, const char *src, char *dst, int pixels );
+extern void		pixconv_rect( pixconv_t *pc, const char *src, int src_rb, char *dst, int dst_rb,
+				      int x, int y, int w, int h );
+
+#endif   /* _H_PIXCONV */
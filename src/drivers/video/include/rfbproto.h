@@ -289,6 +289,14 @@ typedef struct {
 #define rfbEncodingRRE 2
 #define rfbEncodingCoRRE 4
 #define rfbEncodingHextile 5
+#define rfbEncodingTight 7
+#define rfbEncodingZRLE 16
+
+/* pseudo-encodings */
+#define rfbEncodingCompressLevel0 0xFFFFFF00
+#define rfbEncodingCompressLevel9 0xFFFFFF09
+#define rfbEncodingQualityLevel0 0xFFFFFFE0
+#define rfbEncodingQualityLevel9 0xFFFFFFE9
 
 
 
@@ -437,6 +445,61 @@ typedef struct {
 #define rfbHextileExtractH(byte) (((byte) & 0xf) + 1)
 
 
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * ZRLE - zlib run-length encoding.  The rectangle data is a CARD32 length
+ * followed by that many bytes of zlib data.  The zlib stream lasts for the
+ * whole connection.  Uncompressed, the rectangle is a series of 64x64 tiles
+ * in left-to-right, top-to-bottom order, each starting with a subencoding
+ * byte:
+ *
+ *   0        raw, w*h CPIXELs
+ *   1        solid, one CPIXEL
+ *   2-16     packed palette; palette of that many CPIXELs, followed by
+ *            1, 2 or 4 bit indices, each row padded to a byte boundary
+ *   128      plain RLE; runs of a CPIXEL and a run length
+ *   130-255  palette RLE; palette of (subencoding-128) CPIXELs, then runs
+ *            of an index byte (top bit set if a run length follows)
+ *
+ * A run length is (length-1) encoded as a sequence of bytes, all 255
+ * except the last.  A CPIXEL is a PIXEL, except that 32 bpp true colour
+ * pixels of depth 24 or less only send the 3 bytes that carry colour.
+ */
+
+#define rfbZRLETileWidth 64
+#define rfbZRLETileHeight 64
+
+#define rfbZRLERaw 0
+#define rfbZRLESolid 1
+#define rfbZRLEPlainRLE 128
+
+
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Tight Encoding.  Each rectangle starts with a compression control byte.
+ * Bits 0-3 ask the client to reset the corresponding zlib stream.  The upper
+ * nibble is rfbTightFill (a single TPIXEL follows), rfbTightJpeg, or a
+ * basic compression where bits 4-5 select one of four zlib streams and
+ * bit 6 says that a filter id byte follows.  The palette filter is followed
+ * by (number of colours - 1) and the palette; the data is then 1 bit per
+ * pixel for two colours, 8 bits otherwise.
+ *
+ * Data shorter than rfbTightMinToCompress bytes is sent as is; longer data
+ * is preceded by its compressed length in 1-3 bytes, 7 bits per byte with
+ * the top bit meaning "more".  A TPIXEL is 3 bytes (R, G, B) when the
+ * pixel format is 32 bpp, depth 24 with 8 bits per colour, else a PIXEL.
+ * Rectangles are at most rfbTightMaxWidth pixels wide.
+ */
+
+#define rfbTightExplicitFilter 0x04
+#define rfbTightFill 0x08
+#define rfbTightJpeg 0x09
+#define rfbTightFilterCopy 0x00
+#define rfbTightFilterPalette 0x01
+#define rfbTightFilterGradient 0x02
+
+#define rfbTightMinToCompress 12
+#define rfbTightMaxWidth 2048
+
+
 /*-----------------------------------------------------------------------------
  * SetColourMapEntries - these messages are only sent if the pixel
  * format uses a "colour map" (i.e. trueColour false) and the client has not
@@ -0,0 +1,469 @@
+/*
+ *   Creation Date: <2026/10/18 00:04:56 agent>
+ *   Time-stamp: <2026/10/18 01:12:15 agent>
+ *
+ *	<pixconv.c>
+ *
+ *	Mac framebuffer to host/client pixel conversion
+ *
+ *   Copyright (C) 2026 agent (agent@local)
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation
+ *
+ */
+
+#include "mol_config.h"
+#include "byteorder.h"
+#include "video_module.h"
+#include "pixconv.h"
+
+/* Source pixels are big endian: 8-bit indexed, x-5-5-5 or x-8-8-8. Every
+ * (source, destination size, byte order) combination has its own kernel.
+ * The C kernels use lookup tables (a palette or one table per channel); the
+ * SIMD kernels scale the channels arithmetically, eight or sixteen pixels
+ * at a time, and produce exactly the same pixels.
+ */
+
+typedef void conv_func( pixconv_t *pc, const u8 *s, u8 *d, int n );
+
+struct pixconv {
+	int		src_depth;	/* 8, 15 or 32 */
+	int		src_bpp;	/* bytes per source pixel */
+	pixfmt_t	fmt;
+	int		swap;		/* destination byte order differs from the host */
+
+	/* 8-bit sources: lut[0..255] are destination pixels. Otherwise lut[0..767]
+	 * are the scaled and shifted red, green and blue channels. The entries are
+	 * byte swapped if necessary; a native store gives the destination order.
+	 */
+	u32		lut[768];
+
+	conv_func	*scalar;	/* C kernel (also does the tail of the SIMD kernels) */
+	conv_func	*func;		/* best kernel */
+
+	int		scale;		/* channels are not copied as is (SIMD) */
+};
+
+
+/************************************************************************/
+/*	lookup tables							*/
+/************************************************************************/
+
+static inline u32
+scale_chan( int v, int max, int src_max )
+{
+	return (v * max + src_max/2) / src_max;
+}
+
+static u32
+swap_pixel( pixconv_t *pc, u32 v )
+{
+	if( !pc->swap )
+		return v;
+	return (pc->fmt.bpp == 2) ? bswap_16(v) : bswap_32(v);
+}
+
+static void
+build_chan_luts( pixconv_t *pc )
+{
+	pixfmt_t *f = &pc->fmt;
+	int i, smax = (pc->src_depth == 15) ? 31 : 255;
+
+	for( i=0; i<=smax; i++ ) {
+		pc->lut[i] = swap_pixel( pc, scale_chan(i, f->red_max, smax) << f->red_shift );
+		pc->lut[256+i] = swap_pixel( pc, scale_chan(i, f->green_max, smax) << f->green_shift );
+		pc->lut[512+i] = swap_pixel( pc, scale_chan(i, f->blue_max, smax) << f->blue_shift );
+	}
+}
+
+void
+pixconv_set_palette( pixconv_t *pc, const char *pal )
+{
+	const u8 *p = (const u8*)pal;
+	pixfmt_t *f = &pc->fmt;
+	int i;
+
+	if( pc->src_depth != 8 )
+		return;
+	for( i=0; i<256; i++, p+=3 )
+		pc->lut[i] = swap_pixel( pc, (scale_chan(p[0], f->red_max, 255) << f->red_shift)
+					 | (scale_chan(p[1], f->green_max, 255) << f->green_shift)
+					 | (scale_chan(p[2], f->blue_max, 255) << f->blue_shift) );
+}
+
+
+/************************************************************************/
+/*	C kernels							*/
+/************************************************************************/
+
+#define SRC8( s )	(lut[(s)[0]])
+#define SRC15( s )	(lut[((s)[0] >> 2) & 0x1f] | lut[256 + (((((s)[0] << 8) | (s)[1]) >> 5) & 0x1f)] \
+			 | lut[512 + ((s)[1] & 0x1f)])
+#define SRC32( s )	(lut[(s)[1]] | lut[256 + (s)[2]] | lut[512 + (s)[3]])
+
+#define SCALAR_KERNEL( name, SRC, sbpp, dtype )					\
+static void									\
+name( pixconv_t *pc, const u8 *s, u8 *d, int n )				\
+{										\
+	const u32 *lut = pc->lut;						\
+										\
+	for( ; n-- > 0; s += sbpp, d += sizeof(dtype) ) {			\
+		dtype v = SRC( s );						\
+		memcpy( d, &v, sizeof(dtype) );					\
+	}									\
+}
+
+SCALAR_KERNEL( conv8_1, SRC8, 1, u8 )
+SCALAR_KERNEL( conv8_2, SRC8, 1, u16 )
+SCALAR_KERNEL( conv8_4, SRC8, 1, u32 )
+SCALAR_KERNEL( conv15_1, SRC15, 2, u8 )
+SCALAR_KERNEL( conv15_2, SRC15, 2, u16 )
+SCALAR_KERNEL( conv15_4, SRC15, 2, u32 )
+SCALAR_KERNEL( conv32_1, SRC32, 4, u8 )
+SCALAR_KERNEL( conv32_2, SRC32, 4, u16 )
+SCALAR_KERNEL( conv32_4, SRC32, 4, u32 )
+
+/* [source][destination bpp] */
+static conv_func *scalar_kernels[3][3] = {
+	{ conv8_1, conv8_2, conv8_4 },
+	{ conv15_1, conv15_2, conv15_4 },
+	{ conv32_1, conv32_2, conv32_4 },
+};
+
+
+/************************************************************************/
+/*	SIMD kernels (x86)						*/
+/************************************************************************/
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+
+#define SSE2		__attribute__((target("sse2")))
+#define AVX2		__attribute__((target("avx2")))
+#define INLINE		inline __attribute__((always_inline))
+
+/* In 16-bit lanes, (c * max + 127) / 255 = (t + 1 + (t >> 8)) >> 8 with
+ * t = c * max + 127 and (c * max + 15) / 31 = mulhi(t, 16913) >> 3 with
+ * t = c * max + 15. Both are exact for max <= 255.
+ */
+#define DIV31_MUL	16913
+
+static INLINE SSE2 __m128i
+scale_sse2( __m128i c, __m128i max, const int src15 )
+{
+	__m128i t;
+
+	if( src15 ) {
+		t = _mm_add_epi16( _mm_mullo_epi16(c, max), _mm_set1_epi16(15) );
+		return _mm_srli_epi16( _mm_mulhi_epu16(t, _mm_set1_epi16(DIV31_MUL)), 3 );
+	}
+	t = _mm_add_epi16( _mm_mullo_epi16(c, max), _mm_set1_epi16(127) );
+	t = _mm_add_epi16( t, _mm_add_epi16(_mm_srli_epi16(t, 8), _mm_set1_epi16(1)) );
+	return _mm_srli_epi16( t, 8 );
+}
+
+static INLINE SSE2 __m128i
+swap16_sse2( __m128i v )
+{
+	return _mm_or_si128( _mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8) );
+}
+
+static INLINE SSE2 __m128i
+swap32_sse2( __m128i v )
+{
+	v = swap16_sse2( v );
+	return _mm_shufflehi_epi16( _mm_shufflelo_epi16(v, 0xb1), 0xb1 );
+}
+
+static INLINE SSE2 void
+conv_sse2_( pixconv_t *pc, const u8 *s, u8 *d, int n, const int src15, const int dbpp, const int swap )
+{
+	pixfmt_t *f = &pc->fmt;
+	__m128i rmax = _mm_set1_epi16( f->red_max ), gmax = _mm_set1_epi16( f->green_max );
+	__m128i bmax = _mm_set1_epi16( f->blue_max );
+	__m128i rsh = _mm_cvtsi32_si128( f->red_shift ), gsh = _mm_cvtsi32_si128( f->green_shift );
+	__m128i bsh = _mm_cvtsi32_si128( f->blue_shift );
+	__m128i z = _mm_setzero_si128();
+	const int sbpp = src15 ? 2 : 4;
+
+	for( ; n >= 8; n -= 8, s += 8*sbpp, d += 8*dbpp ) {
+		__m128i r, g, b, p, lo, hi;
+
+		if( src15 ) {
+			__m128i v = swap16_sse2( _mm_loadu_si128((const __m128i*)s) );
+			__m128i m = _mm_set1_epi16( 0x1f );
+			r = _mm_and_si128( _mm_srli_epi16(v, 10), m );
+			g = _mm_and_si128( _mm_srli_epi16(v, 5), m );
+			b = _mm_and_si128( v, m );
+		} else {
+			__m128i v0 = _mm_loadu_si128( (const __m128i*)s );
+			__m128i v1 = _mm_loadu_si128( (const __m128i*)(s + 16) );
+			__m128i m = _mm_set1_epi32( 0xff );
+			r = _mm_packs_epi32( _mm_and_si128(_mm_srli_epi32(v0, 8), m),
+					     _mm_and_si128(_mm_srli_epi32(v1, 8), m) );
+			g = _mm_packs_epi32( _mm_and_si128(_mm_srli_epi32(v0, 16), m),
+					     _mm_and_si128(_mm_srli_epi32(v1, 16), m) );
+			b = _mm_packs_epi32( _mm_srli_epi32(v0, 24), _mm_srli_epi32(v1, 24) );
+		}
+		if( pc->scale ) {
+			r = scale_sse2( r, rmax, src15 );
+			g = scale_sse2( g, gmax, src15 );
+			b = scale_sse2( b, bmax, src15 );
+		}
+		if( dbpp == 4 ) {
+			lo = _mm_or_si128( _mm_or_si128(_mm_sll_epi32(_mm_unpacklo_epi16(r, z), rsh),
+							_mm_sll_epi32(_mm_unpacklo_epi16(g, z), gsh)),
+					   _mm_sll_epi32(_mm_unpacklo_epi16(b, z), bsh) );
+			hi = _mm_or_si128( _mm_or_si128(_mm_sll_epi32(_mm_unpackhi_epi16(r, z), rsh),
+							_mm_sll_epi32(_mm_unpackhi_epi16(g, z), gsh)),
+					   _mm_sll_epi32(_mm_unpackhi_epi16(b, z), bsh) );
+			if( swap ) {
+				lo = swap32_sse2( lo );
+				hi = swap32_sse2( hi );
+			}
+			_mm_storeu_si128( (__m128i*)d, lo );
+			_mm_storeu_si128( (__m128i*)(d + 16), hi );
+			continue;
+		}
+		p = _mm_or_si128( _mm_or_si128(_mm_sll_epi16(r, rsh), _mm_sll_epi16(g, gsh)),
+				  _mm_sll_epi16(b, bsh) );
+		if( dbpp == 2 )
+			_mm_storeu_si128( (__m128i*)d, swap ? swap16_sse2(p) : p );
+		else
+			_mm_storel_epi64( (__m128i*)d, _mm_packus_epi16(p, p) );
+	}
+	if( n )
+		(*pc->scalar)( pc, s, d, n );
+}
+
+static INLINE AVX2 __m256i
+scale_avx2( __m256i c, __m256i max, const int src15 )
+{
+	__m256i t;
+
+	if( src15 ) {
+		t = _mm256_add_epi16( _mm256_mullo_epi16(c, max), _mm256_set1_epi16(15) );
+		return _mm256_srli_epi16( _mm256_mulhi_epu16(t, _mm256_set1_epi16(DIV31_MUL)), 3 );
+	}
+	t = _mm256_add_epi16( _mm256_mullo_epi16(c, max), _mm256_set1_epi16(127) );
+	t = _mm256_add_epi16( t, _mm256_add_epi16(_mm256_srli_epi16(t, 8), _mm256_set1_epi16(1)) );
+	return _mm256_srli_epi16( t, 8 );
+}
+
+static INLINE AVX2 __m256i
+swap16_avx2( __m256i v )
+{
+	return _mm256_or_si256( _mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8) );
+}
+
+static INLINE AVX2 __m256i
+swap32_avx2( __m256i v )
+{
+	const __m256i m = _mm256_setr_epi8( 3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+					    3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12 );
+	return _mm256_shuffle_epi8( v, m );
+}
+
+/* the AVX2 pack/unpack instructions work within 128-bit halves; the
+ * permutes below restore the pixel order
+ */
+static INLINE AVX2 void
+conv_avx2_( pixconv_t *pc, const u8 *s, u8 *d, int n, const int src15, const int dbpp, const int swap )
+{
+	pixfmt_t *f = &pc->fmt;
+	__m256i rmax = _mm256_set1_epi16( f->red_max ), gmax = _mm256_set1_epi16( f->green_max );
+	__m256i bmax = _mm256_set1_epi16( f->blue_max );
+	__m128i rsh = _mm_cvtsi32_si128( f->red_shift ), gsh = _mm_cvtsi32_si128( f->green_shift );
+	__m128i bsh = _mm_cvtsi32_si128( f->blue_shift );
+	__m256i z = _mm256_setzero_si256();
+	const int sbpp = src15 ? 2 : 4;
+
+	for( ; n >= 16; n -= 16, s += 16*sbpp, d += 16*dbpp ) {
+		__m256i r, g, b, p, lo, hi;
+
+		if( src15 ) {
+			__m256i v = swap16_avx2( _mm256_loadu_si256((const __m256i*)s) );
+			__m256i m = _mm256_set1_epi16( 0x1f );
+			r = _mm256_and_si256( _mm256_srli_epi16(v, 10), m );
+			g = _mm256_and_si256( _mm256_srli_epi16(v, 5), m );
+			b = _mm256_and_si256( v, m );
+		} else {
+			__m256i v0 = _mm256_loadu_si256( (const __m256i*)s );
+			__m256i v1 = _mm256_loadu_si256( (const __m256i*)(s + 32) );
+			__m256i m = _mm256_set1_epi32( 0xff );
+			r = _mm256_packs_epi32( _mm256_and_si256(_mm256_srli_epi32(v0, 8), m),
+						_mm256_and_si256(_mm256_srli_epi32(v1, 8), m) );
+			g = _mm256_packs_epi32( _mm256_and_si256(_mm256_srli_epi32(v0, 16), m),
+						_mm256_and_si256(_mm256_srli_epi32(v1, 16), m) );
+			b = _mm256_packs_epi32( _mm256_srli_epi32(v0, 24), _mm256_srli_epi32(v1, 24) );
+			r = _mm256_permute4x64_epi64( r, 0xd8 );
+			g = _mm256_permute4x64_epi64( g, 0xd8 );
+			b = _mm256_permute4x64_epi64( b, 0xd8 );
+		}
+		if( pc->scale ) {
+			r = scale_avx2( r, rmax, src15 );
+			g = scale_avx2( g, gmax, src15 );
+			b = scale_avx2( b, bmax, src15 );
+		}
+		if( dbpp == 4 ) {
+			lo = _mm256_or_si256( _mm256_or_si256(_mm256_sll_epi32(_mm256_unpacklo_epi16(r, z), rsh),
+							      _mm256_sll_epi32(_mm256_unpacklo_epi16(g, z), gsh)),
+					      _mm256_sll_epi32(_mm256_unpacklo_epi16(b, z), bsh) );
+			hi = _mm256_or_si256( _mm256_or_si256(_mm256_sll_epi32(_mm256_unpackhi_epi16(r, z), rsh),
+							      _mm256_sll_epi32(_mm256_unpackhi_epi16(g, z), gsh)),
+					      _mm256_sll_epi32(_mm256_unpackhi_epi16(b, z), bsh) );
+			if( swap ) {
+				lo = swap32_avx2( lo );
+				hi = swap32_avx2( hi );
+			}
+			_mm256_storeu_si256( (__m256i*)d, _mm256_permute2x128_si256(lo, hi, 0x20) );
+			_mm256_storeu_si256( (__m256i*)(d + 32), _mm256_permute2x128_si256(lo, hi, 0x31) );
+			continue;
+		}
+		p = _mm256_or_si256( _mm256_or_si256(_mm256_sll_epi16(r, rsh), _mm256_sll_epi16(g, gsh)),
+				     _mm256_sll_epi16(b, bsh) );
+		if( dbpp == 2 ) {
+			_mm256_storeu_si256( (__m256i*)d, swap ? swap16_avx2(p) : p );
+		} else {
+			p = _mm256_permute4x64_epi64( _mm256_packus_epi16(p, p), 0x08 );
+			_mm_storeu_si128( (__m128i*)d, _mm256_castsi256_si128(p) );
+		}
+	}
+	if( n )
+		(*pc->scalar)( pc, s, d, n );
+}
+
+#define SIMD_KERNELS( isa, attr, src )							\
+static attr void isa##_##src##_1( pixconv_t *pc, const u8 *s, u8 *d, int n )		\
+	{ conv_##isa##_( pc, s, d, n, src == 15, 1, 0 ); }				\
+static attr void isa##_##src##_2( pixconv_t *pc, const u8 *s, u8 *d, int n )		\
+	{ conv_##isa##_( pc, s, d, n, src == 15, 2, 0 ); }				\
+static attr void isa##_##src##_2s( pixconv_t *pc, const u8 *s, u8 *d, int n )		\
+	{ conv_##isa##_( pc, s, d, n, src == 15, 2, 1 ); }				\
+static attr void isa##_##src##_4( pixconv_t *pc, const u8 *s, u8 *d, int n )		\
+	{ conv_##isa##_( pc, s, d, n, src == 15, 4, 0 ); }				\
+static attr void isa##_##src##_4s( pixconv_t *pc, const u8 *s, u8 *d, int n )		\
+	{ conv_##isa##_( pc, s, d, n, src == 15, 4, 1 ); }
+
+SIMD_KERNELS( sse2, SSE2, 15 )
+SIMD_KERNELS( sse2, SSE2, 32 )
+SIMD_KERNELS( avx2, AVX2, 15 )
+SIMD_KERNELS( avx2, AVX2, 32 )
+
+/* [isa][source][destination bpp][swap] */
+static conv_func *simd_kernels[2][2][3][2] = {
+	{ { { sse2_15_1, sse2_15_1 }, { sse2_15_2, sse2_15_2s }, { sse2_15_4, sse2_15_4s } },
+	  { { sse2_32_1, sse2_32_1 }, { sse2_32_2, sse2_32_2s }, { sse2_32_4, sse2_32_4s } } },
+	{ { { avx2_15_1, avx2_15_1 }, { avx2_15_2, avx2_15_2s }, { avx2_15_4, avx2_15_4s } },
+	  { { avx2_32_1, avx2_32_1 }, { avx2_32_2, avx2_32_2s }, { avx2_32_4, avx2_32_4s } } },
+};
+
+static conv_func *
+simd_kernel( pixconv_t *pc, int dbpp_ind )
+{
+	int isa;
+
+	if( __builtin_cpu_supports("avx2") )
+		isa = 1;
+	else if( __builtin_cpu_supports("sse2") )
+		isa = 0;
+	else
+		return NULL;
+	return simd_kernels[isa][pc->src_depth == 32][dbpp_ind][pc->swap];
+}
+#else
+static conv_func *
+simd_kernel( pixconv_t *pc, int dbpp_ind )
+{
+	return NULL;
+}
+#endif /* x86 */
+
+
+/************************************************************************/
+/*	interface							*/
+/************************************************************************/
+
+/* the channels must fit in 16-bit lanes */
+static int
+simd_usable( pixconv_t *pc )
+{
+	pixfmt_t *f = &pc->fmt;
+	ulong lim = (f->bpp == 4) ? 0xffffffffUL : (f->bpp == 2) ? 0xffff : 0xff;
+
+	if( pc->src_depth == 8 )
+		return 0;
+	if( f->red_max > 255 || f->green_max > 255 || f->blue_max > 255 )
+		return 0;
+	if( f->red_shift > 24 || f->green_shift > 24 || f->blue_shift > 24 )
+		return 0;
+	return ((ulong)f->red_max << f->red_shift) <= lim && ((ulong)f->green_max << f->green_shift) <= lim
+		&& ((ulong)f->blue_max << f->blue_shift) <= lim;
+}
+
+pixconv_t *
+alloc_pixconv( int src_depth, const pixfmt_t *fmt )
+{
+	pixconv_t *pc;
+	int src, dbpp_ind, smax;
+
+	switch( fmt->bpp ) {
+	case 1: dbpp_ind = 0; break;
+	case 2: dbpp_ind = 1; break;
+	case 4: dbpp_ind = 2; break;
+	default:
+		return NULL;
+	}
+	src_depth = std_depth( src_depth );
+	if( src_depth != 8 && src_depth != 15 && src_depth != 32 )
+		return NULL;
+
+	pc = calloc( 1, sizeof(pixconv_t) );
+	pc->fmt = *fmt;
+	pc->src_depth = src_depth;
+	pc->src_bpp = (src_depth == 8) ? 1 : (src_depth == 15) ? 2 : 4;
+#if BYTE_ORDER == BIG_ENDIAN
+	pc->swap = (fmt->bpp > 1 && !fmt->big_endian);
+#else
+	pc->swap = (fmt->bpp > 1 && fmt->big_endian);
+#endif
+	if( src_depth != 8 )
+		build_chan_luts( pc );
+
+	smax = (src_depth == 15) ? 31 : 255;
+	pc->scale = fmt->red_max != smax || fmt->green_max != smax || fmt->blue_max != smax;
+
+	src = (src_depth == 8) ? 0 : (src_depth == 15) ? 1 : 2;
+	pc->scalar = pc->func = scalar_kernels[src][dbpp_ind];
+	if( simd_usable(pc) ) {
+		conv_func *f = simd_kernel( pc, dbpp_ind );
+		if( f )
+			pc->func = f;
+	}
+	return pc;
+}
+
+void
+free_pixconv( pixconv_t *pc )
+{
+	free( pc );
+}
+
+void
+pixconv_line( pixconv_t *pc, const char *src, char *dst, int pixels )
+{
+	(*pc->func)( pc, (const u8*)src, (u8*)dst, pixels );
+}
+
+void
+pixconv_rect( pixconv_t *pc, const char *src, int src_rb, char *dst, int dst_rb,
+	      int x, int y, int w, int h )
+{
+	src += y * src_rb + x * pc->src_bpp;
+	dst += y * dst_rb + x * pc->fmt.bpp;
+
+	for( ; h-- > 0; src += src_rb, dst += dst_rb )
+		(*pc->func)( pc, (const u8*)src, (u8*)dst, w );
+}
@@ -69,6 +69,8 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <limits.h>
+#include <zlib.h>
 #include "poll_compat.h"
 
 #include "verbose.h"
@@ -84,6 +86,8 @@
 #include "keycodes.h"
 #include "input.h"
 #include "async.h"
+#include "checksum.h"
+#include "pixconv.h"
 
 // --- Basic VNC definitions -----
 
@@ -105,115 +109,127 @@ typedef int             bool;
 #define ADBKeyDown( ch ) PE_adb_key_event( (ch & 0x7f), VNC_RAW_KEYCODE | (ch & 0x7f) )
 #define ADBKeyUp( ch ) PE_adb_key_event( (ch | 0x80), VNC_RAW_KEYCODE | (ch & 0x7f) )
 
-// ---- vnc helper macros ----------
-
-#define CARD32IntoCARD8Star(a, b)  	\
-   *(b++) = ((a) & 0xff000000) >> 24;	\
-   *(b++) = ((a) & 0xff0000) >> 16;	\
-   *(b++) = ((a) & 0xff00) >> 8;	\
-   *(b++) = ((a) & 0xff);
-
-#define SwapCARD32IntoCARD8Star(a, b)  	\
-   *(b++) = ((a) & 0xff);		\
-   *(b++) = ((a) & 0xff00) >> 8;	\
-   *(b++) = ((a) & 0xff0000) >> 16;	\
-   *(b++) = ((a) & 0xff000000) >> 24;
-
-#define CARD16IntoCARD8Star(a, b) 	\
-   *(b++) = ((a) & 0xff00) >> 8; 	\
-   *(b++) = ((a) & 0xff);
-
-#define SwapCARD16IntoCARD8Star(a, b)	\
-   *(b++) = ((a) & 0xff); 		\
-   *(b++) = ((a) & 0xff00) >> 8;
-
-#define IndexedToRemote(i)                                                \
-               ((mac_pal[i*3] * remote_format.redMax + 127) / 255)        \
-               << remote_format.redShift           |                      \
-               ((mac_pal[i*3 + 1] * remote_format.greenMax + 127) / 255)  \
-               << remote_format.greenShift           |                    \
-               ((mac_pal[i*3 + 2] * remote_format.blueMax + 127) / 255)   \
-               << remote_format.blueShift;
- 
-#define RGB555ToRemote(i) \
-  (((((i >> 10) & 31) * remote_format.redMax + 15) / 31)               \
-                                       << remote_format.redShift) |    \
-  (((((i >> 5) & 31) * remote_format.greenMax + 15) / 31)              \
-                                       << remote_format.greenShift) |  \
-  ((((i & 31) * remote_format.blueMax + 15) / 31)                      \
-                                       << remote_format.blueShift);
-
-#define RGB565ToRemote(i) \
-  (((((i >> 11) & 31) * remote_format.redMax + 15) / 31)               \
-                                       << remote_format.redShift) |    \
-  (((((i >> 5) & 63) * remote_format.greenMax + 31) / 63)              \
-                                       << remote_format.greenShift) |  \
-  ((((i & 31) * remote_format.blueMax + 15) / 31)                      \
-                                       << remote_format.blueShift);
- 
-
-/* #define RGB888ToRemote(i) \
-   (((((i >> 16) & 0xff) * remote_format.redMax + 127) / 255)   \
-             << remote_format.redShift) |			\
-   (((((i >> 8) & 0xff) * remote_format.greenMax + 127) / 255)  \
-             << remote_format.greenShift) |      		\
-   ((((i & 0xff) * remote_format.blueMax + 127) / 255)    	\
-             << remote_format.blueShift);    */
-
-#define ARGB8888ToRemote(i) \
-   (((((i >> 16) & 0xff) * remote_format.redMax + 127) / 255)   \
-             << remote_format.redShift) |			\
-   (((((i >> 8) & 0xff) * remote_format.greenMax + 127) / 255)  \
-             << remote_format.greenShift) |			\
-   ((((i & 0xff) * remote_format.blueMax + 127) / 255)		\
-             << remote_format.blueShift);
-
-static bool		sendHextiles8( int x, int y, int w, int h);
-static bool		sendHextiles16( int x, int y, int w, int h);
-static bool		sendHextiles32( int x, int y, int w, int h);
-
 // cache the Mac's palette
 static unsigned char	mac_pal[256 * 3];
 
 // bpp = bytes per pixel
 static int		offscreen_bpp = 2;
-static int		output_bpp = 2;
 
 // --- vnc functions -------------------------------
 
 static int		ks_decode( CARD32 ks );
 
-static bool 		request_received;
-static volatile int	vnc_sock = -1;
-static bool		vnc_sock_valid;
+typedef struct {
+	z_stream	zs;
+	bool		valid;
+} vnc_zstream_t;
+
+// --- per client state, owned by the client's vnc thread
+
+typedef struct vnc_client {
+	int		sock;
+	volatile bool	sock_valid;
+	bool		running;		// handshake done
+	bool		request_received;
+	bool		force_redraw;		// buffers_mutex
+
+	rfbPixelFormat	format;			// the client's pixel format
+	int		output_bpp;		// bytes per client pixel
+	pixconv_t	*conv;			// Mac pixels -> client pixels
+	int		format_id;		// clients with the same format share cached tiles
+	int		cpixel_bytes;		// ZRLE CPIXEL
+	int		cpixel_offs;		// first byte of the CPIXEL within the PIXEL
+	bool		tpixel_rgb;		// Tight TPIXELs are sent as R, G, B
 
-static rfbPixelFormat	remote_format;
+	int		encoding;		// negotiated by SetEncodings
+	int		zlib_level;		// CompressLevel pseudo-encoding
+	vnc_zstream_t	zrle_stream;		// zlib streams live as long as the connection
+	vnc_zstream_t	tight_streams[4];
 
-// --- vnc thread / main communication
+	char		*dirty;			// one flag per tile (buffers_mutex)
+	int		n_dirty;
+	int		scan_pos;		// the next update starts with this tile
+
+	// the tiles of a rectangle, copied out of the shared cache
+	unsigned char	*stage;
+	int		stage_size;
+
+	// a whole FramebufferUpdate is encoded here and sent with a single write
+	unsigned char	*buf;
+	long		buf_size;
+	int		buf_len;
+	int		update_rects;		// rectangles in the current update
+
+	struct vnc_client *next;
+} vnc_client_t;
+
+static bool		sendHextiles8( vnc_client_t *c, int x, int y, int w, int h );
+static bool		sendHextiles16( vnc_client_t *c, int x, int y, int w, int h );
+static bool		sendHextiles32( vnc_client_t *c, int x, int y, int w, int h );
+
+// --- shared state, protected by buffers_mutex
 
-static bool		force_redraw;
 static bool		is_open;
 
 static unsigned char	*offscreen_buf;		// The Mac's Buffer
-static unsigned char	*output_buf;
-static long		output_buf_size;
 
 static pthread_mutex_t  buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	clients_cond = PTHREAD_COND_INITIALIZER;	// n_clients decreased
 
 static video_desc_t	vmode;  		// format of the Mac's buffer
-static bool		connection_running;	// is anyone connected?
-
-static int		ublen;
 
-#define TRANSTABLE_SIZE	(65536*4)
-static volatile CARD8	*translationtable;
+static vnc_client_t	*clients;
+static int		n_clients;
+static int		max_clients;		// vnc_max_clients
+static int		send_budget;		// vnc_send_budget, bytes per update
+static int		format_serial;
 
 // --- listen / main communication
 static int		vnc_listen_sock=-1;
 static int		async_listener_id;
 
+// --- dirty tracking. The screen is split into tiles one checksum block wide;
+// --- every client has its own dirty flags, the tile contents are shared.
 
-static bool		g_CanHextile;
+#define CKSUM_BLOCK_SIZE	64		// X_BLOCK_SIZE in checksum.c
+#define TILE_W			CKSUM_BLOCK_SIZE
+#define TILE_H			16
+
+static video_cksum_t	*vnc_cksum;
+static int		tiles_x, tiles_y, n_tiles;
+static CARD32		*tile_gen;		// bumped whenever a tile changes
+
+// --- encoded tiles. Anything that does not depend on the client's zlib
+// --- streams is cached, keyed by (tile, encoding, format).
+
+#define TILE_CACHE_WAYS		2
+#define RUN_MAX_TILES		32		// tiles joined into one rectangle
+#define TILE_BUF_SIZE		(TILE_W * TILE_H * 4 * 2)
+
+typedef struct {
+	int		encoding;
+	int		format_id;		// 0 if unused
+	CARD32		gen;			// tile_gen when encoded
+	CARD32		stamp;			// last use
+
+	int		hdr_len;		// bytes sent as is
+	int		stream;			// zlib stream for the rest, -1 if none
+	int		len;
+	int		size;			// allocated
+	unsigned char	*data;
+} vnc_tile_t;
+
+// a tile staged for a rectangle; the data is in vnc_client_t.stage
+typedef struct {
+	int		w;
+	int		hdr_len, stream, len;	// as in vnc_tile_t
+} vnc_staged_t;
+
+static vnc_tile_t	*tile_cache;		// TILE_CACHE_WAYS entries per tile
+static CARD32		cache_stamp;
+static vnc_tile_t	scratch;		// a tile that was just encoded
+static unsigned char	tile_buf[TILE_BUF_SIZE];
+static int		ublen;			// bytes used in tile_buf
 
 
 /************************************************************************/
@@ -221,20 +237,22 @@ static bool		g_CanHextile;
 /************************************************************************/
 
 static bool
-write_exact( const unsigned char *buffer, int size )
+write_exact( vnc_client_t *c, const unsigned char *buffer, int size )
 {
 	int p=0, i=0;
 
-	if( !vnc_sock_valid )
+	if( !c->sock_valid )
 		return false;
  
 	while( p < size ) {
-		i = write( vnc_sock, buffer + p, size - p );
+		i = write( c->sock, buffer + p, size - p );
+		if( i < 0 && errno == EINTR )
+			continue;
 		if( i < 0 ) {
 			LOG("Error on socket write\n");
 			perror("Write to socket");
 			// assume the socket is broken
-			vnc_sock_valid = false;
+			c->sock_valid = false;
 			return false;
 		}
 		p += i;
@@ -242,363 +260,563 @@ write_exact( const unsigned char *buffer, int size )
 	return true;
 }
 
-static void
-translate( unsigned char *in, unsigned char *out, int pixels )
+/* make room for another 'bytes' bytes in the update buffer */
+static bool
+reserve_output( vnc_client_t *c, int bytes )
 {
-	int x;
-	CARD32 ttwo, trans = 0;
-	CARD32 *in32 = (CARD32 *)in;
-	CARD16 *in16 = (CARD16 *)in;
-	CARD8 *in8 = (CARD8 *)in;
-
-	//LOG( "translate( %lx, %lx, %d ) ( %d -> %d )\n", (long) in, (long) out, pixels, vmode.depth, output_bpp );
-
-	if( vmode.depth != 32 ) {
-		for( x=0; x<pixels; x++ ) {
-			switch( vmode.depth ) {
-			case 8:
-				trans = *(in8++);
-				break;
-			case 15:
-			case 16:
-				trans = *(in16++);
-				//LOG("input pixel is %04x\n", trans);
-				break;
-			default:
-				LOG("bad vmode.depth %d\n", vmode.depth);
-				return;
-			}
-
-			switch( output_bpp ) {
-			case 1:
-				out[x] = translationtable[trans];
-				break;
-
-			case 2:
-				*(out++) = translationtable[trans * 2];
-				*(out++) = translationtable[trans * 2 + 1];
-				break;
+	unsigned char *p;
+	long size = c->buf_size;
 
-			case 4:
-				*(out++) = translationtable[trans * 4];
-				*(out++) = translationtable[trans * 4 + 1];
-				*(out++) = translationtable[trans * 4 + 2];
-				*(out++) = translationtable[trans * 4 + 3];
-				break;
- 
-			default:
-				LOG("bad output_bpp (1) %d\n", output_bpp);
-				return;
-			}
-		}
-	} else {
-		for( x=0; x<pixels; x++ ) {
-			trans = *(in32++);
-			ttwo = ARGB8888ToRemote(trans);
-			switch( output_bpp ) {
-			case 1:
-				out[x] = ttwo;
-				break;
+	if( c->buf_len + bytes <= size )
+		return true;
 
-			case 2:
-				if( remote_format.bigEndian ) {
-					CARD16IntoCARD8Star(ttwo, out);
-				} else {
-					SwapCARD16IntoCARD8Star(ttwo, out);
-				}
-				break;
-				
-			case 4:
-				if( remote_format.bigEndian ) {
-					CARD32IntoCARD8Star(ttwo, out);
-				} else {
-					SwapCARD32IntoCARD8Star(ttwo, out);
-				}
-				break;
+	while( c->buf_len + bytes > size )
+		size = size ? size * 2 : 64 * 1024;
 
-			default:
-				LOG("bad output_bpp (2) %d\n", output_bpp);
-				return;
-			}
-		}
+	if( !(p=realloc(c->buf, size)) ) {
+		LOG("out of memory (update buffer)\n");
+		return false;
 	}
+	c->buf = p;
+	c->buf_size = size;
+	return true;
 }
 
 static bool
-send_rect_hextile( int x, int y, int w, int h )
+put_output( vnc_client_t *c, const void *data, int size )
 {
-	rfbFramebufferUpdateRectHeader rect;
-	rect.encoding = rfbEncodingHextile;
+	if( !reserve_output(c, size) )
+		return false;
+	memcpy( c->buf + c->buf_len, data, size );
+	c->buf_len += size;
+	return true;
+}
 
-	//LOG( "send_rect_hextile( %d, %d, %d, %d )\n", x, y, w, h );
+static bool
+put_rect_header( vnc_client_t *c, int x, int y, int w, int h )
+{
+	rfbFramebufferUpdateRectHeader rect;
 
+	rect.encoding = c->encoding;
 	rect.r.x = x;
 	rect.r.y = y;
 	rect.r.w = w;
 	rect.r.h = h;
 
-	if ( !write_exact( (unsigned char*) &rect, sizeof(rect) ) ) {
-		LOG( "failed to write hextile header\n" );
-		return false;
+	c->update_rects++;
+	return put_output( c, &rect, sizeof(rect) );
+}
+
+/* compresses data into the update buffer */
+static bool
+deflate_output( vnc_client_t *c, vnc_zstream_t *s, unsigned char *data, int size, int flush )
+{
+	int avail;
+
+	if( !s->valid ) {
+		memset( &s->zs, 0, sizeof(s->zs) );
+		if( deflateInit(&s->zs, c->zlib_level) != Z_OK ) {
+			LOG("deflateInit failed\n");
+			return false;
+		}
+		s->valid = true;
 	}
+	s->zs.next_in = data;
+	s->zs.avail_in = size;
 
-	switch( vmode.depth ) {
-		case 8:
-			return sendHextiles8( x, y, w, h );
+	for( ;; ) {
+		if( !reserve_output(c, 4096) )
+			return false;
+		s->zs.next_out = c->buf + c->buf_len;
+		s->zs.avail_out = avail = c->buf_size - c->buf_len;
+
+		if( deflate(&s->zs, flush) == Z_STREAM_ERROR )
+			return false;
+		c->buf_len += avail - s->zs.avail_out;
+
+		if( s->zs.avail_out && !s->zs.avail_in )
+			return true;
+	}
+}
+
+static void
+close_zstreams( vnc_client_t *c )
+{
+	int i;
+
+	if( c->zrle_stream.valid )
+		deflateEnd( &c->zrle_stream.zs );
+	c->zrle_stream.valid = false;
+
+	for( i=0; i<4; i++ ) {
+		if( c->tight_streams[i].valid )
+			deflateEnd( &c->tight_streams[i].zs );
+		c->tight_streams[i].valid = false;
+	}
+}
+
+static void
+translate( vnc_client_t *c, unsigned char *in, unsigned char *out, int pixels )
+{
+	if( c->conv )
+		pixconv_line( c->conv, (char*)in, (char*)out, pixels );
+}
+
+static void
+encode_raw( vnc_client_t *c, int x, int y, int w, int h )
+{
+	int hh;
+
+	for( hh=0; hh < h; hh++ ) {
+		translate( c, offscreen_buf + vmode.offs + (y + hh) * vmode.rowbytes
+			   + x * offscreen_bpp, tile_buf + ublen, w );
+		ublen += w * c->output_bpp;
+	}
+}
+
+static bool
+encode_hextile( vnc_client_t *c, int x, int y, int w, int h )
+{
+	//LOG( "encode_hextile( %d, %d, %d, %d )\n", x, y, w, h );
+
+	// the hextile pixel size is that of the client
+	switch( c->output_bpp ) {
+		case 1:
+			return sendHextiles8( c, x, y, w, h );
 			break;
 
-		case 15:
-		case 16:
-			return sendHextiles16( x, y, w, h );
+		case 2:
+			return sendHextiles16( c, x, y, w, h );
 			break;
 
-		case 32:
-			return sendHextiles32( x, y, w, h );
+		case 4:
+			return sendHextiles32( c, x, y, w, h );
 			break;
 
 		default:
-			LOG("bad vmode.depth %d\n", vmode.depth);
+			LOG("bad output_bpp %d\n", c->output_bpp);
 			return false;
 	}
 	return false;
 }
 
-static bool
-send_rect( int x, int y, int w, int h )
+static int		zrle_encode_tile( vnc_client_t *c, int x, int y, int w, int h );
+static void		tight_encode_tile( vnc_client_t *c, int x, int y, int w, int h, vnc_tile_t *t );
+static bool		zrle_put_data( vnc_client_t *c, unsigned char *data, int size );
+static bool		tight_put_data( vnc_client_t *c, int stream, unsigned char *data, int size );
+
+/* encodes a tile for the client, or finds it in the cache; buffers_mutex must be held */
+static vnc_tile_t *
+encode_tile( vnc_client_t *c, int idx, int x, int y, int w, int h )
 {
-	int hh;
-	bool res;
-	
-	rfbFramebufferUpdateRectHeader rect;
-	
-	//LOG("Send %dx%dx%dx%d Dep=(%d -> %d) Bpp=(%d -> %d)\n",
-	//		    x, y, w, h,
-	//                 vmode.depth, remote_format.bitsPerPixel,
-	//                  offscreen_bpp, output_bpp);
-	
-	if( g_CanHextile )
-		return send_rect_hextile( x, y, w, h );
+	vnc_tile_t *t = &tile_cache[idx * TILE_CACHE_WAYS];
+	vnc_tile_t *victim = t;
+	int i;
 
-	//LOG( "sending rawdata\n" );
+	for( i=0; i<TILE_CACHE_WAYS; i++, t++ ) {
+		if( t->format_id == c->format_id && t->encoding == c->encoding
+		    && t->gen == tile_gen[idx] ) {
+			t->stamp = ++cache_stamp;
+			return t;
+		}
+		if( t->stamp < victim->stamp )
+			victim = t;
+	}
 
-	rect.encoding = 0;
-	rect.r.x = x;
-	rect.r.y = y;
-	rect.r.w = w;
-	rect.r.h = h;
+	t = &scratch;
+	t->data = tile_buf;
+	t->stream = -1;
+	ublen = 0;
 
-	//LOG("Send %d %d %d %d (%d -> %d) (%d -> %d)\n", x, y, w, h,
-	//                  vmode.depth, remote_format.bitsPerPixel,
-	//                  offscreen_bpp, output_bpp);
-	
-	if( !write_exact((unsigned char *)&rect, sizeof(rect)) )
-		return false;
+	switch( c->encoding ) {
+	case rfbEncodingHextile:
+		if( !encode_hextile(c, x, y, w, h) )
+			return NULL;
+		t->hdr_len = t->len = ublen;
+		break;
+	case rfbEncodingZRLE:
+		t->hdr_len = 0;
+		t->len = zrle_encode_tile( c, x, y, w, h );
+		break;
+	case rfbEncodingTight:
+		tight_encode_tile( c, x, y, w, h, t );
+		break;
+	default:
+		encode_raw( c, x, y, w, h );
+		t->hdr_len = t->len = ublen;
+		break;
+	}
 
-	for( hh=0; hh < h; hh++ ) {
-		pthread_mutex_lock(&buffers_mutex);
+	// worth keeping if somebody else might want it
+	if( n_clients < 2 )
+		return t;
 
-		translate( offscreen_buf + vmode.offs + (x + (y + hh) * vmode.w)
-			   * offscreen_bpp, output_buf, w );
+	if( victim->size < t->len ) {
+		unsigned char *p = realloc( victim->data, t->len );
+		if( !p )
+			return t;
+		victim->data = p;
+		victim->size = t->len;
+	}
+	memcpy( victim->data, t->data, t->len );
+	victim->len = t->len;
+	victim->hdr_len = t->hdr_len;
+	victim->stream = t->stream;
+	victim->encoding = c->encoding;
+	victim->format_id = c->format_id;
+	victim->gen = tile_gen[idx];
+	victim->stamp = ++cache_stamp;
+	return victim;
+}
+
+/* Copies dirty tile idx (encoded, or found in the cache) to c->stage at offs.
+ * Returns 1 if staged, 0 if the tile is clean or the screen went away, -1 on
+ * errors. buffers_mutex must be held.
+ */
+static int
+stage_tile( vnc_client_t *c, int idx, int offs, vnc_staged_t *st )
+{
+	int x, y, w, h;
+	unsigned char *p;
+	vnc_tile_t *t;
+
+	// the video mode might have changed since the update started
+	if( !offscreen_buf || c->n_dirty != n_tiles || !c->dirty[idx] )
+		return 0;
+	c->dirty[idx] = 0;
+
+	x = (idx % tiles_x) * TILE_W;
+	y = (idx / tiles_x) * TILE_H;
+	w = (x + TILE_W > vmode.w) ? vmode.w - x : TILE_W;
+	h = (y + TILE_H > vmode.h) ? vmode.h - y : TILE_H;
+
+	if( !(t=encode_tile(c, idx, x, y, w, h)) )
+		return -1;
+	if( offs + t->len > c->stage_size ) {
+		if( !(p=realloc(c->stage, offs + t->len)) )
+			return -1;
+		c->stage = p;
+		c->stage_size = offs + t->len;
+	}
+	memcpy( c->stage + offs, t->data, t->len );
+	st->w = w;
+	st->hdr_len = t->hdr_len;
+	st->stream = t->stream;
+	st->len = t->len;
+	return 1;
+}
 
-		res = write_exact(output_buf, w * output_bpp);
+/* Appends n staged tiles of a tile row as a single rectangle. Raw, Hextile
+ * and ZRLE data of horizontally adjacent tiles can be joined; a Tight
+ * rectangle always holds a single tile. The zlib part is compressed per client.
+ */
+static bool
+emit_run( vnc_client_t *c, int x, int y, int h, vnc_staged_t *run, int n )
+{
+	int i, r, w, len, offs, bytes;
 
-		pthread_mutex_unlock(&buffers_mutex);
+	for( w=len=i=0; i<n; i++ ) {
+		w += run[i].w;
+		len += run[i].len;
+	}
+	if( !put_rect_header(c, x, y, w, h) )
+		return false;
 
-		if( !res )
+	switch( c->encoding ) {
+	case rfbEncodingHextile:
+		// a row of 16x16 subtiles; every tile starts with its own colours
+		return put_output( c, c->stage, len );
+	case rfbEncodingZRLE:
+		// the ZRLE tiles of the rectangle are our tiles
+		return zrle_put_data( c, c->stage, len );
+	case rfbEncodingTight:
+		if( !put_output(c, c->stage, run[0].hdr_len) )
 			return false;
+		if( run[0].stream < 0 )
+			return true;
+		return tight_put_data( c, run[0].stream, c->stage + run[0].hdr_len, run[0].len - run[0].hdr_len );
+	}
+	// raw pixels are sent line by line
+	for( r=0; r<h; r++ ) {
+		for( offs=i=0; i<n; offs += run[i++].len ) {
+			bytes = run[i].w * c->output_bpp;
+			if( !put_output(c, c->stage + offs + r * bytes, bytes) )
+				return false;
+		}
 	}
-	
 	return true;
 }
 
+/* checksum callback; marks the tiles of a changed rectangle */
+static void
+mark_dirty( int x, int y, int w, int h )
+{
+	vnc_client_t *c;
+	int tx, ty, idx;
+
+	for( ty=y/TILE_H; ty <= (y+h-1)/TILE_H; ty++ ) {
+		for( tx=x/TILE_W; tx <= (x+w-1)/TILE_W; tx++ ) {
+			idx = ty * tiles_x + tx;
+			tile_gen[idx]++;
+
+			for( c=clients; c; c=c->next )
+				if( c->n_dirty == n_tiles )
+					c->dirty[idx] = 1;
+		}
+	}
+}
+
+/* picks up framebuffer changes; must be called with buffers_mutex held */
 static void
-send_update( void )
+poll_framebuffer( void )
+{
+	short dirty_buffer[80];
+	int i, y, h, dirty_size;
+
+	dirty_size = _get_dirty_fb_lines( dirty_buffer, sizeof(dirty_buffer) );
+
+	for( i=0; i<dirty_size; i++ ) {
+		y = dirty_buffer[i*2];
+		h = dirty_buffer[i*2+1] - dirty_buffer[i*2] + 1;
+
+		if( !vnc_cksum ) {
+			mark_dirty( 0, y, vmode.w, h );
+			continue;
+		}
+		// only the 64 pixel blocks whose checksum changed are sent
+		vcksum_calc( vnc_cksum, y, h );
+		vcksum_redraw( vnc_cksum, y, h, mark_dirty );
+	}
+}
+
+static void
+send_update( vnc_client_t *c )
 {
 	//struct timespec close_req = {0, 1}; /* 60 Hz */
 	rfbFramebufferUpdateMsg msg;
-	short dirty_buffer[80];
-	int dirty_size = 0;
-	int i, y=-1, hight;
+	vnc_staged_t run[RUN_MAX_TILES];
+	bool res;
+	int i, k, n, cnt, ret, offs, idx, tx, x, y, h, screen_h;
 
 	// wait for sock and fb to become valid
-	if( (vnc_sock_valid == false) || (vnc_sock == -1) ||
-	    (is_open == false) || (offscreen_buf == NULL) )
+	if( !c->sock_valid || !c->running || !is_open )
 	{
 		//LOG( "sock/fb not ready, EXITING send_update\n" );
 		return;
 	}
 
-	if( force_redraw ) {
-		dirty_size = 1;
+	c->buf_len = 0;
+	c->update_rects = 0;
+	pthread_mutex_lock(&buffers_mutex);
 
-		pthread_mutex_lock(&buffers_mutex);
-		_get_dirty_fb_lines(dirty_buffer, sizeof(dirty_buffer) );
+	if( !offscreen_buf ) {
 		pthread_mutex_unlock(&buffers_mutex);
- 
-		dirty_buffer[0] = 0;
-		dirty_buffer[1] = vmode.h - 1;
+		return;
+	}
+	poll_framebuffer();
+
+	// new client or new video mode
+	if( c->n_dirty != n_tiles ) {
+		free( c->dirty );
+		c->n_dirty = (c->dirty=malloc(n_tiles)) ? n_tiles : 0;
+		c->scan_pos = 0;
+		c->force_redraw = true;
+	}
+	if( c->force_redraw ) {
+		memset( c->dirty, 1, c->n_dirty );
+		c->force_redraw = false;
+	}
+	n = c->n_dirty;
+	tx = tiles_x;
+	screen_h = vmode.h;
+	pthread_mutex_unlock(&buffers_mutex);
+
+	msg.type = rfbFramebufferUpdate;
+	msg.nRects = 0;
+	res = put_output( c, &msg, sizeof(msg) );
+
+	// The scan resumes where the previous update ran out of budget, so the
+	// bottom of the screen is not starved. buffers_mutex is only held while
+	// a tile is picked up; rectangles are assembled and compressed without it.
+	for( k=0; res && k<n && c->buf_len < send_budget; k += cnt ? cnt : 1 ) {
+		idx = (c->scan_pos + k) % n;
+		offs = 0;
+		for( cnt=0; cnt < RUN_MAX_TILES && k + cnt < n; cnt++ ) {
+			// runs end at the end of the tile row
+			if( cnt && (c->encoding == rfbEncodingTight || (idx + cnt) % tx == 0) )
+				break;
+			pthread_mutex_lock(&buffers_mutex);
+			ret = stage_tile( c, idx + cnt, offs, &run[cnt] );
+			pthread_mutex_unlock(&buffers_mutex);
+			if( ret <= 0 ) {
+				res = (ret == 0);
+				break;
+			}
+			offs += run[cnt].len;
+		}
+		if( !res || !cnt )
+			continue;
 
-		force_redraw = false;
+		x = (idx % tx) * TILE_W;
+		y = (idx / tx) * TILE_H;
+		h = (y + TILE_H > screen_h) ? screen_h - y : TILE_H;
+		res = emit_run( c, x, y, h, run, cnt );
 	}
- 
-	if( !dirty_size ) {
+	if( n )
+		c->scan_pos = (c->scan_pos + k) % n;
+
+	if( res )
+		((rfbFramebufferUpdateMsg *)c->buf)->nRects = c->update_rects;
+	else {
 		pthread_mutex_lock(&buffers_mutex);
-		dirty_size = _get_dirty_fb_lines(dirty_buffer, sizeof(dirty_buffer) );
+		c->force_redraw = true;
 		pthread_mutex_unlock(&buffers_mutex);
 	}
 
-	if( !dirty_size )
+	if( !res || !c->update_rects )
 		return;
 
-	//LOG( "now sending update, size=%d\n", dirty_size );
+	//LOG( "now sending update, %d rects (%d bytes)\n", c->update_rects, c->buf_len );
 
-	msg.type = rfbFramebufferUpdate;
-	msg.nRects = dirty_size;
-
-	request_received = false;
-
-	// send the update
+	c->request_received = false;
 
-	if( !write_exact((unsigned char *)&msg, sizeof(msg)) ) {
-		//LOG( "failed to write update header\n" );
-		return;
-	}
- 
-	for( i=0; i<dirty_size; i++ ) {
-		y = dirty_buffer[i*2];
-		hight = dirty_buffer[i*2+1] - dirty_buffer[i*2] + 1;
+	write_exact( c, c->buf, c->buf_len );
 
-		if( !send_rect(0, y, vmode.w, hight) ) {
-			//LOG( "failed to send rect, leaving send_update\n" );
-			return;
-		}
-	}
-	
 	//LOG( "leaving send_update\n" );
 }
 
 static bool
-read_exact( unsigned char *buffer, int size )
+read_exact( vnc_client_t *c, unsigned char *buffer, int size )
 {
 	int p=0, i=0;
 	
-	if( !vnc_sock_valid )
+	if( !c->sock_valid )
 		return false;
 	
 	while( p < size ) {
 		struct pollfd polls;
 		int retval = 1;
 
-		if( request_received ) {
-			polls.fd = vnc_sock;
+		if( c->request_received ) {
+			polls.fd = c->sock;
 			polls.events = POLLIN;
 			
 			retval = poll(&polls, 1, 1000 / 10);
 		}
  
 		if( retval > 0 ) {
-			i = read( vnc_sock, buffer + p, size - p);
+			i = read( c->sock, buffer + p, size - p);
 			if( i <= 0 ) {
 				LOG("Error on socket read %d\n", i);
 				perror("Read from socket");
-				vnc_sock_valid = false;
+				c->sock_valid = false;
 				return false;
 			}
 			p += i;
 		}
 
-		if( request_received ) {
-			send_update();
+		if( c->request_received ) {
+			send_update( c );
 		}
 	}
 	return true;
 }
 
 static void
-init_translationtable( void )
+init_pixconv( vnc_client_t *c )
 {
-	CARD16 tone=0;
-	CARD32 ttwo;
-	CARD8 *pos;
-	int i;
- 
-	if( !is_open || !connection_running )
-		return;
+	rfbPixelFormat *f = &c->format;
+	pixfmt_t fmt;
+
+	LOG("init_pixconv %d %d\n", vmode.depth, f->bitsPerPixel);
+
+	fmt.bpp = c->output_bpp;
+	fmt.big_endian = f->bigEndian;
+	fmt.red_max = f->redMax;
+	fmt.green_max = f->greenMax;
+	fmt.blue_max = f->blueMax;
+	fmt.red_shift = f->redShift;
+	fmt.green_shift = f->greenShift;
+	fmt.blue_shift = f->blueShift;
+
+	if( c->conv )
+		free_pixconv( c->conv );
+	if( !(c->conv = alloc_pixconv(vmode.depth, &fmt)) )
+		LOG("unsupported pixel format (%d -> %d bpp)\n", vmode.depth, f->bitsPerPixel);
+	else if( vmode.depth == 8 )
+		pixconv_set_palette( c->conv, (char*)mac_pal );
+}
 
-	if( !translationtable ) {
-		translationtable = malloc( TRANSTABLE_SIZE );
-		if( !translationtable ) 
-			fatal("vnc: out-of-mem\n");
+/* CPIXEL / TPIXEL layout of the client pixel format */
+static void
+init_compact_pixels( vnc_client_t *c )
+{
+	rfbPixelFormat *f = &c->format;
+	CARD32 mask = (f->redMax << f->redShift) | (f->greenMax << f->greenShift)
+		| (f->blueMax << f->blueShift);
+
+	c->cpixel_bytes = c->output_bpp;
+	c->cpixel_offs = 0;
+
+	if( c->output_bpp == 4 && f->trueColour && f->depth <= 24 ) {
+		if( !(mask & 0xff000000) ) {
+			c->cpixel_bytes = 3;
+			c->cpixel_offs = f->bigEndian ? 1 : 0;
+		} else if( !(mask & 0xff) ) {
+			c->cpixel_bytes = 3;
+			c->cpixel_offs = f->bigEndian ? 0 : 1;
+		}
 	}
-	
-	LOG("init_translationtable %d %d\n",
-	    vmode.depth, remote_format.bitsPerPixel);
 
-	pos = (CARD8 *)translationtable;
+	c->tpixel_rgb = c->output_bpp == 4 && f->depth == 24 && f->redMax == 255
+		&& f->greenMax == 255 && f->blueMax == 255;
+}
 
-	switch( vmode.depth ) {
-	case 8:
-		for( i=0; i < 256; i++ ) {
-			switch( remote_format.bitsPerPixel ) {
-			case 8:
-				*(pos++) = IndexedToRemote(i);
-				break;
-			case 16:
-				tone = IndexedToRemote(i);
-				if( remote_format.bigEndian ) {
-					CARD16IntoCARD8Star(tone, pos);
-				} else {
-					SwapCARD16IntoCARD8Star(tone, pos);
-				}
-				break;
-			case 32:
-				ttwo = IndexedToRemote(i);
-				if( remote_format.bigEndian ) {
-					CARD32IntoCARD8Star(tone, pos);
-				} else {
-					SwapCARD32IntoCARD8Star(tone, pos);
-				}
-				break;
-			}
-		}
-		break;
+static bool
+same_format( rfbPixelFormat *a, rfbPixelFormat *b )
+{
+	return a->bitsPerPixel == b->bitsPerPixel && a->depth == b->depth
+		&& a->bigEndian == b->bigEndian && a->trueColour == b->trueColour
+		&& a->redMax == b->redMax && a->greenMax == b->greenMax && a->blueMax == b->blueMax
+		&& a->redShift == b->redShift && a->greenShift == b->greenShift
+		&& a->blueShift == b->blueShift;
+}
 
-	case 16:
-	case 15:
-		for( i=0; i < 65536; i++ ) {
-			switch( remote_format.bitsPerPixel ) {
-			case 8:
-				translationtable[i] = RGB555ToRemote(i);
-				break;
-			case 16:
-				tone = RGB555ToRemote(i);
-				if( remote_format.bigEndian ) {
-					CARD16IntoCARD8Star(tone, pos);
-				} else {
-					SwapCARD16IntoCARD8Star(tone, pos);
-				}
-				break;
+static void
+set_pixel_format( vnc_client_t *c, const rfbPixelFormat *format )
+{
+	vnc_client_t *p;
 
-			case 32:
-				ttwo = RGB555ToRemote(i);
- 
-				if( remote_format.bigEndian) {
-					CARD32IntoCARD8Star(ttwo, pos);
-				} else {
-					SwapCARD32IntoCARD8Star(ttwo, pos);
-				}
-				break;
-			}
+	pthread_mutex_lock(&buffers_mutex);
+
+	c->format = *format;
+	c->output_bpp = c->format.bitsPerPixel / 8;
+
+	//LOG( "setting output_bpp to %d\n", c->output_bpp );
+
+	c->format_id = ++format_serial;
+	for( p=clients; p; p=p->next ) {
+		if( p != c && p->running && same_format(&p->format, &c->format) ) {
+			c->format_id = p->format_id;
+			break;
 		}
-		break;
 	}
+	c->running = true;
+	c->force_redraw = true;
+
+	init_pixconv( c );
+	init_compact_pixels( c );
+
+	pthread_mutex_unlock(&buffers_mutex);
 }
 
 static void
 vnc_thread( void *arg )
 {
+	vnc_client_t *c = arg, **pp;
 	unsigned char buffer[256];
 	CARD32 encodingBuffer[20];
+	int encoding, n, nread;
 	CARD32 auth = rfbNoAuth;
 	CARD8 lastbuttonmask = 0;
 
@@ -618,20 +836,18 @@ vnc_thread( void *arg )
 
 	bool caps_on = false;        // Flag: Caps Lock on
 
-	request_received = false;
-
 	LOG("vnc_thread starts as pid %d\n", getpid());
  
 	snprintf( (char *)buffer, 256, rfbProtocolVersionFormat, rfbProtocolMajorVersion,
 		  rfbProtocolMinorVersion);
 
-	if( !write_exact(buffer, 12) )
+	if( !write_exact(c, buffer, 12) )
 		goto endo;
-	if( !read_exact(buffer, 12) )
+	if( !read_exact(c, buffer, 12) )
 		goto endo;
-	if( !write_exact((unsigned char *)&auth, sizeof(auth)) )
+	if( !write_exact(c, (unsigned char *)&auth, sizeof(auth)) )
 		goto endo;
-	if( !read_exact(buffer, sizeof(CARD8)) )
+	if( !read_exact(c, buffer, sizeof(CARD8)) )
 		goto endo;
 
 	switch( vmode.depth ) {
@@ -649,66 +865,70 @@ vnc_thread( void *arg )
 	server_init.framebufferHeight = vmode.h;
 	server_init.nameLength = strlen(display_name);
 	
-	if( !write_exact((unsigned char *)&server_init, sizeof(server_init)) )
+	if( !write_exact(c, (unsigned char *)&server_init, sizeof(server_init)) )
 		goto endo;
  
-	if( !write_exact((unsigned char *)display_name, strlen(display_name)) )
+	if( !write_exact(c, (unsigned char *)display_name, strlen(display_name)) )
 		goto endo;
 
-	force_redraw = true;
+	// until the client asks for something else
+	set_pixel_format( c, &server_init.format );
 
-	while( vnc_sock_valid ) {
-		if( !read_exact(buffer, sizeof(CARD8)) )
+	while( c->sock_valid ) {
+		if( !read_exact(c, buffer, sizeof(CARD8)) )
 			goto endo;
  
 		switch( buffer[0] ) {
 		case rfbSetPixelFormat:
 			//LOG( "rfbSetPIxelFormat\n" );
 
-			if( !read_exact(((unsigned char *)&set_pixels) + 1,
+			if( !read_exact(c, ((unsigned char *)&set_pixels) + 1,
 					sz_rfbSetPixelFormatMsg - 1) < 0 )
 				goto endo;
 
-			connection_running = true;
-			remote_format = set_pixels.format;
-			output_bpp = remote_format.bitsPerPixel / 8;
-
-			//LOG( "setting output_bpp to %d\n", output_bpp );
-
-			init_translationtable();
-
+			set_pixel_format( c, &set_pixels.format );
 			break;
 		case rfbSetEncodings:
-			if( !read_exact(((unsigned char *)&set_encodings) + 1,
+			if( !read_exact(c, ((unsigned char *)&set_encodings) + 1,
 					sz_rfbSetEncodingsMsg - 1) < 0 )
 				goto endo;
 
 			//LOG( "rfbSetEncoding - %d encodings\n", set_encodings.nEncodings );
- 
-			if( !read_exact((unsigned char*)&encodingBuffer,
-					sizeof(CARD32) * set_encodings.nEncodings) < 0 )
-				goto endo;
 
-			g_CanHextile = false;
-			for( i=0; i<set_encodings.nEncodings; ++i ) {
-				//LOG( "rfbSetEncoding - likes %d\n", encodingBuffer[i] );
+			// the client lists its encodings in order of preference
+			encoding = -1;
+			c->zlib_level = 6;
+			for( n=set_encodings.nEncodings; n > 0; n -= nread ) {
+				nread = (n > 20) ? 20 : n;
+				if( !read_exact(c, (unsigned char*)&encodingBuffer, sizeof(CARD32) * nread) )
+					goto endo;
 
-				if( encodingBuffer[i] == rfbEncodingHextile ) {
-					g_CanHextile = true;
-					break;
+				for( i=0; i<nread; ++i ) {
+					CARD32 enc = encodingBuffer[i];
+					//LOG( "rfbSetEncoding - likes %d\n", enc );
+
+					if( enc >= rfbEncodingCompressLevel0 && enc <= rfbEncodingCompressLevel9 )
+						c->zlib_level = enc - rfbEncodingCompressLevel0;
+					if( encoding != -1 )
+						continue;
+					if( enc == rfbEncodingHextile || enc == rfbEncodingZRLE
+					    || enc == rfbEncodingTight || enc == rfbEncodingRaw )
+						encoding = enc;
 				}
 			}
+			c->encoding = (encoding == -1) ? rfbEncodingRaw : encoding;
+			LOG("using encoding %d\n", c->encoding );
 			break;
  
 		case rfbFramebufferUpdateRequest:
 			//LOG( "update request\n" );
 
-			if( !read_exact(((unsigned char *)&request) + 1,
+			if( !read_exact(c, ((unsigned char *)&request) + 1,
 					sz_rfbFramebufferUpdateRequestMsg - 1) < 0 )
 				goto endo;
 			if (!request.incremental)
-				force_redraw = true;
-			request_received = true;
+				c->force_redraw = true;
+			c->request_received = true;
 			//send_update();
 			break;
  
@@ -717,7 +937,7 @@ vnc_thread( void *arg )
  
 			//LOG( "rfbKeyEvent\n" );
 
-			if(!read_exact(((unsigned char *)&key) + 1, sz_rfbKeyEventMsg - 1) < 0 )
+			if(!read_exact(c, ((unsigned char *)&key) + 1, sz_rfbKeyEventMsg - 1) < 0 )
 				goto endo;
 
 			code = ks_decode(key.key);
@@ -743,7 +963,7 @@ vnc_thread( void *arg )
 		case rfbPointerEvent:
 			//LOG( "rfbPointerEvent\n" );
 
-			if( !read_exact(((unsigned char *)&pointer) + 1,
+			if( !read_exact(c, ((unsigned char *)&pointer) + 1,
 					sz_rfbPointerEventMsg - 1)  < 0 )
 				goto endo;
 
@@ -757,7 +977,7 @@ vnc_thread( void *arg )
 			break;
  
 		case rfbClientCutText:
-			if( !read_exact(((unsigned char *)&cut) + 1,
+			if( !read_exact(c, ((unsigned char *)&cut) + 1,
 					sz_rfbClientCutTextMsg - 1) < 0 )
 				goto endo;
 
@@ -765,7 +985,7 @@ vnc_thread( void *arg )
 				int i = cut.length;
 				if( i>255 )
 					i = 255;
-				if( !read_exact(buffer, i) < 0 )
+				if( !read_exact(c, buffer, i) < 0 )
 					goto endo;
 				cut.length -= i;
 			}
@@ -779,11 +999,27 @@ vnc_thread( void *arg )
 	}
 
 endo:
-	connection_running = false;
+	pthread_mutex_lock(&buffers_mutex);
+	for( pp=&clients; *pp != c; pp=&(*pp)->next )
+		;
+	*pp = c->next;
+	pthread_mutex_unlock(&buffers_mutex);
+
 	LOG("Closing vnc_sock\n");
-	LOG("Result %d \n", close(vnc_sock));
-	vnc_sock_valid = false;
-	vnc_sock = -1;
+	c->sock_valid = false;
+	LOG("Result %d \n", close(c->sock));
+	close_zstreams( c );
+	free( c->dirty );
+	free( c->buf );
+	free( c->stage );
+	if( c->conv )
+		free_pixconv( c->conv );
+	free( c );
+
+	pthread_mutex_lock(&buffers_mutex);
+	n_clients--;
+	pthread_cond_broadcast( &clients_cond );
+	pthread_mutex_unlock(&buffers_mutex);
 	LOG("------- vnc_thread ends\n");
 	return;
 }
@@ -838,7 +1074,7 @@ static void testColours##bpp(CARD##bpp *data, int size, bool *mono,	      \
   */									      \
 									      \
 static bool								      \
-sendHextiles##bpp( int rx, int ry, int rw, int rh )			      \
+sendHextiles##bpp( vnc_client_t *c, int rx, int ry, int rw, int rh )	      \
 {									      \
      int x, y, w, h;							      \
      int startUblen;							      \
@@ -851,12 +1087,11 @@ sendHextiles##bpp( int rx, int ry, int rw, int rh )			      \
      unsigned char* updateBuf;						      \
      unsigned char* fbptr;						      \
      unsigned char* clptr;						      \
-     ublen = 0;								      \
      bg = 0;								      \
      fg = 0;								      \
      newBg = 0;								      \
      newFg = 0;								      \
-     updateBuf = output_buf;						      \
+     updateBuf = tile_buf;						      \
      									      \
      /* LOG( "sendHextiles%dbpp( %d, %d, %d, %d )\n", bpp, rx, ry, rw, rh ); */ \
      /* LOG( "offscreen_bpp=%d\n", offscreen_bpp ); */			      \
@@ -870,32 +1105,18 @@ sendHextiles##bpp( int rx, int ry, int rw, int rh )			      \
 	    if (ry+rh - y < 16)						      \
 		h = ry+rh - y;						      \
 									      \
-	    if ( (ublen + 1 + 16*16*(bpp/8)) > output_buf_size) {	      \
-     	        pthread_mutex_lock(&buffers_mutex);			      \
-		/* LOG( "Writing buffer %lx of length %d\n", (long) output_buf, ublen ); */ \
-	    	if ( !write_exact(output_buf, ublen) )			      \
-		{							      \
-     	            pthread_mutex_unlock(&buffers_mutex);		      \
-		    return false;					      \
-		}							      \
-     	        pthread_mutex_unlock(&buffers_mutex);			      \
-									      \
-		ublen = 0;						      \
-	    }								      \
 									      \
 									      \
 	    /* LOG( "sending hextile(%dx%dx%dx%d) ofsb=%lx\n", x, y, w, h, (long) offscreen_buf ); */ \
-     	    pthread_mutex_lock(&buffers_mutex);				      \
 	    for( hh = 0; hh < h; ++hh )					      \
 	    {								      \
 		/* LOG( "offscreen_buf=%lx hh=%d\n", (long) offscreen_buf, hh ); */ \
-		fbptr = offscreen_buf + (x * offscreen_bpp) + ( (y+hh) * rw) * offscreen_bpp; \
-		clptr = ((unsigned char*) clientPixelData) + (hh*16) * (bpp/8); \
+		fbptr = offscreen_buf + vmode.offs + (y+hh) * vmode.rowbytes + x * offscreen_bpp; \
+		clptr = ((unsigned char*) clientPixelData) + (hh*w) * (bpp/8); \
 									      \
 		/* copypixels( fbptr, (unsigned char*) clientPixelData, bpp/8, rw, w, h );  */ \
-	    	translate( fbptr, clptr, w );				      \
+	    	translate( c, fbptr, clptr, w );			      \
 	    }								      \
-     	    pthread_mutex_unlock(&buffers_mutex);			      \
 									      \
 	    startUblen = ublen;						      \
 	    updateBuf[startUblen] = 0;					      \
@@ -937,27 +1158,20 @@ sendHextiles##bpp( int rx, int ry, int rw, int rh )			      \
 		updateBuf[ublen++] = rfbHextileRaw;			      \
 									      \
 	    	/* LOG( "sending raw(%dx%dx%dx%d)\n", x, y, w, h ); */	      \
-     	    	pthread_mutex_lock(&buffers_mutex);			      \
 	    	for( hh = 0; hh < h; ++hh )				      \
 	    	{							      \
-			fbptr = offscreen_buf + (x * offscreen_bpp) + ( (y+hh) * rw) * offscreen_bpp; \
-			clptr = ((unsigned char*) clientPixelData) + (hh*16) * (bpp/8); \
+			fbptr = offscreen_buf + vmode.offs + (y+hh) * vmode.rowbytes + x * offscreen_bpp; \
+			clptr = ((unsigned char*) clientPixelData) + (hh*w) * (bpp/8); \
 									      \
 			/* copypixels( fbptr, (unsigned char*) clientPixelData, bpp/8, rw, w, h ); */ \
-	    		translate( fbptr, clptr, w );			      \
+	    		translate( c, fbptr, clptr, w );		      \
 	    	}							      \
-     	    	pthread_mutex_unlock(&buffers_mutex);			      \
 	    	memcpy( &updateBuf[ublen], (char*) clientPixelData, w * h * (bpp/8) ); \
 	    	ublen += w * h * (bpp/8);				      \
 	    }								      \
 	}								      \
      }									      \
 									      \
-    /* LOG( "Writing remaining buffer %lx of length %d\n", (long) output_buf, ublen ); */ \
-    if ( ublen > 0 && !write_exact(output_buf, ublen) )			      \
-    	return false;							      \
-    ublen = 0;								      \
-									      \
      return true;							      \
 }									      \
 									      \
@@ -979,7 +1193,7 @@ subrectEncode##bpp(CARD##bpp *data, int w, int h, CARD##bpp bg,		      \
      int newLen;							      \
      int nSubrectsUblen;						      \
      unsigned char* updateBuf;						      \
-     updateBuf = output_buf; 						      \
+     updateBuf = tile_buf;						      \
 									      \
      nSubrectsUblen = ublen;						      \
      ublen++;								      \
@@ -995,7 +1209,7 @@ subrectEncode##bpp(CARD##bpp *data, int w, int h, CARD##bpp bg,		      \
 		    seg = data+(j*w);					      \
 		    if (seg[x] != cl) {break;}				      \
 		    i = x;						      \
-		    while ((seg[i] == cl) && (i < w)) i += 1;		      \
+		    while ((i < w) && (seg[i] == cl)) i += 1;		      \
 		    i -= 1;						      \
 		    if (j == y) vx = hx = i;				      \
 		    if (i < vx) vx = i;					      \
@@ -1119,6 +1333,344 @@ DEFINE_SEND_HEXTILES(8)
 DEFINE_SEND_HEXTILES(16)
 DEFINE_SEND_HEXTILES(32)
 
+
+/************************************************************************/
+/*	ZRLE and Tight encodings					*/
+/************************************************************************/
+
+#define TILE_PIXELS		(TILE_W * TILE_H)
+#define PALETTE_HASH_SIZE	512
+
+typedef struct {
+	int	n;				// number of colours
+	CARD32	colour[256];
+	short	hash[PALETTE_HASH_SIZE];	// index + 1, 0 if free
+} vnc_palette_t;
+
+// encoders run under buffers_mutex, so these can be shared
+static vnc_palette_t	palette;
+static CARD32		pixel_buf[TILE_PIXELS];
+
+#define PALETTE_HASH(c)		(((c) * 2654435761U) >> 23)
+
+static void
+palette_reset( void )
+{
+	palette.n = 0;
+	memset( palette.hash, 0, sizeof(palette.hash) );
+}
+
+/* returns the palette index of the colour; -1 if more than max colours are needed */
+static int
+palette_insert( CARD32 c, int max )
+{
+	int h;
+
+	for( h=PALETTE_HASH(c); palette.hash[h]; h=(h+1) & (PALETTE_HASH_SIZE-1) )
+		if( palette.colour[palette.hash[h]-1] == c )
+			return palette.hash[h] - 1;
+
+	if( palette.n >= max )
+		return -1;
+	palette.colour[palette.n++] = c;
+	palette.hash[h] = palette.n;
+	return palette.n - 1;
+}
+
+/* translated pixels of the rectangle, as client pixel values */
+static void
+fetch_pixels( vnc_client_t *c, int x, int y, int w, int h, CARD32 *dst )
+{
+	unsigned char *p;
+	int i, j;
+
+	for( j=0; j<h; j++, dst+=w ) {
+		p = (unsigned char*)dst;
+		translate( c, offscreen_buf + vmode.offs + (y + j) * vmode.rowbytes
+			   + x * offscreen_bpp, p, w );
+
+		// widen in place, back to front
+		for( i=w-1; i>=0; i-- ) {
+			unsigned char *s = p + i * c->output_bpp;
+
+			switch( c->output_bpp ) {
+			case 1:
+				dst[i] = s[0];
+				break;
+			case 2:
+				dst[i] = c->format.bigEndian ? (s[0] << 8) | s[1]
+					: (s[1] << 8) | s[0];
+				break;
+			default:
+				dst[i] = c->format.bigEndian ?
+					(s[0] << 24) | (s[1] << 16) | (s[2] << 8) | s[3] :
+					(s[3] << 24) | (s[2] << 16) | (s[1] << 8) | s[0];
+				break;
+			}
+		}
+	}
+}
+
+static unsigned char *
+put_pixel( vnc_client_t *c, unsigned char *d, CARD32 pix )
+{
+	int i;
+
+	for( i=0; i<c->output_bpp; i++ ) {
+		int shift = c->format.bigEndian ? (c->output_bpp - 1 - i) * 8 : i * 8;
+		*d++ = pix >> shift;
+	}
+	return d;
+}
+
+static unsigned char *
+put_cpixel( vnc_client_t *c, unsigned char *d, CARD32 pix )
+{
+	unsigned char bytes[4];
+
+	put_pixel( c, bytes, pix );
+	memcpy( d, bytes + c->cpixel_offs, c->cpixel_bytes );
+	return d + c->cpixel_bytes;
+}
+
+static unsigned char *
+put_tpixel( vnc_client_t *c, unsigned char *d, CARD32 pix )
+{
+	if( !c->tpixel_rgb )
+		return put_pixel( c, d, pix );
+
+	*d++ = pix >> c->format.redShift;
+	*d++ = pix >> c->format.greenShift;
+	*d++ = pix >> c->format.blueShift;
+	return d;
+}
+
+static unsigned char *
+put_run_length( unsigned char *d, int len )
+{
+	for( len--; len >= 255; len -= 255 )
+		*d++ = 255;
+	*d++ = len;
+	return d;
+}
+
+/* encodes a ZRLE tile into tile_buf, returns the number of bytes */
+static int
+zrle_encode_tile( vnc_client_t *c, int x0, int y0, int w, int h )
+{
+	CARD32 *pix = pixel_buf;
+	unsigned char *d = tile_buf;
+	int i, x, y, len, n, bits;
+	int raw, packed, plain_rle, pal_rle, best;
+	int npix = w * h, cb = c->cpixel_bytes;
+	bool many = false;
+
+	fetch_pixels( c, x0, y0, w, h, pix );
+
+	// colours and runs
+	palette_reset();
+	plain_rle = pal_rle = 0;
+	for( i=0; i<npix; i+=len ) {
+		for( len=1; i+len < npix && pix[i+len] == pix[i]; len++ )
+			;
+		if( !many && palette_insert(pix[i], 127) < 0 )
+			many = true;
+		plain_rle += cb + (len-1) / 255 + 1;
+		pal_rle += (len == 1) ? 1 : 1 + (len-1) / 255 + 1;
+	}
+	n = palette.n;
+
+	if( n == 1 ) {
+		*d++ = rfbZRLESolid;
+		d = put_cpixel( c, d, pix[0] );
+		return d - tile_buf;
+	}
+
+	bits = (n <= 2) ? 1 : (n <= 4) ? 2 : 4;
+	raw = npix * cb;
+	packed = (!many && n <= 16) ? n * cb + h * ((w * bits + 7) / 8) : INT_MAX;
+	pal_rle = many ? INT_MAX : n * cb + pal_rle;
+
+	best = raw;
+	if( packed < best )
+		best = packed;
+	if( plain_rle < best )
+		best = plain_rle;
+	if( pal_rle < best )
+		best = pal_rle;
+
+	if( best == raw ) {
+		*d++ = rfbZRLERaw;
+		for( i=0; i<npix; i++ )
+			d = put_cpixel( c, d, pix[i] );
+	} else if( best == packed ) {
+		*d++ = n;
+		for( i=0; i<n; i++ )
+			d = put_cpixel( c, d, palette.colour[i] );
+		for( y=0; y<h; y++ ) {
+			int byte = 0, nbits = 0;
+
+			for( x=0; x<w; x++ ) {
+				byte = (byte << bits) | palette_insert( pix[y*w+x], n );
+				if( (nbits += bits) == 8 ) {
+					*d++ = byte;
+					byte = nbits = 0;
+				}
+			}
+			if( nbits )
+				*d++ = byte << (8 - nbits);
+		}
+	} else if( best == plain_rle ) {
+		*d++ = rfbZRLEPlainRLE;
+		for( i=0; i<npix; i+=len ) {
+			for( len=1; i+len < npix && pix[i+len] == pix[i]; len++ )
+				;
+			d = put_cpixel( c, d, pix[i] );
+			d = put_run_length( d, len );
+		}
+	} else {
+		*d++ = 128 + n;
+		for( i=0; i<n; i++ )
+			d = put_cpixel( c, d, palette.colour[i] );
+		for( i=0; i<npix; i+=len ) {
+			for( len=1; i+len < npix && pix[i+len] == pix[i]; len++ )
+				;
+			if( len == 1 ) {
+				*d++ = palette_insert( pix[i], n );
+			} else {
+				*d++ = 128 | palette_insert( pix[i], n );
+				d = put_run_length( d, len );
+			}
+		}
+	}
+	return d - tile_buf;
+}
+
+/* ZRLE data of a single tile rectangle; a big-endian length and the zlib data */
+static bool
+zrle_put_data( vnc_client_t *c, unsigned char *data, int size )
+{
+	int lenpos;
+
+	if( !reserve_output(c, 4) )
+		return false;
+	lenpos = c->buf_len;
+	c->buf_len += 4;
+
+	if( !deflate_output(c, &c->zrle_stream, data, size, Z_SYNC_FLUSH) )
+		return false;
+
+	size = c->buf_len - lenpos - 4;
+	c->buf[lenpos] = size >> 24;
+	c->buf[lenpos+1] = size >> 16;
+	c->buf[lenpos+2] = size >> 8;
+	c->buf[lenpos+3] = size;
+	return true;
+}
+
+/* Tight data; short data is sent as is, the rest compressed with a length prefix */
+static bool
+tight_put_data( vnc_client_t *c, int stream, unsigned char *data, int size )
+{
+	unsigned char len[3];
+	int pos, n;
+
+	if( size < rfbTightMinToCompress )
+		return put_output( c, data, size );
+
+	if( !reserve_output(c, 3) )
+		return false;
+	pos = c->buf_len;
+	c->buf_len += 3;
+	if( !deflate_output(c, &c->tight_streams[stream], data, size, Z_SYNC_FLUSH) )
+		return false;
+
+	size = c->buf_len - pos - 3;
+	len[0] = size & 0x7f;
+	n = 1;
+	if( size > 0x7f ) {
+		len[0] |= 0x80;
+		len[n++] = (size >> 7) & 0x7f;
+		if( size > 0x3fff ) {
+			len[1] |= 0x80;
+			len[n++] = (size >> 14) & 0xff;
+		}
+	}
+	memmove( c->buf + pos + n, c->buf + pos + 3, size );
+	memcpy( c->buf + pos, len, n );
+	c->buf_len -= 3 - n;
+	return true;
+}
+
+/* encodes a Tight tile into tile_buf; the control bytes and palette go first,
+ * followed by the data for stream t->stream (none for fill)
+ */
+static void
+tight_encode_tile( vnc_client_t *c, int x, int y, int w, int h, vnc_tile_t *t )
+{
+	unsigned char *d = tile_buf, *p;
+	int i, j, n, npix = w * h;
+	int tb = c->tpixel_rgb ? 3 : c->output_bpp;
+
+	fetch_pixels( c, x, y, w, h, pixel_buf );
+
+	palette_reset();
+	for( i=0; i<npix; i++ )
+		if( palette_insert(pixel_buf[i], 256) < 0 )
+			break;
+	n = (i < npix) ? 0 : palette.n;
+
+	if( n == 1 ) {
+		*d++ = rfbTightFill << 4;
+		d = put_tpixel( c, d, pixel_buf[0] );
+		t->stream = -1;
+		t->hdr_len = t->len = d - tile_buf;
+		return;
+	}
+
+	if( n == 2 ) {
+		// stream 1, two colour palette with one bit per pixel
+		*d++ = (1 | rfbTightExplicitFilter) << 4;
+		*d++ = rfbTightFilterPalette;
+		*d++ = 1;
+		d = put_tpixel( c, d, palette.colour[0] );
+		d = put_tpixel( c, d, palette.colour[1] );
+
+		for( p=d, j=0; j<h; j++ ) {
+			int byte = 0, nbits = 0;
+
+			for( i=0; i<w; i++ ) {
+				byte = (byte << 1) | (pixel_buf[j*w+i] == palette.colour[1]);
+				if( ++nbits == 8 ) {
+					*p++ = byte;
+					byte = nbits = 0;
+				}
+			}
+			if( nbits )
+				*p++ = byte << (8 - nbits);
+		}
+		t->stream = 1;
+	} else if( n && n * tb + npix < npix * tb ) {
+		// stream 2, palette with one byte per pixel
+		*d++ = (2 | rfbTightExplicitFilter) << 4;
+		*d++ = rfbTightFilterPalette;
+		*d++ = n - 1;
+		for( i=0; i<n; i++ )
+			d = put_tpixel( c, d, palette.colour[i] );
+		for( p=d, i=0; i<npix; i++ )
+			*p++ = palette_insert( pixel_buf[i], n );
+		t->stream = 2;
+	} else {
+		// stream 0, full colour
+		*d++ = 0;
+		for( p=d, i=0; i<npix; i++ )
+			p = put_tpixel( c, p, pixel_buf[i] );
+		t->stream = 0;
+	}
+	t->hdr_len = d - tile_buf;
+	t->len = p - tile_buf;
+}
+
 // functions called from fb_watch_thread and vnc_thread
 
 static int
@@ -1275,6 +1827,7 @@ static void
 vnc_rcv_connection( int fd, int event )
 {
 	struct sockaddr_in addr;
+	vnc_client_t *c = NULL;
 	int new_socket;
 	int len = sizeof(addr);
 
@@ -1287,16 +1840,25 @@ vnc_rcv_connection( int fd, int event )
 		perrorm("vnc_accept");
 		return;
 	}
-	if( vnc_sock != -1 ) {
-		// there is already a vnc thread running
-		LOG("Vnc connection rejected. Connection is already in progress (%d)\n", vnc_sock );
+
+	pthread_mutex_lock(&buffers_mutex);
+	if( n_clients < max_clients && (c=calloc(1, sizeof(vnc_client_t))) ) {
+		c->sock = new_socket;
+		c->sock_valid = true;
+		c->encoding = rfbEncodingRaw;
+		c->zlib_level = 6;
+		c->next = clients;
+		clients = c;
+		n_clients++;
+	}
+	pthread_mutex_unlock(&buffers_mutex);
+
+	if( !c ) {
+		LOG("Vnc connection rejected. %d clients are connected\n", n_clients );
 		close( new_socket );
-	} else {
-		vnc_sock = new_socket;
-		vnc_sock_valid = true;
- 
-		create_thread( vnc_thread, NULL, "VNC-thread");
+		return;
 	}
+	create_thread( vnc_thread, c, "VNC-thread");
 }
 
 static int
@@ -1324,7 +1886,7 @@ setup_listener( void )
 
 	printm("Serving VNC on port %d\n", addr.sin_port);
 	vnc_listen_sock = sock;
-	async_listener_id = add_async_handler( sock, POLLIN, vnc_rcv_connection, 1 /* SIGIO */ );	
+	async_listener_id = add_threadsafe_async_handler( sock, POLLIN, vnc_rcv_connection );	
 
 	return 0;
  bail:
@@ -1349,6 +1911,12 @@ vnc_init( video_module_t *m )
 	if( get_bool_res("enable_vncvideo") != 1 )
 		return 1;
 
+	if( (max_clients=get_numeric_res("vnc_max_clients")) < 1 )
+		max_clients = 4;
+	if( (send_budget=get_numeric_res("vnc_send_budget")) < 1 )
+		send_budget = 512;
+	send_budget *= 1024;
+
 	if( setup_listener() )
 		return 1;
 
@@ -1369,7 +1937,8 @@ vnc_init( video_module_t *m )
 static void
 vnc_cleanup( video_module_t *m )
 {
-	int i;
+	vnc_client_t *c;
+	struct timespec timeout;
  
 	LOG("vnc_cleanup called\n");
 
@@ -1380,23 +1949,23 @@ vnc_cleanup( video_module_t *m )
 		vnc_listen_sock = -1;
 	}
 
-	if( vnc_sock != -1 ) {
+	// the next poll or read will fail and exit the vnc threads
+	pthread_mutex_lock(&buffers_mutex);
+	for( c=clients; c; c=c->next ) {
 		LOG("Shutting down vnc sock\n");
- 
-		// the next poll or read will fail and exit the vnc_thread
-
-		shutdown( vnc_sock, 2 );
-		vnc_sock_valid = false;
-		
-		for( i=0 ; i<60 && vnc_sock != -1 ; i++ ) {
-			LOG("Waiting for vnc thread\n");
-			sleep(1);
-		}
+		shutdown( c->sock, 2 );
+		c->sock_valid = false;
 	}
-	if( translationtable ) {
-		free( (void*)translationtable );
-		translationtable = NULL;
+
+	// ...which signal when they are gone (a stuck thread is waited for at most 60 s)
+	clock_gettime( CLOCK_REALTIME, &timeout );
+	timeout.tv_sec += 60;
+	while( n_clients ) {
+		LOG("Waiting for %d vnc threads\n", n_clients);
+		if( pthread_cond_timedwait(&clients_cond, &buffers_mutex, &timeout) == ETIMEDOUT )
+			break;
 	}
+	pthread_mutex_unlock(&buffers_mutex);
 	
 	free( vnc_module.modes );
 }
@@ -1404,6 +1973,8 @@ vnc_cleanup( video_module_t *m )
 static int
 vopen( video_desc_t *org_vm )
 {
+	vnc_client_t *c;
+
 	LOG( "vopen called\n" );
 
 	vmode = *org_vm;
@@ -1416,11 +1987,6 @@ vopen( video_desc_t *org_vm )
 	pthread_mutex_lock(&buffers_mutex);
  
 	offscreen_buf = (unsigned char *) map_zero( NULL, FBBUF_SIZE(org_vm));
-
-	//output_buf_size = org_vm->w * 4;
-	output_buf_size = 10000;
-	output_buf = malloc( output_buf_size );
-	//LOG( "output_buf = %lx  size = %ld\n", (long) output_buf, output_buf_size );
  
 	// Fill in the fields video.c expects
 	org_vm->mmu_flags = MAPPING_FB_ACCEL | MAPPING_FORCE_CACHE;
@@ -1436,6 +2002,28 @@ vopen( video_desc_t *org_vm )
 
 	_setup_fb_accel( vmode.lvbase+vmode.offs, vmode.rowbytes, vmode.h );
 
+	// a last block narrower than 16 bytes is not checksummed (the hash
+	// kernels load 16 bytes at a time), so its changes would never be seen
+	vnc_cksum = NULL;
+	if( get_bool_res("vnc_checksum") != 0 && (!(vmode.w % CKSUM_BLOCK_SIZE)
+	    || (vmode.w % CKSUM_BLOCK_SIZE) * offscreen_bpp >= 16) )
+		vnc_cksum = alloc_vcksum( &vmode );
+
+	tiles_x = (vmode.w + TILE_W - 1) / TILE_W;
+	tiles_y = (vmode.h + TILE_H - 1) / TILE_H;
+	n_tiles = tiles_x * tiles_y;
+	tile_gen = calloc( n_tiles, sizeof(CARD32) );
+	tile_cache = calloc( n_tiles * TILE_CACHE_WAYS, sizeof(vnc_tile_t) );
+	if( !tile_gen || !tile_cache )
+		fatal("vnc: out-of-mem\n");
+
+	// the depth may have changed
+	for( c=clients; c; c=c->next ) {
+		if( c->running )
+			init_pixconv( c );
+		c->force_redraw = true;
+	}
+
 	is_open = true;
 
 	pthread_mutex_unlock(&buffers_mutex);
@@ -1445,6 +2033,8 @@ vopen( video_desc_t *org_vm )
 static void
 vclose( void )
 {
+	int i;
+
 	//LOG( "vclose called\n" );
 
 	if( !is_open )
@@ -1456,31 +2046,58 @@ vclose( void )
  
 	_setup_fb_accel( NULL, 0, 0 );
 
+	if( vnc_cksum ) {
+		free_vcksum( vnc_cksum );
+		vnc_cksum = NULL;
+	}
+
+	for( i=0; i < n_tiles * TILE_CACHE_WAYS; i++ )
+		free( tile_cache[i].data );
+	free( tile_cache );
+	free( tile_gen );
+	tile_cache = NULL;
+	tile_gen = NULL;
+
 	munmap( offscreen_buf, FBBUF_SIZE(&vmode) );
 	offscreen_buf = NULL;
 
-	free( output_buf );
-	output_buf = NULL;
-	output_buf_size = 0;
-
 	pthread_mutex_unlock(&buffers_mutex);
 }
 
 static void
 vrefresh( void )
 {
-	force_redraw = true;
+	vnc_client_t *c;
+
+	pthread_mutex_lock(&buffers_mutex);
+	for( c=clients; c; c=c->next )
+		c->force_redraw = true;
+	pthread_mutex_unlock(&buffers_mutex);
 }
 
 static void
 setcmap( char *pal )
 {
+	vnc_client_t *c;
+	int i;
+
 	if( vmode.depth != 8 )
 		return;
  
+	pthread_mutex_lock(&buffers_mutex);
+
 	memcpy( mac_pal, pal, 256 * 3 );
 
-	init_translationtable();
+	// every cached tile is stale
+	for( i=0; tile_gen && i<n_tiles; i++ )
+		tile_gen[i]++;
+
+	for( c=clients; c; c=c->next ) {
+		if( c->conv )
+			pixconv_set_palette( c->conv, pal );
+		c->force_redraw = true;
+	}
+	pthread_mutex_unlock(&buffers_mutex);
 }
 
 video_module_t vnc_module  = {
@@ -44,6 +44,7 @@
 #include "video.h"
 #include "molcpu.h"
 #include "checksum.h"
+#include "pixconv.h"
 #include "input.h"
 #include "timer.h"
 #include "byteorder.h"
@@ -98,14 +99,13 @@ static struct {
 	/* redraw timer */
 	ulong 		vbl_period;
 
-	/* depth conversion */
+	/* depth and endian conversion */
 	int		depth_emulation;		/* in depth emulation mode */
-	char		*offscreen_buf;
-	ulong		*depth_blit_palette;		/* 256 byte table (8->24/32 pixel value conversion) */
+	char		*offscreen_buf;			/* Mac frame buffer (depth emulation) */
+	pixconv_t	*conv;
 
-	/* hooks for depth and endian conversions */
+	/* hook for depth and endian conversions */
 	void		(*blit_hook_pre)( int x, int y, int w, int h );
-	void		(*blit_hook_post)( int x, int y, int w, int h );
 } vs;
 
 static video_desc_t	vmode;				/* virtual vmode (might have a different depth) */
@@ -122,276 +122,33 @@ static unsigned char	no_cursor_data[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
 /*	support for various video mode conversions			*/
 /************************************************************************/
 
-#ifndef CLIENT_LE24_SWAP
-static void
-endian_conv_32( int x, int y, int w, int h ) 
-{
-	char *pp, *start = vmode.lvbase + vmode.offs + vmode.rowbytes * y + x*4;
-	int i, ww = (w & ~3);
-
-	pp = start;
-	for( ; h-- > 0 ; pp += vmode.rowbytes ) {
-		ulong *p = (ulong*)pp;
-		if( w & 1 ) {
-			p[0] = ld_le32( p );
-			p++;
-		}
-		if( w & 2 ) {
-			p[0] = ld_le32( p );
-			p[1] = ld_le32( p+1 );
-			p+=2;
-		}
-		for( i=0; i<ww; i+=4, p+=4 ) {
-			p[0] = ld_le32( p );
-			p[1] = ld_le32( p+1 );
-			p[2] = ld_le32( p+2 );
-			p[3] = ld_le32( p+3 );
-		}
-	}
-}
-#endif
-
-static void
-endian_conv_15( int x, int y, int w, int h ) 
-{
-	char *pp, *start = vmode.lvbase + vmode.offs + vmode.rowbytes * y + x*2;
-	int i, ww = (w & ~3);
-
-	pp = start;
-	for( ; h-- > 0 ; pp += vmode.rowbytes ) {
-		ushort *p = (ushort*)pp;
-		if( w & 1 ) {
-			p[0] = ld_le16( p );
-			p++;
-		}
-		if( w & 2 ) {
-			p[0] = ld_le16( p );
-			p[1] = ld_le16( p+1 );
-			p+=2;
-		}
-		for( i=0; i<ww; i+=4, p+=4 ) {
-			p[0] = ld_le16( p );
-			p[1] = ld_le16( p+1 );
-			p[2] = ld_le16( p+2 );
-			p[3] = ld_le16( p+3 );
-		}
-	}
-}
-
-#ifdef __ppc__
-static inline void
-conv_15_to_le16( u16 *p, u32 x )
-{
-	asm ("rlwimi %0,%0,1,16,25" : "+r" (x) : );
-	asm ("rlwinm %0,%1,0,27,25" : "=r" (x) : "r" (x) );
-	asm ("sthbrx %1,0,%2" : "=m" (*p) : "r" (x), "r" (p) );
-}
-
-static inline u32
-conv_le16_to_15( u16 *p )
-{
-	u32 r;
-	asm ("lhbrx %0,0,%1" : "=r" (r) : "r" (p), "m" (*p) );
-	asm ("rlwimi %0,%0,31,17,26" : "+r" (r) : );
-	asm ("rlwinm %0,%1,0,17,31" : "=r" (r) : "r" (r) );
-	return r;
-}
-#else
-/* fixme */
-static inline void conv_15_to_le16( u16 *p, u32 x ) { *p = x; }
-static inline u32 conv_le16_to_15( u16 *p ) { return *p; }
-#endif
-
-static void
-endian_conv_16( int x, int y, int w, int h ) 
-{
-	char *pp, *start = vmode.lvbase + vmode.offs + vmode.rowbytes * y + x*2;
-	int i, ww = (w & ~3);
-
-	pp = start;
-	for( ; h-- > 0 ; pp += vmode.rowbytes ) {
-		ushort *p = (ushort*)pp;
-		if( w & 1 ) {
-			conv_15_to_le16( p, p[0] );
-			p++;
-		}
-		if( w & 2 ) {
-			conv_15_to_le16( p, p[0] );
-			conv_15_to_le16( p+1, p[1] );
-			p+=2;
-		}
-		for( i=0; i<ww; i+=4, p+=4 ) {
-			conv_15_to_le16( p, p[0] );
-			conv_15_to_le16( p+1, p[1] );
-			conv_15_to_le16( p+2, p[2] );
-			conv_15_to_le16( p+3, p[3] );
-		}
-	}
-}
-
-static void
-endian_conv_16b( int x, int y, int w, int h ) 
-{
-	char *pp, *start = vmode.lvbase + vmode.offs + vmode.rowbytes * y + x*2;
-	int i, ww = (w & ~3);
-
-	pp = start;
-	for( ; h-- > 0 ; pp += vmode.rowbytes ) {
-		u16 *p = (u16*)pp;
-		if( w & 1 ) {
-			p[0] = conv_le16_to_15( p );
-			p++;
-		}
-		if( w & 2 ) {
-			p[0] = conv_le16_to_15( p );
-			p[1] = conv_le16_to_15( p+1 );
-			p+=2;
-		}
-		for( i=0; i<ww; i+=4, p+=4 ) {
-			p[0] = conv_le16_to_15( p );
-			p[1] = conv_le16_to_15( p+1 );
-			p[2] = conv_le16_to_15( p+2 );
-			p[3] = conv_le16_to_15( p+3 );
-		}
-	}
-}
-
-#ifdef __ppc__
-static inline ulong
-conv_15_to_16( ulong x )
-{
-	asm ("rlwimi %0,%0,1,16,25" : "+r" (x) : );
-	asm ("rlwinm %0,%1,0,27,25" : "=r" (x) : "r" (x) );
-	return x;
-}
-
-static inline ulong
-conv_16_to_15( ulong x )
-{
-	asm ("rlwimi %0,%0,31,17,26" : "+r" (x) : );
-	asm ("rlwinm %0,%1,0,17,31" : "=r" (x) : "r" (x) );
-	return x;
-}
-#else
-/* fixme */
-static inline u32 conv_15_to_16( u32 x ) { return x; }
-static inline u32 conv_16_to_15( u32 x ) { return x; }
-#endif
-
-static void
-convert_555_to_565( int x, int y, int w, int h ) 
-{
-	char *pp, *start = vmode.lvbase + vmode.offs + vmode.rowbytes * y + x*2;
-	int i, ww = (w & ~3);
-
-	pp = start;
-	for( ; h-- > 0 ; pp += vmode.rowbytes ) {
-		ushort *p = (ushort*)pp;
-		if( w & 1 ) {
-			p[0] = conv_15_to_16( p[0] );
-			p++;
-		}
-		if( w & 2 ) {
-			p[0] = conv_15_to_16( p[0] );
-			p[1] = conv_15_to_16( p[1] );
-			p+=2;
-		}
-		for( i=0; i<ww; i+=4, p+=4 ) {
-			p[0] = conv_15_to_16( p[0] );
-			p[1] = conv_15_to_16( p[1] );
-			p[2] = conv_15_to_16( p[2] );
-			p[3] = conv_15_to_16( p[3] );
-		}
-	}
-}
-
-static void
-convert_565_to_555( int x, int y, int w, int h ) 
-{
-	char *pp, *start = vmode.lvbase + vmode.offs + vmode.rowbytes * y + x*2;
-	int i, ww = (w & ~3);
-
-	pp = start;
-	for( ; h-- > 0 ; pp += vmode.rowbytes ) {
-		ushort *p = (ushort*)pp;
-		if( w & 1 ) {
-			p[0] = conv_16_to_15( p[0] );
-			p++;
-		}
-		if( w & 2 ) {
-			p[0] = conv_16_to_15( p[0] );
-			p[1] = conv_16_to_15( p[1] );
-			p+=2;
-		}
-		for( i=0; i<ww; i+=4, p+=4 ) {
-			p[0] = conv_16_to_15( p[0] );
-			p[1] = conv_16_to_15( p[1] );
-			p[2] = conv_16_to_15( p[2] );
-			p[3] = conv_16_to_15( p[3] );
-		}
-	}
-}
-
+/* pixel format of the X image */
 static void
-depth_blit_8_to_32( int x, int y, int w, int h )
+x_pixfmt( pixfmt_t *f )
 {
-	char *pp, *start = vmode.lvbase + vmode.offs + vmode.rowbytes * y + x*4;
-	char *src = mac_vmode.lvbase + mac_vmode.offs + mac_vmode.rowbytes *y + x;
-	ulong *pal = vs.depth_blit_palette;
-	int i, ww = (w & ~3);
-
-	pp = start;
-	for( ; h-- > 0 ; pp += vmode.rowbytes, src += mac_vmode.rowbytes ) {
-		ulong *p = (ulong*)pp;
-		unsigned char *s = (unsigned char*)src;
-		if( w & 1 ) {
-			p[0] = pal[s[0]];
-			p++; s++;
-		}
-		if( w & 2 ) {
-			p[0] = pal[s[0]];
-			p[1] = pal[s[1]];
-			p+=2;
-			s+=2;
-		}
-		for( i=0; i<ww; i+=4, p+=4, s+=4 ) {
-			p[0] = pal[s[0]];
-			p[1] = pal[s[1]];
-			p[2] = pal[s[2]];
-			p[3] = pal[s[3]];
-		}
-	}
+	f->big_endian = (x11.byte_order == MSBFirst);
+	if( std_depth(x11.xdepth) == std_depth(32) ) {
+		f->bpp = 4;
+		f->red_max = f->green_max = f->blue_max = 255;
+		f->red_shift = 16;
+		f->green_shift = 8;
+	} else {
+		/* 555 or 565 pixels */
+		f->bpp = 2;
+		f->red_max = f->blue_max = 31;
+		f->green_max = x11.is_565 ? 63 : 31;
+		f->red_shift = x11.is_565 ? 11 : 10;
+		f->green_shift = 5;
+	}
+	f->blue_shift = 0;
 }
 
+/* the Mac draws in vs.offscreen_buf; converted pixels go to the X image */
 static void
-depth_blit_8_to_16( int x, int y, int w, int h )
+conv_blit( int x, int y, int w, int h )
 {
-	char *pp, *start = vmode.lvbase + vmode.offs + vmode.rowbytes * y + x*2;
-	char *src = mac_vmode.lvbase + mac_vmode.offs + mac_vmode.rowbytes *y + x;
-	ulong *pal = vs.depth_blit_palette;
-	int i, ww = (w & ~3);
-
-	pp = start;
-	for( ; h-- > 0 ; pp += vmode.rowbytes, src += mac_vmode.rowbytes ) {
-		ushort *p = (ushort*)pp;
-		unsigned char *s = (unsigned char*)src;
-		if( w & 1 ) {
-			p[0] = pal[s[0]];
-			p++; s++;
-		}
-		if( w & 2 ) {
-			p[0] = pal[s[0]];
-			p[1] = pal[s[1]];
-			p+=2;
-			s+=2;
-		}
-		for( i=0; i<ww; i+=4, p+=4, s+=4 ) {
-			p[0] = pal[s[0]];
-			p[1] = pal[s[1]];
-			p[2] = pal[s[2]];
-			p[3] = pal[s[3]];
-		}
-	}
+	pixconv_rect( vs.conv, mac_vmode.lvbase + mac_vmode.offs, mac_vmode.rowbytes,
+		      vmode.lvbase + vmode.offs, vmode.rowbytes, x, y, w, h );
 }
 
 
@@ -410,31 +167,6 @@ vrefresh( void )
 }
 
 
-static void 
-set_depth_blit_pentry( ulong *dest, char *p )
-{
-	/* p points to three chars (R,G,B) */
-
-	if( std_depth(x11.xdepth) == std_depth(32) ) {
-		*dest = (x11.byte_order == MSBFirst) ?
-			((ulong)*p<<16) | ((ulong)*(p+1)<<8) | *(p+2) :
-			((ulong)*(p+2)<<24) | ((ulong)*(p+1)<<16) | (*p<<8);
-	} else {
-		if( !x11.is_565 ) {
-			*dest = (((ulong)*p<<(10-3)) & 0x7c00)
-				| (((ulong)*(p+1)<<(5-3)) & 0x3e0)
-				| (((ulong)*(p+2)>>3) & 0x1f);
-		} else {
-			/* 565 pixels */
-			*dest = (((ulong)*p<<(11-3)) & 0xf800)
-				| (((ulong)*(p+1)<<(5-2)) & 0x7e0)
-				| (((ulong)*(p+2)>>3) & 0x1f);
-		}
-		if( x11.byte_order == LSBFirst)
-			*dest = ((*dest & 0xff) << 8) | ((*dest & 0xff00) >> 8);
-	}
-}
-
 static void 
 setcmap( char *pal )
 {
@@ -453,9 +185,8 @@ setcmap( char *pal )
 	}
 
 	/* setup depth emulation tables */
-	if( vs.depth_blit_palette ) {
-		for( i=0; i<256; i++ )
-			set_depth_blit_pentry( &vs.depth_blit_palette[i], &pal[i*3] );
+	if( vs.conv ) {
+		pixconv_set_palette( vs.conv, pal );
 		vs.force_redraw = 1;
 	}
 	vs.palette_changed = 1;
@@ -511,8 +242,6 @@ blit_rect( int x, int y, int w, int h )
 		XPutImage( x11.disp, vs.win, vs.the_gc, vs.img, x, y, x, y, w, h );
 
 	XSync( x11.disp, 0);
-	if( vs.blit_hook_post )
-		vs.blit_hook_post( x, y, w, h );
 }
 
 static void
@@ -689,7 +418,6 @@ vopen( video_desc_t *org_vm )
 
 	vs.depth_emulation = 0;
 	vs.blit_hook_pre = NULL;
-	vs.blit_hook_post = NULL;
 
 	if( std_depth(x11.xdepth) != std_depth(vmode.depth) ) {
 		/* Use a X depth emulation mode... */
@@ -699,58 +427,43 @@ vopen( video_desc_t *org_vm )
 			printm("Bad vmode depth %d (x11.xdepth = %d)!\n", vmode.depth, x11.xdepth );
 			return 1;
 		}
-
-		if( std_depth(x11.xdepth) == std_depth(32) )
-			vs.blit_hook_pre = depth_blit_8_to_32;
-		else
-			vs.blit_hook_pre = depth_blit_8_to_16;
-		
-		vmode.rowbytes = vmode.w;
-		switch( x11.xdepth ){
-		case 1:
-			vmode.rowbytes /= 8; 
-			break;
-		case 15: 
-		case 16:
-			vmode.rowbytes *= 2;
-			break;
-		case 24:
-		case 32:
-			vmode.rowbytes *= 4; 
-			break;
-		}
-		vmode.depth = x11.xdepth;
-		vmode.offs = 0;
 		vs.depth_emulation = 1;
-		if( vs.offscreen_buf || vs.depth_blit_palette )
-			printm("Internal error in xvideo.c (unreleased resource)\n");
-
-		vs.offscreen_buf = map_zero( NULL, FBBUF_SIZE(org_vm));
-		vs.depth_blit_palette = calloc( 256, sizeof(ulong) );
-
 	} else if( x11.byte_order != MSBFirst ) {
 		/* endian conversion? */
 		switch( vmode.depth ) {
 		case 15:
 		case 16:
-			if( x11.is_565 ) {
-				vs.blit_hook_pre = endian_conv_16;
-				vs.blit_hook_post = endian_conv_16b;
-			} else {
-				vs.blit_hook_pre = vs.blit_hook_post = endian_conv_15;
-			}
-			break;
 #ifndef CLIENT_LE24_SWAP
 		case 24: 
 		case 32:
-			vs.blit_hook_pre = vs.blit_hook_post = endian_conv_32;
-			break;
 #endif
+			vs.depth_emulation = 1;
+			break;
 		}
 	} else if( x11.is_565 ) {
 		/* depth conversion 555 -> 565 */
-		vs.blit_hook_pre = convert_555_to_565;
-		vs.blit_hook_post = convert_565_to_555;
+		vs.depth_emulation = 1;
+	}
+
+	/* The Mac framebuffer is converted into the X image rather than
+	 * converted in place before, and back after, every blit.
+	 */
+	if( vs.depth_emulation ) {
+		pixfmt_t fmt;
+
+		x_pixfmt( &fmt );
+		if( vs.offscreen_buf || vs.conv )
+			printm("Internal error in xvideo.c (unreleased resource)\n");
+		if( !(vs.conv = alloc_pixconv(vmode.depth, &fmt)) ) {
+			printm("Bad vmode depth %d (x11.xdepth = %d)!\n", vmode.depth, x11.xdepth );
+			return 1;
+		}
+		vs.blit_hook_pre = conv_blit;
+
+		vmode.rowbytes = vmode.w * fmt.bpp;
+		vmode.depth = x11.xdepth;
+		vmode.offs = 0;
+		vs.offscreen_buf = map_zero( NULL, FBBUF_SIZE(org_vm));
 	}
 
 	/* Try to create and attach SHM image */
@@ -904,9 +617,9 @@ vclose( void )
 		munmap( vs.offscreen_buf, FBBUF_SIZE(&mac_vmode) );
 		vs.offscreen_buf = NULL;
 	}
-	if( vs.depth_blit_palette ) {
-		free( vs.depth_blit_palette );
-		vs.depth_blit_palette = NULL;
+	if( vs.conv ) {
+		free_pixconv( vs.conv );
+		vs.conv = NULL;
 	}
 
 	/* and force a screen refresh */
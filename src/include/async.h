@@ -28,6 +28,9 @@ typedef void	(*aevent_handler_t)( int token );
 extern int 	add_async_handler( int fd, int events, async_handler_t proc, int sigio_capable );
 extern void 	delete_async_handler( int handler_id );
 
+/* The handler is run directly from the I/O thread and must do its own locking */
+extern int	add_threadsafe_async_handler( int fd, int events, async_handler_t proc );
+
 /* Note: POLLHUP and POLLERR can not be masked */
 extern void 	set_async_handler_events( int handler_id, int new_events );
 
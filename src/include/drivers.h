@@ -24,6 +24,8 @@ extern void 	driver_mgr_cleanup( void );
 /* from ioports.c */
 extern void 	do_io_read( void *_ior, ulong mphys, int len, ulong *retvalue );
 extern void 	do_io_write( void *_ior, ulong mphys, ulong data, int len );
+extern int	ioprof_active;
+extern void	ioprof_trap( void *_ior, ulong mphys, int isread, ulong nip, ullong ticks );
 
 /* from console.c */
 extern void	console_make_safe( void );
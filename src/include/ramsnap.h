@@ -0,0 +1,27 @@
+/*
+ *   Creation Date: <2026/10/17 23:52:26 agent>
+ *   Time-stamp: <2026/10/18 01:15:20 agent>
+ *
+ *	<ramsnap.h>
+ *
+ *	Incremental, compressed RAM snapshots
+ *
+ *   Copyright (C) 2026 agent (agent@local)
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation
+ *
+ */
+
+#ifndef _H_RAMSNAP
+#define _H_RAMSNAP
+
+extern void	ramsnap_init( char *lvbase, size_t size );
+extern void	ramsnap_cleanup( void );
+
+extern int	ramsnap_busy( void );			/* session prepare proc */
+extern int	ramsnap_save( void );			/* session save proc */
+extern int	ramsnap_load( char *lvbase, size_t size );
+
+#endif   /* _H_RAMSNAP */
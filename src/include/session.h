@@ -30,6 +30,11 @@ extern void	schedule_save_session( int usecs );
 
 extern void	session_save_proc( session_save_fp, session_prepare_fp, int dynamic_data );
 
+/* savers completing in the background bracket the work with these */
+extern void	session_async_begin( void );
+extern int	session_async_end( int err );
+extern int	session_save_count( void );
+
 extern int	read_session_data( char *type, int id, char *ptr, size_t size );
 extern void	align_session_data( int boundary );
 extern int	write_session_data( char *type, int id, char *ptr, ssize_t size );
@@ -40,6 +45,7 @@ extern ulong	calc_str_checksum( char *str );
 extern ulong	calc_checksum( char *ptr, int size );
 
 extern int	loading_session( void );
+extern int	session_save_enabled( void );
 extern void	session_is_loaded( void );
 
 extern void	session_failure( char *err ) __attribute__ ((__noreturn__));
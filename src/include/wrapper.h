@@ -109,16 +109,15 @@ static inline int _call_kernel( void ) {
 	return mol_ioctl_simple( MOL_IOCTL_CALL_KERNEL ); }
 #endif /* __darwin__ */
 
-#if 0
 static inline int _track_dirty_RAM( void ) {
 	return mol_ioctl( MOL_IOCTL_TRACK_DIRTY_RAM, 0, 0, 0 ); }
 
-static inline int _get_dirty_RAM( char *retbuf ) {
-	return mol_ioctl( MOL_IOCTL_GET_DIRTY_RAM, retbuf, 0, 0 ); }
+/* clear != 0 resets the tracker (fetch-and-clear) */
+static inline int _get_dirty_RAM( char *retbuf, int clear ) {
+	return mol_ioctl( MOL_IOCTL_GET_DIRTY_RAM, (int)retbuf, clear, 0 ); }
 
 static inline int _set_dirty_RAM( char *dirtybuf ) {
-	return mol_ioctl( MOL_IOCTL_SET_DIRTY_RAM, dirtybuf, 0, 0 ); }
-#endif
+	return mol_ioctl( MOL_IOCTL_SET_DIRTY_RAM, (int)dirtybuf, 0, 0 ); }
 
 static inline int _get_irqs( irq_bitfield_t *irqs ) {
 	return mol_ioctl( MOL_IOCTL_GET_IRQS, (int)irqs, 0, 0 ); }
@@ -53,16 +53,27 @@ fix_pte( ulong *p, ulong set, ulong flags )
 
 /*
  * Get physical page corresponding to linux virtual address. Invokes linux page
- * fault handler if the page is missing. This function never fails since we
- * know there is a valid mapping...
+ * fault handler if the page is missing. Returns 0 if the page could not be
+ * faulted in (bad address, fatal signal); it must not be mapped then.
  */
 #define PAGE_BITS_WRITE		(_PAGE_ACCESSED | _PAGE_DIRTY | _PAGE_HASHPTE )
 #define PAGE_BITS_READ		(_PAGE_ACCESSED | _PAGE_HASHPTE )
+#define MAX_FAULT_TRIES		16
 
 #ifndef FAULT_FLAG_WRITE
 #define FAULT_FLAG_WRITE 1
 #endif
 
+/* RAM registered with userfaultfd (lazy session restore) is filled in by
+ * userspace; the fault handler drops mmap_sem and asks for a retry. Only
+ * kernels with userfaultfd and the (mm, vma, address, flags) handle_mm_fault
+ * signature are supported.
+ */
+#if defined(FAULT_FLAG_ALLOW_RETRY) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0) \
+	&& LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
+#define FAULT_RETRY_SUPPORT
+#endif
+
 ulong 
 get_phys_page( kernel_vars_t *kv, ulong va, int request_rw )
 {
@@ -71,11 +82,13 @@ get_phys_page( kernel_vars_t *kv, ulong va, int request_rw )
 	ulong flags;
 	struct mm_struct *mm;
 	struct vm_area_struct *vma;
+	int tries = 0;
 
 	/* pte bits that must be set */
 	flags = request_rw ? (_PAGE_USER | _PAGE_RW | _PAGE_PRESENT)
 		: (_PAGE_USER | _PAGE_PRESENT);
 	
+again:
 	uptr = ((ulong*)current->thread.pgdir)[va>>22];	/* top 10 bits */
 	ptr = (ulong*)(uptr & ~0xfff);
 	if( !ptr )
@@ -115,10 +128,24 @@ no_page:
 	if( !(vma->vm_flags & (request_rw ? VM_WRITE : (VM_READ | VM_EXEC))) )
 		goto bad_area;
 
+	if( ++tries > MAX_FAULT_TRIES ) {
+		up_read( &mm->mmap_sem );
+		printk("get_phys_page: page %08lx could not be faulted in\n", va );
+		return 0;
+	}
+#ifdef FAULT_RETRY_SUPPORT
+	/* mmap_sem has been released if a retry is requested */
+	if( handle_mm_fault(mm, vma, va, (request_rw ? FAULT_FLAG_WRITE : 0)
+			    | FAULT_FLAG_ALLOW_RETRY | FAULT_FLAG_KILLABLE) & VM_FAULT_RETRY ) {
+		if( fatal_signal_pending(current) )
+			return 0;
+		goto again;
+	}
+#else
 	handle_mm_fault( mm, vma, va, request_rw?FAULT_FLAG_WRITE:0 );
-
+#endif
 	up_read( &mm->mmap_sem );
-	return get_phys_page(kv, va, request_rw);
+	goto again;
 
 bad_area:
 	up_read( &mm->mmap_sem );
@@ -339,7 +339,7 @@ insert_pte( kernel_vars_t *kv, fault_param_t *pb, const int ebits )
 	int status, pte_replaced;
 	pte_lvrange_t *lvrange;
 	ulong pte0, pte1, *slot;
-	ulong lvptr;
+	ulong lvptr, phys;
 
 #ifdef CONFIG_AMIGAONE
 	pte1 = PTE1_R | (pb->pte1 & (PTE1_R | PTE1_C | PTE1_WIMG))
@@ -392,14 +392,15 @@ insert_pte( kernel_vars_t *kv, fault_param_t *pb, const int ebits )
 	 * call, then the PTE slot is zeroed out.
 	 */
 	if( !(status & MAPPING_PHYSICAL) ) {
-#if 0
-		if( is_write(ebits) )
+		/* the dirty RAM tracker is only allocated while sessions are saved */
+		if( is_write(ebits) && MMU.tracker_data )
 			lvpage_dirty( kv, lvptr );
-#endif
 		pte1 &= ~PTE1_RPN;
 
 		/* zero pages should work just fine now... */
-		pte1 |= get_phys_page( kv, lvptr, is_write(ebits) );
+		if( !(phys=get_phys_page(kv, lvptr, is_write(ebits))) )
+			return RVEC_NOP;		/* retried (or the process is killed) */
+		pte1 |= phys;
 		/* pte1 |= get_phys_page( kv, lvptr, !(status & MAPPING_RO) ); */
 	}
 
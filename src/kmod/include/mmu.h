@@ -81,7 +81,7 @@ extern int	get_dirty_fb_lines( kernel_vars_t *kv, short *retbuf, int num_bytes )
 extern int 	init_mmu_tracker( kernel_vars_t *kv );
 extern void 	cleanup_mmu_tracker( kernel_vars_t *kv );
 extern int 	track_lvrange( kernel_vars_t *kv );
-extern size_t 	get_track_buffer( kernel_vars_t *kv, char *retbuf );
+extern size_t 	get_track_buffer( kernel_vars_t *kv, char *retbuf, int clear );
 extern void 	set_track_buffer( kernel_vars_t *kv, char *buf );
 extern void	lvpage_dirty( kernel_vars_t *kv, ulong lvpage );
 
@@ -230,17 +230,16 @@ handle_ioctl( kernel_vars_t *kv, int cmd, int arg1, int arg2, int arg3 )
 			ret = -EFAULT_MOL;
 		break;
 
-#if 0
 	case MOL_IOCTL_TRACK_DIRTY_RAM:
 		ret = track_lvrange( kv );
 		break;
 	case MOL_IOCTL_GET_DIRTY_RAM:
-		ret = get_track_buffer( kv, (char*)arg1 );
+		ret = get_track_buffer( kv, (char*)arg1, arg2 );
 		break;
 	case MOL_IOCTL_SET_DIRTY_RAM:
 		set_track_buffer( kv, (char*)arg1 );
 		break;
-#endif
+
 	/* ---------------- performance statistics ------------------ */
 
 	case MOL_IOCTL_CLEAR_PERF_INFO:
@@ -18,6 +18,7 @@
 #include "alloc.h"
 #include "uaccess.h"
 #include "mmu.h"
+#include "mtable.h"
 
 
 typedef struct tracker_data {
@@ -99,9 +100,10 @@ lvpage_dirty( kernel_vars_t *kv, ulong lvbase )
 
 
 size_t
-get_track_buffer( kernel_vars_t *kv, char *retbuf )
+get_track_buffer( kernel_vars_t *kv, char *retbuf, int clear )
 {
 	DECLARE_TS;
+	int i;
 	
 	if( !ts )
 		return 0;
@@ -110,6 +112,18 @@ get_track_buffer( kernel_vars_t *kv, char *retbuf )
 
 	if( copy_to_user_mol(retbuf, ts->table, ts->table_size) )
 		return 0;
+
+	/* pages are marked when a writable PTE is inserted. Every such PTE
+	 * belongs to a marked page, so flushing the marked pages ensures the
+	 * next write to them faults (and marks them) again.
+	 */
+	if( clear ) {
+		for( i=0; i<ts->npages; i++ ) {
+			if( ts->table[i >> 3] & (1 << (i & 7)) )
+				flush_lvptr( kv, ts->lvbase + (i << 12) );
+		}
+		memset( ts->table, 0, ts->table_size );
+	}
 	return ts->table_size;
 }
 
@@ -17,24 +17,51 @@
 #include "mol_config.h"
 #include <signal.h>
 #ifdef __linux__
-#include <linux/version.h>
+#include <sys/epoll.h>
+#define USE_EPOLL
 #endif
 #include "poll_compat.h"
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sched.h>
+#include <pthread.h>
 #include "async.h"
 #include "debugger.h"
 #include "thread.h"
 #include "timer.h"
 #include "molcpu.h"
 
-#define MAX_NUM_HANDLERS	16
+/*
+ * The I/O thread waits for events on all registered fds. Thread-safe
+ * handlers are run directly from the I/O thread. Events for the other
+ * handlers are queued, the fd is disarmed and the main thread is
+ * interrupted; the fd is re-armed once the main thread has run the
+ * handler. The I/O thread never waits for the main thread.
+ *
+ * Handler ids encode the table slot and a generation count, so lookups
+ * and registration are O(1) and stale events are discarded.
+ */
+
 #define MAX_NUM_AEVENTS		8
+#define MAX_NUM_EVENTS		32		/* per epoll_wait */
+
+#define SLOT_BITS		16
+#define SLOT_MASK		((1 << SLOT_BITS) - 1)
+#define MAKE_ID(slot, gen)	((int)((((gen) & 0x7fff) << SLOT_BITS) | ((slot) + 1)))
+#define ID_SLOT(id)		(((id) & SLOT_MASK) - 1)
+#define WAKE_SLOT		SLOT_MASK	/* never a valid slot */
 
 typedef struct {
-	int		handler_id;
+	int		id;		/* 0 if the slot is free */
+	int		fd;
+	int		events;		/* 0 means inactive */
+	int		revents;	/* queued for the main thread */
 	async_handler_t	proc;
+	int		threadsafe;
+	int		armed;		/* registered with the I/O thread */
+	int		always_ready;	/* refused by epoll (regular file) */
+	int		pending;	/* on the pending list */
+	int		next;		/* free list / pending list */
 } handler_t;
 
 typedef struct {
@@ -45,13 +72,27 @@ typedef struct {
 volatile int	 	__io_is_pending;
 
 static struct {
-	handler_t 	handlers[ MAX_NUM_HANDLERS ];
-	struct pollfd	ufds[ MAX_NUM_HANDLERS ];
-	int 		nhandlers;
-	int		npoll;
-	int		npending;
-	int 		next_handler_id;
-	int    		handlers_modified;
+	pthread_mutex_t	lock;
+	pthread_cond_t	busy_cond;
+
+	handler_t 	*handlers;
+	int		nslots;
+	int		free_slot;		/* free list head, -1 if empty */
+	unsigned int	next_gen;
+	int		pending_head;		/* events for the main thread */
+	int		pending_tail;
+	int		busy;			/* slot run by the I/O thread, or -1 */
+	pthread_t	busy_th;		/* the I/O thread */
+
+#ifdef USE_EPOLL
+	int		epfd;
+	int		n_ready;		/* armed always_ready handlers */
+#else
+	struct pollfd	*ufds;			/* rebuilt by the I/O thread */
+	int		*ufd_slot;
+	int		nufds;
+	int		table_modified;
+#endif
 
 	aevent_t	aevents[ MAX_NUM_AEVENTS ];
 	int		num_aevents;
@@ -60,69 +101,154 @@ static struct {
 	volatile int	cancel_thread;
 
 	int	 	pipefds[2];
-	int	 	ackpipe[2];
+	int	 	wakepipe[2];		/* wakes up the I/O thread */
 
 	int		initstate;
 } as;
 
+#define LOCK		pthread_mutex_lock( &as.lock );
+#define UNLOCK		pthread_mutex_unlock( &as.lock );
+
+
+/************************************************************************/
+/*	Kernel interface						*/
+/************************************************************************/
 
-/* only to be called from the main thread */	
 static void
-wait_safe( void )
+wake_io_thread( void )
 {
-	if( as.initstate == 2 && !__io_is_pending ) {
-		send_aevent(0);
-		while( !__io_is_pending )
-			sched_yield();
-	}
+	const char ch = 0;
+
+	if( as.initstate == 2 && write(as.wakepipe[1], &ch, 1) < 0 && errno != EAGAIN )
+		perrorm("wake_io_thread");
 }
 
+/* start watching h->fd (again); called with the lock held */
+static void
+arm_handler( int slot )
+{
+	handler_t *h = &as.handlers[slot];
+#ifdef USE_EPOLL
+	struct epoll_event ev;
+	int op = h->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+	/* the poll and epoll event bits have the same values */
+	ev.events = h->events | (h->threadsafe ? 0 : EPOLLONESHOT);
+	ev.data.u64 = ((unsigned long long)h->id << 32) | slot;
+
+	if( h->always_ready ) {
+		if( !h->armed ) {
+			h->armed = 1;
+			as.n_ready++;
+			wake_io_thread();
+		}
+		return;
+	}
+	if( epoll_ctl(as.epfd, op, h->fd, &ev) < 0 ) {
+		if( errno != EPERM ) {
+			perrorm("epoll_ctl");
+			return;
+		}
+		/* like poll(), treat the fd as always readable and writable */
+		printm("async: fd %d does not support epoll, polling it\n", h->fd );
+		h->always_ready = 1;
+		h->armed = 1;
+		as.n_ready++;
+		wake_io_thread();
+		return;
+	}
+	h->armed = 1;
+#else
+	h->armed = 1;
+	as.table_modified = 1;
+	wake_io_thread();
+#endif
+}
 
-/* WARNING: handler pointers are invalid after this call! */
 static void
-permute_inactive( void )
+disarm_handler( int slot )
 {
-	struct pollfd tmp_p;
-	handler_t tmp_h;
-	int i, j;
+	handler_t *h = &as.handlers[slot];
 
-	for( i=0; i<as.nhandlers; i++ ) {
-		if( as.ufds[i].events )
-			continue;
-		tmp_p = as.ufds[i];
-		tmp_h = as.handlers[i];
-
-		for( j=i+1; j<as.nhandlers; j++ ) {
-			if( as.ufds[j].events ) {
-				as.ufds[i] = as.ufds[j];
-				as.handlers[i] = as.handlers[j];
-				as.ufds[j] = tmp_p;
-				as.handlers[j] = tmp_h;
-				break;
-			}
-		}
+	if( !h->armed )
+		return;
+#ifdef USE_EPOLL
+	/* the fd might already be closed */
+	if( h->always_ready )
+		as.n_ready--;
+	else
+		epoll_ctl( as.epfd, EPOLL_CTL_DEL, h->fd, NULL );
+#else
+	as.table_modified = 1;
+	wake_io_thread();
+#endif
+	h->armed = 0;
+}
+
+
+/************************************************************************/
+/*	Handler table							*/
+/************************************************************************/
+
+static int
+alloc_slot( void )
+{
+	handler_t *h;
+	int i, n;
+
+	if( as.free_slot < 0 ) {
+		n = as.nslots ? as.nslots * 2 : 16;
+		if( n > WAKE_SLOT )
+			n = WAKE_SLOT;
+		if( n <= as.nslots || !(h=realloc(as.handlers, n * sizeof(handler_t))) )
+			return -1;
+		memset( h + as.nslots, 0, (n - as.nslots) * sizeof(handler_t) );
+		for( i=as.nslots; i<n; i++ )
+			h[i].next = (i+1 < n) ? i+1 : -1;
+		as.free_slot = as.nslots;
+		as.handlers = h;
+		as.nslots = n;
 	}
+	i = as.free_slot;
+	as.free_slot = as.handlers[i].next;
+	return i;
+}
 
-	as.npoll = 0;
-	for( i=0; i<as.nhandlers && as.ufds[i].events; i++ )
-		as.npoll++;
+/* returns the slot of a valid handler id, or -1 */
+static int
+lookup_slot( int id )
+{
+	int slot = ID_SLOT(id);
 
-	as.handlers_modified = 1;
+	if( id <= 0 || slot >= as.nslots || as.handlers[slot].id != id )
+		return -1;
+	return slot;
 }
 
-int
-add_async_handler( int fd, int events, async_handler_t proc, int sigio_capable )
+static void
+unlink_pending( int slot )
+{
+	int *pp, prev = -1;
+
+	for( pp=&as.pending_head; *pp != slot; pp=&as.handlers[*pp].next )
+		prev = *pp;
+	*pp = as.handlers[slot].next;
+	if( as.pending_tail == slot )
+		as.pending_tail = prev;
+	as.handlers[slot].pending = 0;
+}
+
+static int
+add_handler( int fd, int events, async_handler_t proc, int threadsafe )
 {
 	handler_t *h;
-	int id, flags;
+	int slot, id, flags;
 
-	if( as.nhandlers >= MAX_NUM_HANDLERS || !proc ) {
-		printm("async error: %s\n", proc ? "MAX_NUM_HANDLERS exceeded\n" : "NULL proc" );
+	if( !proc ) {
+		printm("async error: NULL proc\n");
 		return -1;
 	}
 
-	wait_safe();
-
 	/* doesn't hurt to make sure it is close-on-exec */
 	fcntl( fd, F_SETFD, FD_CLOEXEC );
 
@@ -133,82 +259,263 @@ add_async_handler( int fd, int events, async_handler_t proc, int sigio_capable )
 	if( fcntl(fd, F_SETFL, flags) == -1 )
 		return -1;
 
-	/* add to table */
-	as.ufds[as.nhandlers].fd = fd;
-	as.ufds[as.nhandlers].events = events;
-	as.ufds[as.nhandlers].revents = 0;
-	h = &as.handlers[as.nhandlers];
-	id = h->handler_id = as.next_handler_id++;
+	LOCK;
+	if( (slot=alloc_slot()) < 0 ) {
+		UNLOCK;
+		printm("async error: out of handler slots\n");
+		return -1;
+	}
+	h = &as.handlers[slot];
+	if( !(++as.next_gen & 0x7fff) )
+		as.next_gen++;
+	id = h->id = MAKE_ID( slot, as.next_gen );
+	h->fd = fd;
+	h->events = events;
+	h->revents = 0;
 	h->proc = proc;
-	as.nhandlers++;
-
-	/* h is invalid after this call! */
-	permute_inactive();
+	h->threadsafe = threadsafe;
+	h->armed = 0;
+	h->always_ready = 0;
+	h->pending = 0;
+
+	if( events )
+		arm_handler( slot );
+	UNLOCK;
 	return id;
 }
 
+int
+add_async_handler( int fd, int events, async_handler_t proc, int sigio_capable )
+{
+	return add_handler( fd, events, proc, 0 );
+}
+
+int
+add_threadsafe_async_handler( int fd, int events, async_handler_t proc )
+{
+	return add_handler( fd, events, proc, 1 );
+}
+
 void
 delete_async_handler( int handler_id )
 {
-	int i;
-
-	wait_safe();
+	handler_t *h;
+	int slot;
 
-	for( i=0; i<as.nhandlers; i++ )
-		if( as.handlers[i].handler_id == handler_id ) {
-			memmove( &as.handlers[i], &as.handlers[i+1],
-				 (as.nhandlers-i-1)*sizeof(as.handlers[0]) );
-			memmove( &as.ufds[i], &as.ufds[i+1],
-				 (as.nhandlers-i-1)*sizeof(as.ufds[0]) );
-			break;
-		}
-	if( i == as.nhandlers ) {
+	LOCK;
+	if( (slot=lookup_slot(handler_id)) < 0 ) {
+		UNLOCK;
 		printm("delete_async_handler: bad id (%d)!\n", handler_id );
 		return;
 	}
-	as.nhandlers--;
-	permute_inactive();
+	/* the caller will probably close the fd once we return */
+	while( as.busy == slot && !pthread_equal(pthread_self(), as.busy_th) )
+		pthread_cond_wait( &as.busy_cond, &as.lock );
+
+	h = &as.handlers[slot];
+	disarm_handler( slot );
+	if( h->pending )
+		unlink_pending( slot );
+	h->id = 0;
+	h->next = as.free_slot;
+	as.free_slot = slot;
+	UNLOCK;
 }
 
 void
 set_async_handler_events( int id, int new_events )
 {
-	int i;
+	handler_t *h;
+	int slot;
 
-	wait_safe();
+	LOCK;
+	if( (slot=lookup_slot(id)) < 0 ) {
+		UNLOCK;
+		printm("set_async_handler_events: Handler not found\n");
+		return;
+	}
+	h = &as.handlers[slot];
+	h->events = new_events;
+
+	/* a queued handler is re-armed after it has run */
+	if( !new_events )
+		disarm_handler( slot );
+	else if( !h->pending )
+		arm_handler( slot );
+	UNLOCK;
+}
 
-	for( i=0; i<as.nhandlers; i++ )
-		if( as.handlers[i].handler_id == id ) {
-			as.ufds[i].events = new_events;
-			break;
+
+/************************************************************************/
+/*	Event delivery							*/
+/************************************************************************/
+
+/* called by the I/O thread with the lock held; returns 1 if the main
+ * thread needs to run a handler
+ */
+static int
+deliver_event( int slot, int id, int revents )
+{
+	handler_t *h;
+	async_handler_t proc;
+	int fd, ev;
+
+	if( slot >= as.nslots || as.handlers[slot].id != id )
+		return 0;
+	h = &as.handlers[slot];
+
+	/* POLLHUP and POLLERR can not be masked */
+	if( !(ev=revents & (h->events | POLLHUP | POLLERR)) )
+		return 0;
+
+	if( h->threadsafe ) {
+		proc = h->proc;
+		fd = h->fd;
+		as.busy = slot;
+		UNLOCK;
+		(*proc)( fd, ev );
+		LOCK;
+		as.busy = -1;
+		pthread_cond_broadcast( &as.busy_cond );
+		return 0;
+	}
+
+	/* disarmed (EPOLLONESHOT) until the main thread has run the handler */
+#ifndef USE_EPOLL
+	h->armed = 0;
+	as.table_modified = 1;
+#endif
+	h->revents |= ev;
+	if( h->pending )
+		return 1;
+	h->pending = 1;
+	h->next = -1;
+	if( as.pending_tail >= 0 )
+		as.handlers[as.pending_tail].next = slot;
+	else
+		as.pending_head = slot;
+	as.pending_tail = slot;
+	return 1;
+}
+
+static void
+drain_wakepipe( void )
+{
+	char buf[64];
+
+	while( read(as.wakepipe[0], buf, sizeof(buf)) == sizeof(buf) )
+		;
+}
+
+#ifdef USE_EPOLL
+/* called with the lock held */
+static int
+deliver_always_ready( void )
+{
+	handler_t *h;
+	int slot, raise = 0;
+
+	for( slot=0; slot < as.nslots && as.n_ready; slot++ ) {
+		h = &as.handlers[slot];
+		if( !h->id || !h->always_ready || !h->armed )
+			continue;
+		/* emulates EPOLLONESHOT */
+		if( !h->threadsafe ) {
+			h->armed = 0;
+			as.n_ready--;
 		}
+		raise |= deliver_event( slot, h->id, POLLIN | POLLOUT );
+	}
+	return raise;
+}
 
-	if( i >= as.nhandlers )
-		printm("set_async_handler_events: Handler not found\n");
+static int
+wait_events( void )
+{
+	struct epoll_event ev[ MAX_NUM_EVENTS ];
+	int i, n, slot, timeout, raise = 0;
+
+	/* don't block while there are always ready fds */
+	LOCK;
+	timeout = as.n_ready ? 0 : -1;
+	UNLOCK;
+
+	if( (n=epoll_wait(as.epfd, ev, MAX_NUM_EVENTS, timeout)) < 0 ) {
+		if( errno != EINTR )
+			perrorm("epoll_wait");
+		return 0;
+	}
+	LOCK;
+	for( i=0; i<n; i++ ) {
+		slot = ev[i].data.u64 & 0xffffffff;
+		if( slot == WAKE_SLOT )
+			drain_wakepipe();
+		else
+			raise |= deliver_event( slot, ev[i].data.u64 >> 32, ev[i].events );
+	}
+	if( as.n_ready )
+		raise |= deliver_always_ready();
+	UNLOCK;
+	return raise;
+}
+#else
+static int
+wait_events( void )
+{
+	int i, n, slot, raise = 0;
+
+	LOCK;
+	if( as.table_modified ) {
+		as.table_modified = 0;
+		as.ufds = realloc( as.ufds, (as.nslots + 1) * sizeof(struct pollfd) );
+		as.ufd_slot = realloc( as.ufd_slot, (as.nslots + 1) * sizeof(int) );
+		as.ufds[0].fd = as.wakepipe[0];
+		as.ufds[0].events = POLLIN;
+		as.ufd_slot[0] = WAKE_SLOT;
+		for( n=1, i=0; i<as.nslots; i++ ) {
+			if( !as.handlers[i].id || !as.handlers[i].armed )
+				continue;
+			as.ufds[n].fd = as.handlers[i].fd;
+			as.ufds[n].events = as.handlers[i].events;
+			as.ufd_slot[n++] = i;
+		}
+		as.nufds = n;
+	}
+	UNLOCK;
 
-	permute_inactive();
+	if( poll(as.ufds, as.nufds, -1) < 0 ) {
+		if( errno != EINTR )
+			perrorm("poll");
+		return 0;
+	}
+	LOCK;
+	for( i=0; i<as.nufds; i++ ) {
+		if( !as.ufds[i].revents )
+			continue;
+		if( (slot=as.ufd_slot[i]) == WAKE_SLOT )
+			drain_wakepipe();
+		else if( as.handlers[slot].armed )
+			raise |= deliver_event( slot, as.handlers[slot].id, as.ufds[i].revents );
+		as.ufds[i].revents = 0;
+	}
+	UNLOCK;
+	return raise;
 }
+#endif
 
 static void
 poll_thread_entry( void *dummy )
 {
-	char ack_char;
-
 	/* Increase priority to reduce latency */
 	/* setpriority( PRIO_PROCESS, getpid(), -17 ); */
 
+	as.busy_th = pthread_self();
+
 	while( !as.cancel_thread ) {
-		if( (as.npending=poll(as.ufds, as.npoll, -1)) < 0 ) {
-			if( errno != EINTR )
-				perrorm("poll");
-			continue;
+		if( wait_events() ) {
+			__io_is_pending = 1;
+			interrupt_emulation();
 		}
-		__io_is_pending = 1;
-		interrupt_emulation();
-
-		/* wait for ack */
-		while( read(as.ackpipe[0], &ack_char, 1) != 1 && errno == EINTR )
-			;
 	}
 	as.cancel_thread = 0;
 }
@@ -216,30 +523,35 @@ poll_thread_entry( void *dummy )
 void
 __do_async_io( void )
 {
-	const char ackchar=1;
-	int i;
-
-	for( i=0; i<as.npoll && as.npending>0; i++ ) {
-		int ev = as.ufds[i].revents & as.ufds[i].events;
-		if( ev ) {
-			as.npending--;
-			as.ufds[i].revents = 0;
-			as.handlers_modified = 0;
-
-			(*as.handlers[i].proc)( as.ufds[i].fd, ev );
+	async_handler_t proc;
+	handler_t *h;
+	int slot, id, fd, ev;
 
-			/* the handler might change our table */
-			if( as.handlers_modified ) {
-				as.handlers_modified = 0;
-				i=0;
-			}
-		}
-	}
 	__io_is_pending = 0;
 
-	/* restart polling thread */
-	while( write(as.ackpipe[1], &ackchar, 1) != 1 && errno == EINTR )
-		;
+	LOCK;
+	while( (slot=as.pending_head) >= 0 ) {
+		h = &as.handlers[slot];
+		if( (as.pending_head=h->next) < 0 )
+			as.pending_tail = -1;
+		h->pending = 0;
+
+		ev = h->revents;
+		h->revents = 0;
+		id = h->id;
+		fd = h->fd;
+		proc = h->proc;
+		UNLOCK;
+
+		(*proc)( fd, ev );
+
+		/* the handler might have changed the table */
+		LOCK;
+		h = &as.handlers[slot];
+		if( h->id == id && h->events && !h->pending )
+			arm_handler( slot );
+	}
+	UNLOCK;
 }
 
 
@@ -320,17 +632,39 @@ start_async_thread( void )
 void
 async_init( void )
 {
-	as.next_handler_id = 1;
+#ifdef USE_EPOLL
+	struct epoll_event ev;
+#endif
+	pthread_mutex_init( &as.lock, NULL );
+	pthread_cond_init( &as.busy_cond, NULL );
+	as.free_slot = -1;
+	as.pending_head = as.pending_tail = -1;
+	as.busy = -1;
 
-	if( pipe(as.pipefds) < 0 || pipe(as.ackpipe) < 0 ) {
+	if( pipe(as.pipefds) < 0 || pipe(as.wakepipe) < 0 ) {
 		perrorm("pipe");
 		exit(1);
 	}
 	fcntl( as.pipefds[0], F_SETFD, FD_CLOEXEC );
 	fcntl( as.pipefds[1], F_SETFD, FD_CLOEXEC );
-	fcntl( as.ackpipe[0], F_SETFD, FD_CLOEXEC );
-	fcntl( as.ackpipe[1], F_SETFD, FD_CLOEXEC );
+	fcntl( as.wakepipe[0], F_SETFD, FD_CLOEXEC );
+	fcntl( as.wakepipe[1], F_SETFD, FD_CLOEXEC );
+	fcntl( as.wakepipe[0], F_SETFL, O_NONBLOCK );
+	fcntl( as.wakepipe[1], F_SETFL, O_NONBLOCK );
+
+#ifdef USE_EPOLL
+	if( (as.epfd=epoll_create(MAX_NUM_EVENTS)) < 0 ) {
+		perrorm("epoll_create");
+		exit(1);
+	}
+	fcntl( as.epfd, F_SETFD, FD_CLOEXEC );
 
+	ev.events = EPOLLIN;
+	ev.data.u64 = WAKE_SLOT;
+	epoll_ctl( as.epfd, EPOLL_CTL_ADD, as.wakepipe[0], &ev );
+#else
+	as.table_modified = 1;
+#endif
 	as.next_aevent_token = 1;	/* 0 is used by us */
 
 	add_async_handler( as.pipefds[0], POLLIN, aevent_rx, 0 );
@@ -341,21 +675,17 @@ async_init( void )
 void
 async_cleanup( void )
 {
-	const char dummy_ch = 0;
 	struct timespec tv;
 	tv.tv_sec = 0;
 	tv.tv_nsec = 1000;
 
 	if( !as.initstate )
 		return;
-	
-	/* make sure thread is not spinning in the poll loop */
-	if( as.initstate > 1 ) {
-		wait_safe();
 
+	/* stop the I/O thread */
+	if( as.initstate > 1 ) {
 		as.cancel_thread = 1;
-		while ( write( as.ackpipe[1], &dummy_ch, 1 ) != 1 )
-			;;
+		wake_io_thread();
 
 		while( as.cancel_thread )
 			nanosleep(&tv, NULL);
@@ -363,8 +693,19 @@ async_cleanup( void )
 
 	close( as.pipefds[0] );
 	close( as.pipefds[1] );
-	close( as.ackpipe[0] );
-	close( as.ackpipe[1] );
+	close( as.wakepipe[0] );
+	close( as.wakepipe[1] );
+#ifdef USE_EPOLL
+	close( as.epfd );
+#else
+	free( as.ufds );
+	free( as.ufd_slot );
+	as.ufds = NULL;
+	as.ufd_slot = NULL;
+#endif
+	free( as.handlers );
+	as.handlers = NULL;
+	as.nslots = 0;
 
 	as.initstate = 0;
 }
@@ -24,98 +24,13 @@
 #include "verbose.h"
 #include "booter.h"
 #include "session.h"
+#include "ramsnap.h"
 
 /* #define DEBUG_LOCK_MEM  */
 #define WANTED_RAM_BASE		((char*)0x40000000)
 #define	DEFAULT_RAM_SIZE	64
-/* #define SESSION_SAVE_SUPPORT	 */
 
 struct mmu_mapping		ram, rom;
-static int			fmapped_ram;		/* file-mapped RAM */
-
-
-/************************************************************************/
-/*	session support							*/
-/************************************************************************/
-
-#ifdef SESSION_SAVE_SUPPORT
-static int
-save_ram( void )
-{
-	int size,i, j, fd, wsize;
-	char *lvbase, *p;
-	off_t offs;
-
-	if( fmapped_ram ) {
-		if( msync(ram.lvbase, ram.size, MS_SYNC) < 0 ) {
-			perrorm("msync");
-			return 1;
-		}
-		return 0;
-	}
-
-	/* save dirty page information... */
-	if( !(size=_get_dirty_RAM(NULL)) )
-		return 1;
-
-	p = alloca(size);
-	_get_dirty_RAM( p );
-
-	if( write_session_data("RAMp", 0, p, size) )
-		return 1;
-
-	/* prepare to save RAM */
-	align_session_data( 0x1000 );
-
-	if( write_session_data("RAM", 0, NULL, ram.size) )
-		return 1;
-	if( get_session_data_fd("RAM", 0, &fd, &offs, NULL) )
-		return 1;
-
-	lseek( fd, offs, SEEK_SET );
-	ftruncate( fd, offs );
-
-	/* ...and the actual data */
-	lvbase = ram.lvbase;
-	for( wsize=0, i=0; i<size; i++ ) {
-		for( j=0; j<8 && lvbase + wsize < ram.lvbase + ram.size; j++ ) {
-			if( p[i] & (1<<j) ) {
-				wsize += 0x1000;
-			} else {
-				if( wsize && write(fd, lvbase, wsize) != wsize )
-					return 1;
-				lvbase += wsize + 0x1000;
-
-				wsize = 0;
-				lseek( fd, 0x1000, SEEK_CUR );
-			}
-		}
-	}
-	if( wsize && write(fd, lvbase, wsize) != wsize )
-		return 1;
-
-	return 0;
-}
-#endif
-
-static void
-load_ram( void )
-{
-	ssize_t size;
-	off_t offs;
-	int fd;
-
-	if( get_session_data_fd("RAM", 0, &fd, &offs, &size) )
-		fatal("failed restoring RAM");
-
-	ram.flags = 0;
-	ram.size = size;
-	ram.lvbase = mmap( WANTED_RAM_BASE, ram.size, 
-			   PROT_EXEC | PROT_READ | PROT_WRITE, MAP_SHARED, fd, offs );
-	if( ram.lvbase == MAP_FAILED )
-		fatal("could not map RAM");
-	fmapped_ram = 1;
-}
 
 
 /************************************************************************/
@@ -217,6 +132,19 @@ unmap_mem( char *start, size_t length )
 	return munmap( start, length );
 }
 
+/************************************************************************/
+/*	session support							*/
+/************************************************************************/
+
+static void
+load_ram( void )
+{
+	map_ram();
+	if( ramsnap_load(ram.lvbase, ram.size) )
+		session_failure("failed restoring RAM\n");
+}
+
+
 /************************************************************************/
 /*	mphys <-> lvptr translation					*/
 /************************************************************************/
@@ -283,16 +211,18 @@ mem_init( void )
 		prom_add_property( dn, "reg", (char*)tab, sizeof(tab) );
 	}
 
-#ifdef SESSION_SAVE_SUPPORT
-	session_save_proc( save_ram, NULL, kStaticChunk );
-	_track_dirty_RAM();
-#endif
+	/* dirty RAM tracking has a cost; only done when sessions are saved */
+	if( session_save_enabled() ) {
+		ramsnap_init( ram.lvbase, ram.size );
+		session_save_proc( ramsnap_save, ramsnap_busy, kDynamicChunk );
+	}
 }
 
 void 
 mem_cleanup( void ) 
 {
 	if( ram.lvbase ) {
+		ramsnap_cleanup();
 		_remove_mmu_mapping( &ram );
 		munmap( ram.lvbase, ram.size );
 		ram.lvbase = 0;
@@ -0,0 +1,941 @@
+/*
+ *   Creation Date: <2026/10/17 23:52:26 agent>
+ *   Time-stamp: <2026/10/18 01:15:20 agent>
+ *
+ *	<ramsnap.c>
+ *
+ *	Incremental, compressed RAM snapshots
+ *
+ *   Copyright (C) 2026 agent (agent@local)
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation
+ *
+ */
+
+/* RAM is saved to an append-only log next to the session file
+ * (<session_file>.ram0 or .ram1). A checkpoint copies the pages dirtied
+ * since the previous checkpoint while the guest is stopped; compression
+ * and I/O is done by worker threads while the guest runs. Checkpoints
+ * too large to be copied are compressed straight from RAM before the
+ * guest continues. The session file holds the page table which locates
+ * the current copy of every page.
+ *
+ * A full checkpoint starts a new log in the file not referenced by the
+ * last saved session, which stays usable until it is replaced.
+ *
+ * Dirty pages are found through the kernel tracker (guest writes) and
+ * the host soft-dirty bits (writes done by MOL itself, e.g. DMA). Without
+ * soft-dirty support, every checkpoint saves all of RAM.
+ *
+ * On restore, RAM is registered with userfaultfd and the guest is started
+ * at once. Missing pages are filled in when touched while a prefetch
+ * thread restores the rest, the most recently saved pages first.
+ */
+
+#include "mol_config.h"
+#include <sys/mman.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "ramsnap.h"
+#include "session.h"
+#include "wrapper.h"
+#include "res_manager.h"
+#include "thread.h"
+#include "timer.h"
+#include "debugger.h"
+#include "verbose.h"
+#include "memory.h"
+
+#ifdef HAVE_LINUX_USERFAULTFD_H
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <linux/userfaultfd.h>
+#endif
+
+SET_VERBOSE_NAME("ramsnap");
+
+#define LOG_MAGIC		0x4d4f4c52	/* 'MOLR' */
+#define LOG_VERSION		3
+#define LOG_SUFFIX		".ram%d"
+
+#define PAGE_SIZE_		0x1000
+#define BATCH_PAGES		64		/* pages per worker I/O */
+#define STAGE_MAX_PAGES		8192		/* 32 MB, larger checkpoints are not copied */
+#define STAGE_KEEP_PAGES	1024		/* staging kept between checkpoints */
+#define MAX_THREADS		8
+#define COMPACT_SLACK		(32 << 20)	/* rewrite log when garbage exceeds live data + slack */
+
+enum { kPageZero=0, kPageRaw, kPageZlib };
+
+typedef struct {
+	ullong		offs;			/* offset in the log */
+	uint		len;
+	uint		type:8;			/* kPageXXX */
+	uint		gen:24;			/* checkpoint which saved the page */
+} rs_page_t;
+
+typedef struct {
+	int		magic;
+	int		version;
+	uint		log_id;			/* identifies the log generation */
+	uint		npages;
+	uint		gen;			/* checkpoint number */
+	int		slot;			/* log file */
+	ullong		log_size;		/* valid log data */
+} rs_head_t;
+
+static struct {
+	char		*lvbase;
+	int		npages;
+	int		map_size;		/* dirty bitmap size */
+	char		*dirty;
+	rs_page_t	*table;
+
+	int		log_fd;
+	int		log_slot;		/* log file open */
+	int		saved_slot;		/* log of the saved session, or -1 */
+	int		save_count;		/* session saves at the last checkpoint */
+	uint		log_id;
+	ullong		log_size;
+	ullong		live_size;		/* bytes referenced by the table */
+	uint		gen;
+	int		need_full;
+
+	int		tracking;		/* kernel tracker active */
+	int		soft_dirty;		/* host soft-dirty bits usable */
+	int		nthreads;
+	int		level;			/* zlib level */
+
+	/* checkpoint in progress */
+	int		busy;
+	int		*pages;			/* staged page numbers */
+	char		*stage;			/* copies of the staged pages */
+	int		direct;			/* pages are read from RAM */
+	int		nstaged, stage_max, pages_max;
+	int		next;			/* next page to hand out */
+	int		nrunning;
+	int		err;
+	int		session_fd;
+	off_t		head_offs, table_offs;
+	ullong		start_mt;
+
+	/* statistics (last checkpoint) */
+	int		n_checkpoints, n_full;
+	int		st_pages, st_zero;
+	ullong		st_bytes;
+	uint		st_pause_us, st_pause_max_us, st_total_us;
+} rs;
+
+/* lazy restore */
+static struct {
+	int		uffd;
+	int		hsize;			/* host page size */
+	int		per_hpage;		/* pages per host page */
+	int		nhpages;
+	char		*present;		/* host pages filled in */
+	int		nmissing;
+	int		*order;			/* prefetch order */
+	int		nthreads;
+	int		stop;
+
+	/* statistics */
+	int		faults, prefetched;
+	ullong		fault_us;
+	uint		fault_max_us;
+	ullong		start_mt;
+	uint		done_ms;
+} lz;
+
+static pthread_mutex_t		rs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		rs_cond = PTHREAD_COND_INITIALIZER;
+
+#define LOCK		pthread_mutex_lock( &rs_lock );
+#define UNLOCK		pthread_mutex_unlock( &rs_lock );
+
+static inline int
+page_dirty( int pg ) {
+	return rs.dirty[pg >> 3] & (1 << (pg & 7));
+}
+
+
+/************************************************************************/
+/*	host soft-dirty tracking					*/
+/************************************************************************/
+
+#ifdef __linux__
+#define PM_SOFT_DIRTY		(1ULL << 55)
+
+static int
+clear_soft_dirty( void )
+{
+	int fd, ret;
+
+	if( (fd=open("/proc/self/clear_refs", O_WRONLY)) < 0 )
+		return -1;
+	ret = (write(fd, "4", 1) == 1) ? 0 : -1;
+	close( fd );
+	return ret;
+}
+
+/* or the soft-dirty bits of [lvbase, lvbase+npages*4K) into map */
+static int
+get_soft_dirty( char *lvbase, int npages, char *map )
+{
+	int i, j, n, fd, hpages, hsize = getpagesize(), per_hpage = hsize / PAGE_SIZE_;
+	ullong buf[512];
+	int pg = 0;
+	off_t offs;
+
+	if( (fd=open("/proc/self/pagemap", O_RDONLY)) < 0 )
+		return -1;
+
+	hpages = (npages + per_hpage - 1) / per_hpage;
+	for( i=0; i<hpages; i+=n ) {
+		n = hpages - i;
+		if( n > sizeof(buf)/sizeof(buf[0]) )
+			n = sizeof(buf)/sizeof(buf[0]);
+		offs = ((ulong)lvbase / hsize + i) * sizeof(ullong);
+		if( pread(fd, buf, n * sizeof(ullong), offs) != n * sizeof(ullong) ) {
+			close( fd );
+			return -1;
+		}
+		for( j=0; j<n; j++, pg += per_hpage ) {
+			int k;
+			if( !(buf[j] & PM_SOFT_DIRTY) )
+				continue;
+			for( k=pg; k<pg+per_hpage && k<npages; k++ )
+				map[k >> 3] |= (1 << (k & 7));
+		}
+	}
+	close( fd );
+	return 0;
+}
+
+static int
+probe_soft_dirty( void )
+{
+	char *p = map_zero( NULL, getpagesize() );
+	char map[1] = { 0 };
+	int ret;
+
+	if( !p )
+		return 0;
+	ret = !clear_soft_dirty() && !get_soft_dirty(p, 1, map) && !map[0];
+	p[0] = 1;
+	ret = ret && !get_soft_dirty(p, 1, map) && map[0];
+	munmap( p, getpagesize() );
+	return ret;
+}
+#else
+static int clear_soft_dirty( void ) { return -1; }
+static int get_soft_dirty( char *lvbase, int npages, char *map ) { return -1; }
+static int probe_soft_dirty( void ) { return 0; }
+#endif
+
+
+/************************************************************************/
+/*	log file							*/
+/************************************************************************/
+
+static char *
+log_filename( int slot )
+{
+	static char buf[256];
+	char *name = get_filename_res( "session_file" );
+
+	if( !name || strlen(name) + sizeof(LOG_SUFFIX) > sizeof(buf) )
+		return NULL;
+	sprintf( buf, "%s" LOG_SUFFIX, name, slot );
+	return buf;
+}
+
+static int
+open_log( int slot, int create )
+{
+	char *name = log_filename( slot );
+
+	if( rs.log_fd >= 0 && rs.log_slot == slot )
+		return 0;
+	if( rs.log_fd >= 0 )
+		close( rs.log_fd );
+	if( !name || (rs.log_fd=open(name, O_RDWR | (create ? O_CREAT : 0), 0644)) < 0 ) {
+		LOG_ERR("Could not open RAM log");
+		rs.log_fd = -1;
+		return -1;
+	}
+	fcntl( rs.log_fd, F_SETFD, FD_CLOEXEC );
+	rs.log_slot = slot;
+	return 0;
+}
+
+/* start a new log generation (the table is rewritten completely) */
+static int
+reset_log( void )
+{
+	rs_head_t head;
+
+	/* the log of the saved session must survive until the session is replaced */
+	if( open_log(rs.saved_slot == 0, 1) )
+		return -1;
+
+	memset( &head, 0, sizeof(head) );
+	head.magic = LOG_MAGIC;
+	head.version = LOG_VERSION;
+	head.log_id = rs.log_id = (uint)time(NULL) ^ (getpid() << 16) ^ (rs.log_id + 1);
+	head.npages = rs.npages;
+	head.slot = rs.log_slot;
+
+	if( ftruncate(rs.log_fd, 0) < 0 || pwrite(rs.log_fd, &head, sizeof(head), 0) != sizeof(head) ) {
+		LOG_ERR("RAM log");
+		return -1;
+	}
+	rs.log_size = sizeof(head);
+	rs.live_size = 0;
+	return 0;
+}
+
+
+/************************************************************************/
+/*	workers								*/
+/************************************************************************/
+
+static inline int
+is_zero_page( const char *p )
+{
+	const ulong *w = (const ulong*)p;
+	int i;
+
+	for( i=0; i<PAGE_SIZE_/sizeof(ulong); i+=4 )
+		if( w[i] | w[i+1] | w[i+2] | w[i+3] )
+			return 0;
+	return 1;
+}
+
+/* the page list is always needed, copies only of staged checkpoints */
+static int
+stage_alloc( int n, int direct )
+{
+	if( n > rs.pages_max ) {
+		free( rs.pages );
+		rs.pages_max = (rs.pages=malloc(n * sizeof(int))) ? n : 0;
+		if( !rs.pages )
+			return 1;
+	}
+	if( !direct && n > rs.stage_max ) {
+		free( rs.stage );
+		rs.stage_max = (rs.stage=malloc(n * PAGE_SIZE_)) ? n : 0;
+		if( !rs.stage )
+			return 1;
+	}
+	return 0;
+}
+
+/* don't hold on to the buffers of a large checkpoint */
+static void
+stage_trim( void )
+{
+	if( rs.stage_max > STAGE_KEEP_PAGES ) {
+		free( rs.stage );
+		rs.stage = NULL;
+		rs.stage_max = 0;
+	}
+	if( rs.pages_max > STAGE_KEEP_PAGES ) {
+		free( rs.pages );
+		rs.pages = NULL;
+		rs.pages_max = 0;
+	}
+}
+
+static void
+finish_checkpoint( void )
+{
+	rs_head_t head;
+	size_t size = rs.npages * sizeof(rs_page_t);
+	int err = rs.err;
+
+	memset( &head, 0, sizeof(head) );
+	head.magic = LOG_MAGIC;
+	head.version = LOG_VERSION;
+	head.log_id = rs.log_id;
+	head.npages = rs.npages;
+	head.gen = rs.gen;
+	head.slot = rs.log_slot;
+	head.log_size = rs.log_size;
+
+	err = err || fdatasync( rs.log_fd ) < 0;
+	err = err || pwrite( rs.session_fd, rs.table, size, rs.table_offs ) != size;
+	err = err || pwrite( rs.session_fd, &head, sizeof(head), rs.head_offs ) != sizeof(head);
+
+	/* the table might reference data which never made it to disk */
+	if( err )
+		rs.need_full = 1;
+
+	rs.st_total_us = mticks_to_usecs( get_mticks_() - rs.start_mt );
+	session_async_end( err );
+}
+
+static void
+worker_entry( void *dummy )
+{
+	static const int bufsize = BATCH_PAGES * (PAGE_SIZE_ + 128);
+	rs_page_t ent[BATCH_PAGES];
+	char *buf = malloc( bufsize );
+	int i, first, n, len, nzero;
+	ullong offs;
+	uLongf clen;
+	char *p;
+
+	for( ;; ) {
+		LOCK;
+		if( !buf )
+			rs.err = 1;
+		if( rs.err || rs.next >= rs.nstaged ) {
+			UNLOCK;
+			break;
+		}
+		first = rs.next;
+		if( (n=rs.nstaged - first) > BATCH_PAGES )
+			n = BATCH_PAGES;
+		rs.next += n;
+		UNLOCK;
+
+		/* compress the batch; zero pages take no space */
+		for( len=0, nzero=0, i=0; i<n; i++ ) {
+			p = rs.direct ? rs.lvbase + rs.pages[first + i] * PAGE_SIZE_
+				: rs.stage + (first + i) * PAGE_SIZE_;
+			ent[i].offs = len;
+			if( is_zero_page(p) ) {
+				ent[i].type = kPageZero;
+				ent[i].len = 0;
+				nzero++;
+				continue;
+			}
+			clen = PAGE_SIZE_ + 128;
+			if( compress2((Bytef*)buf + len, &clen, (Bytef*)p, PAGE_SIZE_, rs.level) == Z_OK
+			    && clen < PAGE_SIZE_ ) {
+				ent[i].type = kPageZlib;
+				ent[i].len = clen;
+			} else {
+				memcpy( buf + len, p, PAGE_SIZE_ );
+				ent[i].type = kPageRaw;
+				ent[i].len = PAGE_SIZE_;
+			}
+			len += ent[i].len;
+		}
+
+		/* reserve log space and write */
+		LOCK;
+		offs = rs.log_size;
+		rs.log_size += len;
+		UNLOCK;
+		if( len && pwrite(rs.log_fd, buf, len, offs) != len ) {
+			LOG_ERR("RAM log write");
+			LOCK;
+			rs.err = 1;
+			UNLOCK;
+			break;
+		}
+
+		LOCK;
+		for( i=0; i<n; i++ ) {
+			rs_page_t *t = &rs.table[ rs.pages[first + i] ];
+			rs.live_size += (llong)ent[i].len - t->len;
+			t->type = ent[i].type;
+			t->gen = rs.gen;
+			t->len = ent[i].len;
+			t->offs = ent[i].type == kPageZero ? 0 : offs + ent[i].offs;
+		}
+		rs.st_zero += nzero;
+		rs.st_bytes += len;
+		UNLOCK;
+	}
+	free( buf );
+
+	LOCK;
+	if( !--rs.nrunning ) {
+		finish_checkpoint();
+		stage_trim();
+		rs.busy = 0;
+		pthread_cond_broadcast( &rs_cond );
+	}
+	UNLOCK;
+}
+
+
+/************************************************************************/
+/*	checkpoint							*/
+/************************************************************************/
+
+int
+ramsnap_busy( void )
+{
+	/* the log must stay intact until the restore is complete */
+	return rs.busy || lz.nthreads;
+}
+
+/* collect the pages dirtied since the last checkpoint. Ret: nonzero if all of RAM must be saved */
+static int
+collect_dirty( void )
+{
+	int full = rs.need_full || !rs.soft_dirty || !rs.tracking;
+
+	/* garbage collect the log */
+	if( rs.log_size > 2 * rs.live_size + COMPACT_SLACK )
+		full = 1;
+
+	/* the trackers are always reset */
+	if( !rs.tracking || _get_dirty_RAM(rs.dirty, 1) != rs.map_size )
+		full = 1;
+	if( rs.soft_dirty && get_soft_dirty(rs.lvbase, rs.npages, rs.dirty) )
+		full = 1;
+	if( rs.soft_dirty && clear_soft_dirty() )
+		full = 1;
+
+	if( full )
+		memset( rs.dirty, 0xff, rs.map_size );
+	return full;
+}
+
+int
+ramsnap_save( void )
+{
+	int i, n, full, pg;
+	ullong t;
+
+	if( !rs.table || rs.busy )
+		return 1;
+	rs.start_mt = get_mticks_();
+
+	/* the previous checkpoint is referenced by the session file once it is replaced */
+	if( session_save_count() != rs.save_count )
+		rs.saved_slot = rs.log_slot;
+	rs.save_count = session_save_count();
+
+	/* the dirty state is lost from here on if the checkpoint fails */
+	if( (full=collect_dirty()) ? reset_log() : open_log(rs.log_slot, 0) )
+		goto fail;
+
+	/* reserve the session chunks (written when the workers are done) */
+	if( write_session_data("RAMs", 0, NULL, sizeof(rs_head_t))
+	    || write_session_data("RAMt", 0, NULL, rs.npages * sizeof(rs_page_t))
+	    || get_session_data_fd("RAMs", 0, &rs.session_fd, &rs.head_offs, NULL)
+	    || get_session_data_fd("RAMt", 0, &rs.session_fd, &rs.table_offs, NULL) )
+		goto fail;
+
+	for( n=0, i=0; i<rs.map_size; i++ )
+		n += __builtin_popcount( (unsigned char)rs.dirty[i] );
+
+	rs.direct = (n > STAGE_MAX_PAGES);
+	if( stage_alloc(n, rs.direct) )
+		goto fail;
+
+	/* the guest only waits for this copy (or for all of a direct checkpoint) */
+	for( n=0, pg=0; pg<rs.npages; pg++ ) {
+		if( !page_dirty(pg) )
+			continue;
+		if( !rs.direct )
+			memcpy( rs.stage + n * PAGE_SIZE_, rs.lvbase + pg * PAGE_SIZE_, PAGE_SIZE_ );
+		rs.pages[n++] = pg;
+	}
+	if( full )
+		memset( rs.table, 0, rs.npages * sizeof(rs_page_t) );
+
+	rs.need_full = 0;
+	rs.gen++;
+	rs.nstaged = n;
+	rs.next = 0;
+	rs.err = 0;
+	rs.st_pages = n;
+	rs.st_zero = 0;
+	rs.st_bytes = 0;
+	rs.n_checkpoints++;
+	rs.n_full += full;
+
+	session_async_begin();
+	rs.busy = 1;
+	rs.nrunning = rs.nthreads;
+	for( i=0; i<rs.nthreads; i++ )
+		create_thread( worker_entry, NULL, "ramsnap" );
+
+	if( rs.direct ) {
+		LOCK;
+		while( rs.busy )
+			pthread_cond_wait( &rs_cond, &rs_lock );
+		UNLOCK;
+	}
+
+	t = get_mticks_() - rs.start_mt;
+	rs.st_pause_us = mticks_to_usecs( t );
+	if( rs.st_pause_us > rs.st_pause_max_us )
+		rs.st_pause_max_us = rs.st_pause_us;
+	return 0;
+ fail:
+	rs.need_full = 1;
+	return 1;
+}
+
+
+/************************************************************************/
+/*	restore								*/
+/************************************************************************/
+
+/* buf is scratch space for the compressed data */
+static int
+read_page( rs_page_t *t, char *dest, char *buf )
+{
+	uLongf dlen = PAGE_SIZE_;
+
+	switch( t->type ) {
+	case kPageZero:
+		memset( dest, 0, PAGE_SIZE_ );
+		return 0;
+	case kPageRaw:
+		return t->len != PAGE_SIZE_ || pread(rs.log_fd, dest, PAGE_SIZE_, t->offs) != PAGE_SIZE_;
+	case kPageZlib:
+		return t->len > PAGE_SIZE_ || pread(rs.log_fd, buf, t->len, t->offs) != t->len
+			|| uncompress((Bytef*)dest, &dlen, (Bytef*)buf, t->len) != Z_OK
+			|| dlen != PAGE_SIZE_;
+	}
+	return 1;
+}
+
+#ifdef UFFD_API
+static inline int
+hpage_present( int hp ) {
+	return lz.present[hp >> 3] & (1 << (hp & 7));
+}
+
+/* fill in a host page. Ret: 1 if populated by us, 0 if already present */
+static int
+populate( int hp, char *buf )
+{
+	struct uffdio_copy cp;
+	struct uffdio_zeropage zp;
+	struct uffdio_range r;
+	int i, ret, pg = hp * lz.per_hpage, zero = 1;
+	ulong dst = (ulong)rs.lvbase + hp * lz.hsize;
+
+	if( hpage_present(hp) )
+		return 0;
+
+	for( i=0; i<lz.per_hpage; i++ ) {
+		zero &= (rs.table[pg + i].type == kPageZero);
+		if( read_page(&rs.table[pg + i], buf + i * PAGE_SIZE_, buf + lz.hsize) )
+			session_failure("Failed to read RAM from the session log\n");
+	}
+	if( zero ) {
+		zp.range.start = dst;
+		zp.range.len = lz.hsize;
+		zp.mode = 0;
+		ret = ioctl( lz.uffd, UFFDIO_ZEROPAGE, &zp );
+	} else {
+		cp.dst = dst;
+		cp.src = (ulong)buf;
+		cp.len = lz.hsize;
+		cp.mode = 0;
+		ret = ioctl( lz.uffd, UFFDIO_COPY, &cp );
+	}
+	if( ret < 0 && errno != EEXIST )
+		session_failure("UFFDIO_COPY failed\n");
+
+	/* the other thread won the race; make sure the faulting thread runs */
+	if( ret < 0 ) {
+		r.start = dst;
+		r.len = lz.hsize;
+		ioctl( lz.uffd, UFFDIO_WAKE, &r );
+	}
+
+	LOCK;
+	if( (ret=!hpage_present(hp)) ) {
+		lz.present[hp >> 3] |= (1 << (hp & 7));
+		lz.nmissing--;
+	}
+	UNLOCK;
+	return ret;
+}
+
+static void
+lazy_thread_exit( char *buf )
+{
+	struct uffdio_range r;
+
+	free( buf );
+	LOCK;
+	if( !--lz.nthreads ) {
+		r.start = (ulong)rs.lvbase;
+		r.len = rs.npages * PAGE_SIZE_;
+		ioctl( lz.uffd, UFFDIO_UNREGISTER, &r );
+		close( lz.uffd );
+		lz.uffd = -1;
+		free( lz.present );
+		free( lz.order );
+		lz.present = NULL;
+		lz.order = NULL;
+		lz.done_ms = mticks_to_usecs( get_mticks_() - lz.start_mt ) / 1000;
+		pthread_cond_broadcast( &rs_cond );
+	}
+	UNLOCK;
+}
+
+static void
+lazy_fault_entry( void *dummy )
+{
+	char *buf = malloc( lz.hsize + PAGE_SIZE_ );
+	struct uffd_msg msg;
+	struct pollfd pfd;
+	ullong t;
+	uint us;
+
+	pfd.fd = lz.uffd;
+	pfd.events = POLLIN;
+	while( !lz.stop && lz.nmissing ) {
+		if( poll(&pfd, 1, 100) <= 0 || read(lz.uffd, &msg, sizeof(msg)) != sizeof(msg) )
+			continue;
+		if( msg.event != UFFD_EVENT_PAGEFAULT )
+			continue;
+
+		t = get_mticks_();
+		populate( (msg.arg.pagefault.address - (ulong)rs.lvbase) / lz.hsize, buf );
+		us = mticks_to_usecs( get_mticks_() - t );
+
+		lz.faults++;
+		lz.fault_us += us;
+		if( us > lz.fault_max_us )
+			lz.fault_max_us = us;
+	}
+	lazy_thread_exit( buf );
+}
+
+static void
+lazy_prefetch_entry( void *dummy )
+{
+	char *buf = malloc( lz.hsize + PAGE_SIZE_ );
+	int i;
+
+	for( i=0; i<lz.nhpages && !lz.stop; i++ )
+		lz.prefetched += populate( lz.order[i], buf );
+	lazy_thread_exit( buf );
+}
+
+static int *sort_key;
+
+static int
+recency_cmp( const void *a, const void *b )
+{
+	return sort_key[*(int*)b] - sort_key[*(int*)a];
+}
+
+/* Ret: 0 if the restore was started */
+static int
+lazy_restore( void )
+{
+	struct uffdio_api api;
+	struct uffdio_register reg;
+	int i, hp, *key;
+
+	lz.hsize = getpagesize();
+	lz.per_hpage = lz.hsize / PAGE_SIZE_;
+	lz.nhpages = rs.npages / lz.per_hpage;
+
+	/* non-blocking: a fault may be resolved (by the prefetcher) between poll and read */
+	if( (lz.uffd=syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK)) < 0 )
+		return 1;
+	api.api = UFFD_API;
+	api.features = 0;
+	reg.range.start = (ulong)rs.lvbase;
+	reg.range.len = rs.npages * PAGE_SIZE_;
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+	if( ioctl(lz.uffd, UFFDIO_API, &api) < 0 || ioctl(lz.uffd, UFFDIO_REGISTER, &reg) < 0 ) {
+		close( lz.uffd );
+		return 1;
+	}
+
+	/* prefetch the most recently saved pages first; zero pages last */
+	lz.present = calloc( (lz.nhpages + 7) / 8, 1 );
+	lz.order = malloc( lz.nhpages * sizeof(int) );
+	key = malloc( lz.nhpages * sizeof(int) );
+	if( !lz.present || !lz.order || !key )
+		fatal("ramsnap: out of memory");
+	for( hp=0; hp<lz.nhpages; hp++ ) {
+		lz.order[hp] = hp;
+		for( key[hp]=-1, i=0; i<lz.per_hpage; i++ ) {
+			rs_page_t *t = &rs.table[hp * lz.per_hpage + i];
+			if( t->type != kPageZero && (int)t->gen > key[hp] )
+				key[hp] = t->gen;
+		}
+	}
+	sort_key = key;
+	qsort( lz.order, lz.nhpages, sizeof(int), recency_cmp );
+	free( key );
+
+	lz.nmissing = lz.nhpages;
+	lz.start_mt = get_mticks_();
+	lz.nthreads = 2;
+	create_thread( lazy_fault_entry, NULL, "ramsnap-fault" );
+	create_thread( lazy_prefetch_entry, NULL, "ramsnap-prefetch" );
+	return 0;
+}
+#else
+static int lazy_restore( void ) { return 1; }
+#endif
+
+int
+ramsnap_load( char *lvbase, size_t size )
+{
+	rs_head_t head, lhead;
+	char *buf;
+	int pg;
+
+	rs.log_fd = -1;
+	lz.uffd = -1;
+	if( read_session_data("RAMs", 0, (char*)&head, sizeof(head)) || head.magic != LOG_MAGIC
+	    || head.version != LOG_VERSION || head.npages != size / PAGE_SIZE_ ) {
+		LOG("Bad RAM snapshot header\n");
+		return -1;
+	}
+	rs.lvbase = lvbase;
+	rs.npages = head.npages;
+	rs.table = calloc( rs.npages, sizeof(rs_page_t) );
+	buf = malloc( PAGE_SIZE_ );
+	if( !rs.table || !buf
+	    || read_session_data("RAMt", 0, (char*)rs.table, rs.npages * sizeof(rs_page_t)) )
+		goto bad;
+
+	if( (head.slot != 0 && head.slot != 1) || open_log(head.slot, 0)
+	    || pread(rs.log_fd, &lhead, sizeof(lhead), 0) != sizeof(lhead)
+	    || lhead.magic != LOG_MAGIC || lhead.log_id != head.log_id
+	    || lhead.npages != head.npages ) {
+		LOG("RAM log does not match the session\n");
+		goto bad;
+	}
+	for( rs.live_size=0, pg=0; pg<rs.npages; pg++ )
+		rs.live_size += rs.table[pg].len;
+
+	/* continue the log; drop data of interrupted checkpoints */
+	rs.log_id = head.log_id;
+	rs.saved_slot = head.slot;
+	rs.gen = head.gen;
+	rs.log_size = head.log_size;
+	ftruncate( rs.log_fd, rs.log_size );
+
+	if( get_bool_res("session_lazy_restore") == 0 || lazy_restore() ) {
+		/* RAM is fresh (zeroed) memory */
+		for( pg=0; pg<rs.npages; pg++ )
+			if( rs.table[pg].type != kPageZero
+			    && read_page(&rs.table[pg], lvbase + pg * PAGE_SIZE_, buf) )
+				goto bad;
+	}
+	free( buf );
+	return 0;
+ bad:
+	LOG("Failed to restore RAM\n");
+	free( buf );
+	free( rs.table );
+	rs.table = NULL;
+	return -1;
+}
+
+
+/************************************************************************/
+/*	debugger							*/
+/************************************************************************/
+
+static int __dcmd
+cmd_ramsnap( int argc, char **argv )
+{
+	if( argc != 1 )
+		return 1;
+
+	printm("checkpoints %d (%d full), incremental %s\n", rs.n_checkpoints, rs.n_full,
+	       rs.soft_dirty && rs.tracking ? "enabled" : "unavailable" );
+	printm("last: %d pages (%d zero), %lld KB written, pause %d us (max %d us), total %d us%s\n",
+	       rs.st_pages, rs.st_zero, rs.st_bytes >> 10, rs.st_pause_us, rs.st_pause_max_us,
+	       rs.st_total_us, rs.busy ? " [in progress]" : "" );
+	printm("log %lld KB, live %lld KB\n", rs.log_size >> 10, rs.live_size >> 10 );
+	if( lz.start_mt ) {
+		printm("lazy restore: %d faults (avg %d us, max %d us), %d prefetched, ",
+		       lz.faults, lz.faults ? (int)(lz.fault_us / lz.faults) : 0, lz.fault_max_us,
+		       lz.prefetched );
+		if( lz.nthreads )
+			printm("%d of %d pages missing\n", lz.nmissing * lz.per_hpage, rs.npages );
+		else
+			printm("completed after %d ms\n", lz.done_ms );
+	}
+	return 0;
+}
+
+static dbg_cmd_t dbg_cmds[] = {
+#ifdef CONFIG_DEBUGGER
+	{ "ramsnap",	cmd_ramsnap,	"ramsnap \nshow RAM snapshot statistics\n" },
+#endif
+};
+
+
+/************************************************************************/
+/*	init / cleanup							*/
+/************************************************************************/
+
+void
+ramsnap_init( char *lvbase, size_t size )
+{
+	int loaded = (rs.table != NULL);
+
+	rs.lvbase = lvbase;
+	rs.npages = size / PAGE_SIZE_;
+	rs.map_size = (rs.npages + 7) / 8;
+	if( !loaded ) {
+		rs.log_fd = -1;
+		rs.saved_slot = -1;
+	}
+	if( !(rs.dirty=malloc(rs.map_size)) || (!loaded && !(rs.table=calloc(rs.npages, sizeof(rs_page_t)))) )
+		fatal("ramsnap: out of memory");
+	rs.need_full = !loaded;
+
+	if( (rs.nthreads=get_numeric_res("session_threads")) <= 0 )
+		rs.nthreads = 2;
+	if( rs.nthreads > MAX_THREADS )
+		rs.nthreads = MAX_THREADS;
+	if( (rs.level=get_numeric_res("session_compression")) < 0 || rs.level > 9 )
+		rs.level = Z_BEST_SPEED;
+
+	rs.tracking = !_track_dirty_RAM();
+	if( !(rs.soft_dirty=probe_soft_dirty()) )
+		LOG("No soft-dirty support, RAM checkpoints will not be incremental\n");
+	else
+		clear_soft_dirty();
+
+	/* pages filled in by a lazy restore look soft-dirty, as do pages written
+	 * by MOL meanwhile. The two can't be told apart; start over with a full
+	 * checkpoint.
+	 */
+	if( lz.nthreads )
+		rs.need_full = 1;
+
+	add_dbg_cmds( dbg_cmds, sizeof(dbg_cmds) );
+}
+
+void
+ramsnap_cleanup( void )
+{
+	if( !rs.lvbase )
+		return;
+
+	/* wait for the workers */
+	LOCK;
+	lz.stop = 1;
+	while( rs.busy || lz.nthreads )
+		pthread_cond_wait( &rs_cond, &rs_lock );
+	UNLOCK;
+
+	if( rs.log_fd >= 0 )
+		close( rs.log_fd );
+	free( rs.stage );
+	free( rs.pages );
+	free( rs.dirty );
+	free( rs.table );
+	memset( &rs, 0, sizeof(rs) );
+	memset( &lz, 0, sizeof(lz) );
+}
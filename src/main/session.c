@@ -15,6 +15,8 @@
  */
 
 #include "mol_config.h"
+#include <pthread.h>
+#include <libgen.h>
 #include "session.h"
 #include "verbose.h"
 #include "res_manager.h"
@@ -25,11 +27,12 @@
 #include "molcpu.h"
 #include "debugger.h"
 
-#define DISABLE_SAVE_SESSION		/* TEMPORARY DISABLED */
-
 SET_VERBOSE_NAME("session");
 
 #define SESSION_FILE_RESOURCE	"session_file"
+#define SAVE_RESOURCE		"session_save"
+#define CHECKPOINT_RESOURCE	"session_checkpoint"
+#define NEW_SUFFIX		".new"
 
 #define MAX_SAVE_PROCS		5
 #define MAX_PREPARE_PROCS	5
@@ -74,9 +77,22 @@ static struct {
 	int		dyn_offs;		/* offset to dynamical data */
 	off_t		eof;			/* EOF of data in use */
 
+	/* a save completes when the last (possibly asynchronous) saver is done */
+	pthread_mutex_t	async_lock;
+	int		async_pending;
+	int		async_err;
+	int		prev_fd;		/* session file replaced by the save */
+	int		nsaved;			/* completed saves */
+
+	int		save_enabled;
+	int		checkpoint_id;		/* periodic checkpoint timer */
+
 	int		initialized;
 } sd;
 
+#define ASYNC_LOCK	pthread_mutex_lock( &sd.async_lock );
+#define ASYNC_UNLOCK	pthread_mutex_unlock( &sd.async_lock );
+
 void 
 session_save_proc( session_save_fp proc, session_prepare_fp prep, int dynamic_data ) 
 {
@@ -119,6 +135,43 @@ save_session_( int dummy_id, void *dummy, int info )
 	save_session();
 }
 
+static void
+checkpoint_( int id, void *dummy, int lost )
+{
+	/* retried at the next period if the state is unsafe or busy */
+	if( save_session_now() < 0 ) {
+		printm("Periodic session checkpoints disabled\n");
+		pause_ptimer( sd.checkpoint_id );
+	}
+}
+
+static char *
+new_filename( char *name )
+{
+	static char buf[256];
+
+	if( strlen(name) + sizeof(NEW_SUFFIX) > sizeof(buf) )
+		return NULL;
+	sprintf( buf, "%s" NEW_SUFFIX, name );
+	return buf;
+}
+
+/* make a rename in the directory of name durable */
+static int
+sync_dir( char *name )
+{
+	char buf[256];
+	int fd, ret;
+
+	strncpy( buf, name, sizeof(buf) - 1 );
+	buf[sizeof(buf) - 1] = 0;
+	if( (fd=open(dirname(buf), O_RDONLY)) < 0 )
+		return -1;
+	ret = fsync( fd );
+	close( fd );
+	return ret;
+}
+
 void
 schedule_save_session( int usecs ) 
 {
@@ -132,17 +185,16 @@ schedule_save_session( int usecs )
 int
 save_session_now( void )
 {
-	int i, err=0;
-	char *name = get_filename_res( SESSION_FILE_RESOURCE );
+	int i, fd, err=0;
+	char *newname, *name = get_filename_res( SESSION_FILE_RESOURCE );
 	head_t head;
 	size_t size;
-	chunk_t *k;
 
-#ifdef DISABLE_SAVE_SESSION
-	printm("Session support is unavailable (temporary disabled)\n");
-	return -1;
-#endif
-	
+	if( !sd.save_enabled ) {
+		printm("Session support is disabled (set %s: yes)\n", SAVE_RESOURCE );
+		return -1;
+	}
+
 	if( is_oldworld_boot() ){
 		printm("Session support is not available in the oldworld setting\n");
 		return -1;
@@ -153,29 +205,34 @@ save_session_now( void )
 		return -1;
 	}
 
+	/* a previous save is still being completed */
+	if( sd.async_pending )
+		return 1;
+
 	/* First check that we are in a recoverable state */
 	for(i=0; i<sd.nprep_procs; i++ )
 		if( (*sd.prep_procs[i])() )
 			return 1;
 	
-	/* Create/open session file if needed */ 
-	if( sd.fd <= 0 ) {
-		if( (sd.fd = open( name, O_RDWR | O_CREAT, 00644 )) < 0 ) {
-			LOG_ERR("Could not create/open session file '%s'", name );
-			return -1;
-		}
-		sd.eof = sizeof(head_t) + MAX_NUM_CHUNKS*sizeof(chunk_t);
-		sd.dyn_offs = sd.eof;
-
-		sd.chunks = calloc( MAX_NUM_CHUNKS, sizeof(chunk_t) );
+	/* The session is written to a new file which replaces the old one
+	 * once complete. A crash leaves the previous session intact.
+	 */
+	if( !(newname=new_filename(name)) || (fd=open(newname, O_RDWR | O_CREAT | O_TRUNC, 00644)) < 0 ) {
+		LOG_ERR("Could not create session file '%s'", newname ? newname : name );
+		return -1;
 	}
-	
-	/* Clear out dynamic chunks */
-	for(i=0, k=sd.chunks; i<MAX_NUM_CHUNKS; i++, k++ )
-		if( k->offs + k->size > sd.dyn_offs )
-			k->type = 0;
-	
-	sd.eof = sd.dyn_offs;
+	if( !sd.chunks && !(sd.chunks=calloc(MAX_NUM_CHUNKS, sizeof(chunk_t))) ) {
+		close( fd );
+		return -1;
+	}
+	sd.prev_fd = sd.fd;
+	sd.fd = fd;
+
+	/* all chunks are new (static chunks are only reused within a file) */
+	memset( sd.chunks, 0, MAX_NUM_CHUNKS * sizeof(chunk_t) );
+	sd.eof = sizeof(head_t) + MAX_NUM_CHUNKS*sizeof(chunk_t);
+	sd.async_err = 0;
+	session_async_begin();
 
 	/* First run procs whose data must be static (e.g. file-mapped RAM) */
 	for( i=0; !err && i<sd.nsave_procs; i++ )
@@ -192,19 +249,65 @@ save_session_now( void )
 	head.mol_version = MOL_VERSION;
 	head.dyn_offs = sd.dyn_offs;
 	head.num_chunks = chunk_compress();
-	lseek( sd.fd, 0, SEEK_SET );
-	err = err || write( sd.fd, &head, sizeof(head) ) != sizeof(head);
 	size = sizeof(chunk_t)*head.num_chunks;
-	err = err || write( sd.fd, sd.chunks, size ) != size;
+	err = err || pwrite( sd.fd, &head, sizeof(head), 0 ) != sizeof(head);
+	err = err || pwrite( sd.fd, sd.chunks, size, sizeof(head) ) != size;
+
+	return session_async_end( err ) ? -1 : 0;
+}
+
+/* called (on the main thread) by savers which complete in the background */
+void
+session_async_begin( void )
+{
+	ASYNC_LOCK;
+	sd.async_pending++;
+	ASYNC_UNLOCK;
+}
+
+/* may be called from any thread. Ret: nonzero if the save failed */
+int
+session_async_end( int err )
+{
+	char *newname, *name = get_filename_res( SESSION_FILE_RESOURCE );
+
+	ASYNC_LOCK;
+	sd.async_err |= err;
+	if( --sd.async_pending ) {
+		ASYNC_UNLOCK;
+		return 0;
+	}
+	newname = name ? new_filename( name ) : NULL;
 
+	/* replace the session file once all data is on disk */
+	err = sd.async_err || !newname || fsync( sd.fd ) < 0
+		|| rename( newname, name ) < 0 || sync_dir( name );
 	if( err ) {
 		printm("Failed saving the session\n");
-		close(sd.fd);
-		sd.fd = -1;
-		unlink( name );
-		return -1;
+		close( sd.fd );
+		if( newname )
+			unlink( newname );
+		sd.fd = sd.prev_fd;
+	} else {
+		if( sd.prev_fd > 0 )
+			close( sd.prev_fd );
+		sd.nsaved++;
 	}
-	return 0;
+	sd.prev_fd = -1;
+	ASYNC_UNLOCK;
+	return err;
+}
+
+/* number of saves which have replaced the session file */
+int
+session_save_count( void )
+{
+	int n;
+
+	ASYNC_LOCK;
+	n = sd.nsaved;
+	ASYNC_UNLOCK;
+	return n;
 }
 
 static chunk_t *
@@ -234,6 +337,12 @@ stype_to_type( char *stype )
 	return *(int*)stype;
 }
 
+int
+session_save_enabled( void )
+{
+	return sd.save_enabled;
+}
+
 int
 loading_session( void )
 {
@@ -245,6 +354,13 @@ void
 session_is_loaded( void )
 {
 	head_t head;
+	int secs;
+
+	/* periodic checkpoints (the timer service is available by now) */
+	if( sd.save_enabled && (secs=get_numeric_res(CHECKPOINT_RESOURCE)) > 0 ) {
+		sd.checkpoint_id = new_ptimer( checkpoint_, NULL, 1 );
+		set_ptimer( sd.checkpoint_id, secs * 1000000 );
+	}
 
 	if( !loading_session() )
 		return;
@@ -438,12 +554,14 @@ session_init( void )
 	head_t head;
 	
 	memset( &sd, 0, sizeof(sd) );
+	pthread_mutex_init( &sd.async_lock, NULL );
 	sd.initialized = 1;
-#ifdef DISABLE_SAVE_SESSION
-	/* printm("The session save/restore feature is disabled\n"); */
-	return;
-#endif
+
+	/* the feature is experimental; only enabled on request */
+	if( get_bool_res(SAVE_RESOURCE) != 1 )
+		return;
 	add_cmd( "save_session", "save_session\nSave session\n", -1, cmd_save_session );
+	sd.save_enabled = 1;
 
 	if( !(s=get_filename_res( SESSION_FILE_RESOURCE )))
 		return;
@@ -20,6 +20,10 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <signal.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/eventfd.h>
+#endif
 
 #include "timer.h"
 #include "thread.h"
@@ -33,43 +37,102 @@
 #include "os_interface.h"
 
 #define TF_PERIODIC		1
-#define TF_OVERFLOW		2
 #define TF_AUTORESUME		4
 
-#define MAX_NUM_TIMERS		16
 #define TIMER_MAX		0x7fffffff
 
 #define DBG_DISABLE_DOZE	0
 
+/* timer ids encode the slot and a generation count */
+#define SLOT_BITS		16
+#define MAX_NUM_TIMERS		((1 << SLOT_BITS) - 1)
+#define MAKE_ID(slot, gen)	((int)((((gen) & 0x7fff) << SLOT_BITS) | ((slot) + 1)))
+#define ID_SLOT(id)		(((id) & ((1 << SLOT_BITS) - 1)) - 1)
+
+enum { TS_FREE=0, TS_INACTIVE, TS_QUEUED, TS_FIRING };
+
+/* latency statistics, kept per handler function */
+#define LAT_BUCKETS		16		/* bucket n: < 2^n usecs */
+#define MAX_NUM_STATS		64
+
+typedef struct {
+	timer_func_t		*handler;
+	uint			count;
+	uint			max;		/* mticks */
+	ullong			sum;
+	uint			hist[LAT_BUCKETS];
+} timer_stats_t;
+
 typedef struct timer_entry {
-	uint			tbu;
-	uint			tbl;
+	ullong			mark;
 	int			flags;
+	int			state;
 	uint			period;
 
 	int			id;
-	struct timer_entry 	*next;
+	int			slot;
+	int			heap_index;
+	uint			seq;		/* bumped by every API call */
+	struct timer_entry 	*next;		/* free list */
 	void			*usr;
 	timer_func_t 		*handler;
+	timer_stats_t		*stats;
 } mtimer_t;
 
-static struct {
-	mtimer_t		slots[MAX_NUM_TIMERS];
+typedef struct {
+	mtimer_t		*t;
+	int			id;
+	uint			seq;
+	int			info;
+	timer_func_t		*handler;
+	void			*usr;
+} expired_t;
 
-	mtimer_t		*head;
-	mtimer_t		*inactive;
+static struct {
+	mtimer_t		**slots;
+	int			nslots;
+	uint			next_gen;
 	mtimer_t		*free;
 
-	mtimer_t		*overflow;
+	mtimer_t		**heap;		/* min-heap on mark */
+	int			heap_size;
+	int			heap_alloc;
+
+	timer_stats_t		stats[MAX_NUM_STATS];
 
 	uint			tb_freq;
 	uint			ticks_per_usec_num;
 	uint			ticks_per_usec_den;
 
 	atomic_t		dozing;
+#ifdef __linux__
+	int			wakefd;		/* eventfd */
+#else
 	int			abortpipe[2];
+#endif
+	uint			spin_max;	/* mticks, 0 disables spinning */
+	uint			slack;		/* average oversleep (mticks) */
 } ts;
 
+/* idle statistics */
+static struct {
+	uint			dozes;
+	uint			aborted;
+	uint			spins;
+	uint			reclaims;
+	ullong			idle_mticks;	/* wall time spent dozing */
+	ullong			idle_cpu_nsecs;	/* host CPU used while dozing */
+
+	ullong			oversleep_sum;	/* timeouts: woke after the deadline */
+	uint			oversleep_max;
+	uint			timeouts;
+
+	volatile ullong		abort_stamp;	/* set by abort_doze */
+	ullong			wake_sum;	/* aborts: abort_doze until running */
+	uint			wake_max;
+	uint			wake_hist[LAT_BUCKETS];
+} idle;
+
 int				__recalc_timer;
 
 static pthread_mutex_t 		timer_lock_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -85,45 +148,106 @@ static inline ulong mticks_to_usecs_( ullong mt ) {
 	return (mt * ts.ticks_per_usec_den) / ts.ticks_per_usec_num;
 }
 
+static inline ullong mticks_to_nsecs_( ullong mt ) {
+	return (mt * ts.ticks_per_usec_den * 1000) / ts.ticks_per_usec_num;
+}
+
 
 /************************************************************************/
-/*	internal timer functions					*/
+/*	timer heap							*/
 /************************************************************************/
 
-static mtimer_t *
-dequeue_timer( mtimer_t **list, ulong id ) 
+static inline void
+heap_set( int i, mtimer_t *t )
 {
-	for( ; *list; list=&(**list).next ){
-		if( (**list).id == id ) {
-			mtimer_t *t = *list;
-			*list = t->next;
-			return t;
-		}
+	ts.heap[i] = t;
+	t->heap_index = i;
+}
+
+static void
+heap_up( int i )
+{
+	mtimer_t *t = ts.heap[i];
+	int p;
+
+	for( ; i > 0; i=p ) {
+		p = (i - 1) / 2;
+		if( (llong)(ts.heap[p]->mark - t->mark) <= 0 )
+			break;
+		heap_set( i, ts.heap[p] );
 	}
-	return NULL;
+	heap_set( i, t );
 }
 
 static void
-insert_timer( mtimer_t *t )
+heap_down( int i )
 {
-	mtimer_t **tc;
-	ullong mark = ((ullong)t->tbu << 32) | t->tbl;
-	ullong omark = ((ullong)ts.overflow->tbu <<32) | ts.overflow->tbl;
+	mtimer_t *t = ts.heap[i];
+	int c;
 
-	if( (llong)(mark - omark) > 0 ) {
-		t->next = ts.overflow->next;
-		ts.overflow->next = t;
-		t->flags |= TF_OVERFLOW;
-		return;
+	for( ; (c=2*i+1) < ts.heap_size; i=c ) {
+		if( c+1 < ts.heap_size && (llong)(ts.heap[c+1]->mark - ts.heap[c]->mark) < 0 )
+			c++;
+		if( (llong)(t->mark - ts.heap[c]->mark) <= 0 )
+			break;
+		heap_set( i, ts.heap[c] );
 	}
+	heap_set( i, t );
+}
 
-	for( tc=&ts.head; *tc && (int)((**tc).tbl - t->tbl) < 0 ; tc=&(*tc)->next )
-		;
-	t->next = *tc;
-	*tc = t;
+static void
+heap_remove( mtimer_t *t )
+{
+	int i = t->heap_index;
+	mtimer_t *last = ts.heap[--ts.heap_size];
+
+	if( last != t ) {
+		heap_set( i, last );
+		heap_up( i );
+		heap_down( last->heap_index );
+	}
+	t->heap_index = -1;
+}
+
+/* the next timer interrupt; far away timers are handled in steps */
+static uint
+next_stamp( ullong now )
+{
+	if( !ts.heap_size || (llong)(ts.heap[0]->mark - now) > TIMER_MAX )
+		return now + TIMER_MAX;
+	return ts.heap[0]->mark;
+}
+
+static void
+dequeue_timer( mtimer_t *t )
+{
+	if( t->state == TS_QUEUED )
+		heap_remove( t );
+	t->state = TS_INACTIVE;
+	t->seq++;
+}
+
+static int
+insert_timer( mtimer_t *t )
+{
+	mtimer_t **p;
+	int n;
+
+	if( ts.heap_size == ts.heap_alloc ) {
+		n = ts.heap_alloc ? ts.heap_alloc * 2 : 32;
+		if( !(p=realloc(ts.heap, n * sizeof(mtimer_t*))) ) {
+			printm("insert_timer: out of memory\n");
+			return 1;
+		}
+		ts.heap = p;
+		ts.heap_alloc = n;
+	}
+	t->state = TS_QUEUED;
+	heap_set( ts.heap_size++, t );
+	heap_up( t->heap_index );
 
-	if( t == ts.head ) {
-		mregs->timer_stamp = t->tbl;
+	if( !t->heap_index ) {
+		mregs->timer_stamp = next_stamp( get_mticks_() );
 		if( likely(is_main_thread()) )
 			mregs->flag_bits |= fb_RecalcDecInt;
 		else {
@@ -131,45 +255,124 @@ insert_timer( mtimer_t *t )
 			interrupt_emulation();
 		}
 	}
+	return 0;
+}
+
+static timer_stats_t *
+get_stats( timer_func_t *handler )
+{
+	timer_stats_t *s;
+	int i, h = ((ulong)handler >> 2) % MAX_NUM_STATS;
+
+	for( i=0; i<MAX_NUM_STATS; i++ ) {
+		s = &ts.stats[(h + i) % MAX_NUM_STATS];
+		if( s->handler == handler )
+			return s;
+		if( !s->handler ) {
+			s->handler = handler;
+			return s;
+		}
+	}
+	return NULL;
+}
+
+static void
+record_latency( timer_stats_t *s, uint latency )
+{
+	uint usecs = mticks_to_usecs_( latency );
+	int b;
+
+	if( !s )
+		return;
+	for( b=0; b < LAT_BUCKETS-1 && usecs >= (1U << b); b++ )
+		;
+	s->hist[b]++;
+	s->count++;
+	s->sum += latency;
+	if( latency > s->max )
+		s->max = latency;
 }
 
 static mtimer_t *
-new_timer( timer_func_t *handler, void *usr, int flags )
+lookup_timer( int id )
 {
+	int slot = ID_SLOT(id);
 	mtimer_t *t;
 
-	if( !(t=ts.free) ) {
-		printm("No free timers!\n");
+	if( id <= 0 || slot >= ts.nslots || !(t=ts.slots[slot]) )
+		return NULL;
+	if( t->id != id || t->state == TS_FREE )
 		return NULL;
+	return t;
+}
+
+static mtimer_t *
+new_timer( timer_func_t *handler, void *usr, int flags )
+{
+	mtimer_t *t, **p;
+	int n;
+
+	if( !(t=ts.free) ) {
+		if( ts.nslots == MAX_NUM_TIMERS ) {
+			printm("No free timers!\n");
+			return NULL;
+		}
+		if( !(ts.nslots & (ts.nslots - 1)) ) {
+			n = ts.nslots ? ts.nslots * 2 : 16;
+			if( !(p=realloc(ts.slots, n * sizeof(mtimer_t*))) )
+				return NULL;
+			ts.slots = p;
+		}
+		if( !(t=calloc(1, sizeof(*t))) )
+			return NULL;
+		t->slot = ts.nslots;
+		ts.slots[ts.nslots++] = t;
+	} else {
+		ts.free = t->next;
 	}
-	ts.free = t->next;
 
+	if( !(++ts.next_gen & 0x7fff) )
+		ts.next_gen++;
+	t->id = MAKE_ID( t->slot, ts.next_gen );
 	t->flags = flags;
-	t->id += 0x100;
+	t->state = TS_INACTIVE;
+	t->heap_index = -1;
+	t->seq++;
 	t->period = 0;
 	t->usr = usr;
 	t->handler = handler;
+	t->stats = get_stats( handler );
 	t->next = NULL;
 	return t;
 }
 
+static void
+release_timer( mtimer_t *t )
+{
+	dequeue_timer( t );
+	t->state = TS_FREE;
+	t->next = ts.free;
+	ts.free = t;
+}
+
 
 /************************************************************************/
 /*	external timer API						*/
 /************************************************************************/
 
 static int
-abs_timer( uint tbu, uint tbl, timer_func_t *handler, void *usr )
+abs_timer( ullong mark, timer_func_t *handler, void *usr )
 {
 	mtimer_t *t;
 	int id=0;
 
 	LOCK;
 	if( (t=new_timer(handler, usr, 0)) ) {
-		id = t->id;
-		t->tbu = tbu;
-		t->tbl = tbl;
-		insert_timer( t );
+		t->mark = mark;
+		if( insert_timer(t) )
+			release_timer( t );
+		else
+			id = t->id;
 	}
 	UNLOCK;
 	return id;
@@ -178,15 +381,13 @@ abs_timer( uint tbu, uint tbl, timer_func_t *handler, void *usr )
 int
 tick_timer( uint ticks, timer_func_t *proc, void *usr )
 {
-	ullong mark = ticks + get_mticks_();
-	return abs_timer( mark >> 32, mark, proc, usr );
+	return abs_timer( ticks + get_mticks_(), proc, usr );
 }
 
 int
 usec_timer( uint usecs, timer_func_t *proc, void *usr )
 {
-	ullong mark = usecs_to_mticks_( usecs ) + get_mticks_();
-	return abs_timer( mark >> 32, mark, proc, usr );
+	return abs_timer( usecs_to_mticks_(usecs) + get_mticks_(), proc, usr );
 }
 
 void
@@ -195,12 +396,10 @@ cancel_timer( int id )
 	mtimer_t *t;
 
 	LOCK;
-	if( !(t=dequeue_timer(&ts.head, id)) )
+	if( !(t=lookup_timer(id)) || t->state == TS_INACTIVE )
 		printm("cancel_timer: no such timer\n");
-	else {
-		t->next = ts.free;
-		ts.free = t;
-	}
+	else
+		release_timer( t );
 	UNLOCK;
 }
 
@@ -216,26 +415,12 @@ new_ptimer( timer_func_t *handler, void *usr, int auto_resume )
 	int id=0;
 	
 	LOCK;
-	if( (t=new_timer(handler, usr, TF_PERIODIC | (auto_resume? TF_AUTORESUME:0))) ) {
+	if( (t=new_timer(handler, usr, TF_PERIODIC | (auto_resume? TF_AUTORESUME:0))) )
 		id = t->id;
-		t->next = ts.inactive;
-		ts.inactive = t;
-	}
 	UNLOCK;
 	return id;
 }
 
-static void
-set_ptimer_ticks( mtimer_t *t, int ticks )
-{
-	ullong mark = get_mticks_() + ticks;
-	
-	t->tbu = mark >> 32;
-	t->tbl = mark;
-	t->period = ticks;
-	insert_timer( t );
-}
-
 void
 set_ptimer( int id, uint uperiod )
 {
@@ -247,15 +432,12 @@ set_ptimer( int id, uint uperiod )
 	}
 
 	LOCK;
-	if( !(t=dequeue_timer(&ts.inactive, id)) && !(t=dequeue_timer(&ts.head, id)) )
+	if( !(t=lookup_timer(id)) || !(t->flags & TF_PERIODIC) )
 		printm("bogus timer\n");
 	else {
-		ullong mark = usecs_to_mticks_( uperiod );
-		t->period = mark;
-		mark += get_mticks_();
-
-		t->tbu = mark >> 32;
-		t->tbl = mark;
+		dequeue_timer( t );
+		t->period = usecs_to_mticks_( uperiod );
+		t->mark = get_mticks_() + t->period;
 		insert_timer( t );
 	}
 	UNLOCK;
@@ -264,17 +446,13 @@ set_ptimer( int id, uint uperiod )
 static int
 recalc_ptimer( mtimer_t *t )
 {
-	llong mark = (((ullong)t->tbu << 32) | t->tbl);
 	llong now = get_mticks_();
 	int lost = -1;
 
-	while( now - mark >= 0 ) {
+	while( (llong)(now - t->mark) >= 0 ) {
 		lost++;
-		mark += t->period;
+		t->mark += t->period;
 	}
-	t->tbu = mark >> 32;
-	t->tbl = mark;
-
 	if( lost < 0 ) {
 		printm("Warning: unsynchronized timebase detected\n");
 		lost = 0;
@@ -289,9 +467,10 @@ resume_ptimer( int id )
 	int lost=0;
 
 	LOCK;
-	if( !(t=dequeue_timer(&ts.inactive, id)) )
+	if( !(t=lookup_timer(id)) || t->state == TS_QUEUED || !(t->flags & TF_PERIODIC) )
 		printm("resume_ptimer: bogus timer\n");
 	else {
+		t->seq++;
 		lost = recalc_ptimer( t );
 		insert_timer( t );
 	}
@@ -305,12 +484,10 @@ pause_ptimer( int id )
 	mtimer_t *t;
 
 	LOCK;
-	if( !(t=dequeue_timer(&ts.head, id)) )
+	if( !(t=lookup_timer(id)) || t->state == TS_INACTIVE )
 		printm("pause_ptimer: not found\n");
-	else {
-		t->next = ts.inactive;
-		ts.inactive = t;
-	}
+	else
+		dequeue_timer( t );
 	UNLOCK;
 }
 
@@ -320,12 +497,10 @@ free_ptimer( int id )
 	mtimer_t *t;
 
 	LOCK;
-	if( !(t=dequeue_timer(&ts.head, id)) && !(t=dequeue_timer(&ts.inactive, id)) )
+	if( !(t=lookup_timer(id)) || !(t->flags & TF_PERIODIC) )
 		printm("free_ptimer: no such timer\n");
-	else {
-		t->next = ts.free;
-		ts.free = t;
-	}
+	else
+		release_timer( t );
 	UNLOCK;
 }
 
@@ -338,66 +513,128 @@ void
 retune_timers( ullong freeze_mticks )
 {
 	ullong add = get_mticks_() - freeze_mticks;
-	mtimer_t *t;
+	int i;
 
-	/* timers were frozen at mticks, recalculate... */
+	/* timers were frozen at mticks, recalculate (the heap order is unchanged) */
 	LOCK;
-	for( t=ts.head; t; t=t->next ) {
-		ullong mark = (((ullong)t->tbu << 32) | t->tbl) + add;
-		t->tbu = mark >> 32;
-		t->tbl = mark;
-	}
+	for( i=0; i<ts.heap_size; i++ )
+		ts.heap[i]->mark += add;
 	mregs->dec_stamp += add;
 	UNLOCK;
 }
 
+static int __dcmd
+cmd_timers( int argc, char **argv )
+{
+	timer_stats_t *s;
+	int i, b;
 
+	if( argc != 1 )
+		return 1;
+
+	LOCK;
+	printm("%d timers queued, %d allocated\n", ts.heap_size, ts.nslots );
+	printm("handler      count   avg(us)  max(us)   latency histogram (<1,2,4...us)\n");
+	for( i=0; i<MAX_NUM_STATS; i++ ) {
+		s = &ts.stats[i];
+		if( !s->handler || !s->count )
+			continue;
+		printm("%08lx %8d %8d %8d  ", (ulong)s->handler, s->count,
+		       (int)mticks_to_usecs_(s->sum / s->count), (int)mticks_to_usecs_(s->max) );
+		for( b=0; b<LAT_BUCKETS; b++ )
+			printm(" %d", s->hist[b] );
+		printm("\n");
+	}
+	UNLOCK;
+	return 0;
+}
+
+static int __dcmd
+cmd_timers_clear( int argc, char **argv )
+{
+	int i;
+
+	if( argc != 1 )
+		return 1;
+
+	LOCK;
+	for( i=0; i<MAX_NUM_STATS; i++ ) {
+		ts.stats[i].count = ts.stats[i].max = 0;
+		ts.stats[i].sum = 0;
+		memset( ts.stats[i].hist, 0, sizeof(ts.stats[i].hist) );
+	}
+	UNLOCK;
+	return 0;
+}
 
 
 /************************************************************************/
 /*	timer and doze stuff						*/
 /************************************************************************/
 
+#define MAX_EXPIRED		32
+
 static int
 rvec_timer( int dummy )
 {
-	timer_func_t *handler;
+	expired_t exp[ MAX_EXPIRED ];
+	ullong now;
 	mtimer_t *t;
-	void *usr;
-	int id, info;
+	int i, n;
 
-	LOCK;
-	while( (t=ts.head) ) {
-		info = get_tbl() - t->tbl;
-
-		if( info < 0 || (t->flags & TF_OVERFLOW) )
-			break;
+	do {
+		/* collect the expired timers under a single lock */
+		LOCK;
+		now = get_mticks_();
+		for( n=0; n < MAX_EXPIRED && ts.heap_size; n++ ) {
+			t = ts.heap[0];
+			if( (llong)(now - t->mark) < 0 )
+				break;
+			heap_remove( t );
+			record_latency( t->stats, now - t->mark );
 
-		/* printm("Latency: %d\n", info ); */
+			exp[n].t = t;
+			exp[n].id = t->id;
+			exp[n].info = now - t->mark;
 
-		handler= t->handler;
-		usr = t->usr;
-		id = t->id;
-		ts.head = t->next;
+			exp[n].handler = t->handler;
+			exp[n].usr = t->usr;
 
-		if( t->flags & TF_PERIODIC ) {
-			if( t->flags & TF_AUTORESUME ) {
-				info = recalc_ptimer( t );
+			if( (t->flags & TF_AUTORESUME) ) {
+				exp[n].info = recalc_ptimer( t );
 				insert_timer( t );
 			} else {
-				t->next = ts.inactive;
-				ts.inactive = t;
+				t->state = TS_FIRING;
 			}
-		} else {
-			t->next = ts.free;
-			ts.free = t;
+			exp[n].seq = t->seq;
 		}
 		UNLOCK;
+
 		/* info is either latency or lost ticks */
-		(*handler)( id, usr, info );
+		for( i=0; i<n; i++ ) {
+			t = exp[i].t;
+
+			/* an earlier handler might have changed the timer */
+			if( t->seq == exp[i].seq && t->id == exp[i].id )
+				(*exp[i].handler)( exp[i].id, exp[i].usr, exp[i].info );
+		}
+
+		/* one-shot timers are released once the handler has run */
 		LOCK;
-	}
-	mregs->timer_stamp = t->tbl;
+		for( i=0; i<n; i++ ) {
+			t = exp[i].t;
+			if( t->id != exp[i].id || t->state != TS_FIRING )
+				continue;
+			if( t->flags & TF_PERIODIC )
+				t->state = TS_INACTIVE;
+			else
+				release_timer( t );
+		}
+		UNLOCK;
+	} while( n == MAX_EXPIRED );
+
+	LOCK;
+	mregs->timer_stamp = next_stamp( get_mticks_() );
 	__recalc_timer = 0;
 	UNLOCK;
 
@@ -406,16 +643,153 @@ rvec_timer( int dummy )
 	return 0;
 }
 
+static ullong
+thread_cpu_nsecs( void )
+{
+	struct timespec tv;
+
+	if( clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tv) )
+		return 0;
+	return (ullong)tv.tv_sec * 1000000000 + tv.tv_nsec;
+}
+
+/* consume the wakeup sent by abort_doze */
+static void
+idle_drain( void )
+{
+#ifdef __linux__
+	uint64_t cnt;
+	read( ts.wakefd, &cnt, sizeof(cnt) );
+#else
+	char ch;
+	read( ts.abortpipe[0], &ch, 1 );
+#endif
+}
+
+/* sleep until abort_doze is called or the deadline (mticks) has passed;
+ * returns 1 if aborted
+ */
+static int
+idle_wait( ullong deadline )
+{
+	llong left;
+	int ret;
+#ifdef __linux__
+	struct pollfd pfd;
+	struct timespec tv;
+	ullong nsecs;
+
+	pfd.fd = ts.wakefd;
+	pfd.events = POLLIN;
+	while( (left=deadline - get_mticks_()) > 0 ) {
+		nsecs = mticks_to_nsecs_( left );
+		tv.tv_sec = nsecs / 1000000000;
+		tv.tv_nsec = nsecs % 1000000000;
+		if( (ret=ppoll(&pfd, 1, &tv, NULL)) > 0 ) {
+			idle_drain();
+			return 1;
+		}
+		/* a signal; sleep for the remaining time */
+		if( !ret || errno != EINTR )
+			break;
+	}
+#else
+	struct timeval tv;
+	fd_set readfs;
+	ulong usecs;
+
+	while( (left=deadline - get_mticks_()) > 0 ) {
+		FD_ZERO( &readfs );
+		FD_SET( ts.abortpipe[0], &readfs );
+		usecs = mticks_to_usecs_( left );
+		tv.tv_sec = usecs / 1000000;
+		tv.tv_usec = usecs % 1000000;
+		if( (ret=select(ts.abortpipe[0]+1, &readfs, NULL, NULL, &tv)) > 0 ) {
+			idle_drain();
+			return 1;
+		}
+		if( !ret || errno != EINTR )
+			break;
+	}
+#endif
+	return 0;
+}
+
+/* Ends a doze which was not aborted through the wakeup fd. Returns 1 if
+ * abort_doze came first; it has then sent (or is about to send) a wakeup
+ * which would otherwise cut the next doze short.
+ */
+static int
+end_doze( void )
+{
+	if( __sync_bool_compare_and_swap(&ts.dozing.counter, -1, DBG_DISABLE_DOZE) )
+		return 0;
+	idle_drain();
+	return 1;
+}
+
+/* sleeps until the deadline, less the expected oversleep which is spun away */
+static void
+idle_sleep( ullong now, int ticks )
+{
+	ullong deadline = now + ticks, cpu = thread_cpu_nsecs();
+	int aborted = 0, spin = 0, sleep_ticks = ticks;
+	uint lat, b;
+
+	if( ts.spin_max ) {
+		spin = (ts.slack < ts.spin_max) ? ts.slack : ts.spin_max;
+		sleep_ticks -= spin;
+	}
+
+	if( sleep_ticks > 0 ) {
+		aborted = idle_wait( now + sleep_ticks );
+
+		/* track how late timeouts are (an error might end the wait early) */
+		lat = get_mticks_() - (now + sleep_ticks);
+		if( !aborted && (int)lat >= 0 ) {
+			ts.slack += ((int)lat - (int)ts.slack) / 8;
+			idle.timeouts++;
+			idle.oversleep_sum += lat;
+			if( lat > idle.oversleep_max )
+				idle.oversleep_max = lat;
+		}
+	}
+	if( !aborted && spin > 0 && (llong)(deadline - get_mticks_()) > 0 ) {
+		idle.spins++;
+		while( (llong)(deadline - get_mticks_()) > 0 && atomic_read(&ts.dozing) == -1 )
+			;
+	}
+	if( !aborted )
+		aborted = end_doze();
+
+	now = get_mticks_();
+	idle.idle_mticks += now - (deadline - ticks);
+	idle.idle_cpu_nsecs += thread_cpu_nsecs() - cpu;
+
+	if( aborted ) {
+		idle.aborted++;
+		lat = now - idle.abort_stamp;
+		idle.wake_sum += lat;
+		if( lat > idle.wake_max )
+			idle.wake_max = lat;
+		lat = mticks_to_usecs_( lat );
+		for( b=0; b < LAT_BUCKETS-1 && lat >= (1U << b); b++ )
+			;
+		idle.wake_hist[b]++;
+	}
+}
+
 void
 doze( void )
 {
-	uint tbl = get_tbl();
+	ullong now = get_mticks_();
+	uint tbl = now;
 	int t, ticks;
 	static int cnt;
 	
 	LOCK;
 	ticks = mregs->dec_stamp - tbl;
-	t = ts.head->tbl - tbl;
+	t = next_stamp( now ) - tbl;
 	if( t < ticks )
 		ticks = t;
 	UNLOCK;
@@ -423,19 +797,13 @@ doze( void )
 	if( ticks > 0 ) {
 		atomic_dec( &ts.dozing );
 		if( atomic_read(&ts.dozing) == -1 ) {
+			idle.dozes++;
 			if( (cnt++ & 0xff) == 0xff ) {
+				idle.reclaims++;
 				_idle_reclaim_memory();
+				end_doze();
 			} else {
-				struct timeval tv;
-				fd_set readfs;
-				char ch;
-
-				FD_ZERO( &readfs );
-				FD_SET( ts.abortpipe[0], &readfs );
-				tv.tv_sec = 0;
-				tv.tv_usec = mticks_to_usecs_( ticks );
-				if( select(ts.abortpipe[0]+1, &readfs, NULL, NULL, &tv) > 0 )
-					read( ts.abortpipe[0], &ch, 1 );
+				idle_sleep( now, ticks );
 			}
 		}
 		atomic_set( &ts.dozing, DBG_DISABLE_DOZE );
@@ -445,32 +813,45 @@ doze( void )
 void
 abort_doze( void )
 {
-	char ch;
-	if( !atomic_inc_and_test_(&ts.dozing) )
+	if( !atomic_inc_and_test_(&ts.dozing) ) {
+		idle.abort_stamp = get_mticks_();
+#ifdef __linux__
+		eventfd_write( ts.wakefd, 1 );
+#else
+		char ch = 0;
 		write( ts.abortpipe[1], &ch, 1 );
+#endif
+	}
 }
 
-static void
-overflow_handler( int id, void *dummy, int lost_ticks )
+static int __dcmd
+cmd_idlestat( int argc, char **argv )
 {
-	mtimer_t *t, **tp, *chain = NULL;
-	
-	LOCK;
-	for( tp=&ts.head; (t=*tp) ; ) {
-		if( !(t->flags & TF_OVERFLOW) ) {
-			tp = &t->next;
-		} else {
-			*tp = t->next;
-			t->next = chain;
-			chain = t;
-		}
-	}
-	while( (t=chain) ) {
-		t->flags &= ~TF_OVERFLOW;
-		chain = t->next;
-		insert_timer( t );
+	uint n, b;
+
+	if( argc == 2 && !strcmp(argv[1], "clear") ) {
+		memset( &idle, 0, sizeof(idle) );
+		return 0;
 	}
-	UNLOCK;
+	if( argc != 1 )
+		return 1;
+
+	printm("dozes %d (memory reclaims %d), idle %lld ms, host CPU while idle %lld ms\n",
+	       idle.dozes, idle.reclaims, (llong)mticks_to_usecs_(idle.idle_mticks) / 1000,
+	       (llong)idle.idle_cpu_nsecs / 1000000 );
+	n = idle.timeouts ? idle.timeouts : 1;
+	printm("timeouts %d, oversleep avg %d us max %d us, spin %d us (%d spins)\n",
+	       idle.timeouts, (int)mticks_to_usecs_(idle.oversleep_sum / n),
+	       (int)mticks_to_usecs_(idle.oversleep_max), (int)mticks_to_usecs_(ts.slack),
+	       idle.spins );
+	n = idle.aborted ? idle.aborted : 1;
+	printm("wakeups %d, latency avg %d us max %d us, histogram (<1,2,4...us):\n  ",
+	       idle.aborted, (int)mticks_to_usecs_(idle.wake_sum / n),
+	       (int)mticks_to_usecs_(idle.wake_max) );
+	for( b=0; b<LAT_BUCKETS; b++ )
+		printm(" %d", idle.wake_hist[b] );
+	printm("\n");
+	return 0;
 }
 
 
@@ -546,11 +927,18 @@ calibrate_timebase( void )
 	return val;
 }
 
+static dbg_cmd_t dbg_cmds[] = {
+#ifdef CONFIG_DEBUGGER
+	{ "timers",	cmd_timers,	  "timers \nshow timer latency statistics\n" },
+	{ "timers_clr",	cmd_timers_clear, "timers_clr \nclear timer latency statistics\n" },
+	{ "idlestat",	cmd_idlestat,	  "idlestat [clear] \nshow idle (doze) statistics\n" },
+#endif
+};
+
 void
 timer_init( void )
 {
 	uint val;
-	int i;
 
 	if( (val=get_numeric_res("timebase_frequency")) != -1 ) {
 		printm("Using timebase frequency %d.%03d MHz [from config file]\n", 
@@ -563,26 +951,27 @@ timer_init( void )
 	if( DBG_DISABLE_DOZE )
 		printm("************ DOZING disabled **************\n");
 	
-	for( i=1; i<MAX_NUM_TIMERS; i++ )
-		ts.slots[i-1].next = &ts.slots[i];
-	for( i=0; i<MAX_NUM_TIMERS; i++ )
-		ts.slots[i].id = i+1;
-	ts.free = &ts.slots[0];
-
 	mregs->timer_stamp = get_tbl() + TIMER_MAX;
 
+#ifdef __linux__
+	if( (ts.wakefd=eventfd(0, 0)) < 0 )
+		fatal_err("eventfd");
+	fcntl( ts.wakefd, F_SETFD, FD_CLOEXEC );
+#else
 	pipe( ts.abortpipe );
 	fcntl( ts.abortpipe[0], F_SETFD, FD_CLOEXEC );
 	fcntl( ts.abortpipe[1], F_SETFD, FD_CLOEXEC );
+#endif
 
 	ts.ticks_per_usec_num = ts.tb_freq;
 	ts.ticks_per_usec_den = 1000000;
 
-	new_ptimer( overflow_handler, NULL, 1 );
-	ts.overflow = ts.inactive;
-	set_ptimer_ticks( ts.overflow, TIMER_MAX );
+	/* spin away the expected oversleep of short dozes (at most doze_spin usecs) */
+	if( (val=get_numeric_res("doze_spin")) != -1 )
+		ts.spin_max = usecs_to_mticks_( val );
 
 	set_rvector( RVEC_TIMER, rvec_timer, "Timer" );	
+	add_dbg_cmds( dbg_cmds, sizeof(dbg_cmds) );
 	os_interface_add_proc( OSI_MTICKS_TO_USECS, osip_mticks_to_usecs );
 	os_interface_add_proc( OSI_USECS_TO_MTICKS, osip_usecs_to_mticks );
 }
@@ -590,5 +979,5 @@ timer_init( void )
 void
 timer_cleanup( void )
 {
-	ts.head = NULL;
+	ts.heap_size = 0;
 }
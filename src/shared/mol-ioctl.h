@@ -96,7 +96,7 @@ typedef struct mol_ioctl_pb {
 #define MOL_IOCTL_SETUP_FBACCEL		_IOWR('M', 41, mol_ioctl_pb_t)	/* void * ( char *lvbase, int bytes_per_row, int height ) */
 #define MOL_IOCTL_GET_DIRTY_FBLINES	_IOWR('M', 42, mol_ioctl_pb_t)	/* int ( short *rettable, int table_size_in_bytes ) */
 #define MOL_IOCTL_TRACK_DIRTY_RAM	_IOWR('M', 43, mol_ioctl_pb_t)	/* int ( char *lvbase, size_t size ) */
-#define MOL_IOCTL_GET_DIRTY_RAM		_IOWR('M', 44, mol_ioctl_pb_t)	/* size_t ( char *retbuf ) */
+#define MOL_IOCTL_GET_DIRTY_RAM		_IOWR('M', 44, mol_ioctl_pb_t)	/* size_t ( char *retbuf, int clear ) */
 #define MOL_IOCTL_SET_DIRTY_RAM		_IOWR('M', 45, mol_ioctl_pb_t)	/* void ( char *dirtybuf ) */
 #define MOL_IOCTL_GET_MREGS_PHYS	_IOWR('M', 46, mol_ioctl_pb_t)	/* ulong ( void ) */
 #define MOL_IOCTL_ALLOC_EMUACCEL_SLOT	_IOWR('M', 47, mol_ioctl_pb_t)	/* int ( int inst_flags, int param, int inst_addr ) */